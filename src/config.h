@@ -129,16 +129,68 @@
 /* CONFIGURE: sigcache directory (inside the application home directory)
  * which contain all the cached signatures. If a "multipart/msigned" is asked
  * through the "Accept:" request header, and requested ressource match SIG_PATTERN ;
- * then it check if the expanded file is older than the cached signature.
+ * then it look for the signature of the file, keyed by its name, size and
+ * mtime, in one of the 256 pack files of the cache (append-only, indexed
+ * in memory).
  *
- * If the cached signature does not exist or is older than the file, then the
- * server will generate it into this dir (writing in must be enabled), else it
- * will use the cached signature to sign the requested file.
+ * If the cached signature does not exist, then the server will generate it
+ * into this dir (writing in must be enabled), else it will use the cached
+ * signature to sign the requested file.
  *
  * You may undefine this to disable signatures caching, but that's not recommanded !
  */
 #define SIG_CACHEDIR "sigcache"
 
+/* CONFIGURE: How many bytes the cached signatures may take, about (0 for no
+** limit).  Each pack gets its share: once it is over it, it is rewritten
+** without its least recently used signatures.  The "sigcompact" tool
+** cleans the cache up offline.
+*/
+#define SIG_CACHE_MAX_BYTES 256000000
+
+/* CONFIGURE: How many bytes of the signatures cached above are also kept in
+** memory, read in at startup then as files are signed, so that a file whose
+** signature is there is answered at once by the main loop.
+*/
+#define SIG_INDEX_MAX_BYTES 8000000
+
+/* CONFIGURE: Answer a signed Range request with the asked bytes and the
+** signature of the whole file (the one cached, made once for all), told
+** apart by a "Content-Description: signature of the whole file" header in
+** the signature part; the total length is in the Content-Range of the data
+** part.  A client resuming a download checks the signature once it has it
+** all.  Comment it out to sign each range by itself again.
+*/
+#define WHOLE_FILE_RANGE_SIG
+
+/* CONFIGURE: Files of MERKLE_MIN_FILE bytes or more also get, when the
+** signing pool signs them (in the background when their signature comes
+** cached), a Merkle tree of the SHA-256 of their chunks of
+** MERKLE_CHUNK_SIZE bytes, with its root signed, cached in MERKLE_CACHEDIR
+** (next to SIG_CACHEDIR, it must exist).  A signed range of whole chunks
+** then comes with the proof of its chunks and the signature of the root,
+** which a client checks without the rest of the file.  Needs libgcrypt,
+** SIGN_WORKERS and SIG_CACHEDIR; comment out MERKLE_CACHEDIR to only sign
+** whole files.
+*/
+#define MERKLE_CACHEDIR "merkle"
+#define MERKLE_CHUNK_SIZE 1048576
+#define MERKLE_MIN_FILE 16777216
+
+/* CONFIGURE: A request for DIR_MANIFEST_NAME in a directory which has no
+** file of that name gets the manifest of the directory (the SHA-256, size
+** and mtime of each file), with its signature, so that a mirror checks the
+** whole directory against one signature.  Manifests are made by the
+** signing pool, cached in DIRSIG_CACHEDIR (next to SIG_CACHEDIR, it must
+** exist), and made again, reading only the files changed, when the
+** directory changed or after DIR_MANIFEST_MAX_AGE seconds; the pre-signer
+** also makes them again as inotify reports changes.  Needs libgcrypt,
+** SIGN_WORKERS and SIG_CACHEDIR; comment out DIRSIG_CACHEDIR to disable.
+*/
+#define DIRSIG_CACHEDIR "manifests"
+#define DIR_MANIFEST_NAME "@manifest"
+#define DIR_MANIFEST_MAX_AGE 300
+
 /* CONFIGURE: Maximum number of simultaneous connexion per client (ip). 
  * This use external tool iptables (which have to be in your $PATH and
  * need the root privileges).
@@ -180,6 +232,54 @@
 */
 #define IDLE_SEND_TIMELIMIT 300
 
+/* CONFIGURE: How many seconds to keep a persistent (keep-alive) connection
+** open while waiting for its next request.  0 disables keep-alives.  Can
+** be changed with the "keepalivetime" config option.
+*/
+#define IDLE_KEEPALIVE_TIMELIMIT 5
+
+/* CONFIGURE: How many requests may be served on a single persistent
+** connection before we close it.  Can be changed with the "keepalivemax"
+** config option.
+*/
+#define KEEPALIVE_MAX_REQUESTS 100
+
+/* CONFIGURE: When a client pipelines requests on a persistent connection,
+** the responses are held back and written together as long as they fit in
+** that many bytes, small files included.
+*/
+#define PIPELINE_COALESCE_SIZE 16384
+
+/* CONFIGURE: Maximum number of lines (request line and headers) in a
+** request.  Requests with more are refused with a 400 error.
+*/
+#define MAX_REQUEST_LINES 100
+
+/* CONFIGURE: Maximum number of ranges in a request for several byte ranges
+** of a file (once the overlapping ones are merged).  Requests with more get
+** the whole file.
+*/
+#define MAX_BYTE_RANGES 16
+
+/* CONFIGURE: Files at least that big are sent with sendfile() (if your
+** system has a Linux-like one) instead of going through the mmap cache,
+** unless the response has to be signed.  Comment this out to always use
+** the mmap cache.
+*/
+#define SENDFILE_MIN_SIZE 32768
+
+/* CONFIGURE: How many event-loop processes to run.  Each one accepts
+** connections on listen sockets of its own (SO_REUSEPORT, where available)
+** so they can keep several cores busy.  Can be changed with the "workers"
+** config option or the -w flag.
+*/
+#define DEFAULT_WORKERS 1
+
+/* CONFIGURE: A worker which dies sooner than that many seconds after it was
+** started is not started again (it would most probably die the same way).
+*/
+#define WORKER_RESPAWN_TIME 10
+
 /* CONFIGURE: The syslog facility to use.  Using this you can set up your
 ** syslog.conf so that all ludd messages go into a separate file.  Note
 ** that even if you use the -l command line flag to send logging to a
@@ -299,22 +399,103 @@
 */
 #define STATS_TIME 36000
 
-/* CONFIGURE: The mmap cache tries to keep the total number of mapped
-** files below this number, so you don't run out of kernel file descriptors.
-** If you have reconfigured your kernel to have more descriptors, you can
-** raise this and ludd will keep more maps cached.  However it's not
-** a hard limit, ludd will go over it if you really are accessing
-** a whole lot of files.
+/* CONFIGURE: How many seconds the results of the realpath() and stat()
+** calls used to resolve a request are cached.  Where inotify is available,
+** an entry is dropped as soon as its directory changes, and this only
+** bounds the changes inotify can't see (like a parent directory renamed).
+** 0 disables the cache.
+*/
+#define PATH_CACHE_TTL 60
+
+/* CONFIGURE: How many paths the cache above may hold. */
+#define PATH_CACHE_MAX 10000
+
+/* CONFIGURE: The mmap cache keeps the total number of mapped files below
+** this number, so you don't run out of kernel file descriptors: before
+** mapping a new file, it unmaps the unused ones, least recently used first
+** (files which were only served once go first).  If you have reconfigured
+** your kernel to have more descriptors, you can raise this and ludd will
+** keep more maps cached.  Only maps in use can make ludd go over it, if
+** you really are serving a whole lot of files at once.
 */
 #define DESIRED_MAX_MAPPED_FILES 1000
 
-/* CONFIGURE: The mmap cache also tries to keep the total mapped bytes
-** below this number, so you don't run out of address space.  Again
-** it's not a hard limit, ludd will go over it if you really are
-** accessing a bunch of large files.
+/* CONFIGURE: The mmap cache also keeps the total mapped bytes below this
+** number, the same way, so you don't run out of address space.  Again
+** only maps in use can make ludd go over it.
 */
 #define DESIRED_MAX_MAPPED_BYTES 1000000000
 
+/* CONFIGURE: Files up to this size get their whole 200 response (headers
+** and body) cached in memory, so that serving one again is a single write().
+** 0 disables the response cache.
+*/
+#define RESPONSE_CACHE_MAX_FILE 16384
+
+/* CONFIGURE: How many bytes the response cache above may hold. */
+#define RESPONSE_CACHE_MAX_BYTES 16000000
+
+/* CONFIGURE: When ludd is built with zlib, files between these sizes which
+** have no precompressed .br or .gz sibling (and whose type isn't a
+** compressed one already) are gzip-compressed for the clients accepting
+** it.  Each file is compressed once, the result is cached.  Comment out
+** COMPRESS_MAX_FILE to disable this, and the compression of HKP output.
+*/
+#define COMPRESS_MIN_FILE 256
+#define COMPRESS_MAX_FILE 1000000
+
+/* CONFIGURE: How many bytes of compressed files the cache above may hold. */
+#define COMPRESS_CACHE_MAX_BYTES 32000000
+
+/* CONFIGURE: Static files which have to be signed are handed by the main
+** loop to this many signer processes, instead of having an interposer
+** process forked for each of them.  When SIGN_QUEUE_MAX files are already
+** waiting for their signature, the next ones are served unsigned.  Comment
+** out SIGN_WORKERS to fork an interposer for each signed file again.
+*/
+#define SIGN_WORKERS 4
+#define SIGN_QUEUE_MAX 64
+
+/* CONFIGURE: Signing is busy when SIGN_BUSY_QUEUE responses wait for the
+** signing pool, when the responses waited SIGN_BUSY_LATENCY milliseconds
+** or more for their signature lately, when the load average is
+** SIGN_BUSY_LOAD or more (0 not to look at one of them), and anyway when
+** SIGN_QUEUE_MAX responses wait (or cgilimit interposers run, without the
+** signing pool).  A signature which isn't cached is then, as
+** SIGN_BUSY_ACTION says: "delay", made all the same while less than
+** SIGN_QUEUE_MAX responses wait, else left out; "cache", left out, the file
+** being served unsigned; "refuse", not made, a 503 with a Retry-After of
+** SIGN_RETRY_AFTER seconds being sent instead.  The config file options
+** "signqueue", "signlatency", "signload" and "signbusy" override these.
+*/
+#define SIGN_BUSY_QUEUE 32
+#define SIGN_BUSY_LATENCY 2000
+#define SIGN_BUSY_LOAD 0
+#define SIGN_BUSY_ACTION "cache"
+#define SIGN_RETRY_AFTER 5
+
+/* CONFIGURE: Sign ahead of the requests the files under the web directory
+** that would be signed, walking it at startup then as inotify reports
+** changes, so that the signatures asked for are nearly always cached
+** already.  No more than PRESIGN_JOBS files are handed to the signers at a
+** time, which only take them when no response is waiting.  With several
+** workers (see DEFAULT_WORKERS), only the first one signs ahead, into the
+** shared cache: the signature index of each other worker only gets a
+** file's signature with the first request for it there, which still goes
+** through its signing pool (the signer reads the cached signature instead
+** of signing).  Needs SIGN_WORKERS and SIG_CACHEDIR; comment it out to
+** sign on demand only.
+*/
+#define PRESIGN_JOBS 1
+
+/* CONFIGURE: Make the detached signatures in process with libgcrypt, from
+** a copy of the secret key exported from gpg at startup, instead of going
+** through the gpg engine and gpg-agent for each of them.  Only RSA and
+** Ed25519 keys without passphrase can be loaded: with another key, or
+** without libgcrypt, gpg keeps signing.
+*/
+#define NATIVE_SIGN
+
 /* You almost certainly don't want to change anything below here. */
 
 /* CONFIGURE: When throttling CGI programs, we don't know how many bytes
@@ -0,0 +1,382 @@
+/* dirsig.c - signed manifests of directories, one signature for all files
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* Manifests are remade incrementally: the lines of the last one are walked
+* along with the sorted names, and the hash of a file whose size and mtime
+* didn't change, and which was older than that manifest, is copied over;
+* only the other files are read again.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+
+#ifdef HAVE_DIRENT_H
+# include <dirent.h>
+# define NAMLEN(dirent) strlen((dirent)->d_name)
+#else
+# define dirent direct
+# define NAMLEN(dirent) (dirent)->d_namlen
+# ifdef HAVE_SYS_NDIR_H
+#  include <sys/ndir.h>
+# endif
+# ifdef HAVE_SYS_DIR_H
+#  include <sys/dir.h>
+# endif
+# ifdef HAVE_NDIR_H
+#  include <ndir.h>
+# endif
+#endif
+
+#include "libhttpd.h"
+#include "dirsig.h"
+
+#ifdef USE_DIRSIG
+
+#include <gcrypt.h>
+
+
+/* Defines. */
+#ifndef MAXPATHLEN
+#define MAXPATHLEN 2048
+#endif
+#define HASH_LEN 32
+#define READ_SIZE 65536
+#define HEADER "Directory-Manifest: SHA256\nDirectory: %s\n"
+#define SIG_START "-----BEGIN"
+
+
+/* Globals. */
+static int ready = 0;
+static const char hex[] = "0123456789abcdef";
+static char tree[MAXPATHLEN];	/* the web tree, without its last '/' */
+static size_t treelen;
+
+
+/* Forwards. */
+static int name_compare( const void* a, const void* b );
+static int in_tree( const char* path );
+static const char* old_hash( const char** cpP, const char* end, const char* name, const struct stat* sbP, time_t oldtime );
+static int hash_file( const char* path, char* hexhash, char* buf );
+static int grow( char** bufP, size_t* maxP, size_t len );
+
+
+int
+dirsig_init( const char* dir )
+	{
+	struct stat sb;
+
+	if ( gcry_check_version( (char*) 0 ) == (char*) 0 )
+		return -1;
+	if ( ! gcry_control( GCRYCTL_INITIALIZATION_FINISHED_P ) )
+		{
+		(void) gcry_control( GCRYCTL_DISABLE_SECMEM, 0 );
+		(void) gcry_control( GCRYCTL_INITIALIZATION_FINISHED, 0 );
+		}
+	if ( stat( dir, &sb ) < 0 || ! S_ISDIR( sb.st_mode ) )
+		{
+		syslog( LOG_WARNING, "no manifest cache dir %.80s - directories won't have signed manifests", dir );
+		return -1;
+		}
+	if ( getcwd( tree, sizeof(tree) ) == (char*) 0 )
+		{
+		syslog( LOG_ERR, "getcwd - %m" );
+		return -1;
+		}
+	treelen = strlen( tree );
+	if ( treelen > 0 && tree[treelen - 1] == '/' )
+		tree[--treelen] = '\0';
+	ready = 1;
+	return 0;
+	}
+
+
+int
+dirsig_ready( void )
+	{
+	return ready;
+	}
+
+
+int
+dirsig_path( char* path, size_t size, const char* dir )
+	{
+	int len;
+
+	if ( strcmp( dir, "." ) == 0 )
+		len = snprintf( path, size, "%s/%s", DIRSIG_CACHE_DIR, DIR_MANIFEST_NAME );
+	else
+		len = snprintf( path, size, "%s/%s/%s", DIRSIG_CACHE_DIR, dir, DIR_MANIFEST_NAME );
+	return ( len < 0 || len >= size ) ? -1 : 0;
+	}
+
+
+char*
+dirsig_make( const char* dir, const char* old, size_t oldlen, time_t oldtime, size_t* lenP )
+	{
+	DIR* dirp;
+	struct dirent* de;
+	struct stat sb;
+	char** names = (char**) 0;
+	char** newnames;
+	int nnames = 0, maxnames = 0, i;
+	char path[MAXPATHLEN];
+	char hexhash[2 * HASH_LEN + 1];
+	char* buf = (char*) 0;
+	char* readbuf;
+	size_t len = 0, maxlen = 0, namlen;
+	const char* oldcp = old;
+	const char* oldend = old + oldlen;
+	const char* h;
+
+	dirp = opendir( dir );
+	if ( dirp == (DIR*) 0 )
+		return (char*) 0;
+	while ( ( de = readdir( dirp ) ) != (struct dirent*) 0 )
+		{
+		namlen = NAMLEN( de );
+		if ( strcmp( de->d_name, "." ) == 0 || strcmp( de->d_name, ".." ) == 0 ||
+#ifdef FORBID_HIDDEN_RESSOURCE
+			 de->d_name[0] == '.' ||
+#endif /* FORBID_HIDDEN_RESSOURCE */
+			 memchr( de->d_name, '\n', namlen ) != (char*) 0 )
+			continue;
+		if ( nnames >= maxnames )
+			{
+			maxnames = ( maxnames == 0 ? 64 : maxnames * 2 );
+			newnames = (char**) realloc( (void*) names, maxnames * sizeof(char*) );
+			if ( newnames == (char**) 0 )
+				break;
+			names = newnames;
+			}
+		names[nnames] = strdup( de->d_name );
+		if ( names[nnames] != (char*) 0 )
+			++nnames;
+		}
+	(void) closedir( dirp );
+	qsort( names, nnames, sizeof(*names), name_compare );
+
+	readbuf = (char*) malloc( READ_SIZE );
+	if ( readbuf == (char*) 0 ||
+		 grow( &buf, &maxlen, sizeof(HEADER) + strlen( dir ) ) < 0 )
+		goto fail;
+	len = snprintf( buf, maxlen, HEADER, dir );
+	for ( i = 0; i < nnames; ++i )
+		{
+		if ( ( strcmp( dir, "." ) == 0 ?
+				snprintf( path, sizeof(path), "%s", names[i] ) :
+				snprintf( path, sizeof(path), "%s/%s", dir, names[i] ) ) >= sizeof(path) ||
+			 lstat( path, &sb ) < 0 )
+			continue;
+		/* Symbolic links are listed as what they point to, as served: so
+		** only the ones pointing in the web tree.
+		*/
+		if ( S_ISLNK( sb.st_mode ) && ( ! in_tree( path ) || stat( path, &sb ) < 0 ) )
+			continue;
+		if ( ! ( sb.st_mode & S_IROTH ) ||
+			 grow( &buf, &maxlen, len + 2 * HASH_LEN + 50 + strlen( names[i] ) ) < 0 )
+			continue;
+		if ( S_ISDIR( sb.st_mode ) )
+			len += snprintf( &buf[len], maxlen - len, "- - - %s/\n", names[i] );
+		else if ( S_ISREG( sb.st_mode ) && ! ( sb.st_mode & S_IXOTH ) )
+			{
+			h = old_hash( &oldcp, oldend, names[i], &sb, oldtime );
+			if ( h != (char*) 0 )
+				{
+				(void) memcpy( hexhash, h, 2 * HASH_LEN );
+				hexhash[2 * HASH_LEN] = '\0';
+				}
+			else if ( hash_file( path, hexhash, readbuf ) < 0 )
+				continue;
+			len += snprintf(
+				&buf[len], maxlen - len, "%s %lld %ld %s\n",
+				hexhash, (long long) sb.st_size, (long) sb.st_mtime, names[i] );
+			}
+		}
+	for ( i = 0; i < nnames; ++i )
+		free( (void*) names[i] );
+	free( (void*) names );
+	free( (void*) readbuf );
+	*lenP = len;
+	return buf;
+
+	fail:
+	for ( i = 0; i < nnames; ++i )
+		free( (void*) names[i] );
+	free( (void*) names );
+	free( (void*) readbuf );
+	free( (void*) buf );
+	return (char*) 0;
+	}
+
+
+int
+dirsig_split( const char* file, size_t len, size_t* manifestlenP, const char** sigP, size_t* siglenP )
+	{
+	const char* cp;
+	const char* end = file + len;
+
+	/* (No line of a manifest starts like a signature.) */
+	for ( cp = file; cp < end; ++cp )
+		{
+		cp = (const char*) memchr( cp, '\n', end - cp );
+		if ( cp == (char*) 0 )
+			break;
+		if ( end - cp >= 2 + sizeof(SIG_START) - 1 && cp[1] == '\n' &&
+			 strncmp( &cp[2], SIG_START, sizeof(SIG_START) - 1 ) == 0 )
+			{
+			*manifestlenP = cp + 1 - file;
+			*sigP = &cp[2];
+			*siglenP = end - &cp[2];
+			return 0;
+			}
+		}
+	return -1;
+	}
+
+
+static int
+name_compare( const void* a, const void* b )
+	{
+	return strcmp( *(char**) a, *(char**) b );
+	}
+
+
+/* Whether path resolves to something in the web tree, as
+** httpd_start_request() checks it.
+*/
+static int
+in_tree( const char* path )
+	{
+	char real[MAXPATHLEN];
+
+	if ( realpath( path, real ) == (char*) 0 )
+		return 0;
+	return strncmp( real, tree, treelen ) == 0 &&
+		( real[treelen] == '/' || real[treelen] == '\0' );
+	}
+
+
+/* Looks for the line of name, as it comes in sorted order, from *cpP in the
+** old manifest, and returns its hash if the file hasn't changed since.
+*/
+static const char*
+old_hash( const char** cpP, const char* end, const char* name, const struct stat* sbP, time_t oldtime )
+	{
+	const char* line;
+	const char* eol;
+	const char* lname;
+	long long size;
+	long mtime;
+	size_t namelen = strlen( name );
+	int cmp;
+
+	if ( sbP->st_mtime >= oldtime )
+		return (char*) 0;
+	for ( line = *cpP; line < end; line = eol + 1 )
+		{
+		eol = (const char*) memchr( line, '\n', end - line );
+		if ( eol == (char*) 0 )
+			break;
+		/* (Only the file lines, which are sorted among themselves.) */
+		if ( eol - line < 2 * HASH_LEN + 6 || line[2 * HASH_LEN] != ' ' ||
+			 strspn( line, hex ) != 2 * HASH_LEN ||
+			 sscanf( &line[2 * HASH_LEN + 1], "%lld %ld", &size, &mtime ) != 2 )
+			continue;
+		lname = (const char*) memchr( &line[2 * HASH_LEN + 1], ' ', eol - line - 2 * HASH_LEN - 1 );
+		if ( lname == (char*) 0 ||
+			 ( lname = (const char*) memchr( lname + 1, ' ', eol - lname - 1 ) ) == (char*) 0 )
+			continue;
+		++lname;
+		cmp = strncmp( lname, name, MIN( eol - lname, namelen ) );
+		if ( cmp == 0 && eol - lname != namelen )
+			cmp = ( eol - lname < namelen ? -1 : 1 );
+		if ( cmp > 0 )
+			break;
+		if ( cmp == 0 )
+			{
+			*cpP = eol + 1;
+			if ( size == sbP->st_size && mtime == sbP->st_mtime )
+				return line;
+			return (char*) 0;
+			}
+		}
+	*cpP = line;
+	return (char*) 0;
+	}
+
+
+/* Puts the hex SHA-256 of the file in hexhash, reading it through buf
+** (READ_SIZE bytes).
+*/
+static int
+hash_file( const char* path, char* hexhash, char* buf )
+	{
+	gcry_md_hd_t md;
+	unsigned char* h;
+	ssize_t r;
+	int fd, i;
+
+	fd = open( path, O_RDONLY );
+	if ( fd < 0 )
+		return -1;
+	if ( gcry_md_open( &md, GCRY_MD_SHA256, 0 ) != 0 )
+		{
+		(void) close( fd );
+		return -1;
+		}
+	while ( ( r = read( fd, buf, READ_SIZE ) ) > 0 )
+		gcry_md_write( md, buf, r );
+	(void) close( fd );
+	if ( r < 0 )
+		{
+		gcry_md_close( md );
+		return -1;
+		}
+	h = gcry_md_read( md, GCRY_MD_SHA256 );
+	for ( i = 0; i < HASH_LEN; ++i )
+		{
+		hexhash[2 * i] = hex[h[i] >> 4];
+		hexhash[2 * i + 1] = hex[h[i] & 0xf];
+		}
+	hexhash[2 * HASH_LEN] = '\0';
+	gcry_md_close( md );
+	return 0;
+	}
+
+
+/* Makes *bufP at least len bytes long. */
+static int
+grow( char** bufP, size_t* maxP, size_t len )
+	{
+	size_t newmax;
+	char* newbuf;
+
+	if ( len <= *maxP )
+		return 0;
+	newmax = ( *maxP == 0 ? 4096 : *maxP );
+	while ( newmax < len )
+		newmax *= 2;
+	newbuf = (char*) realloc( (void*) *bufP, newmax );
+	if ( newbuf == (char*) 0 )
+		return -1;
+	*bufP = newbuf;
+	*maxP = newmax;
+	return 0;
+	}
+
+#endif /* USE_DIRSIG */
@@ -0,0 +1,54 @@
+/* dirsig.h - header file for the signed manifests of directories
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The manifest of a directory is the text:
+*
+*	Directory-Manifest: SHA256
+*	Directory: <directory, from the web directory>
+*	<hex> <bytes> <mtime> <name>		for each file
+*	- - - <name>/				for each subdirectory
+*
+* listing, sorted by name, the world-readable entries a request could get:
+* regular files which aren't executable, and directories.  The cached
+* manifest file holds the manifest, an empty line and the armored signature
+* of the manifest.  A request for DIR_MANIFEST_NAME in a directory which
+* has no file of that name gets the manifest and its signature in a
+* multipart/msigned response.
+*/
+
+#ifndef _DIRSIG_H_
+#define _DIRSIG_H_
+
+#include <sys/types.h>
+
+/*! Get libgcrypt ready, and check that the manifest cache dir exists.
+ * \return 0, or -1 if no manifests will be made.
+ */
+int dirsig_init( const char* dir );
+
+/*! Whether dirsig_init() succeeded. */
+int dirsig_ready( void );
+
+/*! Put in path (size bytes) the cached manifest file of dir.
+ * \return 0, or -1 if too long.
+ */
+int dirsig_path( char* path, size_t size, const char* dir );
+
+/*! Make the manifest of dir.  The hashes of the files which haven't
+ * changed since old, the oldlen bytes long manifest made at oldtime (and
+ * followed by a '\0' somewhere), are taken from it instead of read again.
+ * \return the malloc()ed manifest, its length in *lenP; or (char*) 0.  May
+ * be called from any thread.
+ */
+char* dirsig_make( const char* dir, const char* old, size_t oldlen, time_t oldtime, size_t* lenP );
+
+/*! Find the manifest and its signature in the len bytes of a cached
+ * manifest file.
+ * \return 0, with the manifest length in *manifestlenP and *sigP pointing
+ * at the signature in file; or -1 if the file doesn't hold both.
+ */
+int dirsig_split( const char* file, size_t len, size_t* manifestlenP, const char** sigP, size_t* siglenP );
+
+#endif /* _DIRSIG_H_ */
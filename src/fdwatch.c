@@ -60,6 +60,13 @@
 #endif /* !HAVE_DEVPOLL */
 #endif /* HAVE_SYS_DEVPOLL_H */
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#ifndef HAVE_EPOLL
+#define HAVE_EPOLL
+#endif /* !HAVE_EPOLL */
+#endif /* HAVE_SYS_EPOLL_H */
+
 #include "fdwatch.h"
 
 #ifdef HAVE_SELECT
@@ -83,8 +90,9 @@ static int nreturned, next_ridx;
 
 #define WHICH				  "kevent"
 #define INIT( nfiles )		 kqueue_init( nfiles )
-#define ADD_FD( fd, rw )	   kqueue_add_fd( fd, rw )
+#define ADD_FD( fd, rw )	   kqueue_add_fd( fd, (rw) & ~FDW_EDGE )
 #define DEL_FD( fd )		   kqueue_del_fd( fd )
+#define MOD_FD( fd, rw )	   do { kqueue_del_fd( fd ); kqueue_add_fd( fd, (rw) & ~FDW_EDGE ); } while ( 0 )
 #define WATCH( timeout_msecs ) kqueue_watch( timeout_msecs )
 #define CHECK_FD( fd )		 kqueue_check_fd( fd )
 #define GET_FD( ridx )		 kqueue_get_fd( ridx )
@@ -97,12 +105,32 @@ static int kqueue_check_fd( int fd );
 static int kqueue_get_fd( int ridx );
 
 #else /* HAVE_KQUEUE */
-# ifdef HAVE_DEVPOLL
+# ifdef HAVE_EPOLL
+
+#define WHICH				  "epoll"
+#define INIT( nfiles )		 epoll_init( nfiles )
+#define ADD_FD( fd, rw )	   epoll_ctl_fd( EPOLL_CTL_ADD, fd, rw )
+#define DEL_FD( fd )		   epoll_del_fd( fd )
+#define MOD_FD( fd, rw )	   epoll_ctl_fd( EPOLL_CTL_MOD, fd, rw )
+#define WATCH( timeout_msecs ) epoll_watch( timeout_msecs )
+#define CHECK_FD( fd )		 epoll_check_fd( fd )
+#define GET_FD( ridx )		 epoll_get_fd( ridx )
+
+static int epoll_init( int nfiles );
+static void epoll_ctl_fd( int op, int fd, int rw );
+static void epoll_del_fd( int fd );
+static int epoll_watch( long timeout_msecs );
+static int epoll_check_fd( int fd );
+static int epoll_get_fd( int ridx );
+
+# else /* HAVE_EPOLL */
+#  ifdef HAVE_DEVPOLL
 
 #define WHICH				  "devpoll"
 #define INIT( nfiles )		 devpoll_init( nfiles )
-#define ADD_FD( fd, rw )	   devpoll_add_fd( fd, rw )
+#define ADD_FD( fd, rw )	   devpoll_add_fd( fd, (rw) & ~FDW_EDGE )
 #define DEL_FD( fd )		   devpoll_del_fd( fd )
+#define MOD_FD( fd, rw )	   do { devpoll_del_fd( fd ); devpoll_add_fd( fd, (rw) & ~FDW_EDGE ); } while ( 0 )
 #define WATCH( timeout_msecs ) devpoll_watch( timeout_msecs )
 #define CHECK_FD( fd )		 devpoll_check_fd( fd )
 #define GET_FD( ridx )		 devpoll_get_fd( ridx )
@@ -114,13 +142,14 @@ static int devpoll_watch( long timeout_msecs );
 static int devpoll_check_fd( int fd );
 static int devpoll_get_fd( int ridx );
 
-# else /* HAVE_DEVPOLL */
-#  ifdef HAVE_POLL
+#  else /* HAVE_DEVPOLL */
+#   ifdef HAVE_POLL
 
 #define WHICH				  "poll"
 #define INIT( nfiles )		 poll_init( nfiles )
-#define ADD_FD( fd, rw )	   poll_add_fd( fd, rw )
+#define ADD_FD( fd, rw )	   poll_add_fd( fd, (rw) & ~FDW_EDGE )
 #define DEL_FD( fd )		   poll_del_fd( fd )
+#define MOD_FD( fd, rw )	   poll_mod_fd( fd, (rw) & ~FDW_EDGE )
 #define WATCH( timeout_msecs ) poll_watch( timeout_msecs )
 #define CHECK_FD( fd )		 poll_check_fd( fd )
 #define GET_FD( ridx )		 poll_get_fd( ridx )
@@ -128,17 +157,19 @@ static int devpoll_get_fd( int ridx );
 static int poll_init( int nfiles );
 static void poll_add_fd( int fd, int rw );
 static void poll_del_fd( int fd );
+static void poll_mod_fd( int fd, int rw );
 static int poll_watch( long timeout_msecs );
 static int poll_check_fd( int fd );
 static int poll_get_fd( int ridx );
 
-#  else /* HAVE_POLL */
-#   ifdef HAVE_SELECT
+#   else /* HAVE_POLL */
+#    ifdef HAVE_SELECT
 
 #define WHICH				  "select"
 #define INIT( nfiles )		 select_init( nfiles )
-#define ADD_FD( fd, rw )	   select_add_fd( fd, rw )
+#define ADD_FD( fd, rw )	   select_add_fd( fd, (rw) & ~FDW_EDGE )
 #define DEL_FD( fd )		   select_del_fd( fd )
+#define MOD_FD( fd, rw )	   select_mod_fd( fd, (rw) & ~FDW_EDGE )
 #define WATCH( timeout_msecs ) select_watch( timeout_msecs )
 #define CHECK_FD( fd )		 select_check_fd( fd )
 #define GET_FD( ridx )		 select_get_fd( ridx )
@@ -146,13 +177,15 @@ static int poll_get_fd( int ridx );
 static int select_init( int nfiles );
 static void select_add_fd( int fd, int rw );
 static void select_del_fd( int fd );
+static void select_mod_fd( int fd, int rw );
 static int select_watch( long timeout_msecs );
 static int select_check_fd( int fd );
 static int select_get_fd( int ridx );
 
-#   endif /* HAVE_SELECT */
-#  endif /* HAVE_POLL */
-# endif /* HAVE_DEVPOLL */
+#    endif /* HAVE_SELECT */
+#   endif /* HAVE_POLL */
+#  endif /* HAVE_DEVPOLL */
+# endif /* HAVE_EPOLL */
 #endif /* HAVE_KQUEUE */
 
 
@@ -185,10 +218,10 @@ fdwatch_get_nfiles( void )
 		}
 #endif /* RLIMIT_NOFILE */
 
-#if defined(HAVE_SELECT) && ! ( defined(HAVE_POLL) || defined(HAVE_DEVPOLL) || defined(HAVE_KQUEUE) )
+#if defined(HAVE_SELECT) && ! ( defined(HAVE_POLL) || defined(HAVE_DEVPOLL) || defined(HAVE_EPOLL) || defined(HAVE_KQUEUE) )
 	/* If we use select(), then we must limit ourselves to FD_SETSIZE. */
 	nfiles = MIN( nfiles, FD_SETSIZE );
-#endif /* HAVE_SELECT && ! ( HAVE_POLL || HAVE_DEVPOLL || HAVE_KQUEUE ) */
+#endif /* HAVE_SELECT && ! ( HAVE_POLL || HAVE_DEVPOLL || HAVE_EPOLL || HAVE_KQUEUE ) */
 
 	/* Initialize the fdwatch data structures. */
 	nwatches = 0;
@@ -215,7 +248,7 @@ fdwatch_add_fd( int fd, void* client_data, int rw )
 		return;
 		}
 	ADD_FD( fd, rw );
-	fd_rw[fd] = rw;
+	fd_rw[fd] = rw & ~FDW_EDGE;
 	fd_data[fd] = client_data;
 	}
 
@@ -234,6 +267,24 @@ fdwatch_del_fd( int fd )
 	fd_data[fd] = (void*) 0;
 	}
 
+
+/* Change the direction watched on a descriptor already in the watch list,
+** without taking it out of the kernel's interest set where the backend
+** allows it.
+*/
+void
+fdwatch_mod_fd( int fd, void* client_data, int rw )
+	{
+	if ( fd < 0 || fd >= nfiles || fd_rw[fd] == -1 )
+		{
+		syslog( LOG_ERR, "bad fd (%d) passed to fdwatch_mod_fd!", fd );
+		return;
+		}
+	MOD_FD( fd, rw );
+	fd_rw[fd] = rw & ~FDW_EDGE;
+	fd_data[fd] = client_data;
+	}
+
 /* Do the watch.  Return value is the number of descriptors that are ready,
 ** or 0 if the timeout expired, or -1 on errors.  A timeout of INFTIM means
 ** wait indefinitely.
@@ -420,7 +471,121 @@ kqueue_get_fd( int ridx )
 #else /* HAVE_KQUEUE */
 
 
-# ifdef HAVE_DEVPOLL
+# ifdef HAVE_EPOLL
+
+static struct epoll_event* eprevents;
+static int* ep_rfdidx;
+static int ep;
+
+
+static int
+epoll_init( int nfiles )
+	{
+	ep = epoll_create( nfiles );
+	if ( ep == -1 )
+		return -1;
+	(void) fcntl( ep, F_SETFD, 1 );
+	eprevents = (struct epoll_event*) malloc( sizeof(struct epoll_event) * nfiles );
+	ep_rfdidx = (int*) malloc( sizeof(int) * nfiles );
+	if ( eprevents == (struct epoll_event*) 0 || ep_rfdidx == (int*) 0 )
+		return -1;
+	(void) memset( ep_rfdidx, 0, sizeof(int) * nfiles );
+	return 0;
+	}
+
+
+/* Unlike the other backends, epoll keeps the interest set in the kernel,
+** so adding and changing a descriptor are both a single epoll_ctl().
+*/
+static void
+epoll_ctl_fd( int op, int fd, int rw )
+	{
+	struct epoll_event ev;
+
+	(void) memset( &ev, 0, sizeof(ev) );
+	ev.data.fd = fd;
+	switch ( rw & ~FDW_EDGE )
+		{
+		case FDW_READ: ev.events = EPOLLIN; break;
+		case FDW_WRITE: ev.events = EPOLLOUT; break;
+		default: break;
+		}
+	if ( rw & FDW_EDGE )
+		ev.events |= EPOLLET;
+	if ( epoll_ctl( ep, op, fd, &ev ) == -1 )
+		syslog( LOG_ERR, "epoll_ctl(%s) fd %d - %m",
+			op == EPOLL_CTL_ADD ? "add" : "mod", fd );
+	}
+
+
+static void
+epoll_del_fd( int fd )
+	{
+	struct epoll_event ev;
+
+	/* (Kernels before 2.6.9 want a non-null event even for a delete.) */
+	if ( epoll_ctl( ep, EPOLL_CTL_DEL, fd, &ev ) == -1 )
+		syslog( LOG_ERR, "epoll_ctl(del) fd %d - %m", fd );
+	}
+
+
+static int
+epoll_watch( long timeout_msecs )
+	{
+	int i, r;
+
+	r = epoll_wait( ep, eprevents, nfiles, (int) timeout_msecs );
+	if ( r == -1 )
+		return -1;
+
+	for ( i = 0; i < r; ++i )
+		ep_rfdidx[eprevents[i].data.fd] = i;
+
+	return r;
+	}
+
+
+static int
+epoll_check_fd( int fd )
+	{
+	int ridx = ep_rfdidx[fd];
+
+	if ( ridx < 0 || ridx >= nfiles )
+		{
+		syslog( LOG_ERR, "bad ridx (%d) in epoll_check_fd!", ridx );
+		return 0;
+		}
+	if ( ridx >= nreturned )
+		return 0;
+	if ( eprevents[ridx].data.fd != fd )
+		return 0;
+	if ( eprevents[ridx].events & EPOLLERR )
+		return 0;
+	switch ( fd_rw[fd] )
+		{
+		case FDW_READ: return eprevents[ridx].events & ( EPOLLIN | EPOLLHUP );
+		case FDW_WRITE: return eprevents[ridx].events & ( EPOLLOUT | EPOLLHUP );
+		default: return 0;
+		}
+	}
+
+
+static int
+epoll_get_fd( int ridx )
+	{
+	if ( ridx < 0 || ridx >= nfiles )
+		{
+		syslog( LOG_ERR, "bad ridx (%d) in epoll_get_fd!", ridx );
+		return -1;
+		}
+	return eprevents[ridx].data.fd;
+	}
+
+
+# else /* HAVE_EPOLL */
+
+
+#  ifdef HAVE_DEVPOLL
 
 static int maxdpevents;
 static struct pollfd* dpevents;
@@ -545,10 +710,10 @@ devpoll_get_fd( int ridx )
 	}
 
 
-# else /* HAVE_DEVPOLL */
+#  else /* HAVE_DEVPOLL */
 
 
-#  ifdef HAVE_POLL
+#   ifdef HAVE_POLL
 
 static struct pollfd* pollfds;
 static int npoll_fds;
@@ -611,6 +776,25 @@ poll_del_fd( int fd )
 	}
 
 
+static void
+poll_mod_fd( int fd, int rw )
+	{
+	int idx = poll_fdidx[fd];
+
+	if ( idx < 0 || idx >= nfiles )
+		{
+		syslog( LOG_ERR, "bad idx (%d) in poll_mod_fd!", idx );
+		return;
+		}
+	switch ( rw )
+		{
+		case FDW_READ: pollfds[idx].events = POLLIN; break;
+		case FDW_WRITE: pollfds[idx].events = POLLOUT; break;
+		default: break;
+		}
+	}
+
+
 static int
 poll_watch( long timeout_msecs )
 	{
@@ -666,10 +850,10 @@ poll_get_fd( int ridx )
 	return poll_rfdidx[ridx];
 	}
 
-#  else /* HAVE_POLL */
+#   else /* HAVE_POLL */
 
 
-#   ifdef HAVE_SELECT
+#    ifdef HAVE_SELECT
 
 static fd_set master_rfdset;
 static fd_set master_wfdset;
@@ -752,6 +936,20 @@ select_del_fd( int fd )
 	}
 
 
+static void
+select_mod_fd( int fd, int rw )
+	{
+	FD_CLR( fd, &master_rfdset );
+	FD_CLR( fd, &master_wfdset );
+	switch ( rw )
+		{
+		case FDW_READ: FD_SET( fd, &master_rfdset ); break;
+		case FDW_WRITE: FD_SET( fd, &master_wfdset ); break;
+		default: break;
+		}
+	}
+
+
 static int
 select_get_maxfd( void )
 	{
@@ -828,10 +1026,12 @@ select_get_fd( int ridx )
 	return select_rfdidx[ridx];
 	}
 
-#   endif /* HAVE_SELECT */
+#    endif /* HAVE_SELECT */
+
+#   endif /* HAVE_POLL */
 
-#  endif /* HAVE_POLL */
+#  endif /* HAVE_DEVPOLL */
 
-# endif /* HAVE_DEVPOLL */
+# endif /* HAVE_EPOLL */
 
 #endif /* HAVE_KQUEUE */
@@ -1,6 +1,6 @@
 /* fdwatch.h - header file for fdwatch package
 **
-** This package abstracts the use of the select()/poll()/kqueue()
+** This package abstracts the use of the select()/poll()/kqueue()/epoll()
 ** system calls.  The basic function of these calls is to watch a set
 ** of file descriptors for activity.  select() originated in the BSD world,
 ** while poll() came from SysV land, and their interfaces are somewhat
@@ -50,6 +50,14 @@
 #define FDW_READ 0
 #define FDW_WRITE 1
 
+/* May be or'ed into rw to ask for edge-triggered readiness, on backends
+** that have it (epoll); the others ignore it.  An edge-triggered
+** descriptor is only reported again once new data (or buffer space)
+** shows up, so the caller must keep reading (or writing) until it gets
+** a short count or EAGAIN.
+*/
+#define FDW_EDGE 2
+
 #ifndef INFTIM
 #define INFTIM -1
 #endif /* INFTIM */
@@ -65,6 +73,11 @@ void fdwatch_add_fd( int fd, void* client_data, int rw );
 /* Delete a descriptor from the watch list. */
 void fdwatch_del_fd( int fd );
 
+/* Switch a descriptor already in the watch list to another rw direction.
+** Cheaper than fdwatch_del_fd() followed by fdwatch_add_fd().
+*/
+void fdwatch_mod_fd( int fd, void* client_data, int rw );
+
 /* Do the watch.  Return value is the number of descriptors that are ready,
 ** or 0 if the timeout expired, or -1 on errors.  A timeout of INFTIM means
 ** wait indefinitely.
@@ -21,6 +21,10 @@
 #include "hkp.h"
 #include "libhttpd.h"
 
+#ifdef USE_COMPRESSION
+#include <zlib.h>
+#endif /* USE_COMPRESSION */
+
 #define QSTRING_MAX 1024
 
 #ifdef PKS_ADD_LOG
@@ -38,6 +42,75 @@ struct gpgdata4export_handle {
 
 static int export_start=0; /* set to 1 once by gpgdata4export_cb(...) */
 
+#ifdef USE_COMPRESSION
+/* gzip stream of the response body, if the client accepts it */
+static gzFile hkp_gz=(gzFile) 0;
+static int hkp_compress=0;
+#endif /* USE_COMPRESSION */
+
+/* Prepare to compress the response body, if the client accepts it.
+ * \return the Content-Encoding to send_mime() with.
+ */
+static char * hkp_encoding(httpd_conn* hc) {
+#ifdef USE_COMPRESSION
+	hc->bfield |= HC_VARY_ENCODING;
+	/* (Detached signatures are made of what is sent.) */
+	hkp_compress = !(hc->bfield & HC_DETACH_SIGN) && httpd_accept_q(hc->accepte, "gzip") > 0;
+	if (hkp_compress)
+		return "gzip";
+#endif /* USE_COMPRESSION */
+	return "";
+}
+
+/* Start the (compressed) body, once the headers are written.
+ * \return 0, or -1 on errors. */
+static int hkp_body_start(httpd_conn* hc) {
+#ifdef USE_COMPRESSION
+	int fd;
+#endif /* USE_COMPRESSION */
+
+	/* This child owns the socket: rather block than have zlib or stdio drop
+	 * what it can't take at once. */
+	httpd_clear_ndelay(hc->conn_fd);
+#ifdef USE_COMPRESSION
+	if (hkp_compress) {
+		if ( (fd=dup(hc->conn_fd)) < 0 )
+			return -1;
+		if ( !(hkp_gz=gzdopen(fd, "wb")) ) {
+			close(fd);
+			return -1;
+		}
+	}
+#endif /* USE_COMPRESSION */
+	return 0;
+}
+
+/* Write into the response body.
+ * \return like write(). */
+static ssize_t hkp_body_write(httpd_conn* hc, const void* buf, size_t size) {
+#ifdef USE_COMPRESSION
+	if (hkp_gz)
+		return ( size == 0 || gzwrite(hkp_gz, buf, size) > 0 ) ? (ssize_t) size : -1;
+#endif /* USE_COMPRESSION */
+	return httpd_write_fully(hc->conn_fd, buf, size);
+}
+
+/* End the response body (flush the gzip trailer).
+ * \return 0, or -1 on errors. */
+static int hkp_body_end(void) {
+#ifdef USE_COMPRESSION
+	int r;
+
+	if (hkp_gz) {
+		r=gzclose(hkp_gz);
+		hkp_gz=(gzFile) 0;
+		if (r != Z_OK)
+			return -1;
+	}
+#endif /* USE_COMPRESSION */
+	return 0;
+}
+
 #ifdef CHECK_UDID2
 extern regex_t udid2c_regex;
 
@@ -231,13 +304,20 @@ void hkp_add( httpd_conn* hc ) {
 static ssize_t gpgdata4export_cb(struct gpgdata4export_handle * h, void *buffer, size_t size)
 {
 	if (!export_start) {
-		send_mime(h->hc, 200, ok200title, "", "", "text/html; charset=%s",(off_t) -1, h->hc->sb.st_mtime );
+		char head[512];
+		int len;
+
+		send_mime(h->hc, 200, ok200title, hkp_encoding(h->hc), "", "text/html; charset=%s",(off_t) -1, h->hc->sb.st_mtime );
 		httpd_write_response(h->hc);
-		httpd_dprintf(h->hc->conn_fd,"<html><head><title>"SOFTWARE_NAME" Public Key Server -- Get: %.80s (%d+)</title></head><body><h1>Public Key Server -- Get: %.80s (%d+)</h1><pre>\n",h->searchs[0],h->nsearchs-1,h->searchs[0],h->nsearchs-1);
+		if ( hkp_body_start(h->hc) < 0 )
+			return -1;
+		len=snprintf(head,sizeof(head),"<html><head><title>"SOFTWARE_NAME" Public Key Server -- Get: %.80s (%d+)</title></head><body><h1>Public Key Server -- Get: %.80s (%d+)</h1><pre>\n",h->searchs[0],h->nsearchs-1,h->searchs[0],h->nsearchs-1);
 		export_start=1;
+		if ( hkp_body_write(h->hc,head,MIN(len,sizeof(head)-1)) < 0 )
+			return -1;
 	}
 
-	return httpd_write_fully(h->hc->conn_fd,buffer,size);
+	return hkp_body_write(h->hc,buffer,size);
 }
 /* dummy function for callback based gpgme data objects */
 static void gpg_data_release_cb(void *handle)
@@ -401,10 +481,14 @@ void hkp_lookup( httpd_conn* hc ) {
 
 		gpgerr = gpgme_op_export_ext(gpglctx,(const char **)searchdec,0,gpgdata);
 		if ( gpgerr != GPG_ERR_NO_ERROR) {
-			httpd_send_err(hc, 500, err500title, "", err500form, "g11" );
+			/* (Too late for an error response once the body started: cut it.) */
+			if (!export_start)
+				httpd_send_err(hc, 500, err500title, "", err500form, "g11" );
 			HKP_LOOKUP_EXIT(EXIT_FAILURE);
 		} else if (export_start) {
-			httpd_write_fully(hc->conn_fd,"\n</pre></body></html>\n",sizeof("\n</pre></body></html>\n")-1);
+			if ( hkp_body_write(hc,"\n</pre></body></html>\n",sizeof("\n</pre></body></html>\n")-1) < 0
+					|| hkp_body_end() < 0 )
+				HKP_LOOKUP_EXIT(EXIT_FAILURE);
 		} else {
 			httpd_send_err(hc, 404, err404title, "", "Get: %.80s (...): No key found ! :-(", search[0]);
 		}
@@ -412,6 +496,7 @@ void hkp_lookup( httpd_conn* hc ) {
 	} else if (!strcmp(op, "index")) {
 		FILE* fp;
 		char begin=0;
+		int r=0;
 		gpgme_key_t gpgkey;
 		gpgme_user_id_t gpguid;
 
@@ -437,19 +522,34 @@ void hkp_lookup( httpd_conn* hc ) {
 		gpgerr = gpgme_op_keylist_next (gpglctx, &gpgkey);
 		while (gpgerr == GPG_ERR_NO_ERROR) {
 			if (!begin) {
-				send_mime(hc, 200, ok200title, "", "", "text/plain; charset=%s",(off_t) -1, hc->sb.st_mtime );
+				send_mime(hc, 200, ok200title, hkp_encoding(hc), "", "text/plain; charset=%s",(off_t) -1, hc->sb.st_mtime );
 				httpd_write_response(hc);
+				if ( hkp_body_start(hc) < 0 )
+					HKP_LOOKUP_EXIT(EXIT_FAILURE);
 				begin=1;
 				/* Luckily: info "header" is optionnal, see draft-shaw-openpgp-hkp-00.txt */
 			}
 			/* first subkey is the main key */
-			fprintf(fp,"pub:%s:%d:%d:%ld:%ld\n",gpgkey->subkeys->fpr,gpgkey->subkeys->pubkey_algo,gpgkey->subkeys->length,gpgkey->subkeys->timestamp,(gpgkey->subkeys->expires?gpgkey->subkeys->expires:-1));
+#ifdef USE_COMPRESSION
+			if (hkp_gz)
+				r=gzprintf(hkp_gz,"pub:%s:%d:%d:%ld:%ld\n",gpgkey->subkeys->fpr,gpgkey->subkeys->pubkey_algo,gpgkey->subkeys->length,gpgkey->subkeys->timestamp,(gpgkey->subkeys->expires?gpgkey->subkeys->expires:-1));
+			else
+#endif /* USE_COMPRESSION */
+			r=fprintf(fp,"pub:%s:%d:%d:%ld:%ld\n",gpgkey->subkeys->fpr,gpgkey->subkeys->pubkey_algo,gpgkey->subkeys->length,gpgkey->subkeys->timestamp,(gpgkey->subkeys->expires?gpgkey->subkeys->expires:-1));
 			gpguid=gpgkey->uids;
-			while (gpguid) {
-				fprintf(fp,"uid:%s (%s) <%s>:\n",gpguid->name,gpguid->comment,gpguid->email);
+			while (gpguid && r > 0) {
+#ifdef USE_COMPRESSION
+				if (hkp_gz)
+					r=gzprintf(hkp_gz,"uid:%s (%s) <%s>:\n",gpguid->name,gpguid->comment,gpguid->email);
+				else
+#endif /* USE_COMPRESSION */
+				r=fprintf(fp,"uid:%s (%s) <%s>:\n",gpguid->name,gpguid->comment,gpguid->email);
 				gpguid=gpguid->next;
 			}
 			gpgme_key_unref(gpgkey);
+			/* The client is gone (or zlib failed): stop there. */
+			if (r <= 0)
+				HKP_LOOKUP_EXIT(EXIT_FAILURE);
 			gpgerr = gpgme_op_keylist_next (gpglctx, &gpgkey);
 		}
 			gpgme_key_unref(gpgkey); /* ... because i don't know how "gpgme_op_keylist_next" behave when not returning GPG_ERR_NO_ERROR */
@@ -457,6 +557,8 @@ void hkp_lookup( httpd_conn* hc ) {
 			httpd_send_err(hc, 404, err404title, "", "Get: %.80s (...): No key found ! :-(", search[0]);
 			HKP_LOOKUP_EXIT(EXIT_SUCCESS);
 		}
+		if ( hkp_body_end() < 0 )
+			HKP_LOOKUP_EXIT(EXIT_FAILURE);
 		(void) fclose( fp );
 		HKP_LOOKUP_EXIT(EXIT_SUCCESS);
 
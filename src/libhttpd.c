@@ -58,6 +58,12 @@
 #include <stdarg.h>
 #include <pthread.h>
 #include <gpgme.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #ifdef HAVE_DIRENT_H
 # include <dirent.h>
@@ -94,6 +100,16 @@ extern char* crypt( const char* key, const char* setting );
 
 #include "libhttpd.h"
 #include "mmc.h"
+#include "pcache.h"
+#include "rcache.h"
+#include "zcache.h"
+#include "signpool.h"
+#include "sigindex.h"
+#include "sigcache.h"
+#include "merkle.h"
+#include "dirsig.h"
+#include "sigpolicy.h"
+#include "pgpsign.h"
 #include "timers.h"
 #include "match.h"
 #include "tdate_parse.h"
@@ -125,17 +141,51 @@ typedef int socklen_t;
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #endif
 
+#ifdef WHOLE_FILE_RANGE_SIG
+/* In the signature part of a range signed with the whole file's signature. */
+#define WHOLE_SIG_HEADER "Content-Description: signature of the whole file\015\012"
+#endif /* WHOLE_FILE_RANGE_SIG */
+
+/* The parts of a range sent with the proof of its Merkle tree chunks. */
+#define MERKLE_PROOF_TYPE "application/x-merkle-proof"
+#define ROOT_SIG_HEADER "Content-Description: signature of the Merkle tree manifest\015\012"
+
 /* a struct passed to callbacks for gpgme data buffers */
 struct fp2fd_gpg_data_handle {
 	FILE * fpin;
 	int fdout;
 }; 
 
+/* Set in the child processes handling a request, which may block. */
+static int in_child = 0;
+
+/* Ids of the request headers we know of, cf. header_lookup(). */
+#define HDR_UNKNOWN 0
+#define HDR_IGNORED 1
+#define HDR_REFERER 2
+#define HDR_USER_AGENT 3
+#define HDR_HOST 4
+#define HDR_ACCEPT 5
+#define HDR_ACCEPT_ENCODING 6
+#define HDR_ACCEPT_LANGUAGE 7
+#define HDR_IF_MODIFIED_SINCE 8
+#define HDR_COOKIE 9
+#define HDR_RANGE 10
+#define HDR_IF_RANGE 11
+#define HDR_CONTENT_TYPE 12
+#define HDR_CONTENT_LENGTH 13
+#define HDR_AUTHORIZATION 14
+#define HDR_CONNECTION 15
+#define HDR_X_FORWARDED_FOR 16
+#define HDR_IF_NONE_MATCH 17
+#define HDR_IF_MATCH 18
+
 /* Forwards. */
 static void free_httpd_server( httpd_server* hs );
-static int init_listen_sockets(const char * hostname, unsigned short port, int * listen_fds,  size_t size);
+static int init_listen_sockets(const char * hostname, unsigned short port, int * listen_fds,  size_t size, int reuseport);
 static void add_response( httpd_conn* hc, char* str );
-static void send_response_tail( httpd_conn* hc );
+static void make_response_tail( char* buf, size_t size );
+static void clear_request( httpd_conn* hc );
 static void defang(const char* str, char* dfstr, int dfsize );
 #ifdef AUTH_FILE
 static void send_authenticate( httpd_conn* hc, char* realm );
@@ -148,10 +198,38 @@ static int hexit( char c );
 static void strencode( char* to, int tosize, char* from );
 #endif /* GENERATE_INDEXES */
 //static char* expand_symlinks( char* path, char** restP, int no_symlink_check );
-static char* bufgets( httpd_conn* hc );
+static size_t find_eol( const char* buf, size_t len );
+static int add_line( httpd_conn* hc );
+static char* bufgets( httpd_conn* hc, size_t eol );
+static void init_headers( void );
+static int header_lookup( const char* name, size_t len );
+static int add_header_value( char** valP, char** bufP, size_t* maxP, char* value );
 static void de_dotdot( char* file );
 static void init_mime( void );
 static void figure_mime( httpd_conn* hc );
+static int parse_ranges( httpd_conn* hc );
+static void make_parts( httpd_conn* hc, int n );
+static off_t multipart_length( httpd_conn* hc );
+static void make_etag( httpd_conn* hc, int sign );
+static void frame_signed( httpd_conn* hc, gpgme_error_t err, const char* sig, size_t siglen, const char* proof, size_t prooflen );
+#ifdef USE_MERKLE
+static int merkle_range( httpd_conn* hc, char** treeP, struct stat* treesbP, char** proofP, size_t* prooflenP, const char** sigP, size_t* siglenP, struct timeval* nowP );
+static void tree_later( httpd_conn* hc );
+#endif /* USE_MERKLE */
+#ifdef USE_DIRSIG
+static int dir_manifest( httpd_conn* hc, struct timeval* nowP );
+static int serve_manifest( httpd_conn* hc, char* fcache, struct stat* sbP, struct timeval* nowP );
+#endif /* USE_DIRSIG */
+static int sign_policy( httpd_conn* hc );
+static int sig_cached( httpd_conn* hc );
+static int etag_match( httpd_conn* hc, const char* list, int strong );
+static int range_applies( httpd_conn* hc );
+static int not_modified( httpd_conn* hc );
+static void choose_encoding( httpd_conn* hc );
+#ifdef USE_COMPRESSION
+static void compress_file( httpd_conn* hc );
+static int compressible_type( const char* type );
+#endif /* USE_COMPRESSION */
 #ifdef CGI_TIMELIMIT
 static void cgi_kill2( ClientData client_data, struct timeval* nowP );
 static void cgi_kill( ClientData client_data, struct timeval* nowP );
@@ -171,6 +249,7 @@ static void cgi_interpose_input(interpose_args_t * args);
 static ssize_t fp2fd_gpg_data_rd_cb(struct fp2fd_gpg_data_handle * handle, void *buffer, size_t size);
 static void gpg_data_release_cb(void *handle);
 static void cgi_child( httpd_conn* hc );
+static int response_variant( httpd_conn* hc );
 static void make_log_entry(const httpd_conn* hc, time_t now, int status);
 static inline int sockaddr_check( const struct sockaddr * sa );
 static inline size_t sockaddr_len( const struct sockaddr * sa );
@@ -186,6 +265,8 @@ free_httpd_server( httpd_server* hs )
 		free( (void*) hs->cgi_pattern );
 	if ( hs->sig_pattern != (char*) 0 )
 		free( (void*) hs->sig_pattern );
+	match_free( hs->cgi_match );
+	match_free( hs->sig_match );
 	free( (void*) hs );
 	}
 
@@ -263,6 +344,26 @@ httpd_server* httpd_initialize( char* hostname, unsigned short port,
 		while ( ( cp = strstr( hs->sig_pattern, "|/" ) ) != (char*) 0 )
 			(void) strcpy( cp + 1, cp + 2 );
 		}
+	/* Compile the patterns once, they are tested on every request. */
+	hs->cgi_match = hs->sig_match = (MatchSet*) 0;
+	if ( hs->cgi_pattern != (char*) 0 )
+		{
+		hs->cgi_match = match_compile( &hs->cgi_pattern, 1 );
+		if ( hs->cgi_match == (MatchSet*) 0 )
+			{
+			syslog( LOG_CRIT, "out of memory compiling cgi_pattern" );
+			return (httpd_server*) 0;
+			}
+		}
+	if ( hs->sig_pattern != (char*) 0 )
+		{
+		hs->sig_match = match_compile( &hs->sig_pattern, 1 );
+		if ( hs->sig_match == (MatchSet*) 0 )
+			{
+			syslog( LOG_CRIT, "out of memory compiling sig_pattern" );
+			return (httpd_server*) 0;
+			}
+		}
 	hs->cgi_limit = cgi_limit;
 	hs->cgi_count = 0;
 	hs->cwd = strdup( cwd );
@@ -275,12 +376,13 @@ httpd_server* httpd_initialize( char* hostname, unsigned short port,
 	hs->logfp = logfp;
 
 	/* Initialize listen sockets. */
-	if ( init_listen_sockets(hostname, port, hs->listen_fds, SIZEOFARRAY(hs->listen_fds))  < 1 ) {
+	if ( init_listen_sockets(hostname, port, hs->listen_fds, SIZEOFARRAY(hs->listen_fds), bfield & HS_REUSEPORT)  < 1 ) {
 		free_httpd_server( hs );
 		return (httpd_server*) 0;
 	}
 
 	init_mime();
+	init_headers();
 
 	/* Done initializing. */
 	if ( hs->binding_hostname == (char*) 0 )
@@ -298,7 +400,7 @@ httpd_server* httpd_initialize( char* hostname, unsigned short port,
 /*
  * \return The number of listening socket (1 to nmemb) if success, -1 on error.
  */
-static int init_listen_sockets(const char * hostname, unsigned short port, int * listen_fds,  size_t nmemb) {
+static int init_listen_sockets(const char * hostname, unsigned short port, int * listen_fds,  size_t nmemb, int reuseport) {
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
 	int s, i;
@@ -339,6 +441,16 @@ static int init_listen_sockets(const char * hostname, unsigned short port, int *
 			free(str);
 		}
 
+#ifdef SO_REUSEPORT
+		/* Allow other processes to bind their own socket on the same address. */
+		s = 1;
+		if ( reuseport && setsockopt(listen_fds[i], SOL_SOCKET, SO_REUSEPORT, (char*) &s, sizeof(s) ) < 0 ) {
+			char * str=get_ip_str(rp->ai_addr);
+			syslog( LOG_WARNING, "setsockopt SO_REUSEPORT [%.80s]:%.80s - %m", str, service);
+			free(str);
+		}
+#endif /* SO_REUSEPORT */
+
 		/* Try to restrict PF_INET6 socket to IPv6 communications only. */
 		if (rp->ai_addr->sa_family == AF_INET6) {
 			s=1;
@@ -426,6 +538,17 @@ void httpd_unlisten( httpd_server* hs ) {
 }
 
 
+/* Call in a forked process to replace the inherited listen socket(s) by
+** its own ones, so the kernel balances new connections between processes.
+** \return the number of listening sockets, or -1 on error.
+*/
+int httpd_relisten( httpd_server* hs ) {
+
+	httpd_unlisten( hs );
+	return init_listen_sockets(hs->binding_hostname, hs->port, hs->listen_fds, SIZEOFARRAY(hs->listen_fds), hs->bfield & HS_REUSEPORT);
+}
+
+
 /* Conditional macro to allow two alternate forms for use in the built-in
 ** error pages.  If EXPLICIT_ERROR_PAGES is defined, the second and more
 ** explicit error form is used; otherwise, the first and more generic
@@ -470,8 +593,14 @@ char* httpd_err408form =
 	"No request appeared within a reasonable time period.\n";
 
 char * err411title = "Length Required";
+char* err412title = "Precondition Failed";
+char* err412form =
+	"The URL '%.80s' doesn't match the conditions of the request.\n";
 char * err413title = "Request Entity Too Large";
 char * err415title = "Unsupported Media Type";
+char* err416title = "Requested Range Not Satisfiable";
+char* err416form =
+	"None of the requested ranges is within the URL '%.80s'.\n";
 
 char* err500title = "Internal Error";
 char* err500form =
@@ -490,11 +619,15 @@ char* httpd_err503form =
 static void
 add_response( httpd_conn* hc, char* str )
 	{
-	size_t len;
+	httpd_add_response( hc, str, strlen( str ) );
+	}
 
-	len = strlen( str );
+/* Append len bytes to the buffer waiting to be sent as response. */
+void
+httpd_add_response( httpd_conn* hc, const char* buf, size_t len )
+	{
 	httpd_realloc_str( &hc->response, &hc->maxresponse, hc->responselen + len );
-	(void) memmove( &(hc->response[hc->responselen]), str, len );
+	(void) memmove( &(hc->response[hc->responselen]), buf, len );
 	hc->responselen += len;
 	}
 
@@ -552,6 +685,15 @@ send_mime( httpd_conn* hc, int status, char* title, char* encodings, char* extra
 	hc->bytes_to_send = length;
 	if ( hc->http_version > 9 )
 		{
+		/* Without a length, only closing the connection tells the client
+		** where the body ends.
+		*/
+		if ( ( hc->bfield & HC_KEEP_ALIVE ) && length < 0 &&
+			 status != 304 && hc->method != METHOD_HEAD )
+			{
+			hc->bfield &= ~HC_KEEP_ALIVE;
+			hc->bfield |= HC_SHOULD_LINGER;
+			}
 		now = time( (time_t*) 0 );
 
 		if ( mod == (time_t) 0 )
@@ -561,10 +703,17 @@ send_mime( httpd_conn* hc, int status, char* title, char* encodings, char* extra
 		(void) snprintf(
 			fixed_type, sizeof(fixed_type), type, DEFAULT_CHARSET );
 		(void) snprintf( buf, sizeof(buf),
-			"%.20s %d %s\015\012Server: %s\015\012Content-Type: %s\015\012Date: %s\015\012Last-Modified: %s\015\012Accept-Ranges: bytes\015\012Connection: close\015\012",
+			"%.20s %d %s\015\012Server: %s\015\012Content-Type: %s\015\012Date: %s\015\012Last-Modified: %s\015\012Accept-Ranges: bytes\015\012Connection: %s\015\012",
 			hc->protocol, status, title, EXPOSED_SERVER_SOFTWARE, fixed_type,
-			nowbuf, modbuf );
+			nowbuf, modbuf, hc->bfield & HC_KEEP_ALIVE ? "keep-alive" : "close" );
 		add_response( hc, buf );
+		if ( hc->bfield & HC_VARY_ENCODING )
+			add_response( hc, "Vary: Accept-Encoding\015\012" );
+		if ( hc->etag[0] != '\0' && ( ( status >= 200 && status < 300 ) || status == 304 ) )
+			{
+			(void) snprintf( buf, sizeof(buf), "ETag: %s\015\012", hc->etag );
+			add_response( hc, buf );
+			}
 		if ( status < 200 || status >= 400 )
 			{
 			(void) snprintf( buf, sizeof(buf),
@@ -577,7 +726,7 @@ send_mime( httpd_conn* hc, int status, char* title, char* encodings, char* extra
 				"Content-Encoding: %s\015\012", encodings );
 			add_response( hc, buf );
 			}
-		if ( status == 206 )
+		if ( status == 206 && hc->nranges == 0 )
 			{
 			(void) snprintf( buf, sizeof(buf),
 				"Content-Range: bytes %lld-%lld/%lld\015\012%s %lld\015\012",
@@ -635,17 +784,14 @@ httpd_realloc_str( char** strP, size_t* maxsizeP, size_t size )
 	}
 
 static void
-send_response_tail( httpd_conn* hc )
+make_response_tail( char* buf, size_t size )
 	{
-	char buf[1000];
-
-	(void) snprintf( buf, sizeof(buf), "\
+	(void) snprintf( buf, size, "\
 <HR>\n\
 <ADDRESS><A HREF=\"%s\">%s</A></ADDRESS>\n\
 </BODY>\n\
 </HTML>\n",
 		SOFTWARE_ADDRESS, EXPOSED_SERVER_SOFTWARE );
-	add_response( hc, buf );
 	}
 
 
@@ -684,30 +830,26 @@ defang( const char* str, char* dfstr, int dfsize )
 void
 httpd_send_err( httpd_conn* hc, int status, char* title, char* extraheads, const char* form, const char* arg )
 	{
-	char defanged_arg[1000], buf[2000];
+	char defanged_arg[1000], body[4000];
+	size_t len;
 
 	/* log server error */
 	if (status>=500)
 		syslog( LOG_ERR, "HTTP %d (%.80s) - %m \"%.80s\"",status,arg,hc->encodedurl );
 
-	send_mime(
-		hc, status, title, "", extraheads, "text/html; charset=%s", (off_t) -1,
-		(time_t) 0 );
-	if ( hc->method == METHOD_HEAD ) {
-		httpd_write_response( hc );
-		return;
-	}
-
-	(void) snprintf( buf, sizeof(buf), "\
+	/* Build the body first, so that its length can be announced and the
+	** connection kept alive.
+	*/
+	(void) snprintf( body, sizeof(body), "\
 <HTML>\n\
 <HEAD><TITLE>%d %s</TITLE></HEAD>\n\
 <BODY BGCOLOR=\"#cc9999\" TEXT=\"#000000\" LINK=\"#2020ff\" VLINK=\"#4040cc\">\n\
 <H2>%d %s</H2>\n",
 		status, title, status, title );
-	add_response( hc, buf );
+	len = strlen( body );
 	defang( arg, defanged_arg, sizeof(defanged_arg) );
-	(void) snprintf( buf, sizeof(buf), form, defanged_arg );
-	add_response( hc, buf );
+	(void) snprintf( &body[len], sizeof(body) - len, form, defanged_arg );
+	len += strlen( &body[len] );
 	/* if ( match( "**MSIE**", hc->useragent ) )
 	// Fuck off old (~#!) MSIE !!
 		{
@@ -717,9 +859,20 @@ httpd_send_err( httpd_conn* hc, int status, char* title, char* extraheads, const
 			add_response( hc, "Padding so that MSIE deigns to show this error instead of its own canned one.\n");
 		add_response( hc, "-->\n" );
 		} */
-	send_response_tail( hc );
+	make_response_tail( &body[len], sizeof(body) - len );
+	len += strlen( &body[len] );
 
-	httpd_write_response( hc );
+	send_mime(
+		hc, status, title, "", extraheads, "text/html; charset=%s", (off_t) len,
+		(time_t) 0 );
+	if ( hc->method != METHOD_HEAD )
+		add_response( hc, body );
+
+	/* The main process sends it when it finishes the connection, without
+	** blocking; a child process exits next.
+	*/
+	if ( in_child )
+		httpd_write_response( hc );
 	}
 
 /* Only used by httpd_parse_resp() which control data and syslog errors itself.
@@ -1384,19 +1537,20 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
 		httpd_realloc_str( &hc->read_buf, &hc->read_size, 500 );
 		hc->maxdecodedurl =
 			hc->maxorigfilename = hc->maxencodings =
-			hc->maxtmpbuff = hc->maxquery = hc->maxaccept =
-			hc->maxaccepte = hc->maxreqhost = hc->maxhostdir =
-			hc->maxremoteuser = hc->maxresponse = 0;
+			hc->maxtmpbuff = hc->maxquery = hc->maxacceptbuf =
+			hc->maxacceptebuf = hc->maxreqhost = hc->maxhostdir =
+			hc->maxremoteuser = hc->maxresponse = hc->maxpartsbuf = 0;
 		httpd_realloc_str( &hc->decodedurl, &hc->maxdecodedurl, 1 );
 		httpd_realloc_str( &hc->origfilename, &hc->maxorigfilename, 1 );
 		httpd_realloc_str( &hc->encodings, &hc->maxencodings, 0 );
 		httpd_realloc_str( &hc->query, &hc->maxquery, 0 );
-		httpd_realloc_str( &hc->accept, &hc->maxaccept, 0 );
-		httpd_realloc_str( &hc->accepte, &hc->maxaccepte, 0 );
+		httpd_realloc_str( &hc->acceptbuf, &hc->maxacceptbuf, 0 );
+		httpd_realloc_str( &hc->acceptebuf, &hc->maxacceptebuf, 0 );
 		httpd_realloc_str( &hc->reqhost, &hc->maxreqhost, 0 );
 		httpd_realloc_str( &hc->hostdir, &hc->maxhostdir, 0 );
 		httpd_realloc_str( &hc->remoteuser, &hc->maxremoteuser, 0 );
 		httpd_realloc_str( &hc->response, &hc->maxresponse, 0 );
+		httpd_realloc_str( &hc->partsbuf, &hc->maxpartsbuf, 0 );
 		hc->initialized = 1;
 		}
 
@@ -1420,9 +1574,62 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
 	(void) fcntl( hc->conn_fd, F_SETFD, 1 );
 	hc->hs = hs;
 	hc->client_addr=get_ip_str(&sa);
+	hc->realfilename = (char*) 0;
+	hc->file_address = (char*) 0;
+	hc->file_fd = -1;
 	hc->read_idx = 0;
+	hc->response[0] = '\0';
+	hc->responselen = 0;
+	clear_request( hc );
+	return GC_OK;
+	}
+
+
+/* Get an httpd_conn which has been fully answered ready for the next
+** request on the same (persistent) connection.  Whatever the client sent
+** after the request (pipelining) is moved to the front of read_buf, and
+** a response not written yet is kept.
+*/
+void
+httpd_reset_conn( httpd_conn* hc, struct timeval* nowP )
+	{
+	if ( hc->file_address != (char*) 0 )
+		{
+		if ( hc->bfield & HC_RCACHED )
+			rcache_release( hc->file_address );
+#ifdef USE_COMPRESSION
+		else if ( hc->bfield & HC_ZCACHED )
+			zcache_release( hc->file_address );
+#endif /* USE_COMPRESSION */
+		else
+			mmc_unmap( hc->file_address, &(hc->sb), nowP );
+		hc->file_address = (char*) 0;
+		}
+	if ( hc->file_fd >= 0 )
+		{
+		(void) close( hc->file_fd );
+		hc->file_fd = -1;
+		}
+	free( (void*) hc->realfilename );
+	hc->realfilename = (char*) 0;
+	if ( hc->checked_idx < hc->read_idx )
+		{
+		hc->read_idx -= hc->checked_idx;
+		(void) memmove( hc->read_buf, &(hc->read_buf[hc->checked_idx]), hc->read_idx );
+		}
+	else
+		hc->read_idx = 0;
+	clear_request( hc );
+	}
+
+
+/* Initialize the per-request part of an httpd_conn. */
+static void
+clear_request( httpd_conn* hc )
+	{
 	hc->checked_idx = 0;
 	hc->checked_state = CHST_FIRSTWORD;
+	hc->nlines = 0;
 	hc->method = METHOD_UNKNOWN;
 	hc->status = 0;
 	hc->bytes_to_send = -1;
@@ -1435,8 +1642,8 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
 	hc->query[0] = '\0';
 	hc->referer = "";
 	hc->useragent = "";
-	hc->accept[0] = '\0';
-	hc->accepte[0] = '\0';
+	hc->accept = "";
+	hc->accepte = "";
 	hc->acceptl = "";
 	hc->cookie = "";
 	hc->contenttype = "";
@@ -1446,20 +1653,22 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
 	hc->authorization = "";
 	hc->forwardedfor = "";
 	hc->remoteuser[0] = '\0';
-	hc->response[0] = '\0';
-	hc->responselen = 0;
 	hc->bytesranges = "";
 	hc->if_modified_since = (time_t) -1;
 	hc->range_if = (time_t) -1;
+	hc->if_none_match = "";
+	hc->if_match = "";
+	hc->range_if_etag = "";
 	hc->contentlength = -1;
 	hc->type = "";
 	hc->http_version=10;
 	hc->first_byte_index = 0;
 	hc->last_byte_index = -1;
 	hc->bfield=0;
-	hc->file_address = (char*) 0;
 	hc->boundary[0] = '\0';
-	return GC_OK;
+	hc->nranges = 0;
+	hc->etag[0] = '\0';
+	hc->signjob = (struct SignJobStruct*) 0;
 	}
 
 
@@ -1469,7 +1678,8 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
 **
 ** hc->read_idx is how much has been read in; hc->checked_idx is how much we
 ** have checked so far; and hc->checked_state is the current state of the
-** finite state machine.
+** finite state machine.  The end of each line is noted in hc->line_ends, so
+** that httpd_parse_request() doesn't have to scan the request again.
 */
 int
 httpd_got_request( httpd_conn* hc )
@@ -1478,6 +1688,14 @@ httpd_got_request( httpd_conn* hc )
 
 	for ( ; hc->checked_idx < hc->read_idx; ++hc->checked_idx )
 		{
+		if ( hc->checked_state == CHST_LINE )
+			{
+			/* Nothing to check inside a header line, jump to its end. */
+			hc->checked_idx += find_eol(
+				&hc->read_buf[hc->checked_idx], hc->read_idx - hc->checked_idx );
+			if ( hc->checked_idx >= hc->read_idx )
+				break;
+			}
 		c = hc->read_buf[hc->checked_idx];
 		switch ( hc->checked_state )
 			{
@@ -1535,11 +1753,10 @@ httpd_got_request( httpd_conn* hc )
 				case ' ': case '\t':
 				hc->checked_state = CHST_THIRDWS;
 				break;
-				case '\012':
-				hc->checked_state = CHST_LF;
-				break;
-				case '\015':
-				hc->checked_state = CHST_CR;
+				case '\012': case '\015':
+				if ( ! add_line( hc ) )
+					return GR_BAD_REQUEST;
+				hc->checked_state = ( c == '\012' ? CHST_LF : CHST_CR );
 				break;
 				}
 			break;
@@ -1548,11 +1765,10 @@ httpd_got_request( httpd_conn* hc )
 				{
 				case ' ': case '\t':
 				break;
-				case '\012':
-				hc->checked_state = CHST_LF;
-				break;
-				case '\015':
-				hc->checked_state = CHST_CR;
+				case '\012': case '\015':
+				if ( ! add_line( hc ) )
+					return GR_BAD_REQUEST;
+				hc->checked_state = ( c == '\012' ? CHST_LF : CHST_CR );
 				break;
 				default:
 				hc->checked_state = CHST_BOGUS;
@@ -1560,15 +1776,10 @@ httpd_got_request( httpd_conn* hc )
 				}
 			break;
 			case CHST_LINE:
-			switch ( c )
-				{
-				case '\012':
-				hc->checked_state = CHST_LF;
-				break;
-				case '\015':
-				hc->checked_state = CHST_CR;
-				break;
-				}
+			/* find_eol() stopped on a '\012' or a '\015'. */
+			if ( ! add_line( hc ) )
+				return GR_BAD_REQUEST;
+			hc->checked_state = ( c == '\012' ? CHST_LF : CHST_CR );
 			break;
 			case CHST_LF:
 			switch ( c )
@@ -1631,6 +1842,73 @@ httpd_got_request( httpd_conn* hc )
 	}
 
 
+/*! \return the offset of the first '\012' or '\015' in buf, or len if there
+** is none.  Looks at 32 or 16 bytes at a time when the compiler targets
+** AVX2 or SSE2.
+*/
+static size_t
+find_eol( const char* buf, size_t len )
+	{
+	size_t i = 0;
+
+#ifdef __AVX2__
+	{
+	const __m256i lf = _mm256_set1_epi8( '\012' );
+	const __m256i cr = _mm256_set1_epi8( '\015' );
+	__m256i v;
+	unsigned int mask;
+
+	for ( ; i + 32 <= len; i += 32 )
+		{
+		v = _mm256_loadu_si256( (const __m256i*) &buf[i] );
+		mask = (unsigned int) _mm256_movemask_epi8( _mm256_or_si256(
+			_mm256_cmpeq_epi8( v, lf ), _mm256_cmpeq_epi8( v, cr ) ) );
+		if ( mask != 0 )
+			return i + __builtin_ctz( mask );
+		}
+	}
+#endif /* __AVX2__ */
+#ifdef __SSE2__
+	{
+	const __m128i lf = _mm_set1_epi8( '\012' );
+	const __m128i cr = _mm_set1_epi8( '\015' );
+	__m128i v;
+	unsigned int mask;
+
+	for ( ; i + 16 <= len; i += 16 )
+		{
+		v = _mm_loadu_si128( (const __m128i*) &buf[i] );
+		mask = (unsigned int) _mm_movemask_epi8( _mm_or_si128(
+			_mm_cmpeq_epi8( v, lf ), _mm_cmpeq_epi8( v, cr ) ) );
+		if ( mask != 0 )
+			return i + __builtin_ctz( mask );
+		}
+	}
+#endif /* __SSE2__ */
+	for ( ; i < len; ++i )
+		if ( buf[i] == '\012' || buf[i] == '\015' )
+			break;
+	return i;
+	}
+
+
+/*! Notes that a line of the request ends at hc->checked_idx.
+** \return 0 if there are too many lines (the request is then bogus), else 1
+*/
+static int
+add_line( httpd_conn* hc )
+	{
+	if ( hc->nlines >= MAX_REQUEST_LINES )
+		{
+		syslog( LOG_NOTICE, "%.80s request has too many header lines", hc->client_addr );
+		hc->checked_state = CHST_BOGUS;
+		return 0;
+		}
+	hc->line_ends[hc->nlines++] = hc->checked_idx;
+	return 1;
+	}
+
+
 int
 httpd_parse_request( httpd_conn* hc )
 	{
@@ -1641,9 +1919,22 @@ httpd_parse_request( httpd_conn* hc )
 	char* reqhost;
 	char* eol;
 	char* cp;
+	char c;
+	int i;
+	int keep_alive, connection = 0;
 
+	/* HC_KEEP_ALIVE set by the caller only means a persistent connection
+	** may be granted; it is set again below if that's what we decide.
+	*/
+	keep_alive = hc->bfield & HC_KEEP_ALIVE;
+	hc->bfield &= ~HC_KEEP_ALIVE;
+
+	/* Without any line noted, this is an HTTP/0.9 request and
+	** httpd_got_request() stopped at the end of its only line.
+	*/
+	i = ( hc->nlines > 0 ? hc->line_ends[0] : hc->checked_idx );
 	hc->checked_idx = 0;		/* reset */
-	method_str = bufgets( hc );
+	method_str = bufgets( hc, i );
 	url = strpbrk( method_str, " \t\012\015" );
 	if ( url == (char*) 0 )
 		{
@@ -1753,105 +2044,77 @@ httpd_parse_request( httpd_conn* hc )
 
 	if ( hc->http_version > 9 )
 		{
-		/* Read the MIME headers. */
-		while ( ( buf = bufgets( hc ) ) != (char*) 0 )
+		/* Read the MIME headers, as noted by httpd_got_request(). */
+		for ( i = 1; ; ++i )
 			{
-			if ( buf[0] == '\0' )
-				break;
-			if ( strncasecmp( buf, "Referer:", 8 ) == 0 )
+			c = hc->read_buf[hc->checked_idx];
+			if ( i >= hc->nlines || c == '\012' || c == '\015' )
 				{
-				cp = &buf[8];
-				cp += strspn( cp, " \t" );
-				hc->referer = cp;
+				/* The blank line. */
+				(void) bufgets( hc, hc->checked_idx );
+				break;
 				}
-			else if ( strncasecmp( buf, "User-Agent:", 11 ) == 0 )
+			buf = bufgets( hc, hc->line_ends[i] );
+			cp = strchr( buf, ':' );
+			if ( cp == (char*) 0 )
 				{
-				cp = &buf[11];
-				cp += strspn( cp, " \t" );
-				hc->useragent = cp;
+#ifdef LOG_UNKNOWN_HEADERS
+				syslog( LOG_DEBUG, "unknown request header: %.80s", buf );
+#endif /* LOG_UNKNOWN_HEADERS */
+				continue;
 				}
-			else if ( strncasecmp( buf, "Host:", 5 ) == 0 )
+			/* Values are used in place, in hc->read_buf. */
+			switch ( header_lookup( buf, cp - buf ) )
 				{
-				cp = &buf[5];
-				cp += strspn( cp, " \t" );
+				case HDR_REFERER:
+				cp += 1 + strspn( cp + 1, " \t" );
+				hc->referer = cp;
+				break;
+				case HDR_USER_AGENT:
+				cp += 1 + strspn( cp + 1, " \t" );
+				hc->useragent = cp;
+				break;
+				case HDR_HOST:
+				cp += 1 + strspn( cp + 1, " \t" );
 				hc->hdrhost = cp;
 				if ( strchr( hc->hdrhost, '/' ) != (char*) 0 || hc->hdrhost[0] == '.' )
 					{
 					httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
 					return -1;
 					}
-				}
-			else if ( strncasecmp( buf, "Accept:", 7 ) == 0 )
-				{
-				cp = &buf[7];
-				cp += strspn( cp, " \t" );
-				if ( hc->accept[0] != '\0' )
-					{
-					if ( strlen( hc->accept ) > 5000 )
-						{
-						syslog(
-							LOG_ERR, "%.80s way too much Accept: data",
-							hc->client_addr );
-						continue;
-						}
-					httpd_realloc_str(
-						&hc->accept, &hc->maxaccept,
-						strlen( hc->accept ) + 2 + strlen( cp ) );
-					(void) strcat( hc->accept, ", " );
-					}
-				else
-					httpd_realloc_str(
-						&hc->accept, &hc->maxaccept, strlen( cp ) );
-				(void) strcat( hc->accept, cp );
-				}
-			else if ( strncasecmp( buf, "Accept-Encoding:", 16 ) == 0 )
-				{
-				cp = &buf[16];
-				cp += strspn( cp, " \t" );
-				if ( hc->accepte[0] != '\0' )
-					{
-					if ( strlen( hc->accepte ) > 5000 )
-						{
-						syslog(
-							LOG_ERR, "%.80s way too much Accept-Encoding: data",
-							hc->client_addr );
-						continue;
-						}
-					httpd_realloc_str(
-						&hc->accepte, &hc->maxaccepte,
-						strlen( hc->accepte ) + 2 + strlen( cp ) );
-					(void) strcat( hc->accepte, ", " );
-					}
-				else
-					httpd_realloc_str(
-						&hc->accepte, &hc->maxaccepte, strlen( cp ) );
-				(void) strcpy( hc->accepte, cp );
-				}
-			else if ( strncasecmp( buf, "Accept-Language:", 16 ) == 0 )
-				{
-				cp = &buf[16];
-				cp += strspn( cp, " \t" );
+				break;
+				case HDR_ACCEPT:
+				cp += 1 + strspn( cp + 1, " \t" );
+				if ( add_header_value( &hc->accept, &hc->acceptbuf, &hc->maxacceptbuf, cp ) < 0 )
+					syslog(
+						LOG_ERR, "%.80s way too much Accept: data",
+						hc->client_addr );
+				break;
+				case HDR_ACCEPT_ENCODING:
+				cp += 1 + strspn( cp + 1, " \t" );
+				if ( add_header_value( &hc->accepte, &hc->acceptebuf, &hc->maxacceptebuf, cp ) < 0 )
+					syslog(
+						LOG_ERR, "%.80s way too much Accept-Encoding: data",
+						hc->client_addr );
+				break;
+				case HDR_ACCEPT_LANGUAGE:
+				cp += 1 + strspn( cp + 1, " \t" );
 				hc->acceptl = cp;
-				}
-			else if ( strncasecmp( buf, "If-Modified-Since:", 18 ) == 0 )
-				{
-				cp = &buf[18];
+				break;
+				case HDR_IF_MODIFIED_SINCE:
+				++cp;
 				hc->if_modified_since = tdate_parse( cp );
 				if ( hc->if_modified_since == (time_t) -1 )
 					syslog( LOG_DEBUG, "unparsable time: %.80s", cp );
-				}
-			else if ( strncasecmp( buf, "Cookie:", 7 ) == 0 )
-				{
-				cp = &buf[7];
-				cp += strspn( cp, " \t" );
+				break;
+				case HDR_COOKIE:
+				cp += 1 + strspn( cp + 1, " \t" );
 				hc->cookie = cp;
-				}
-			else if ( strncasecmp( buf, "Range:", 6 ) == 0 )
-				{
-				/* Only support "%d-", "%d-%d" and "-%d" using fdwatch and mmap.
-				 * TODO: support multirange ("%d-%d,%d-%d,%d-") using a fork() */
-				cp = &buf[6];
-				cp += strspn( cp, " \t" );
+				break;
+				case HDR_RANGE:
+				/* "%d-", "%d-%d" and "-%d" are parsed here, several of them
+				 * ("%d-%d,%d-%d,%d-") by parse_ranges(), once the size is known. */
+				cp += 1 + strspn( cp + 1, " \t" );
 
 				/* http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.12 */
 				if ( strncasecmp( cp, "bytes", 5 ) == 0
@@ -1876,79 +2139,58 @@ httpd_parse_request( httpd_conn* hc )
 					else
 						hc->bytesranges = cp;
 					}
-					
-				}
-			else if ( strncasecmp( buf, "If-Range:", 9 ) == 0 )
-				{
-				cp = &buf[9];
-				hc->range_if = tdate_parse( cp );
-				if ( hc->range_if == (time_t) -1 )
-					syslog( LOG_DEBUG, "unparsable time: %.80s", cp );
-				}
-			else if ( strncasecmp( buf, "Content-Type:", 13 ) == 0 )
-				{
-				cp = &buf[13];
-				cp += strspn( cp, " \t" );
+				break;
+				case HDR_IF_RANGE:
+				cp += 1 + strspn( cp + 1, " \t" );
+				if ( *cp == '"' || strncmp( cp, "W/", 2 ) == 0 )
+					hc->range_if_etag = cp;
+				else
+					{
+					hc->range_if = tdate_parse( cp );
+					if ( hc->range_if == (time_t) -1 )
+						syslog( LOG_DEBUG, "unparsable time: %.80s", cp );
+					}
+				break;
+				case HDR_IF_NONE_MATCH:
+				cp += 1 + strspn( cp + 1, " \t" );
+				hc->if_none_match = cp;
+				break;
+				case HDR_IF_MATCH:
+				cp += 1 + strspn( cp + 1, " \t" );
+				hc->if_match = cp;
+				break;
+				case HDR_CONTENT_TYPE:
+				cp += 1 + strspn( cp + 1, " \t" );
 				hc->contenttype = cp;
-				}
-			else if ( strncasecmp( buf, "Content-Length:", 15 ) == 0 )
-				{
-				cp = &buf[15];
+				break;
+				case HDR_CONTENT_LENGTH:
+				++cp;
 				hc->contentlength = atol( cp );
-				}
-			else if ( strncasecmp( buf, "Authorization:", 14 ) == 0 )
-				{
-				cp = &buf[14];
-				cp += strspn( cp, " \t" );
+				break;
+				case HDR_AUTHORIZATION:
+				cp += 1 + strspn( cp + 1, " \t" );
 				hc->authorization = cp;
-				}
-			else if ( strncasecmp( buf, "Connection:", 11 ) == 0 )
-				{
-				cp = &buf[11];
-				cp += strspn( cp, " \t" );
-				if ( strcasecmp( cp, "keep-alive" ) == 0 )
-					hc->bfield |= HC_KEEP_ALIVE;
-				}
-			else if ( strncasecmp( buf, "X-Forwarded-For:", 16 ) == 0 )
-				{
-				cp = &buf[16];
-				cp += strspn( cp, " \t" );
+				break;
+				case HDR_CONNECTION:
+				cp += 1 + strspn( cp + 1, " \t" );
+				if ( strncasecmp( cp, "keep-alive", 10 ) == 0 )
+					connection = 1;
+				else if ( strncasecmp( cp, "close", 5 ) == 0 )
+					connection = -1;
+				break;
+				case HDR_X_FORWARDED_FOR:
+				cp += 1 + strspn( cp + 1, " \t" );
 				hc->forwardedfor=cp;
-				}
+				break;
+				case HDR_IGNORED:
+				break;
+				default:
 #ifdef LOG_UNKNOWN_HEADERS
-			else if ( strncasecmp( buf, "Accept-Charset:", 15 ) == 0 ||
-					  strncasecmp( buf, "Accept-Language:", 16 ) == 0 ||
-					  strncasecmp( buf, "Agent:", 6 ) == 0 ||
-					  strncasecmp( buf, "Cache-Control:", 14 ) == 0 ||
-					  strncasecmp( buf, "Cache-Info:", 11 ) == 0 ||
-					  strncasecmp( buf, "Charge-To:", 10 ) == 0 ||
-					  strncasecmp( buf, "Client-IP:", 10 ) == 0 ||
-					  strncasecmp( buf, "Date:", 5 ) == 0 ||
-					  strncasecmp( buf, "Extension:", 10 ) == 0 ||
-					  strncasecmp( buf, "Forwarded:", 10 ) == 0 ||
-					  strncasecmp( buf, "From:", 5 ) == 0 ||
-					  strncasecmp( buf, "HTTP-Version:", 13 ) == 0 ||
-					  strncasecmp( buf, "Max-Forwards:", 13 ) == 0 ||
-					  strncasecmp( buf, "Message-Id:", 11 ) == 0 ||
-					  strncasecmp( buf, "MIME-Version:", 13 ) == 0 ||
-					  strncasecmp( buf, "Negotiate:", 10 ) == 0 ||
-					  strncasecmp( buf, "Pragma:", 7 ) == 0 ||
-					  strncasecmp( buf, "Proxy-Agent:", 12 ) == 0 ||
-					  strncasecmp( buf, "Proxy-Connection:", 17 ) == 0 ||
-					  strncasecmp( buf, "Security-Scheme:", 16 ) == 0 ||
-					  strncasecmp( buf, "Session-Id:", 11 ) == 0 ||
-					  strncasecmp( buf, "UA-Color:", 9 ) == 0 ||
-					  strncasecmp( buf, "UA-CPU:", 7 ) == 0 ||
-					  strncasecmp( buf, "UA-Disp:", 8 ) == 0 ||
-					  strncasecmp( buf, "UA-OS:", 6 ) == 0 ||
-					  strncasecmp( buf, "UA-Pixels:", 10 ) == 0 ||
-					  strncasecmp( buf, "User:", 5 ) == 0 ||
-					  strncasecmp( buf, "Via:", 4 ) == 0 ||
-					  strncasecmp( buf, "X-", 2 ) == 0 )
-				; /* ignore */
-			else
-				syslog( LOG_DEBUG, "unknown request header: %.80s", buf );
+				if ( strncasecmp( buf, "X-", 2 ) != 0 )
+					syslog( LOG_DEBUG, "unknown request header: %.80s", buf );
 #endif /* LOG_UNKNOWN_HEADERS */
+				break;
+				}
 			}
 		}
 
@@ -1960,14 +2202,19 @@ httpd_parse_request( httpd_conn* hc )
 			httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
 			return -1;
 			}
+		}
 
-		/* If the client wants to do keep-alives, it might also be doing
-		** pipelining.  There's no way for us to tell.  Since we don't
-		** implement keep-alives yet, if we close such a connection there
-		** might be unread pipelined requests waiting.  So, we have to
-		** do a lingering close.
-		*/
-		if ( hc->bfield & HC_KEEP_ALIVE )
+	/* HTTP/1.1 connections are persistent unless told otherwise, 1.0 ones
+	** only when asked.  We keep it so if allowed to and if no request body
+	** is in the way.  Otherwise, as the client might also be pipelining,
+	** there might be unread requests waiting when we close: so, we have to
+	** do a lingering close.
+	*/
+	if ( hc->http_version > 10 ? connection >= 0 : connection > 0 )
+		{
+		if ( keep_alive && hc->method != METHOD_POST && hc->contentlength <= 0 )
+			hc->bfield |= HC_KEEP_ALIVE;
+		else
 			hc->bfield |= HC_SHOULD_LINGER;
 		}
 
@@ -1978,7 +2225,7 @@ httpd_parse_request( httpd_conn* hc )
 #else
 		&& strstr(hc->accept,"multipart/msigned") /* won't work if client use funny upper cases :'-( :-p */
 #endif
-		&& !match( hc->hs->sig_pattern, hc->origfilename ) )
+		&& match_exec( hc->hs->sig_match, hc->origfilename, (int*) 0, 0 ) == 0 )
 			hc->bfield |= HC_DETACH_SIGN;
 
 	/* Ok, the request has been parsed.  Now we resolve stuff that
@@ -2010,7 +2257,7 @@ httpd_parse_request( httpd_conn* hc )
 			if ( cp != (char*) 0 )
 				*cp = '\0';
 
-			if ( stat( hostdir, &sb ) == 0 ) {
+			if ( pcache_stat( hostdir, &sb ) == 0 ) {
 				lenh=strlen(hostdir);
 
 				/* copy hostdir to hc->hostdir (used by make_log_entry) */
@@ -2037,12 +2284,12 @@ httpd_parse_request( httpd_conn* hc )
 			if ( cp != (char*) 0 )
 				*cp = ':';
 		}
-		hc->realfilename=realpath(toexpand,NULL);
+		hc->realfilename=pcache_realpath(toexpand);
 	}
 	else
 #endif /* VHOSTING */
-	/* Expand all symbolic links in the filename. Since Posix-2008 realpath is (thread) safe on almost all platform */
-		hc->realfilename=realpath(hc->origfilename,NULL);
+	/* Expand all symbolic links in the filename (through the path cache, which is not thread safe: keep it in the main thread). */
+		hc->realfilename=pcache_realpath(hc->origfilename);
 
 	/* If the expanded filename is not null, check that it's still
 	** within the current directory or the alternate directory.
@@ -2076,43 +2323,165 @@ httpd_parse_request( httpd_conn* hc )
 	}
 
 
-static char*
-bufgets( httpd_conn* hc )
+/* The request headers we know of.  They are found with a hash of their
+** name, which happens to be perfect for this list (if you add some and it
+** isn't anymore, header_lookup() still works but has to probe a bit).
+*/
+static struct {
+	const char* name;
+	int id;
+	} headers[] = {
+	{ "Referer", HDR_REFERER },
+	{ "User-Agent", HDR_USER_AGENT },
+	{ "Host", HDR_HOST },
+	{ "Accept", HDR_ACCEPT },
+	{ "Accept-Encoding", HDR_ACCEPT_ENCODING },
+	{ "Accept-Language", HDR_ACCEPT_LANGUAGE },
+	{ "If-Modified-Since", HDR_IF_MODIFIED_SINCE },
+	{ "Cookie", HDR_COOKIE },
+	{ "Range", HDR_RANGE },
+	{ "If-Range", HDR_IF_RANGE },
+	{ "Content-Type", HDR_CONTENT_TYPE },
+	{ "Content-Length", HDR_CONTENT_LENGTH },
+	{ "Authorization", HDR_AUTHORIZATION },
+	{ "Connection", HDR_CONNECTION },
+	{ "X-Forwarded-For", HDR_X_FORWARDED_FOR },
+	{ "If-None-Match", HDR_IF_NONE_MATCH },
+	{ "If-Match", HDR_IF_MATCH },
+	/* Known, but we don't care (and don't log them as unknown). */
+	{ "Accept-Charset", HDR_IGNORED },
+	{ "Agent", HDR_IGNORED },
+	{ "Cache-Control", HDR_IGNORED },
+	{ "Cache-Info", HDR_IGNORED },
+	{ "Charge-To", HDR_IGNORED },
+	{ "Client-IP", HDR_IGNORED },
+	{ "Date", HDR_IGNORED },
+	{ "Extension", HDR_IGNORED },
+	{ "Forwarded", HDR_IGNORED },
+	{ "From", HDR_IGNORED },
+	{ "HTTP-Version", HDR_IGNORED },
+	{ "Max-Forwards", HDR_IGNORED },
+	{ "Message-Id", HDR_IGNORED },
+	{ "MIME-Version", HDR_IGNORED },
+	{ "Negotiate", HDR_IGNORED },
+	{ "Pragma", HDR_IGNORED },
+	{ "Proxy-Agent", HDR_IGNORED },
+	{ "Proxy-Connection", HDR_IGNORED },
+	{ "Security-Scheme", HDR_IGNORED },
+	{ "Session-Id", HDR_IGNORED },
+	{ "UA-Color", HDR_IGNORED },
+	{ "UA-CPU", HDR_IGNORED },
+	{ "UA-Disp", HDR_IGNORED },
+	{ "UA-OS", HDR_IGNORED },
+	{ "UA-Pixels", HDR_IGNORED },
+	{ "User", HDR_IGNORED },
+	{ "Via", HDR_IGNORED },
+	};
+
+#define HEADERS_HASH_SIZE 128	/* must be a power of 2 */
+
+#define HEADERS_HASH(name,len) \
+	( ( (len) * 3 + tolower( (unsigned char) (name)[0] ) * 8 + \
+	  tolower( (unsigned char) (name)[(len)-1] ) * 10 + \
+	  tolower( (unsigned char) (name)[(len)-2] ) * 9 ) & ( HEADERS_HASH_SIZE - 1 ) )
+
+static int headers_hash[HEADERS_HASH_SIZE];	/* index in headers[] + 1, 0 if free */
+
+static void
+init_headers( void )
 	{
-	int i;
-	char c;
+	int h, i;
 
-	for ( i = hc->checked_idx; hc->checked_idx < hc->read_idx; ++hc->checked_idx )
+	for ( i = 0; i < sizeof(headers) / sizeof(*headers); ++i )
 		{
-		c = hc->read_buf[hc->checked_idx];
-		if ( c == '\012' || c == '\015' )
-			{
-			hc->read_buf[hc->checked_idx] = '\0';
-			++hc->checked_idx;
-			if ( c == '\015' && hc->checked_idx < hc->read_idx &&
-				 hc->read_buf[hc->checked_idx] == '\012' )
-				{
-				hc->read_buf[hc->checked_idx] = '\0';
-				++hc->checked_idx;
-				}
-			return &(hc->read_buf[i]);
-			}
+		h = HEADERS_HASH( headers[i].name, strlen( headers[i].name ) );
+		while ( headers_hash[h] != 0 )
+			h = ( h + 1 ) & ( HEADERS_HASH_SIZE - 1 );
+		headers_hash[h] = i + 1;
 		}
-	return (char*) 0;
 	}
 
-/*! de_dotdot delete (clean) all useless '/' and '.' in a filename */
-static void
-de_dotdot( char* file )
+
+/*! \return the HDR_* id of the header called name (len long, not nul-terminated), HDR_UNKNOWN if we don't know it */
+static int
+header_lookup( const char* name, size_t len )
 	{
-	char* cp;
-	char* cp2;
-	int l;
+	int h, i;
 
-	/* Collapse any multiple / sequences. */
-	while ( ( cp = strstr( file, "//") ) != (char*) 0 )
+	if ( len < 2 )
+		return HDR_UNKNOWN;
+	for ( h = HEADERS_HASH( name, len ); headers_hash[h] != 0; h = ( h + 1 ) & ( HEADERS_HASH_SIZE - 1 ) )
 		{
-		for ( cp2 = cp + 2; *cp2 == '/'; ++cp2 )
+		i = headers_hash[h] - 1;
+		if ( strncasecmp( name, headers[i].name, len ) == 0 && headers[i].name[len] == '\0' )
+			return headers[i].id;
+		}
+	return HDR_UNKNOWN;
+	}
+
+
+/*! Sets *valP to the value of a header which may be repeated: the first one
+** is used in place, the next ones are joined to it in *bufP.
+** \return -1 if there is way too much of it already, else 0
+*/
+static int
+add_header_value( char** valP, char** bufP, size_t* maxP, char* value )
+	{
+	size_t len;
+	int inplace;
+
+	if ( (*valP)[0] == '\0' )
+		{
+		*valP = value;
+		return 0;
+		}
+	len = strlen( *valP );
+	if ( len > 5000 )
+		return -1;
+	inplace = ( *valP != *bufP );
+	httpd_realloc_str( bufP, maxP, len + 2 + strlen( value ) );
+	if ( inplace )
+		(void) strcpy( *bufP, *valP );
+	(void) strcat( *bufP, ", " );
+	(void) strcat( *bufP, value );
+	*valP = *bufP;
+	return 0;
+	}
+
+
+/*! Returns the line of the request starting at hc->checked_idx and ending
+** at eol (a '\012' or a '\015' as noted by httpd_got_request()), after
+** having nul-terminated it.  hc->checked_idx is moved to the next line.
+*/
+static char*
+bufgets( httpd_conn* hc, size_t eol )
+	{
+	char* line = &(hc->read_buf[hc->checked_idx]);
+	char c = hc->read_buf[eol];
+
+	hc->read_buf[eol] = '\0';
+	hc->checked_idx = eol + 1;
+	if ( c == '\015' && hc->checked_idx < hc->read_idx &&
+		 hc->read_buf[hc->checked_idx] == '\012' )
+		{
+		hc->read_buf[hc->checked_idx] = '\0';
+		++hc->checked_idx;
+		}
+	return line;
+	}
+
+/*! de_dotdot delete (clean) all useless '/' and '.' in a filename */
+static void
+de_dotdot( char* file )
+	{
+	char* cp;
+	char* cp2;
+	int l;
+
+	/* Collapse any multiple / sequences. */
+	while ( ( cp = strstr( file, "//") ) != (char*) 0 )
+		{
+		for ( cp2 = cp + 2; *cp2 == '/'; ++cp2 )
 			continue;
 		(void) strcpy( cp + 1, cp2 );
 		}
@@ -2152,12 +2521,26 @@ de_dotdot( char* file )
 void
 httpd_close_conn( httpd_conn* hc, struct timeval* nowP )
 	{
-
+#ifdef USE_SIGN_POOL
+	httpd_sign_cancel( hc );
+#endif /* USE_SIGN_POOL */
 	if ( hc->file_address != (char*) 0 )
 		{
-		mmc_unmap( hc->file_address, &(hc->sb), nowP );
+		if ( hc->bfield & HC_RCACHED )
+			rcache_release( hc->file_address );
+#ifdef USE_COMPRESSION
+		else if ( hc->bfield & HC_ZCACHED )
+			zcache_release( hc->file_address );
+#endif /* USE_COMPRESSION */
+		else
+			mmc_unmap( hc->file_address, &(hc->sb), nowP );
 		hc->file_address = (char*) 0;
 		}
+	if ( hc->file_fd >= 0 )
+		{
+		(void) close( hc->file_fd );
+		hc->file_fd = -1;
+		}
 	if ( hc->conn_fd >= 0 )
 		{
 		(void) close( hc->conn_fd );
@@ -2178,12 +2561,13 @@ httpd_destroy_conn( httpd_conn* hc )
 		free( (void*) hc->origfilename );
 		free( (void*) hc->encodings );
 		free( (void*) hc->query );
-		free( (void*) hc->accept );
-		free( (void*) hc->accepte );
+		free( (void*) hc->acceptbuf );
+		free( (void*) hc->acceptebuf );
 		free( (void*) hc->reqhost );
 		free( (void*) hc->hostdir );
 		free( (void*) hc->remoteuser );
 		free( (void*) hc->response );
+		free( (void*) hc->partsbuf );
 		hc->initialized = 0;
 		}
 	}
@@ -2232,6 +2616,217 @@ init_mime( void )
 	}
 
 
+/* Parses the several ranges of hc->bytesranges into hc->ranges, against
+** the size of the file: the unsatisfiable ones are dropped, the others
+** sorted and merged when they overlap or touch.  Returns how many are
+** left (0 if none was satisfiable), or -1 if the whole file should be sent
+** instead (syntax error, no range at all, or too many ranges).
+*/
+static int
+parse_ranges( httpd_conn* hc )
+	{
+	char* cp = hc->bytesranges;
+	char* end;
+	off_t size = hc->sb.st_size;
+	off_t first, last;
+	httpd_range r;
+	int n = 0, given = 0, i, j;
+
+	for (;;)
+		{
+		cp += strspn( cp, " \t," );
+		if ( *cp == '\0' )
+			break;
+		++given;
+		if ( *cp == '-' )
+			{
+			/* The last bytes. */
+			if ( ! isdigit( (int) cp[1] ) )
+				return -1;
+			last = strtoll( &cp[1], &end, 10 );
+			if ( last == 0 )
+				goto next;
+			first = MAX( 0, size - last );
+			last = size - 1;
+			}
+		else
+			{
+			if ( ! isdigit( (int) *cp ) )
+				return -1;
+			first = strtoll( cp, &end, 10 );
+			end += strspn( end, " \t" );
+			if ( *end++ != '-' )
+				return -1;
+			end += strspn( end, " \t" );
+			if ( isdigit( (int) *end ) )
+				{
+				last = strtoll( end, &end, 10 );
+				if ( last < first )
+					return -1;
+				if ( last >= size )
+					last = size - 1;
+				}
+			else
+				last = size - 1;
+			}
+		if ( first < size )
+			{
+			if ( n == MAX_BYTE_RANGES )
+				return -1;
+			hc->ranges[n].first = first;
+			hc->ranges[n].last = last;
+			++n;
+			}
+		next:
+		cp = end + strspn( end, " \t" );
+		if ( *cp != ',' && *cp != '\0' )
+			return -1;
+		}
+	if ( given == 0 )
+		return -1;
+
+	/* Insertion sort (there are a few at most), then merge. */
+	for ( i = 1; i < n; ++i )
+		{
+		r = hc->ranges[i];
+		for ( j = i; j > 0 && hc->ranges[j - 1].first > r.first; --j )
+			hc->ranges[j] = hc->ranges[j - 1];
+		hc->ranges[j] = r;
+		}
+	for ( i = 0, j = 1; j < n; ++j )
+		{
+		if ( hc->ranges[j].first <= hc->ranges[i].last + 1 )
+			hc->ranges[i].last = MAX( hc->ranges[i].last, hc->ranges[j].last );
+		else
+			hc->ranges[++i] = hc->ranges[j];
+		}
+	return n > 0 ? i + 1 : 0;
+	}
+
+
+/* Writes the headers of the n parts of a multipart/byteranges response
+** (and its closing delimiter, as a last part without data) into partsbuf.
+*/
+static void
+make_parts( httpd_conn* hc, int n )
+	{
+	char fixed_type[500];
+	size_t len = 0;
+	int i;
+
+	(void) random_boundary( hc->boundary, BOUNDARYLEN );
+	(void) snprintf( fixed_type, sizeof(fixed_type), hc->type, DEFAULT_CHARSET );
+	for ( i = 0; i <= n; ++i )
+		{
+		httpd_realloc_str( &hc->partsbuf, &hc->maxpartsbuf, len + sizeof(fixed_type) + 200 );
+		hc->ranges[i].headidx = len;
+		if ( i < n )
+			len += snprintf( &hc->partsbuf[len], hc->maxpartsbuf - len,
+				"\015\012--%s\015\012Content-Type: %s\015\012Content-Range: bytes %lld-%lld/%lld\015\012\015\012",
+				hc->boundary, fixed_type, (long long) hc->ranges[i].first,
+				(long long) hc->ranges[i].last, (long long) hc->sb.st_size );
+		else
+			{
+			len += snprintf( &hc->partsbuf[len], hc->maxpartsbuf - len,
+				"\015\012--%s--\015\012", hc->boundary );
+			hc->ranges[i].first = 0;
+			hc->ranges[i].last = -1;
+			}
+		hc->ranges[i].headlen = len - hc->ranges[i].headidx;
+		}
+	hc->nranges = n;
+	}
+
+
+/* The Content-Length of a multipart/byteranges response. */
+static off_t
+multipart_length( httpd_conn* hc )
+	{
+	off_t len = 0;
+	int i;
+
+	for ( i = 0; i <= hc->nranges; ++i )
+		len += hc->ranges[i].headlen + hc->ranges[i].last - hc->ranges[i].first + 1;
+	return len;
+	}
+
+
+/* A strong entity-tag for the file of hc as it will be sent: its inode,
+** size and modification time (to the nanosecond where stat() has it), then
+** its encodings, and whether it is signed.
+*/
+static void
+make_etag( httpd_conn* hc, int sign )
+	{
+	size_t len;
+	char* cp;
+
+	(void) snprintf( hc->etag, sizeof(hc->etag), "\"%llx-%llx-%llx.%lx",
+		(unsigned long long) hc->sb.st_ino, (unsigned long long) hc->sb.st_size,
+		(unsigned long long) hc->sb.st_mtime, (long) ST_MTIME_NSEC( hc->sb ) );
+	len = strlen( hc->etag );
+	/* (The separators of the encodings aren't allowed in an entity-tag.) */
+	if ( hc->encodings[0] != '\0' )
+		hc->etag[len++] = '-';
+	for ( cp = hc->encodings; *cp != '\0' && len < sizeof(hc->etag) - 6; ++cp )
+		if ( isalnum( (int) *cp ) )
+			hc->etag[len++] = *cp;
+	(void) strcpy( &hc->etag[len], sign ? "-sig\"" : "\"" );
+	}
+
+
+/* Whether the entity-tags list of an If-Match, If-None-Match or If-Range
+** header has the one of hc (or is "*").  Weak tags only match if !strong.
+*/
+static int
+etag_match( httpd_conn* hc, const char* list, int strong )
+	{
+	const char* cp;
+	const char* end;
+	size_t len = strlen( hc->etag );
+	int weak;
+
+	for ( cp = list; ; cp = end )
+		{
+		cp += strspn( cp, " \t," );
+		if ( *cp == '*' )
+			return len > 0;
+		weak = ( strncmp( cp, "W/", 2 ) == 0 );
+		if ( weak )
+			cp += 2;
+		if ( *cp != '"' || ( end = strchr( cp + 1, '"' ) ) == (char*) 0 )
+			return 0;
+		++end;
+		if ( ! ( weak && strong ) && len > 0 && (size_t) ( end - cp ) == len &&
+			 strncmp( cp, hc->etag, len ) == 0 )
+			return 1;
+		}
+	}
+
+
+/* Whether the Range header of hc still applies, according to If-Range. */
+static int
+range_applies( httpd_conn* hc )
+	{
+	if ( hc->range_if_etag[0] != '\0' )
+		return etag_match( hc, hc->range_if_etag, 1 );
+	return hc->range_if == (time_t) -1 || hc->range_if == hc->sb.st_mtime;
+	}
+
+
+/* Whether the client has the file of hc already.  If-None-Match, when
+** there is one, is what tells it.
+*/
+static int
+not_modified( httpd_conn* hc )
+	{
+	if ( hc->if_none_match[0] != '\0' )
+		return etag_match( hc, hc->if_none_match, 0 );
+	return hc->if_modified_since != (time_t) -1 &&
+		hc->if_modified_since >= hc->sb.st_mtime;
+	}
+
+
 /* Figure out MIME encodings and type based on the filename.  Multiple
 ** encodings are separated by commas, and are listed in the order in
 ** which they were applied to the file.
@@ -2331,6 +2926,187 @@ figure_mime( httpd_conn* hc )
 	}
 
 
+/* The precompressed siblings of a file, the preferred coding first. */
+static struct {
+	char* ext;
+	char* coding;
+	} precompressed[] = {
+	{ ".br", "br" },
+	{ ".gz", "gzip" },
+	};
+
+/* If the file has an up to date precompressed sibling in a coding the
+** client accepts, serve it instead.  Such a file's responses all depend
+** on Accept-Encoding: HC_VARY_ENCODING then asks send_mime() to say so.
+*/
+static void
+choose_encoding( httpd_conn* hc )
+	{
+	size_t len, cwdlen;
+	struct stat sb, best_sb;
+	int i, q, best_q, best;
+	char* resolved;
+
+	/* Already encoded files are served as they are. */
+	if ( hc->encodings[0] != '\0' )
+		return;
+
+	len = strlen( hc->realfilename );
+	httpd_realloc_str( &hc->tmpbuff, &hc->maxtmpbuff, len + 4 );
+	best = -1;
+	best_q = 0;
+	for ( i = 0; i < SIZEOFARRAY(precompressed); ++i )
+		{
+		(void) strcpy( hc->tmpbuff, hc->realfilename );
+		(void) strcpy( &hc->tmpbuff[len], precompressed[i].ext );
+		if ( pcache_stat( hc->tmpbuff, &sb ) < 0 || ! S_ISREG( sb.st_mode ) ||
+			 ! ( sb.st_mode & S_IROTH ) || ( sb.st_mode & S_IXOTH ) ||
+			 sb.st_mtime < hc->sb.st_mtime )
+			continue;
+		hc->bfield |= HC_VARY_ENCODING;
+		q = httpd_accept_q( hc->accepte, precompressed[i].coding );
+		if ( q > best_q )
+			{
+			best_q = q;
+			best = i;
+			best_sb = sb;
+			}
+		}
+	if ( best < 0 )
+		{
+#ifdef USE_COMPRESSION
+		compress_file( hc );
+#endif /* USE_COMPRESSION */
+		return;
+		}
+
+	/* The sibling may be a symlink: check it stays in the web tree. */
+	(void) strcpy( hc->tmpbuff, hc->realfilename );
+	(void) strcpy( &hc->tmpbuff[len], precompressed[best].ext );
+	resolved = pcache_realpath( hc->tmpbuff );
+	if ( resolved == (char*) 0 )
+		return;
+	cwdlen = strlen( hc->hs->cwd );
+	if ( strncmp( resolved, hc->hs->cwd, cwdlen ) != 0 )
+		{
+		free( (void*) resolved );
+		return;
+		}
+	/* Elide the current directory. */
+	(void) memmove( resolved, &resolved[cwdlen], strlen( &resolved[cwdlen] ) + 1 );
+	free( (void*) hc->realfilename );
+	hc->realfilename = resolved;
+	hc->sb = best_sb;
+	httpd_realloc_str(
+		&hc->encodings, &hc->maxencodings,
+		strlen( precompressed[best].coding ) );
+	(void) strcpy( hc->encodings, precompressed[best].coding );
+	}
+
+
+int
+httpd_accept_q( const char* accepte, const char* coding )
+	{
+	size_t len = strlen( coding );
+	const char* cp;
+	const char* end;
+	const char* param;
+	size_t n;
+	int q, q_coding = -1, q_star = -1;
+
+	for ( cp = accepte; *cp != '\0'; cp = end )
+		{
+		cp += strspn( cp, " \t," );
+		n = strcspn( cp, " \t,;" );
+		end = cp + strcspn( cp, "," );
+		q = 1000;
+		for ( param = cp + n; param < end; ++param )
+			if ( *param == ';' )
+				{
+				param += strspn( param + 1, " \t" ) + 1;
+				if ( ( *param == 'q' || *param == 'Q' ) && param[1] == '=' )
+					q = atof( &param[2] ) * 1000;
+				}
+		if ( ( n == len && strncasecmp( cp, coding, len ) == 0 ) ||
+			 ( n == len + 2 && strncasecmp( cp, "x-", 2 ) == 0 &&
+			   strncasecmp( &cp[2], coding, len ) == 0 ) )
+			q_coding = q;
+		else if ( n == 1 && *cp == '*' )
+			q_star = q;
+		}
+	if ( q_coding >= 0 )
+		return q_coding;
+	if ( q_star >= 0 )
+		return q_star;
+	return 0;
+	}
+
+
+#ifdef USE_COMPRESSION
+/* Types whose files are compressed already; those ending with '/' or '.'
+** are prefixes.
+*/
+static char* compressed_types[] = {
+	"image/", "audio/", "video/", "application/zip", "application/ogg",
+	"application/pdf", "application/x-gtar", "application/x-java-archive",
+	"application/x-debian-package", "application/x-shockwave-flash",
+	"application/x-stuffit", "application/vnd.google-earth.kmz",
+	"application/x-ms-wmz", "application/vnd.sun.xml.",
+	};
+
+/* Serves the file gzip-compressed on the fly, if the client accepts it.
+** The compressed data comes from the compressed output cache, and stands
+** for the file from here: hc->sb.st_size becomes its length.
+*/
+static void
+compress_file( httpd_conn* hc )
+	{
+	char* buf;
+	size_t len;
+
+	if ( hc->sb.st_size < COMPRESS_MIN_FILE || hc->sb.st_size > COMPRESS_MAX_FILE ||
+		 ! compressible_type( hc->type ) )
+		return;
+	hc->bfield |= HC_VARY_ENCODING;
+	if ( httpd_accept_q( hc->accepte, "gzip" ) <= 0 )
+		return;
+	buf = zcache_get( hc->realfilename, &(hc->sb), (struct timeval*) 0, &len );
+	if ( buf == (char*) 0 )
+		return;
+	hc->file_address = buf;
+	hc->bfield |= HC_ZCACHED;
+	hc->sb.st_size = len;
+	httpd_realloc_str( &hc->encodings, &hc->maxencodings, 4 );
+	(void) strcpy( hc->encodings, "gzip" );
+	}
+
+
+static int
+compressible_type( const char* type )
+	{
+	int i;
+	size_t len;
+
+	/* (image/svg+xml is text.) */
+	if ( strncmp( type, "image/svg+xml", 13 ) == 0 )
+		return 1;
+	for ( i = 0; i < SIZEOFARRAY(compressed_types); ++i )
+		{
+		len = strlen( compressed_types[i] );
+		if ( compressed_types[i][len - 1] == '/' || compressed_types[i][len - 1] == '.' )
+			{
+			if ( strncmp( type, compressed_types[i], len ) == 0 )
+				return 0;
+			}
+		else if ( strncmp( type, compressed_types[i], len ) == 0 &&
+				  ( type[len] == '\0' || type[len] == ';' ) )
+			return 0;
+		}
+	return 1;
+	}
+#endif /* USE_COMPRESSION */
+
+
 #ifdef CGI_TIMELIMIT
 static void
 cgi_kill2( ClientData client_data, struct timeval* nowP )
@@ -2413,7 +3189,8 @@ static void drop_child(const char * type,pid_t pid,httpd_conn* hc) {
 
 	hc->status = 200;
 	hc->bytes_sent = CGI_BYTECOUNT;
-	hc->bfield &= ~HC_SHOULD_LINGER;
+	/* The connection now belongs to the child, we'll just close it. */
+	hc->bfield &= ~( HC_SHOULD_LINGER | HC_KEEP_ALIVE );
 	/* The child should hold the log */
 	hc->bfield |= HC_LOG_DONE;
 }
@@ -2422,8 +3199,12 @@ static void drop_child(const char * type,pid_t pid,httpd_conn* hc) {
 static void child_r_start(httpd_conn* hc) {
 	int s=1;
 
+	in_child = 1;
 	httpd_unlisten( hc->hs ); 
 
+	/* We exit once done, so the connection can't be persistent. */
+	hc->bfield &= ~HC_KEEP_ALIVE;
+
 	/* set signals to default behavior. */
 #ifdef HAVE_SIGSET
 	(void) sigset( SIGTERM, SIG_DFL );
@@ -2455,6 +3236,9 @@ static void child_r_start(httpd_conn* hc) {
 	/* activate TCP_NODELAY for CGI and spawned process (cf. man 7 tcp) */
 	if ( setsockopt(hc->conn_fd, IPPROTO_TCP, TCP_NODELAY, (char*) &s, sizeof(s) ) < 0 )
 		syslog( LOG_WARNING, "setsockopt TCP_NODELAY - %m");
+
+	/* Responses to earlier pipelined requests go first. */
+	httpd_write_response( hc );
 }
 
 /*
@@ -2480,7 +3264,9 @@ static int launch_process(void (*funct) (httpd_conn* ), httpd_conn* hc, int meth
 		return(-1);
 	}
 	if ( r > 0 ) {
-		/* Parent process. */
+		/* Parent process.  The responses to earlier pipelined requests
+		** are the child's to send. */
+		hc->responselen = 0;
 		drop_child(fname,r,hc);
 		return(0);
 	}
@@ -2717,6 +3503,13 @@ mode  links  bytes  last-changed  name\n\
 			nameptrs[i], linkprefix, link, fileclass );
 		}
 
+#ifdef USE_DIRSIG
+	/* (The manifest is no file, so it isn't listed above.) */
+	if ( dirsig_ready() )
+		(void) fprintf( fp,
+			"<HR><A HREF=\"%s\">%s</A>  the SHA-256 of these files, signed\n",
+			DIR_MANIFEST_NAME, DIR_MANIFEST_NAME );
+#endif /* USE_DIRSIG */
 	(void) fprintf( fp, "</PRE></BODY>\n</HTML>\n" );
 	(void) fclose( fp );
 	exit( 0 );
@@ -2963,7 +3756,7 @@ static void gpg_data_release_cb(void *handle)
 
 /*! Check the dirname of a file path, and create missing directories if needed
  * \return like mkdir: 0 on succes, -1 on error (cf. errno) */
-static int mk_path(const char * path) {
+int httpd_mk_path(const char * path) {
 	char * cp , * dir=strdup(path);
 	struct stat std;
 
@@ -3027,7 +3820,6 @@ static const char * chdir_path(const char * path) {
 void httpd_parse_resp(interpose_args_t * args) {
 	const httpd_conn * hc=args->hc;
 	int optcgi=args->option;
-#define SIG_CACHE_DIR "../"SIG_CACHEDIR
 #define HTTP_MAX_CONTENTHEADERS 9
 #define HTTP_MAX_HEADERS 40
 
@@ -3036,6 +3828,7 @@ void httpd_parse_resp(interpose_args_t * args) {
 	(fp?fclose(fp):close(args->rfd)); \
 	close(args->wfd); \
 	free(buf); \
+	free(csig); \
 	for (i=0;i<n_c_headers;i++) \
 		free(c_headers[i]); \
 	for (i=0;i<n_o_headers;i++) \
@@ -3052,8 +3845,8 @@ void httpd_parse_resp(interpose_args_t * args) {
 	char * buf=malloc(buflen);
 	int status=-1,i;
 	char * title, * cp;
-	char fcache[MAXPATHLEN];
-	struct stat sts;
+	char * csig=NULL; /* the cached signature */
+	size_t csiglen=0;
 
 
 	do_sign=(optcgi?0:1);
@@ -3164,8 +3957,10 @@ void httpd_parse_resp(interpose_args_t * args) {
 				case 404: title = err404title; break;
 				case 408: title = httpd_err408title; break;
 				case 411: title = err411title; break;
+				case 412: title = err412title; break;
 				case 413: title = err413title; break;
 				case 415: title = err415title; break;
+				case 416: title = err416title; break;
 				case 500: title = err500title; break;
 				case 501: title = err501title; break;
 				case 503: title = httpd_err503title; break;
@@ -3175,22 +3970,18 @@ void httpd_parse_resp(interpose_args_t * args) {
 		}
 	} else {
 #ifdef SIG_CACHEDIR
-		if ( stat(SIG_CACHE_DIR,&sts) < 0 || !S_ISDIR(sts.st_mode) ) {
-			syslog( LOG_ERR,"invalid cache dir %s - %m",SIG_CACHE_DIR);
-		} else if ( snprintf(fcache,MAXPATHLEN,"%s/%s",SIG_CACHE_DIR,hc->realfilename) >= MAXPATHLEN ) {
-			syslog( LOG_ERR,"too big cache path - %s",hc->realfilename);
-		} else if (!(hc->bfield & HC_GOT_RANGE)){
+		if (!(hc->bfield & HC_GOT_RANGE)){
 			use_cache=2; /* by default: do the cache */
-			if ( stat(fcache,&sts) == 0 ) { 
-				if ( ! S_ISREG(sts.st_mode) ) {
-					/* May happen ... */
-					remove(fcache);
-					syslog( LOG_WARNING,"remove %s - %m",fcache);
-				} else if ( sts.st_mtime > hc->sb.st_mtime )
-				/* The cached signature seems newer than file */
-					use_cache=1; /* just use it */
-			}
+			if ( (csig=sigcache_get(hc->realfilename,&hc->sb,&csiglen)) )
+				use_cache=1; /* just use it */
 		}
+#ifdef WHOLE_FILE_RANGE_SIG
+		/* A range goes with the cached signature of the whole file, if
+		** any, else it is signed by itself (and not cached).
+		*/
+		else if ( (csig=sigcache_get(hc->realfilename,&hc->sb,&csiglen)) )
+			use_cache=1;
+#endif /* WHOLE_FILE_RANGE_SIG */
 #else /* SIG_CACHEDIR */
 		use_cache=0;
 #endif /* SIG_CACHEDIR */
@@ -3198,13 +3989,23 @@ void httpd_parse_resp(interpose_args_t * args) {
 
 	if (do_sign && status>=200 && status<300) {
 
+#ifdef USE_NATIVE_SIGN
 #define HTTPD_PARSE_SIGN_CLEAN() { \
 	gpgme_data_release(gpgdata); \
 	gpgme_data_release(gpgsig); \
+	if (pgps) \
+		pgpsign_cancel(pgps); \
 	}
+#else /* USE_NATIVE_SIGN */
+#define HTTPD_PARSE_SIGN_CLEAN() { \
+	gpgme_data_release(gpgdata); \
+	gpgme_data_release(gpgsig); \
+	}
+#endif /* USE_NATIVE_SIGN */
 		char * bound=random_boundary((char *)hc->boundary,BOUNDARYLEN);
 		gpgme_error_t gpgerr;
 		gpgme_data_t gpgdata,gpgsig;
+		PgpSign* pgps = (PgpSign*) 0;	/* when signing in process */
 		struct gpgme_data_cbs gpgcbs = {
 			(gpgme_data_read_cb_t) fp2fd_gpg_data_rd_cb,	/* read method */
 			NULL,									/* write method */
@@ -3259,7 +4060,11 @@ void httpd_parse_resp(interpose_args_t * args) {
 		httpd_write_fully(args->wfd,"\015\012",2);
 
 		/* contrary to RFC 3156, no headers are signed, only the content */
-		if (use_cache==1) {
+#ifdef USE_NATIVE_SIGN
+		if (use_cache!=1 && pgpsign_ready() && pgpsign_begin(&pgps) != GPG_ERR_NO_ERROR)
+			pgps = (PgpSign*) 0;
+#endif /* USE_NATIVE_SIGN */
+		if (use_cache==1 || pgps) {
 			for (;;) {
 				r = fread(buf,sizeof(char), buflen-1,fp );
 				if ( r <= 0 ) {
@@ -3279,50 +4084,62 @@ void httpd_parse_resp(interpose_args_t * args) {
 					HTTPD_PARSE_SIGN_CLEAN();
 					HTTPD_PARSE_RESP_RETURN(-1);
 				}
+#ifdef USE_NATIVE_SIGN
+				if (pgps)
+					pgpsign_write(pgps, buf, r);
+#endif /* USE_NATIVE_SIGN */
 			}
 			gpgerr=GPG_ERR_NO_ERROR;
+#ifdef USE_NATIVE_SIGN
+			if (pgps) {
+				char * sig;
+				size_t len;
+
+				gpgerr = pgpsign_end(pgps, &sig, &len);
+				pgps = (PgpSign*) 0;
+				if (gpgerr == GPG_ERR_NO_ERROR) {
+					if (gpgme_data_write(gpgsig, sig, len) != (ssize_t) len)
+						gpgerr = gpgme_error_from_errno(errno);
+					free(sig);
+				}
+			}
+#endif /* USE_NATIVE_SIGN */
 		} else
 			gpgerr = gpgme_op_sign (main_gpgctx, gpgdata,gpgsig,GPGME_SIG_MODE_DETACH);
 
 		if ( gpgerr == GPG_ERR_NO_ERROR) {
 			off_t siglen;
-			FILE * sigfile;
 			if (use_cache==1) 
-				siglen=sts.st_size;
+				siglen=csiglen;
 			else {
 				siglen=gpgme_data_seek(gpgsig, 0, SEEK_END);
 				gpgme_data_seek(gpgsig, 0, SEEK_SET);
 			}	
-			r=snprintf(buf,buflen, "\015\012--%s\015\012%s %s\015\012%s %d\015\012\015\012",bound,"Content-Type:","application/pgp-signature","Content-Length:",(int) siglen);
+			r=snprintf(buf,buflen, "\015\012--%s\015\012%s %s\015\012%s%s %d\015\012\015\012",bound,"Content-Type:","application/pgp-signature",
+#ifdef WHOLE_FILE_RANGE_SIG
+				(use_cache==1 && (hc->bfield & HC_GOT_RANGE)) ? WHOLE_SIG_HEADER :
+#endif /* WHOLE_FILE_RANGE_SIG */
+				"","Content-Length:",(int) siglen);
 			r=MIN(r,buflen);
 			if (httpd_write_fully(args->wfd,buf,r) !=r ) {
 				HTTPD_PARSE_SIGN_CLEAN();
 				HTTPD_PARSE_RESP_RETURN(-1);
 			}
 
+#ifdef SIG_CACHEDIR
 			if (use_cache==2) {
 			/* (Try to) Cache the signature */
-				if ( mk_path(fcache) == 0 && (sigfile=fopen(fcache,"w")) ) {
-			   		while ( (r=gpgme_data_read(gpgsig, buf, buflen)) > 0 )
-						if (fwrite(buf,sizeof(char),r,sigfile) != r) {
-						   unlink(fcache);
-					   	   break;
-						}	   
-					fclose(sigfile);
-					gpgme_data_seek(gpgsig, 0, SEEK_SET);	
-				}
+				if ( (csig=malloc(siglen>0?siglen:1)) && gpgme_data_read(gpgsig, csig, siglen) == siglen )
+					sigcache_put(hc->realfilename,&hc->sb,csig,siglen);
+				gpgme_data_seek(gpgsig, 0, SEEK_SET);	
 			}
+#endif /* SIG_CACHEDIR */
 
 			if (use_cache==1) {
 			/* output cached signature */
-				sigfile=fopen(fcache,"r");
-				if (sigfile) {
-					while ( (r=fread(buf,sizeof(char), buflen-1, sigfile)) )
-						if ( httpd_write_fully(args->wfd, buf, r ) != r ) {
-							HTTPD_PARSE_SIGN_CLEAN();
-							HTTPD_PARSE_RESP_RETURN(-1);
-						}
-					fclose(sigfile);
+				if ( httpd_write_fully(args->wfd, csig, csiglen ) != csiglen ) {
+					HTTPD_PARSE_SIGN_CLEAN();
+					HTTPD_PARSE_RESP_RETURN(-1);
 				}
 			} else {
 				while ( (r=gpgme_data_read(gpgsig, buf, buflen)) > 0 )
@@ -3382,6 +4199,604 @@ void httpd_parse_resp(interpose_args_t * args) {
 	}
 }
 
+/* Turns the response of hc (past the ones held back for earlier pipelined
+** requests) into its multipart/msigned form, with sig as
+** the signature, or the text of err if it couldn't be made.  With a proof,
+** sig is the signature of the Merkle tree root, and the proof goes in a
+** part of its own before it.
+*/
+static void
+frame_signed( httpd_conn* hc, gpgme_error_t err, const char* sig, size_t siglen, const char* proof, size_t prooflen )
+	{
+	char* cp;
+	char* eol;
+	char* end = &hc->response[hc->responselen];
+	size_t outerlen = hc->heldlen, len;
+
+	(void) random_boundary( hc->boundary, BOUNDARYLEN );
+
+	/* The Content-* headers send_mime() made go to the signed part, the
+	** others stay in front of it.
+	*/
+	httpd_realloc_str( &hc->partsbuf, &hc->maxpartsbuf, hc->responselen + BOUNDARYLEN + 10 );
+	len = snprintf( hc->partsbuf, hc->maxpartsbuf, "--%s\015\012", hc->boundary );
+	for ( cp = &hc->response[hc->heldlen]; cp < end; cp = eol )
+		{
+		eol = (char*) memchr( cp, '\012', end - cp );
+		eol = ( eol != (char*) 0 ? eol + 1 : end );
+		if ( eol - cp <= 2 )
+			break;
+		if ( strncasecmp( cp, "Content-", 8 ) == 0 )
+			{
+			(void) memcpy( &hc->partsbuf[len], cp, eol - cp );
+			len += eol - cp;
+			}
+		else
+			{
+			(void) memmove( &hc->response[outerlen], cp, eol - cp );
+			outerlen += eol - cp;
+			}
+		}
+	(void) memcpy( &hc->partsbuf[len], "\015\012", 2 );
+	len += 2;
+	if ( hc->bfield & HC_GOT_RANGE )
+		{
+		hc->ranges[0].first = hc->first_byte_index;
+		hc->ranges[0].last = hc->last_byte_index;
+		}
+	else
+		{
+		hc->ranges[0].first = 0;
+		hc->ranges[0].last = hc->sb.st_size - 1;
+		}
+	hc->ranges[0].headidx = 0;
+	hc->ranges[0].headlen = len;
+
+	/* Then the signature, as the last part. */
+	httpd_realloc_str( &hc->partsbuf, &hc->maxpartsbuf, len + prooflen + siglen + 400 );
+	if ( proof != (char*) 0 )
+		{
+		len += snprintf( &hc->partsbuf[len], hc->maxpartsbuf - len,
+			"\015\012--%s\015\012Content-Type: %s\015\012Content-Length: %lu\015\012\015\012",
+			hc->boundary, MERKLE_PROOF_TYPE, (unsigned long) prooflen );
+		(void) memcpy( &hc->partsbuf[len], proof, prooflen );
+		len += prooflen;
+		len += snprintf( &hc->partsbuf[len], hc->maxpartsbuf - len,
+			"\015\012--%s\015\012Content-Type: application/pgp-signature\015\012%sContent-Length: %lu\015\012\015\012",
+			hc->boundary, ROOT_SIG_HEADER, (unsigned long) siglen );
+		(void) memcpy( &hc->partsbuf[len], sig, siglen );
+		len += siglen;
+		}
+	else if ( err == GPG_ERR_NO_ERROR )
+		{
+		len += snprintf( &hc->partsbuf[len], hc->maxpartsbuf - len,
+			"\015\012--%s\015\012Content-Type: application/pgp-signature\015\012%sContent-Length: %lu\015\012\015\012",
+			hc->boundary,
+#ifdef WHOLE_FILE_RANGE_SIG
+			( hc->bfield & HC_GOT_RANGE ) ? WHOLE_SIG_HEADER :
+#endif /* WHOLE_FILE_RANGE_SIG */
+			"", (unsigned long) siglen );
+		(void) memcpy( &hc->partsbuf[len], sig, siglen );
+		len += siglen;
+		}
+	else
+		len += snprintf( &hc->partsbuf[len], hc->maxpartsbuf - len,
+			"\015\012--%s\015\012\015\012gpgme_op_sign -> %d : %.100s \015\012",
+			hc->boundary, err, gpgme_strerror( err ) );
+	len += snprintf( &hc->partsbuf[len], hc->maxpartsbuf - len, "\015\012--%s--\015\012", hc->boundary );
+	hc->ranges[1].first = 0;
+	hc->ranges[1].last = -1;
+	hc->ranges[1].headidx = hc->ranges[0].headlen;
+	hc->ranges[1].headlen = len - hc->ranges[1].headidx;
+	hc->nranges = 1;
+	hc->bfield &= ~HC_GOT_RANGE;
+
+	/* Unlike the interposer, we know the whole length. */
+	hc->bytes_to_send = multipart_length( hc );
+	httpd_realloc_str( &hc->response, &hc->maxresponse, outerlen + BOUNDARYLEN + 100 );
+	hc->responselen = outerlen + snprintf( &hc->response[outerlen], hc->maxresponse - outerlen,
+		"Content-Type: multipart/msigned; boundary=%s\015\012Content-Length: %lld\015\012\015\012",
+		hc->boundary, (long long) hc->bytes_to_send );
+	}
+
+
+#ifdef USE_MERKLE
+/* Makes the proof of the range of hc from the tree of its file, if made of
+** the file as it is.  Returns -1 if there is none; else *sigP points in
+** *treeP, mapped, to be unmapped once framed.
+*/
+static int
+merkle_range( httpd_conn* hc, char** treeP, struct stat* treesbP, char** proofP, size_t* prooflenP, const char** sigP, size_t* siglenP, struct timeval* nowP )
+	{
+	char ftree[MAXPATHLEN];
+
+	if ( ! merkle_ready() ||
+		 snprintf( ftree, sizeof(ftree), "%s/%s", MERKLE_CACHE_DIR, hc->realfilename ) >= sizeof(ftree) ||
+		 pcache_stat( ftree, treesbP ) < 0 || ! S_ISREG( treesbP->st_mode ) )
+		return -1;
+	*treeP = mmc_map( ftree, treesbP, nowP );
+	if ( *treeP == (char*) 0 )
+		return -1;
+	if ( merkle_proof(
+			*treeP, treesbP->st_size, &(hc->sb), MERKLE_CHUNK_SIZE,
+			hc->first_byte_index, hc->last_byte_index, proofP, prooflenP, sigP, siglenP ) < 0 )
+		{
+		mmc_unmap( *treeP, treesbP, nowP );
+		return -1;
+		}
+	return 0;
+	}
+#endif /* USE_MERKLE */
+
+
+/* Whether to sign the response to hc, as the signing policy says when
+** signing is busy.  Returns 1 or 0, or -1 if a 503 was sent instead.
+*/
+static int
+sign_policy( httpd_conn* hc )
+	{
+	int policy;
+
+	if ( ! ( hc->bfield & HC_DETACH_SIGN ) )
+		return 0;
+	policy = sigpolicy_decide( hc->hs );
+	if ( ( policy == SIGPOLICY_CACHE || policy == SIGPOLICY_REFUSE ) && ! sig_cached( hc ) )
+		{
+		if ( policy == SIGPOLICY_REFUSE )
+			{
+			char retry[50];
+
+			sigpolicy_count( SIGPOLICY_REFUSE );
+			(void) snprintf( retry, sizeof(retry), "Retry-After: %d\015\012", SIGN_RETRY_AFTER );
+			httpd_send_err(
+				hc, 503, httpd_err503title, retry, httpd_err503form, hc->encodedurl );
+			return -1;
+			}
+		sigpolicy_count( SIGPOLICY_UNSIGNED );
+		return 0;
+		}
+	sigpolicy_count( policy == SIGPOLICY_REFUSE ? SIGPOLICY_CACHE : policy );
+	return 1;
+	}
+
+
+/* Whether the signature of the file of hc is cached, in the index or in
+** the cache dir, and won't have to be made.
+*/
+static int
+sig_cached( httpd_conn* hc )
+	{
+#ifdef SIG_CACHEDIR
+	size_t siglen;
+
+#ifndef WHOLE_FILE_RANGE_SIG
+	if ( hc->bfield & HC_GOT_RANGE )
+		return 0;
+#endif /* ! WHOLE_FILE_RANGE_SIG */
+	if ( sigindex_get( hc->realfilename, &(hc->sb), &siglen ) != (char*) 0 )
+		return 1;
+#ifdef USE_SIGN_POOL
+	/* (Out of the index, only a signer reads it: interposers are forks.) */
+	if ( signpool_pending() < 0 )
+#endif /* USE_SIGN_POOL */
+		return 0;
+	return sigcache_has( hc->realfilename, &(hc->sb) );
+#else /* SIG_CACHEDIR */
+	return 0;
+#endif /* SIG_CACHEDIR */
+	}
+
+
+#ifdef USE_DIRSIG
+/* If hc asks for DIR_MANIFEST_NAME in a directory, answers with the signed
+** manifest of the directory, from the cache if it is fresh; else sets
+** HC_SIGN_PENDING for the signing pool to make it first.  Returns 1 if it
+** isn't such a request, else like httpd_start_request().
+*/
+static int
+dir_manifest( httpd_conn* hc, struct timeval* nowP )
+	{
+	size_t len = strlen( hc->origfilename );
+	size_t namelen = sizeof(DIR_MANIFEST_NAME) - 1;
+	size_t hostlen = strlen( hc->hostdir );
+	size_t cwdlen = strlen( hc->hs->cwd );
+	char fcache[MAXPATHLEN];
+	struct stat sb;
+	time_t now;
+#ifdef FORBID_HIDDEN_RESSOURCE
+	char* cp;
+#endif /* FORBID_HIDDEN_RESSOURCE */
+
+	if ( ! dirsig_ready() || hc->method == METHOD_POST || len < namelen ||
+		 strcmp( &hc->origfilename[len - namelen], DIR_MANIFEST_NAME ) != 0 ||
+		 ( len > namelen && hc->origfilename[len - namelen - 1] != '/' ) )
+		return 1;
+
+	/* Its directory, found as the file would have been. */
+	len -= namelen;
+	httpd_realloc_str( &hc->tmpbuff, &hc->maxtmpbuff, hostlen + 1 + len );
+	if ( hostlen > 0 )
+		(void) snprintf( hc->tmpbuff, hc->maxtmpbuff, "%s/%.*s", hc->hostdir, (int) len, hc->origfilename );
+	else if ( len > 0 )
+		(void) snprintf( hc->tmpbuff, hc->maxtmpbuff, "%.*s", (int) len, hc->origfilename );
+	else
+		(void) strcpy( hc->tmpbuff, "." );
+	hc->realfilename = pcache_realpath( hc->tmpbuff );
+	if ( hc->realfilename == (char*) 0 )
+		return 1;
+	if ( strncmp( hc->realfilename, hc->hs->cwd, cwdlen - 1 ) != 0 ||
+		 ( hc->realfilename[cwdlen - 1] != '\0' && hc->realfilename[cwdlen - 1] != '/' ) )
+		goto not_one;
+	if ( hc->realfilename[cwdlen - 1] == '\0' )
+		(void) strcpy( hc->realfilename, "." );
+	else
+		/* Elide the current directory. */
+		(void) memmove( hc->realfilename, &hc->realfilename[cwdlen], strlen( &hc->realfilename[cwdlen] ) + 1 );
+	if ( pcache_stat( hc->realfilename, &(hc->sb) ) < 0 || ! S_ISDIR( hc->sb.st_mode ) ||
+		 ! ( hc->sb.st_mode & S_IROTH ) ||
+		 dirsig_path( fcache, sizeof(fcache), hc->realfilename ) < 0 )
+		goto not_one;
+#ifdef FORBID_HIDDEN_RESSOURCE
+	cp = hc->realfilename;
+	do {
+		if ( cp[0] == '.' && cp[1] != '\0' && cp[1] != '/' )
+			goto not_one;
+	} while ( (cp=strchr(cp, '/')) && cp++ );
+#endif /* FORBID_HIDDEN_RESSOURCE */
+#ifdef AUTH_FILE
+	if ( auth_check( hc ) == -1 )
+		return -1;
+#endif /* AUTH_FILE */
+
+	hc->bfield |= HC_DIR_MANIFEST;
+	hc->bfield &= ~HC_GOT_RANGE;
+	now = ( nowP != (struct timeval*) 0 ? nowP->tv_sec : time( (time_t*) 0 ) );
+	/* (Fresh if made since the directory last changed, and lately.) */
+	if ( stat( fcache, &sb ) == 0 && S_ISREG( sb.st_mode ) &&
+		 sb.st_mtime > hc->sb.st_mtime && now - sb.st_mtime < DIR_MANIFEST_MAX_AGE )
+		return serve_manifest( hc, fcache, &sb, nowP );
+	if ( hc->method == METHOD_HEAD )
+		{
+		send_mime(
+			hc, 200, ok200title, "", "", "text/plain; charset=%s", (off_t) -1,
+			hc->sb.st_mtime );
+		return 0;
+		}
+	if ( signpool_pending() < 0 )
+		{
+		httpd_send_err(
+			hc, 503, httpd_err503title, "", httpd_err503form, hc->encodedurl );
+		return -1;
+		}
+	hc->bfield |= HC_SIGN_PENDING;
+	return 0;
+
+	not_one:
+	free( (void*) hc->realfilename );
+	hc->realfilename = (char*) 0;
+	return 1;
+	}
+
+
+/* Answers hc with the cached manifest file fcache, described by sbP. */
+static int
+serve_manifest( httpd_conn* hc, char* fcache, struct stat* sbP, struct timeval* nowP )
+	{
+	const char* sig;
+	size_t len, siglen;
+
+	if ( hc->method == METHOD_HEAD )
+		{
+		send_mime(
+			hc, 200, ok200title, "", "", "text/plain; charset=%s", (off_t) -1,
+			sbP->st_mtime );
+		return 0;
+		}
+	hc->file_address = mmc_map( fcache, sbP, nowP );
+	if ( hc->file_address == (char*) 0 )
+		{
+		httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
+		return -1;
+		}
+	hc->sb = *sbP;
+	if ( dirsig_split( hc->file_address, sbP->st_size, &len, &sig, &siglen ) < 0 )
+		{
+		syslog( LOG_ERR, "%.80s isn't a signed manifest", fcache );
+		mmc_unmap( hc->file_address, &(hc->sb), nowP );
+		hc->file_address = (char*) 0;
+		httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
+		return -1;
+		}
+	/* (Only the manifest is sent from the map, the signature is framed.) */
+	hc->sb.st_size = len;
+	send_mime(
+		hc, 200, ok200title, "", "", "text/plain; charset=%s", (off_t) len,
+		hc->sb.st_mtime );
+	frame_signed( hc, GPG_ERR_NO_ERROR, sig, siglen, (char*) 0, 0 );
+	return 0;
+	}
+#endif /* USE_DIRSIG */
+
+
+#ifdef USE_SIGN_POOL
+/* The jobs signing a whole file, that later ones wait for. */
+static SignJob* flights = (SignJob*) 0;
+
+
+/* Returns the job signing the whole file described by sbP, if any. */
+static SignJob*
+find_flight( struct stat* sbP )
+	{
+	SignJob* job;
+
+	for ( job = flights; job != (SignJob*) 0; job = job->flight_next )
+		if ( job->sb.st_ino == sbP->st_ino && job->sb.st_dev == sbP->st_dev &&
+			 job->sb.st_mtime == sbP->st_mtime &&
+			 ST_MTIME_NSEC( job->sb ) == ST_MTIME_NSEC( *sbP ) &&
+			 job->sb.st_size == sbP->st_size )
+			return job;
+	return (SignJob*) 0;
+	}
+
+
+/* Makes the job signing bytes first to last of filename, or the whole file
+** if whole is set (then its signature is cached, and later jobs of the file
+** wait for it), and queues it.
+*/
+static SignJob*
+submit_job( char* filename, struct stat* sbP, off_t first, off_t last, int whole, void* client_data, int low )
+	{
+	SignJob* job;
+	size_t namelen, treelen = 0;
+#ifdef USE_MERKLE
+	char ftree[MAXPATHLEN];
+
+	/* Big files get their Merkle tree made too. */
+	if ( whole && sbP->st_size >= MERKLE_MIN_FILE && merkle_ready() &&
+		 snprintf( ftree, sizeof(ftree), "%s/%s", MERKLE_CACHE_DIR, filename ) < sizeof(ftree) )
+		treelen = strlen( ftree ) + 1;
+#endif /* USE_MERKLE */
+
+	namelen = strlen( filename ) + 1;
+	job = (SignJob*) malloc( sizeof(SignJob) + namelen + treelen );
+	if ( job == (SignJob*) 0 )
+		return (SignJob*) 0;
+	job->sig = (char*) 0;
+	job->sb = *sbP;
+	job->filename = strcpy( (char*) ( job + 1 ), filename );
+	job->first = first;
+	job->len = last - first + 1;
+	job->data = (char*) 0;
+	job->cachename = job->cachefile = job->treefile = job->dirname = (char*) 0;
+#ifdef SIG_CACHEDIR
+	if ( whole )
+		job->cachename = job->filename;
+#endif /* SIG_CACHEDIR */
+#ifdef USE_MERKLE
+	if ( treelen > 0 )
+		job->treefile = strcpy( (char*) ( job + 1 ) + namelen, ftree );
+#endif /* USE_MERKLE */
+	job->mtime = sbP->st_mtime;
+	job->client_data = client_data;
+	job->low = low;
+	job->leader = job->waiters = job->flight_next = (SignJob*) 0;
+	if ( signpool_submit( job ) < 0 )
+		{
+		httpd_sign_release( job );
+		return (SignJob*) 0;
+		}
+	if ( whole )
+		{
+		job->flight_next = flights;
+		flights = job;
+		}
+	return job;
+	}
+
+
+#ifdef USE_DIRSIG
+/* Makes the job making the manifest of dirname, described by sbP, and
+** queues it.  Later jobs of the directory wait for it.
+*/
+static SignJob*
+submit_manifest( char* dirname, struct stat* sbP, void* client_data, int low )
+	{
+	SignJob* job;
+	char fcache[MAXPATHLEN];
+	size_t cachelen;
+
+	if ( dirsig_path( fcache, sizeof(fcache), dirname ) < 0 )
+		return (SignJob*) 0;
+	cachelen = strlen( fcache ) + 1;
+	job = (SignJob*) malloc( sizeof(SignJob) + cachelen + strlen( dirname ) + 1 );
+	if ( job == (SignJob*) 0 )
+		return (SignJob*) 0;
+	job->filename = job->data = job->sig = (char*) 0;
+	job->first = 0;
+	job->len = 0;
+	job->cachefile = strcpy( (char*) ( job + 1 ), fcache );
+	job->dirname = strcpy( (char*) ( job + 1 ) + cachelen, dirname );
+	job->cachename = job->treefile = (char*) 0;
+	job->sb = *sbP;
+	job->mtime = sbP->st_mtime;
+	job->client_data = client_data;
+	job->low = low;
+	job->leader = job->waiters = job->flight_next = (SignJob*) 0;
+	if ( signpool_submit( job ) < 0 )
+		{
+		free( (void*) job );
+		return (SignJob*) 0;
+		}
+	job->flight_next = flights;
+	flights = job;
+	return job;
+	}
+#endif /* USE_DIRSIG */
+
+
+int
+httpd_sign_submit( httpd_conn* hc, void* client_data )
+	{
+	SignJob* job;
+	SignJob* leader;
+
+	hc->bfield &= ~HC_SIGN_PENDING;
+	/* Only whole files have their signature cached, and shared; with
+	** WHOLE_FILE_RANGE_SIG, a range goes with the one of its whole file.
+	*/
+#ifndef WHOLE_FILE_RANGE_SIG
+	if ( hc->bfield & HC_GOT_RANGE )
+		job = submit_job(
+			hc->realfilename, &(hc->sb), hc->first_byte_index, hc->last_byte_index,
+			0, client_data, 0 );
+	else
+#endif /* ! WHOLE_FILE_RANGE_SIG */
+	if ( ( leader = find_flight( &(hc->sb) ) ) != (SignJob*) 0 )
+		{
+		/* Being signed already: wait for that signature. */
+		job = (SignJob*) malloc( sizeof(SignJob) );
+		if ( job == (SignJob*) 0 )
+			return -1;
+		job->filename = job->sig = (char*) 0;
+		job->cachename = job->cachefile = job->treefile = job->dirname = (char*) 0;
+		job->client_data = client_data;
+		job->leader = leader;
+		job->flight_next = (SignJob*) 0;
+		job->waiters = leader->waiters;
+		leader->waiters = job;
+		/* (Not a background one any more, if it is still queued.) */
+		if ( leader->low )
+			(void) signpool_promote( leader );
+		}
+#ifdef USE_DIRSIG
+	else if ( hc->bfield & HC_DIR_MANIFEST )
+		job = submit_manifest( hc->realfilename, &(hc->sb), client_data, 0 );
+#endif /* USE_DIRSIG */
+	else
+		job = submit_job(
+			hc->realfilename, &(hc->sb), 0, hc->sb.st_size - 1, 1, client_data, 0 );
+	if ( job == (SignJob*) 0 )
+		return -1;
+	hc->signjob = job;
+	return 0;
+	}
+
+
+#ifdef USE_PRESIGN
+int
+httpd_presign( char* filename, struct stat* sbP )
+	{
+	if ( find_flight( sbP ) != (SignJob*) 0 ||
+		 submit_job( filename, sbP, 0, sbP->st_size - 1, 1, (void*) 0, 1 ) == (SignJob*) 0 )
+		return -1;
+	return 0;
+	}
+
+
+#ifdef USE_DIRSIG
+int
+httpd_presign_dir( char* dirname, struct stat* sbP )
+	{
+	if ( ! dirsig_ready() || find_flight( sbP ) != (SignJob*) 0 ||
+		 submit_manifest( dirname, sbP, (void*) 0, 1 ) == (SignJob*) 0 )
+		return -1;
+	return 0;
+	}
+#endif /* USE_DIRSIG */
+#endif /* USE_PRESIGN */
+
+
+#ifdef USE_MERKLE
+/* A big file whose signature was cached gets its tree made in the
+** background, unless it has one made since it changed: a background job
+** of the file finds the signature cached, and only makes the tree.
+*/
+static void
+tree_later( httpd_conn* hc )
+	{
+	char ftree[MAXPATHLEN];
+	struct stat treesb;
+
+	if ( hc->sb.st_size < MERKLE_MIN_FILE || ! merkle_ready() ||
+		 signpool_pending() < 0 || find_flight( &(hc->sb) ) != (SignJob*) 0 ||
+		 snprintf( ftree, sizeof(ftree), "%s/%s", MERKLE_CACHE_DIR, hc->realfilename ) >= sizeof(ftree) )
+		return;
+	/* (The signer checks it is the tree of the file as it is.) */
+	if ( pcache_stat( ftree, &treesb ) == 0 && S_ISREG( treesb.st_mode ) &&
+		 treesb.st_mtime >= hc->sb.st_mtime )
+		return;
+	(void) submit_job(
+		hc->realfilename, &(hc->sb), 0, hc->sb.st_size - 1, 1, (void*) 0, SIGNJOB_TREE );
+	}
+#endif /* USE_MERKLE */
+
+
+void
+httpd_signed( httpd_conn* hc, SignJob* job )
+	{
+	hc->signjob = (SignJob*) 0;
+#ifdef USE_DIRSIG
+	if ( job->dirname != (char*) 0 )
+		{
+		struct stat sb;
+
+		/* The manifest is in its cache file now. */
+		if ( job->err != GPG_ERR_NO_ERROR || stat( job->cachefile, &sb ) < 0 )
+			httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
+		else
+			(void) serve_manifest( hc, (char*) job->cachefile, &sb, (struct timeval*) 0 );
+		return;
+		}
+#endif /* USE_DIRSIG */
+	frame_signed( hc, job->err, job->sig, job->siglen, (char*) 0, 0 );
+	}
+
+
+void
+httpd_sign_release( SignJob* job )
+	{
+	SignJob** jP;
+	SignJob* w;
+	SignJob* next;
+
+	for ( jP = &flights; *jP != (SignJob*) 0; jP = &(*jP)->flight_next )
+		if ( *jP == job )
+			{
+			*jP = job->flight_next;
+			break;
+			}
+	for ( w = job->waiters; w != (SignJob*) 0; w = next )
+		{
+		next = w->waiters;
+		free( (void*) w );
+		}
+#ifdef SIG_CACHEDIR
+	/* (A signature of a whole file goes in the index too.) */
+	if ( job->err == GPG_ERR_NO_ERROR && job->sig != (char*) 0 && job->cachename != (char*) 0 )
+		sigindex_put( job->cachename, &(job->sb), job->sig, job->siglen );
+#endif /* SIG_CACHEDIR */
+	free( (void*) job->sig );
+	free( (void*) job );
+	}
+
+
+void
+httpd_sign_cancel( httpd_conn* hc )
+	{
+	SignJob* job = hc->signjob;
+
+	if ( job == (SignJob*) 0 )
+		return;
+	job->client_data = (void*) 0;
+	/* (A waiter is freed with its leader, and a leader is signed for its
+	** waiters anyway.)
+	*/
+	if ( job->leader == (SignJob*) 0 && job->waiters == (SignJob*) 0 && signpool_cancel( job ) )
+		httpd_sign_release( job );
+	hc->signjob = (SignJob*) 0;
+	}
+#endif /* USE_SIGN_POOL */
+
 /* CGI child process. */
 static void
 cgi_child( httpd_conn* hc ) {
@@ -3555,8 +4970,12 @@ int
 httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 	static const char* index_names[] = { INDEX_NAMES };
 	int i;
+	int sign;
+	int unsatisfiable = 0;
 	size_t expnlen, indxlen;
 
+	/* (What is already in the response buffer isn't ours to frame.) */
+	hc->heldlen = hc->responselen;
 	if ( hc->method != METHOD_GET && hc->method != METHOD_HEAD &&
 		 hc->method != METHOD_POST )
 		{
@@ -3583,6 +5002,11 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 
 	/* If there's no realfilename, it's should be a non-existent file. */
 	if ( ! hc->realfilename ) {
+#ifdef USE_DIRSIG
+		/* (Or the manifest of a directory.) */
+		if ( ( i = dir_manifest( hc, nowP ) ) <= 0 )
+			return i;
+#endif /* USE_DIRSIG */
 		httpd_send_err( hc, 404, err404title, "", err404form, hc->encodedurl );
 		return -1;
 	}
@@ -3590,7 +5014,7 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 	expnlen = strlen( hc->realfilename );
 
 	/* Stat the file. */
-	if ( stat( hc->realfilename, &hc->sb ) < 0 )
+	if ( pcache_stat( hc->realfilename, &hc->sb ) < 0 )
 		{
 		httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
 		return -1;
@@ -3665,7 +5089,7 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 			if ( strcmp( hc->tmpbuff, "./" ) == 0 )
 				hc->tmpbuff[0] = '\0';
 			(void) strcat( hc->tmpbuff, index_names[i] );
-			if ( stat( hc->tmpbuff, &hc->sb ) >= 0 )
+			if ( pcache_stat( hc->tmpbuff, &hc->sb ) >= 0 )
 				goto got_one;
 			}
 
@@ -3702,7 +5126,7 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 		/* Got an index file.  Expand symlinks again.
 		*/
 		free(hc->realfilename);
-		hc->realfilename=realpath(hc->tmpbuff,NULL);
+		hc->realfilename=pcache_realpath(hc->tmpbuff);
 
 		/* If the expanded filename is not null, check that it's still
 		** within the current directory or the alternate directory.
@@ -3766,7 +5190,7 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 	if ( hc->sb.st_mode & S_IXOTH )
 		{	
 		if ( hc->hs->cgi_pattern != (char*) 0 
-		&& match( hc->hs->cgi_pattern, hc->realfilename ) )
+		&& match_exec( hc->hs->cgi_match, hc->realfilename, (int*) 0, 0 ) > 0 )
 		    return launch_process(cgi_child, hc, METHOD_HEAD | METHOD_GET | METHOD_POST, "CGI");
 		else
 			{
@@ -3780,6 +5204,22 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 			return -1;
 			}
 		}
+	figure_mime( hc );
+	/* (Detached signatures are made of the file itself.) */
+	if ( ! ( hc->bfield & HC_DETACH_SIGN ) )
+		choose_encoding( hc );
+	/* (As asked for: the signing policy only decides below, when there
+	** is a body to sign.)
+	*/
+	sign = ( ( hc->bfield & HC_DETACH_SIGN ) != 0 );
+	make_etag( hc, sign );
+	if ( hc->if_match[0] != '\0' && ! etag_match( hc, hc->if_match, 1 ) )
+		{
+		httpd_send_err(
+			hc, 412, err412title, "", err412form, hc->encodedurl );
+		return -1;
+		}
+
 	/* Fill in last_byte_index and first_byte_index,, if necessary. */
 	if (hc->bfield & HC_GOT_RANGE) {
 		if ( hc->first_byte_index < 0 ) {
@@ -3787,17 +5227,48 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 			hc->last_byte_index = hc->sb.st_size - 1;
 		} else if ( hc->last_byte_index == -1 || hc->last_byte_index >= hc->sb.st_size )
 			hc->last_byte_index = hc->sb.st_size - 1;
+		/* (Starting past the end, it misses the file, as several may.) */
+		if ( hc->first_byte_index >= hc->sb.st_size && hc->method == METHOD_GET && range_applies( hc ) )
+			unsatisfiable = 1;
+	}
+	/* Several ranges make a multipart/byteranges response, sent from the
+	** event loop like a plain file.  (Not to HEADs, nor signed.)
+	*/
+	else if ( hc->bytesranges[0] != '\0' && hc->method == METHOD_GET &&
+			  ! ( hc->bfield & HC_DETACH_SIGN ) && range_applies( hc ) ) {
+		int n = parse_ranges( hc );
+		if ( n == 0 )
+			unsatisfiable = 1;
+		else if ( n == 1 ) {
+			hc->bfield |= HC_GOT_RANGE;
+			hc->first_byte_index = hc->ranges[0].first;
+			hc->last_byte_index = hc->ranges[0].last;
+		} else if ( n > 1 )
+			make_parts( hc, n );
 	}
 
-	figure_mime( hc );
+	if ( not_modified( hc ) )
+		{
+		send_mime(
+			hc, 304, err304title, hc->encodings, "", hc->type, (off_t) -1,
+			hc->sb.st_mtime );
+		}
+	else if ( unsatisfiable ) {
+		/* None of the ranges is within the file (RFC 7233, 4.4), which
+		** only matters once the validators did (RFC 7232, 6).
+		*/
+		char range[100];
 
-	if ( hc->method == METHOD_HEAD ) {
+		(void) snprintf( range, sizeof(range), "Content-Range: bytes */%lld\015\012", (long long) hc->sb.st_size );
+		httpd_send_err( hc, 416, err416title, range, err416form, hc->encodedurl );
+		return -1;
+	}
+	else if ( hc->method == METHOD_HEAD ) {
 		if ( (hc->bfield & HC_GOT_RANGE) &&
 			 ( hc->last_byte_index >= hc->first_byte_index ) &&
 			 ( ( hc->last_byte_index != hc->sb.st_size - 1 ) ||
 			   ( hc->first_byte_index > 0 ) ) &&
-			 ( hc->range_if == (time_t) -1 ||
-			   hc->range_if == hc->sb.st_mtime ) )
+			 range_applies( hc ) )
 		{
 			send_mime(hc, 206, ok206title, hc->encodings, "", hc->type, hc->sb.st_size,hc->sb.st_mtime );
 		}
@@ -3805,21 +5276,121 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 			send_mime(hc, 200, ok200title, hc->encodings, "", hc->type, hc->sb.st_size,hc->sb.st_mtime );
 		}
 	}
-	else if ( hc->if_modified_since != (time_t) -1 &&
-		 hc->if_modified_since >= hc->sb.st_mtime )
-		{
-		send_mime(
-			hc, 304, err304title, hc->encodings, "", hc->type, (off_t) -1,
-			hc->sb.st_mtime );
-		}
 	else {
+		int partial = (hc->bfield & HC_GOT_RANGE) &&
+			 ( hc->last_byte_index >= hc->first_byte_index ) &&
+			 ( ( hc->last_byte_index != hc->sb.st_size - 1 ) ||
+			   ( hc->first_byte_index > 0 ) ) &&
+			 range_applies( hc );
+		int variant = -1;
+		size_t headidx;
+		char* sig = (char*) 0;
+		size_t siglen;
+#ifdef USE_MERKLE
+		char* tree = (char*) 0;
+		struct stat treesb;
+		char* proof = (char*) 0;
+		size_t prooflen;
+		const char* rootsig;
+		size_t rootsiglen;
+#endif /* USE_MERKLE */
+
+		/* Not signed when signing is busy, maybe unless the signature is
+		** cached.
+		*/
+		if ( sign ) {
+			sign = sign_policy( hc );
+			if ( sign < 0 )
+				return -1;
+			if ( ! sign )
+				make_etag( hc, 0 );
+		}
+
+		/* Whole small files may already have their response cached. */
+		if ( ! sign && ! partial && hc->nranges == 0 && hc->method == METHOD_GET &&
+			 hc->sb.st_size <= RESPONSE_CACHE_MAX_FILE ) {
+			variant = response_variant( hc );
+			if ( variant >= 0 ) {
+				size_t len;
+				char* buf = rcache_get(
+					&(hc->sb), variant, hc->type, hc->encodings,
+					nowP != (struct timeval*) 0 ? nowP->tv_sec : time( (time_t*) 0 ), &len );
+				if ( buf != (char*) 0 ) {
+#ifdef USE_COMPRESSION
+					/* (The compressed file is in the response already.) */
+					if ( hc->bfield & HC_ZCACHED ) {
+						zcache_release( hc->file_address );
+						hc->bfield &= ~HC_ZCACHED;
+					}
+#endif /* USE_COMPRESSION */
+					hc->file_address = buf;
+					hc->bfield |= HC_RCACHED;
+					hc->bfield &= ~HC_GOT_RANGE;
+					hc->status = 200;
+					hc->bytes_to_send = hc->sb.st_size;
+					make_log_entry( hc, 0, 200 );
+					hc->bfield |= HC_LOG_DONE;
+					/* From here, the headers are part of what is sent. */
+					hc->bytes_to_send = len;
+					return 0;
+				}
+			}
+		}
+
+		if ( hc->file_address != (char*) 0 ) {
+			/* Compressed already, see compress_file(). */
+		}
+#ifdef USE_SENDFILE
+		/* Big files go straight from the page cache to the socket, but the
+		** signing interposer needs the data in a pipe: keep mmc for it. */
+		else if ( ! sign && hc->sb.st_size >= SENDFILE_MIN_SIZE ) {
+			hc->file_fd = open( hc->realfilename, O_RDONLY );
+			if ( hc->file_fd < 0 ) {
+				httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
+				return -1;
+			}
+			(void) fcntl( hc->file_fd, F_SETFD, FD_CLOEXEC );
+		}
+#endif /* USE_SENDFILE */
+		else
+		{
 		hc->file_address = mmc_map( hc->realfilename, &(hc->sb), nowP );
 		if ( hc->file_address == (char*) 0 ) {
 			httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
 			return -1;
 		}
-		/* (Won't sign If To much forks are already running )*/
-		if (hc->bfield & HC_DETACH_SIGN && ( hc->hs->cgi_limit <= 0 || hc->hs->cgi_count < hc->hs->cgi_limit ) ) {
+		}
+#ifdef USE_MERKLE
+		/* A range of whole chunks of a big file goes with their proof, once
+		** the tree of the file is made.
+		*/
+		if ( sign && partial && hc->sb.st_size >= MERKLE_MIN_FILE &&
+			 merkle_range( hc, &tree, &treesb, &proof, &prooflen, &rootsig, &rootsiglen, nowP ) == 0 )
+			sign = 0;
+#endif /* USE_MERKLE */
+#ifdef SIG_CACHEDIR
+		/* A signature already in the index needs neither the pool nor an
+		** interposer: it is framed below, behind the headers.
+		*/
+		if ( sign &&
+#ifndef WHOLE_FILE_RANGE_SIG
+			 ! partial &&
+#endif /* ! WHOLE_FILE_RANGE_SIG */
+			 ( sig = sigindex_get( hc->realfilename, &(hc->sb), &siglen ) ) != (char*) 0 )
+			{
+			sign = 0;
+#ifdef USE_MERKLE
+			tree_later( hc );
+#endif /* USE_MERKLE */
+			}
+#endif /* SIG_CACHEDIR */
+#ifdef USE_SIGN_POOL
+		/* The signing pool signs it while the main loop goes on. */
+		if ( sign && signpool_pending() >= 0 )
+			hc->bfield |= HC_SIGN_PENDING;
+		else
+#endif /* USE_SIGN_POOL */
+		if ( sign ) {
 			int ipid,p[2];
 
 			if ( pipe( p ) < 0 ) {
@@ -3839,7 +5410,9 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 				httpd_parse_resp(&args);
 				exit( 0 );
 			}
-			/* Parent process. */
+			/* Parent process.  The responses to earlier pipelined requests
+			** are the child's to send: only the signed one goes in the pipe. */
+			hc->responselen = 0;
 			close(p[0]);
 			drop_child("parse_resp",ipid,hc);
 			/* overwrite hc->conn_fd by the pipe output */
@@ -3853,23 +5426,55 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 			httpd_set_ndelay(hc->conn_fd);
 		}
 
-		if ( (hc->bfield & HC_GOT_RANGE) &&
-			 ( hc->last_byte_index >= hc->first_byte_index ) &&
-			 ( ( hc->last_byte_index != hc->sb.st_size - 1 ) ||
-			   ( hc->first_byte_index > 0 ) ) &&
-			 ( hc->range_if == (time_t) -1 ||
-			   hc->range_if == hc->sb.st_mtime ) )
+		if ( hc->nranges > 0 )
+		{
+			char type[100];
+			(void) snprintf( type, sizeof(type), "multipart/byteranges; boundary=%s", hc->boundary );
+			send_mime(hc, 206, ok206title, hc->encodings, "", type, multipart_length( hc ), hc->sb.st_mtime );
+		}
+		else if ( partial )
 		{
 			send_mime(hc, 206, ok206title, hc->encodings, "", hc->type, hc->sb.st_size,hc->sb.st_mtime );
 		}
 		else {
+			headidx = hc->responselen;
 			send_mime(hc, 200, ok200title, hc->encodings, "", hc->type, hc->sb.st_size,hc->sb.st_mtime );
 			hc->bfield &= ~HC_GOT_RANGE;
+			if ( variant >= 0 && hc->file_address != (char*) 0 )
+				rcache_put(
+					&(hc->sb), variant, hc->type, hc->encodings,
+					&(hc->response[headidx]), hc->responselen - headidx,
+					hc->file_address );
 		}
+#ifdef USE_MERKLE
+		if ( proof != (char*) 0 )
+			{
+			frame_signed( hc, GPG_ERR_NO_ERROR, rootsig, rootsiglen, proof, prooflen );
+			free( (void*) proof );
+			mmc_unmap( tree, &treesb, nowP );
+			}
+		else
+#endif /* USE_MERKLE */
+		if ( sig != (char*) 0 )
+			frame_signed( hc, GPG_ERR_NO_ERROR, sig, siglen, (char*) 0, 0 );
 	}
 	return 0;
 }
 
+/* Which of the variants of a response the response cache keeps hc wants,
+** or -1 if its headers can't come from the cache.
+*/
+static int
+response_variant( httpd_conn* hc )
+	{
+	if ( strcmp( hc->protocol, "HTTP/1.0" ) != 0 &&
+		 strcmp( hc->protocol, "HTTP/1.1" ) != 0 )
+		return -1;
+	return ( hc->protocol[7] - '0' ) << 2 | ( ( hc->bfield & HC_VARY_ENCODING ) != 0 ) << 1 |
+		( ( hc->bfield & HC_KEEP_ALIVE ) != 0 );
+	}
+
+
 static void make_log_entry(const httpd_conn* hc, time_t now, int status) {
 	char* ru;
 	char* rfc1413;
@@ -63,6 +63,8 @@ typedef struct {
 	char* cgi_pattern;
 	struct sockaddr * fastcgi_saddr ;
 	char* sig_pattern;
+	struct MatchSetStruct* cgi_match;	/* compiled cgi_pattern */
+	struct MatchSetStruct* sig_match;	/* compiled sig_pattern */
 	int cgi_limit, cgi_count;
 	char* cwd;
 	int listen_fds[5];
@@ -74,8 +76,18 @@ typedef struct {
 #define HS_NO_LOG (1<<2)
 #define HS_PKS_ADD_MERGE_ONLY (1<<3)
 #define HS_VIRTUAL_HOST (1<<4)
+#define HS_REUSEPORT (1<<5)	/* listen sockets are shared with other processes (SO_REUSEPORT) */
 
 #define BOUNDARYLEN 9
+#define ETAGLEN 96
+/* A part of a multipart/byteranges response: its headers, at headidx in
+** partsbuf, then the bytes first to last of the file.
+*/
+typedef struct {
+	off_t first, last;
+	size_t headidx, headlen;
+	} httpd_range;
+
 /* A connection. */
 typedef struct {
 	int initialized;
@@ -85,6 +97,8 @@ typedef struct {
 	char* read_buf;
 	size_t read_size, read_idx, checked_idx;
 	int checked_state;
+	size_t line_ends[MAX_REQUEST_LINES];	/* where each line of the request ends, found by httpd_got_request() */
+	int nlines;
 	int method;
 	int status;
 	off_t bytes_to_send;
@@ -100,6 +114,8 @@ typedef struct {
 	char* useragent;
 	char* accept;
 	char* accepte; /* Accept-Encoding header */
+	char* acceptbuf;	/* where repeated Accept: headers are joined */
+	char* acceptebuf;
 	char* acceptl; /* Accept-Language header */
 	char* cookie;
 	char* contenttype;
@@ -112,26 +128,86 @@ typedef struct {
 	char* response;
 	char* tmpbuff; /* used to prepare string as parsing and starting request is now multithread, it replace some previous static buff */
 	size_t maxdecodedurl, maxorigfilename, maxencodings,
-		maxtmpbuff, maxquery, maxaccept, maxaccepte, maxreqhost, maxhostdir,
+		maxtmpbuff, maxquery, maxacceptbuf, maxacceptebuf, maxreqhost, maxhostdir,
 		maxremoteuser, maxresponse;
 	size_t responselen;
+	size_t heldlen;		/* the start of response which answers earlier pipelined requests */
 	time_t if_modified_since, range_if;
+	char* if_none_match;
+	char* if_match;
+	char* range_if_etag;	/* If-Range with an entity-tag instead of a date */
 	ssize_t contentlength; /* maybe use off_t to be able to make bigger POST on 32-bits archs ? */
 	char* type;				/* not malloc()ed */
 	int http_version;   /* default: 10 for HTTP/1.0, 11 means HTTP/1.1 or better */ 
 	char * bytesranges;  /* used to manage multi-range */ 
 	off_t first_byte_index, last_byte_index;
+	httpd_range ranges[MAX_BYTE_RANGES+1];	/* the parts, then the closing delimiter */
+	int nranges;		/* >0 for a multipart/byteranges response */
+	char* partsbuf;
+	size_t maxpartsbuf;
 	struct stat sb;
 	int conn_fd;
 	char* file_address;
+	int file_fd;			/* instead of file_address, for sendfile() */
 	char boundary[BOUNDARYLEN+1];
+	char etag[ETAGLEN];		/* "" for responses which have none */
+	struct SignJobStruct* signjob;	/* being signed by the signing pool */
 	} httpd_conn;
 
+/* The sub-second part of a file's modification time, where stat() has it. */
+#ifdef HAVE_ST_MTIM
+#define ST_MTIME_NSEC(sb) ( (sb).st_mtim.tv_nsec )
+#else
+#define ST_MTIME_NSEC(sb) 0L
+#endif
+
+#if defined(HAVE_SYS_SENDFILE_H) && defined(SENDFILE_MIN_SIZE)
+#define USE_SENDFILE
+#endif
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ) && defined(COMPRESS_MAX_FILE)
+#define USE_COMPRESSION
+#endif
+
+#if defined(SIGN_WORKERS) && SIGN_WORKERS > 0
+#define USE_SIGN_POOL
+#endif
+
+#ifdef SIG_CACHEDIR
+/* The signature cache, from the data directory. */
+#define SIG_CACHE_DIR "../"SIG_CACHEDIR
+#endif
+
+#if defined(USE_SIGN_POOL) && defined(SIG_CACHEDIR) && defined(PRESIGN_JOBS) && PRESIGN_JOBS > 0
+#define USE_PRESIGN
+#endif
+
+#if defined(USE_SIGN_POOL) && defined(SIG_CACHEDIR) && defined(MERKLE_CACHEDIR) && defined(HAVE_GCRYPT_H) && defined(HAVE_LIBGCRYPT)
+#define USE_MERKLE
+/* The Merkle tree cache, from the data directory. */
+#define MERKLE_CACHE_DIR "../"MERKLE_CACHEDIR
+#endif
+
+#if defined(USE_SIGN_POOL) && defined(SIG_CACHEDIR) && defined(DIRSIG_CACHEDIR) && defined(HAVE_GCRYPT_H) && defined(HAVE_LIBGCRYPT)
+#define USE_DIRSIG
+/* The directory manifest cache, from the data directory. */
+#define DIRSIG_CACHE_DIR "../"DIRSIG_CACHEDIR
+#endif
+
+#if defined(HAVE_GCRYPT_H) && defined(HAVE_LIBGCRYPT) && defined(NATIVE_SIGN)
+#define USE_NATIVE_SIGN
+#endif
+
 #define HC_GOT_RANGE (1<<1)  /* if match "d-d" or "d-" , which is only supported (except when asked multipart/msigned on a local file) */
-#define HC_KEEP_ALIVE (1<<2)
+#define HC_KEEP_ALIVE (1<<2)  /* set before httpd_parse_request() to allow a persistent connection, kept set if granted */
 #define HC_SHOULD_LINGER (1<<3)
 #define HC_DETACH_SIGN (1<<4)
 #define HC_LOG_DONE (1<<5)
+#define HC_RCACHED (1<<6)  /* file_address is a whole response from the response cache, not a map */
+#define HC_VARY_ENCODING (1<<7)  /* the response depends on Accept-Encoding (precompressed siblings or compression) */
+#define HC_ZCACHED (1<<8)  /* file_address is the compressed file, from the compressed output cache */
+#define HC_SIGN_PENDING (1<<9)  /* the response waits for its signature from the signing pool */
+#define HC_DIR_MANIFEST (1<<10)  /* the response is the signed manifest of the directory realfilename */
 
 /* Useless macros. BTW: if u really think it improves readability, u may use them */
 #define HX_SET(hx,mask) { (hx)->bfield |= (mask); }
@@ -196,6 +272,11 @@ void httpd_terminate( httpd_server* hs );
 /* Call to unlisten/close socket(s) listening for new connections. */
 void httpd_unlisten( httpd_server* hs );
 
+/* Call in a forked process to get listen socket(s) of its own (cf.
+** HS_REUSEPORT).  Returns the number of sockets, or -1 on error.
+*/
+int httpd_relisten( httpd_server* hs );
+
 /* When a listen fd is ready to read, call this.  It does the accept() and
 ** returns an httpd_conn* which includes the fd to read the request from and
 ** write the response to.  Returns an indication of whether the accept()
@@ -240,10 +321,57 @@ void send_mime( httpd_conn* hc, int status, char* title, char* encodings, char*
 ** descriptor for the file to send.  If you don't have a current timeval
 ** handy just pass in 0.
 **
+** If the file has to be signed by the signing pool, HC_SIGN_PENDING is set:
+** hand it with httpd_sign_submit(), and wait for the job to come back.  (A
+** signature found in the signature index is framed in the response at once.)
+** So is it for the manifest of a directory (HC_DIR_MANIFEST), when the
+** cached one is stale: the response is then only made once it is done.
+**
 ** Returns -1 on error.
 */
 int httpd_start_request( httpd_conn* hc, struct timeval* nowP );
 
+#ifdef USE_SIGN_POOL
+/* Queues the signing job of an HC_SIGN_PENDING connection, client_data being
+** what the job will come back with.  If the whole file is being signed
+** already, the connection waits for that job instead, as one of its
+** waiters.  Returns -1 on error.
+*/
+int httpd_sign_submit( httpd_conn* hc, void* client_data );
+
+/* Turns the response of hc into its multipart/msigned form, with the
+** signature of its finished job (or of the job it waited for).
+*/
+void httpd_signed( httpd_conn* hc, struct SignJobStruct* job );
+
+/* Frees a finished job, with its waiters. */
+void httpd_sign_release( struct SignJobStruct* job );
+
+/* Forgets the signing job of hc, if any; it is freed once finished. */
+void httpd_sign_cancel( httpd_conn* hc );
+
+#ifdef USE_PRESIGN
+/* Queues the low priority signing job of filename, its signature to be
+** cached.  The job comes back without client data.  Returns -1 on error,
+** or if the file is being signed already.
+*/
+int httpd_presign( char* filename, struct stat* sbP );
+
+#ifdef USE_DIRSIG
+/* Same for the manifest of the directory dirname: made again from the
+** cached one, which it then replaces (or only touches, if nothing changed).
+*/
+int httpd_presign_dir( char* dirname, struct stat* sbP );
+#endif /* USE_DIRSIG */
+#endif /* USE_PRESIGN */
+#endif /* USE_SIGN_POOL */
+
+/* Like mkdir -p of the directory part of path.  Returns -1 on error. */
+int httpd_mk_path( const char* path );
+
+/* Appends len bytes to the buffered response text. */
+void httpd_add_response( httpd_conn* hc, const char* buf, size_t len );
+
 /* Actually sends any buffered response text. */
 void httpd_write_response( httpd_conn* hc );
 
@@ -254,6 +382,11 @@ void httpd_write_response( httpd_conn* hc );
 */
 void httpd_close_conn( httpd_conn* hc, struct timeval* nowP );
 
+/* Call this instead, once a response is complete on a persistent
+** (HC_KEEP_ALIVE) connection, to get ready for the next request on it.
+*/
+void httpd_reset_conn( httpd_conn* hc, struct timeval* nowP );
+
 /* Call this to de-initialize a connection struct and *really* free the
 ** mallocced strings.
 */
@@ -281,8 +414,11 @@ extern char* err302title;
 extern char* err302form;
 extern char* err304title;
 extern char* err411title;
+extern char* err412title;
 extern char* err413title;
 extern char* err415title;
+extern char* err416title;
+extern char* err416form;
 
 
 #ifdef AUTH_FILE
@@ -309,6 +445,11 @@ char* httpd_method_str( int method );
 /* Reallocate a string. */
 void httpd_realloc_str( char** strP, size_t* maxsizeP, size_t size );
 
+/* Returns the quality (0 to 1000) an Accept-Encoding header gives to a
+** coding, either by name (or its "x-" alias) or through "*".
+*/
+int httpd_accept_q( const char* accepte, const char* coding );
+
 /* Format a network socket to a string representation. */
 char * get_ip_str(const struct sockaddr * sa);
 
@@ -29,11 +29,57 @@
 */
 
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "match.h"
 
+/* A compiled set of patterns is a lazily built DFA.  Its NFA is the
+** sequence of tokens of every alternative of every pattern, each NFA state
+** being a position in those tokens: "the tokens before it have matched".
+** A DFA state is a set of such positions, and its transitions get computed
+** the first time a string needs them.
+*/
+#define TK_CHAR 0		/* a given character */
+#define TK_ANY 1		/* ? */
+#define TK_STAR 2		/* *, anything but slashes */
+#define TK_DSTAR 3		/* **, anything */
+#define TK_END 4		/* end of an alternative: the string matches */
+
+/* Beyond that many DFA states, match() takes over. */
+#define MAX_STATES 1000
+
+typedef struct {
+	int type;
+	int c;
+	int id;			/* index of the pattern */
+	} Token;
+
+typedef struct {
+	int* pos;		/* sorted positions */
+	int npos;
+	int* ids;		/* patterns matched if the string ends here */
+	int nids;
+	unsigned int hash;
+	int next[256];	/* -1 until computed */
+	} State;
+
+struct MatchSetStruct {
+	char** patterns;
+	int npatterns;
+	Token* tokens;
+	int ntokens;
+	State** states;
+	int nstates;
+	int* set;		/* scratch position set */
+	int nset;
+	char* inset;		/* scratch membership of set */
+	};
+
 static int match_one( const char* pattern, int patternlen, const char* string );
+static void set_add( MatchSet* ms, int pos );
+static int state_get( MatchSet* ms );
+static int int_cmp( const void* a, const void* b );
 
 int
 match( const char* pattern, const char* string )
@@ -87,3 +133,259 @@ match_one( const char* pattern, int patternlen, const char* string )
 		return 1;
 	return 0;
 	}
+
+
+MatchSet*
+match_compile( char** patterns, int npatterns )
+	{
+	MatchSet* ms;
+	const char* p;
+	int i, n;
+
+	ms = (MatchSet*) calloc( 1, sizeof(MatchSet) );
+	if ( ms == (MatchSet*) 0 )
+		return (MatchSet*) 0;
+	ms->npatterns = npatterns;
+	ms->patterns = (char**) calloc( npatterns + 1, sizeof(char*) );
+	if ( ms->patterns == (char**) 0 )
+		{
+		match_free( ms );
+		return (MatchSet*) 0;
+		}
+
+	/* Count the tokens: at most one per character, plus the ends. */
+	n = 0;
+	for ( i = 0; i < npatterns; ++i )
+		{
+		ms->patterns[i] = strdup( patterns[i] );
+		if ( ms->patterns[i] == (char*) 0 )
+			{
+			match_free( ms );
+			return (MatchSet*) 0;
+			}
+		n += strlen( patterns[i] ) + 1;
+		}
+	ms->tokens = (Token*) malloc( ( n + 1 ) * sizeof(Token) );
+	ms->set = (int*) malloc( ( n + 1 ) * sizeof(int) );
+	ms->inset = (char*) calloc( n + 1, 1 );
+	ms->states = (State**) malloc( MAX_STATES * sizeof(State*) );
+	if ( ms->tokens == (Token*) 0 || ms->set == (int*) 0 ||
+		 ms->inset == (char*) 0 || ms->states == (State**) 0 )
+		{
+		match_free( ms );
+		return (MatchSet*) 0;
+		}
+
+	/* Tokenize, same rules as match_one(). */
+	for ( i = 0; i < npatterns; ++i )
+		for ( p = patterns[i]; ; ++p )
+			{
+			Token* t = &ms->tokens[ms->ntokens++];
+			t->id = i;
+			t->c = 0;
+			if ( *p == '\0' || *p == '|' )
+				t->type = TK_END;
+			else if ( *p == '?' )
+				t->type = TK_ANY;
+			else if ( *p == '*' && p[1] == '*' )
+				{
+				t->type = TK_DSTAR;
+				++p;
+				}
+			else if ( *p == '*' )
+				t->type = TK_STAR;
+			else
+				{
+				t->type = TK_CHAR;
+				t->c = (unsigned char) *p;
+				}
+			if ( *p == '\0' )
+				break;
+			}
+
+	/* The start state: the first position of every alternative. */
+	ms->nset = 0;
+	for ( i = 0; i < ms->ntokens; ++i )
+		if ( i == 0 || ms->tokens[i - 1].type == TK_END )
+			set_add( ms, i );
+	if ( state_get( ms ) < 0 )
+		{
+		match_free( ms );
+		return (MatchSet*) 0;
+		}
+	return ms;
+	}
+
+
+int
+match_exec( MatchSet* ms, const char* string, int* ids, int maxids )
+	{
+	const char* s;
+	State* st;
+	int cur, next, i;
+
+	if ( ms == (MatchSet*) 0 )
+		return 0;
+	cur = 0;
+	for ( s = string; *s != '\0' && ms->states[cur]->npos > 0; ++s )
+		{
+		st = ms->states[cur];
+		next = st->next[(unsigned char) *s];
+		if ( next < 0 )
+			{
+			/* Compute the transition: step every position over *s. */
+			ms->nset = 0;
+			for ( i = 0; i < st->npos; ++i )
+				{
+				Token* t = &ms->tokens[st->pos[i]];
+				switch ( t->type )
+					{
+					case TK_CHAR:
+					if ( t->c == (unsigned char) *s )
+						set_add( ms, st->pos[i] + 1 );
+					break;
+					case TK_ANY:
+					set_add( ms, st->pos[i] + 1 );
+					break;
+					case TK_STAR:
+					if ( *s != '/' )
+						set_add( ms, st->pos[i] );
+					break;
+					case TK_DSTAR:
+					set_add( ms, st->pos[i] );
+					break;
+					}
+				}
+			next = state_get( ms );
+			if ( next < 0 )
+				{
+				/* No room for more states, interpret the patterns. */
+				int n = 0;
+				for ( i = 0; i < ms->npatterns; ++i )
+					if ( match( ms->patterns[i], string ) )
+						{
+						if ( n < maxids )
+							ids[n] = i;
+						++n;
+						}
+				return n;
+				}
+			st->next[(unsigned char) *s] = next;
+			}
+		cur = next;
+		}
+
+	st = ms->states[cur];
+	if ( *s != '\0' )
+		return 0;		/* dead state */
+	for ( i = 0; i < st->nids && i < maxids; ++i )
+		ids[i] = st->ids[i];
+	return st->nids;
+	}
+
+
+void
+match_free( MatchSet* ms )
+	{
+	int i;
+
+	if ( ms == (MatchSet*) 0 )
+		return;
+	if ( ms->patterns != (char**) 0 )
+		for ( i = 0; i < ms->npatterns; ++i )
+			free( (void*) ms->patterns[i] );
+	free( (void*) ms->patterns );
+	for ( i = 0; i < ms->nstates; ++i )
+		{
+		free( (void*) ms->states[i]->pos );
+		free( (void*) ms->states[i] );
+		}
+	free( (void*) ms->states );
+	free( (void*) ms->tokens );
+	free( (void*) ms->set );
+	free( (void*) ms->inset );
+	free( (void*) ms );
+	}
+
+
+/* Add a position to the scratch set, with the ones reachable from it
+** without consuming anything (a star may match nothing).
+*/
+static void
+set_add( MatchSet* ms, int pos )
+	{
+	for (;;)
+		{
+		if ( ms->inset[pos] )
+			return;
+		ms->inset[pos] = 1;
+		ms->set[ms->nset++] = pos;
+		if ( ms->tokens[pos].type != TK_STAR && ms->tokens[pos].type != TK_DSTAR )
+			return;
+		++pos;
+		}
+	}
+
+
+/* Find or make the DFA state of the scratch set, and empty it.
+** Returns the state index, or -1 if there is no room for it.
+*/
+static int
+state_get( MatchSet* ms )
+	{
+	State* st;
+	unsigned int hash;
+	int i, n;
+
+	for ( i = 0; i < ms->nset; ++i )
+		ms->inset[ms->set[i]] = 0;
+	qsort( ms->set, ms->nset, sizeof(int), int_cmp );
+	hash = ms->nset;
+	for ( i = 0; i < ms->nset; ++i )
+		hash = hash * 31 + ms->set[i];
+
+	for ( i = 0; i < ms->nstates; ++i )
+		{
+		st = ms->states[i];
+		if ( st->hash == hash && st->npos == ms->nset &&
+			 memcmp( st->pos, ms->set, ms->nset * sizeof(int) ) == 0 )
+			return i;
+		}
+
+	if ( ms->nstates >= MAX_STATES )
+		return -1;
+	st = (State*) malloc( sizeof(State) );
+	if ( st == (State*) 0 )
+		return -1;
+	/* One allocation for the positions and the matched ids. */
+	st->pos = (int*) malloc( ( 2 * ms->nset + 1 ) * sizeof(int) );
+	if ( st->pos == (int*) 0 )
+		{
+		free( (void*) st );
+		return -1;
+		}
+	(void) memcpy( st->pos, ms->set, ms->nset * sizeof(int) );
+	st->npos = ms->nset;
+	st->ids = &st->pos[ms->nset];
+	st->nids = 0;
+	/* Positions are sorted, so are the ids of their patterns. */
+	for ( i = 0; i < ms->nset; ++i )
+		{
+		n = ms->tokens[ms->set[i]].id;
+		if ( ms->tokens[ms->set[i]].type == TK_END &&
+			 ( st->nids == 0 || st->ids[st->nids - 1] != n ) )
+			st->ids[st->nids++] = n;
+		}
+	st->hash = hash;
+	for ( i = 0; i < 256; ++i )
+		st->next[i] = -1;
+	ms->states[ms->nstates] = st;
+	return ms->nstates++;
+	}
+
+
+static int
+int_cmp( const void* a, const void* b )
+	{
+	return *(const int*) a - *(const int*) b;
+	}
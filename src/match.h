@@ -33,4 +33,22 @@
 */
 int match( const char* pattern, const char* string );
 
+/* A set of patterns compiled to be tested all at once, in a single pass
+** over the string.
+*/
+typedef struct MatchSetStruct MatchSet;
+
+/* Compile a set of patterns (same syntax as match()).  Returns
+** (MatchSet*) 0 on errors.
+*/
+MatchSet* match_compile( char** patterns, int npatterns );
+
+/* Returns how many patterns of the set match the string, and puts the
+** indexes of the first maxids of them, in increasing order, in ids.
+*/
+int match_exec( MatchSet* ms, const char* string, int* ids, int maxids );
+
+/* Free a compiled set of patterns. */
+void match_free( MatchSet* ms );
+
 #endif /* _MATCH_H_ */
@@ -0,0 +1,287 @@
+/* merkle.c - Merkle trees of big signed files, and proofs of their chunks
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The nodes are written in hex, one fixed length line each, so that the
+* proof of a range reads the few it needs straight from the mapped tree
+* file.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+
+#include "libhttpd.h"
+#include "merkle.h"
+
+#ifdef USE_MERKLE
+
+#include <gcrypt.h>
+
+
+/* Defines. */
+#define HASH_LEN 32
+#define LINE_LEN ( 2 * HASH_LEN + 1 )	/* hex and '\n' */
+#define MANIFEST_MAX 200
+#define IDENT_MAX 100
+#define NODE_LINE_MAX ( 40 + 2 * HASH_LEN )
+
+
+/* Globals. */
+static int ready = 0;
+static const char hex[] = "0123456789abcdef";
+
+
+/* Forwards. */
+static off_t count_nodes( off_t nleaves );
+static size_t put_ident( char* buf, const struct stat* sbP );
+static size_t put_manifest( char* buf, size_t chunk, off_t len, const char* root );
+static void put_hex( char* line, const unsigned char* hash );
+
+
+int
+merkle_init( const char* dir )
+	{
+	struct stat sb;
+
+	if ( gcry_check_version( (char*) 0 ) == (char*) 0 )
+		return -1;
+	if ( ! gcry_control( GCRYCTL_INITIALIZATION_FINISHED_P ) )
+		{
+		(void) gcry_control( GCRYCTL_DISABLE_SECMEM, 0 );
+		(void) gcry_control( GCRYCTL_INITIALIZATION_FINISHED, 0 );
+		}
+	if ( stat( dir, &sb ) < 0 || ! S_ISDIR( sb.st_mode ) )
+		{
+		syslog( LOG_WARNING, "no Merkle tree cache dir %.80s - big files will only be signed whole", dir );
+		return -1;
+		}
+	ready = 1;
+	return 0;
+	}
+
+
+int
+merkle_ready( void )
+	{
+	return ready;
+	}
+
+
+char*
+merkle_tree( const char* data, const struct stat* sbP, size_t chunk, size_t* lenP, size_t* manifestP )
+	{
+	gcry_md_hd_t md;
+	unsigned char* level;
+	unsigned char* h;
+	char* buf;
+	char* line;
+	off_t len = sbP->st_size, csize = chunk, nleaves, nodes, count, i;
+	unsigned char prefix;
+
+	nleaves = ( len + csize - 1 ) / csize;
+	if ( nleaves == 0 )
+		nleaves = 1;
+	nodes = count_nodes( nleaves );
+	buf = (char*) malloc( IDENT_MAX + nodes * LINE_LEN + MANIFEST_MAX );
+	level = (unsigned char*) malloc( nleaves * HASH_LEN );
+	if ( buf == (char*) 0 || level == (unsigned char*) 0 ||
+		 gcry_md_open( &md, GCRY_MD_SHA256, 0 ) != 0 )
+		{
+		free( (void*) buf );
+		free( (void*) level );
+		return (char*) 0;
+		}
+
+	/* The leaves, after what the file was when they were made. */
+	line = buf + put_ident( buf, sbP );
+	prefix = 0x00;
+	for ( i = 0; i < nleaves; ++i )
+		{
+		gcry_md_reset( md );
+		gcry_md_write( md, &prefix, 1 );
+		gcry_md_write( md, &data[i * csize], ( len - i * csize < csize ? len - i * csize : csize ) );
+		(void) memcpy( &level[i * HASH_LEN], gcry_md_read( md, GCRY_MD_SHA256 ), HASH_LEN );
+		put_hex( line, &level[i * HASH_LEN] );
+		line += LINE_LEN;
+		}
+
+	/* Then each level, computed in place over the one below. */
+	prefix = 0x01;
+	for ( count = nleaves; count > 1; count = ( count + 1 ) / 2 )
+		for ( i = 0; i < ( count + 1 ) / 2; ++i )
+			{
+			h = &level[2 * i * HASH_LEN];
+			if ( 2 * i + 1 < count )
+				{
+				gcry_md_reset( md );
+				gcry_md_write( md, &prefix, 1 );
+				gcry_md_write( md, h, 2 * HASH_LEN );
+				h = gcry_md_read( md, GCRY_MD_SHA256 );
+				}
+			(void) memmove( &level[i * HASH_LEN], h, HASH_LEN );
+			put_hex( line, &level[i * HASH_LEN] );
+			line += LINE_LEN;
+			}
+	gcry_md_close( md );
+
+	/* (The root is the last line.) */
+	*manifestP = line - buf;
+	*lenP = *manifestP + put_manifest( line, chunk, len, line - LINE_LEN );
+	free( (void*) level );
+	return buf;
+	}
+
+
+int
+merkle_fresh( const char* treefile, const struct stat* sbP )
+	{
+	char ident[IDENT_MAX];
+	char buf[IDENT_MAX];
+	size_t ilen;
+	int fd, r;
+
+	ilen = put_ident( ident, sbP );
+	fd = open( treefile, O_RDONLY );
+	if ( fd < 0 )
+		return 0;
+	r = read( fd, buf, ilen );
+	(void) close( fd );
+	return r == (int) ilen && memcmp( buf, ident, ilen ) == 0;
+	}
+
+
+int
+merkle_proof( const char* tree, size_t treelen, const struct stat* sbP, size_t chunk, off_t first, off_t last, char** proofP, size_t* prooflenP, const char** sigP, size_t* siglenP )
+	{
+	char ident[IDENT_MAX];
+	char manifest[MANIFEST_MAX];
+	const char* root;
+	const char* cp;
+	off_t len = sbP->st_size, csize = chunk, nleaves, offset, count, a, b;
+	size_t ilen, mlen, plen;
+	int lvl;
+	char* proof;
+
+	/* The tree must have been made of the file as it is now. */
+	ilen = put_ident( ident, sbP );
+	if ( treelen < ilen || memcmp( tree, ident, ilen ) != 0 )
+		return -1;
+	tree += ilen;
+	treelen -= ilen;
+
+	if ( first % csize != 0 || ( ( last + 1 ) % csize != 0 && last != len - 1 ) )
+		return -1;
+	nleaves = ( len + csize - 1 ) / csize;
+	if ( nleaves == 0 )
+		nleaves = 1;
+	offset = count_nodes( nleaves ) * LINE_LEN;
+	if ( offset >= treelen )
+		return -1;
+
+	/* The manifest must be the one of this file, and be followed by a
+	** signature.
+	*/
+	root = &tree[offset - LINE_LEN];
+	mlen = put_manifest( manifest, chunk, len, root );
+	if ( offset + mlen + 1 >= treelen || memcmp( &tree[offset], manifest, mlen ) != 0 ||
+		 tree[offset + mlen] != '\n' )
+		return -1;
+	cp = &tree[offset + mlen + 1];
+	if ( treelen - ( cp - tree ) < 10 || strncmp( cp, "-----BEGIN", 10 ) != 0 )
+		return -1;
+	*sigP = cp;
+	*siglenP = treelen - ( cp - tree );
+
+	/* The nodes beside the range, level after level. */
+	proof = (char*) malloc( mlen + 64 * 2 * NODE_LINE_MAX );
+	if ( proof == (char*) 0 )
+		return -1;
+	(void) memcpy( proof, manifest, mlen );
+	plen = mlen;
+	a = first / csize;
+	b = last / csize;
+	offset = 0;
+	for ( lvl = 0, count = nleaves; count > 1; ++lvl, offset += count, count = ( count + 1 ) / 2 )
+		{
+		if ( a & 1 )
+			plen += snprintf( &proof[plen], NODE_LINE_MAX, "Node: %d %lld %.64s\n",
+				lvl, (long long) ( a - 1 ), &tree[( offset + a - 1 ) * LINE_LEN] );
+		if ( ! ( b & 1 ) && b + 1 < count )
+			plen += snprintf( &proof[plen], NODE_LINE_MAX, "Node: %d %lld %.64s\n",
+				lvl, (long long) ( b + 1 ), &tree[( offset + b + 1 ) * LINE_LEN] );
+		a /= 2;
+		b /= 2;
+		}
+	*proofP = proof;
+	*prooflenP = plen;
+	return 0;
+	}
+
+
+/* How many nodes has the tree of nleaves leaves. */
+static off_t
+count_nodes( off_t nleaves )
+	{
+	off_t nodes = nleaves;
+
+	while ( nleaves > 1 )
+		{
+		nleaves = ( nleaves + 1 ) / 2;
+		nodes += nleaves;
+		}
+	return nodes;
+	}
+
+
+/* Writes the first line of the tree file of the file described by sbP in
+** buf (IDENT_MAX bytes).  Returns its length.
+*/
+static size_t
+put_ident( char* buf, const struct stat* sbP )
+	{
+	return snprintf(
+		buf, IDENT_MAX, "%lld %ld.%09ld %llu\n",
+		(long long) sbP->st_size, (long) sbP->st_mtime, (long) ST_MTIME_NSEC( *sbP ),
+		(unsigned long long) sbP->st_ino );
+	}
+
+
+/* Writes the manifest in buf (MANIFEST_MAX bytes), root being the hex line
+** of the root.  Returns its length.
+*/
+static size_t
+put_manifest( char* buf, size_t chunk, off_t len, const char* root )
+	{
+	return snprintf(
+		buf, MANIFEST_MAX, "Merkle-Tree: SHA256\nChunk-Size: %lu\nLength: %lld\nRoot: %.64s\n",
+		(unsigned long) chunk, (long long) len, root );
+	}
+
+
+static void
+put_hex( char* line, const unsigned char* hash )
+	{
+	int i;
+
+	for ( i = 0; i < HASH_LEN; ++i )
+		{
+		line[2 * i] = hex[hash[i] >> 4];
+		line[2 * i + 1] = hex[hash[i] & 0xf];
+		}
+	line[2 * HASH_LEN] = '\n';
+	}
+
+#endif /* USE_MERKLE */
@@ -0,0 +1,64 @@
+/* merkle.h - header file for the Merkle trees of big signed files
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* A big file is cut in chunks of MERKLE_CHUNK_SIZE bytes (the last one may
+* be shorter).  A leaf is the SHA-256 of 0x00 then the chunk; a node is the
+* SHA-256 of 0x01 then its two children, and the last node of a level
+* without a sibling goes up as is.  The manifest, which is what gets signed,
+* is the text:
+*
+*	Merkle-Tree: SHA256
+*	Chunk-Size: <bytes>
+*	Length: <bytes of the file>
+*	Root: <hex>
+*
+* A proof of the chunks first to last is the manifest followed by the
+* "Node: <level> <index> <hex>" lines of the nodes their check needs beside
+* their own leaves, leaves being level 0.
+*
+* The cached tree file starts with the line "<size> <mtime>.<nanoseconds>
+* <inode>" of the file it was made of: a tree is only used while they stay
+* the same.  Then it holds all the nodes, one hex line each, level after
+* level from the leaves, then the manifest, an empty line and the armored
+* signature of the manifest.
+*/
+
+#ifndef _MERKLE_H_
+#define _MERKLE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*! Get libgcrypt ready, and check that the tree cache dir exists.
+ * \return 0, or -1 if no trees will be made.
+ */
+int merkle_init( const char* dir );
+
+/*! Whether merkle_init() succeeded. */
+int merkle_ready( void );
+
+/*! Make the tree of data, the bytes of the file described by sbP, cut in
+ * chunks of chunk bytes.
+ * \return the malloc()ed start of a tree file, up to its manifest (which
+ * starts *manifestP bytes in), its length in *lenP; or (char*) 0.  May be
+ * called from any thread.
+ */
+char* merkle_tree( const char* data, const struct stat* sbP, size_t chunk, size_t* lenP, size_t* manifestP );
+
+/*! Whether the tree file treefile was made of the file described by sbP.
+ * May be called from any thread.
+ */
+int merkle_fresh( const char* treefile, const struct stat* sbP );
+
+/*! Make the proof of the bytes first to last, out of the tree file of the
+ * file described by sbP, cut in chunks of chunk bytes.  The bytes must be
+ * whole chunks (the last one of the file may be shorter).
+ * \return 0, with the malloc()ed proof in *proofP and its length in
+ * *prooflenP, and *sigP pointing at the signature of the manifest in tree;
+ * or -1 if the bytes or the tree file don't fit, or the tree is stale.
+ */
+int merkle_proof( const char* tree, size_t treelen, const struct stat* sbP, size_t chunk, off_t first, off_t last, char** proofP, size_t* prooflenP, const char** sigP, size_t* siglenP );
+
+#endif /* _MERKLE_H_ */
@@ -74,6 +74,10 @@ typedef long long int64_t;
 #ifndef INITIAL_HASH_SIZE
 #define INITIAL_HASH_SIZE (1 << 10)
 #endif
+/* Percentage of DESIRED_MAX_MAPPED_BYTES the protected segment may hold. */
+#ifndef PROTECTED_SHARE
+#define PROTECTED_SHARE 80
+#endif
 
 #ifndef MAX
 #define MAX(a,b) ((a)>(b)?(a):(b))
@@ -91,12 +95,24 @@ typedef struct MapStruct {
 	time_t ctime;
 	int refcount;
 	time_t reftime;
+	long hits;				/* times it was found already mapped */
+	int protected;			/* in the protected segment (hit at least once) */
 	void* addr;
 	unsigned int hash;
 	int hash_idx;
 	struct MapStruct* next;
+	struct MapStruct* prev;
+	struct MapStruct* lru_next;	/* unreferenced maps only */
+	struct MapStruct* lru_prev;
 	} Map;
 
+/* A list of unreferenced maps, least recently used first. */
+typedef struct {
+	Map* head;
+	Map* tail;
+	off_t bytes;
+	} LruList;
+
 
 /* Globals. */
 static Map* maps = (Map*) 0;
@@ -107,14 +123,26 @@ static int hash_size;
 static unsigned int hash_mask;
 static time_t expire_age = DEFAULT_EXPIRE_AGE;
 static off_t mapped_bytes = 0;
+/* Segmented LRU: a map used only once stays in the probation segment, so
+** a burst of one-shot downloads is evicted before the maps which were used
+** again, in the protected segment.
+*/
+static LruList lru_probation = { (Map*) 0, (Map*) 0, 0 };
+static LruList lru_protected = { (Map*) 0, (Map*) 0, 0 };
+static mmc_stats_t stats;
+static mmc_stats_t last_stats;	/* at the last mmc_logstats() */
 
 
 
 /* Forwards. */
 static void panic( void );
-static void really_unmap( Map** mm );
+static void make_room( off_t size );
+static void really_unmap( Map* m );
+static void lru_append( LruList* l, Map* m );
+static void lru_remove( LruList* l, Map* m );
 static int check_hash_size( void );
 static int add_hash( Map* m );
+static void del_hash( Map* m );
 static Map* find_hash( ino_t ino, dev_t dev, off_t size, time_t ctime );
 static unsigned int hash( ino_t ino, dev_t dev, off_t size, time_t ctime );
 
@@ -154,11 +182,22 @@ mmc_map( char* filename, struct stat* sbP, struct timeval* nowP )
 	m = find_hash( sb.st_ino, sb.st_dev, sb.st_size, sb.st_ctime );
 	if ( m != (Map*) 0 )
 		{
-		/* Yep.  Just return the existing map */
+		/* Yep.  Just return the existing map, which is now in use (so not
+		** evictable) and has earned its place in the protected segment.
+		*/
+		if ( m->refcount == 0 )
+			lru_remove( m->protected ? &lru_protected : &lru_probation, m );
+		m->protected = 1;
 		++m->refcount;
+		++m->hits;
 		m->reftime = now;
+		++stats.hits;
 		return m->addr;
 		}
+	++stats.misses;
+
+	/* Make room for it, the least recently used maps first. */
+	make_room( sb.st_size );
 
 	/* Open the file. */
 	fd = open( filename, O_RDONLY );
@@ -194,6 +233,8 @@ mmc_map( char* filename, struct stat* sbP, struct timeval* nowP )
 	m->ctime = sb.st_ctime;
 	m->refcount = 1;
 	m->reftime = now;
+	m->hits = 0;
+	m->protected = 0;
 
 	/* Avoid doing anything for zero-length files; some systems don't like
 	** to mmap them, other systems dislike mallocing zero bytes.
@@ -264,7 +305,10 @@ mmc_map( char* filename, struct stat* sbP, struct timeval* nowP )
 		}
 
 	/* Put the Map on the active list. */
+	m->prev = (Map*) 0;
 	m->next = maps;
+	if ( maps != (Map*) 0 )
+		maps->prev = m;
 	maps = m;
 	++map_count;
 
@@ -304,6 +348,25 @@ mmc_unmap( void* addr, struct stat* sbP, struct timeval* nowP )
 			m->reftime = nowP->tv_sec;
 		else
 			m->reftime = time( (time_t*) 0 );
+		if ( m->refcount == 0 )
+			{
+			/* Unused: it may be evicted, once older ones are. */
+			if ( m->protected )
+				{
+				lru_append( &lru_protected, m );
+				/* Keep some room for the probation segment. */
+				while ( lru_protected.bytes > DESIRED_MAX_MAPPED_BYTES / 100 * PROTECTED_SHARE &&
+						lru_protected.head != m )
+					{
+					Map* d = lru_protected.head;
+					lru_remove( &lru_protected, d );
+					d->protected = 0;
+					lru_append( &lru_probation, d );
+					}
+				}
+			else
+				lru_append( &lru_probation, m );
+			}
 		}
 	}
 
@@ -312,8 +375,8 @@ void
 mmc_cleanup( struct timeval* nowP )
 	{
 	time_t now;
-	Map** mm;
 	Map* m;
+	Map* next;
 
 	/* Get the current time, if necessary. */
 	if ( nowP != (struct timeval*) 0 )
@@ -322,13 +385,11 @@ mmc_cleanup( struct timeval* nowP )
 		now = time( (time_t*) 0 );
 
 	/* Really unmap any unreferenced entries older than the age limit. */
-	for ( mm = &maps; *mm != (Map*) 0; )
+	for ( m = maps; m != (Map*) 0; m = next )
 		{
-		m = *mm;
+		next = m->next;
 		if ( m->refcount == 0 && now - m->reftime >= expire_age )
-			really_unmap( mm );
-		else
-			mm = &(*mm)->next;
+			really_unmap( m );
 		}
 
 	/* Adjust the age limit if there are too many bytes mapped, or
@@ -356,29 +417,45 @@ mmc_cleanup( struct timeval* nowP )
 static void
 panic( void )
 	{
-	Map** mm;
-	Map* m;
-
 	syslog( LOG_ERR, "mmc panic - freeing all unreferenced maps" );
 
 	/* Really unmap all unreferenced entries. */
-	for ( mm = &maps; *mm != (Map*) 0; )
+	while ( lru_probation.head != (Map*) 0 )
+		really_unmap( lru_probation.head );
+	while ( lru_protected.head != (Map*) 0 )
+		really_unmap( lru_protected.head );
+	}
+
+
+/* Evict unreferenced maps, least recently used first and the probation
+** segment before the protected one, until a new map of that size fits in
+** the limits.  Maps in use can't be evicted, so we may still go over them.
+*/
+static void
+make_room( off_t size )
+	{
+	Map* m;
+
+	while ( mapped_bytes + size > DESIRED_MAX_MAPPED_BYTES ||
+			map_count >= DESIRED_MAX_MAPPED_FILES )
 		{
-		m = *mm;
-		if ( m->refcount == 0 )
-			really_unmap( mm );
+		if ( lru_probation.head != (Map*) 0 )
+			m = lru_probation.head;
+		else if ( lru_protected.head != (Map*) 0 )
+			m = lru_protected.head;
 		else
-			mm = &(*mm)->next;
+			break;
+		really_unmap( m );
+		++stats.evictions;
 		}
 	}
 
 
 static void
-really_unmap( Map** mm )
+really_unmap( Map* m )
 	{
-	Map* m;
-
-	m = *mm;
+	if ( m->refcount == 0 )
+		lru_remove( m->protected ? &lru_protected : &lru_probation, m );
 	if ( m->size != 0 )
 		{
 #ifdef HAVE_MMAP
@@ -390,16 +467,48 @@ really_unmap( Map** mm )
 		}
 	/* Update the total byte count. */
 	mapped_bytes -= m->size;
-	/* And move the Map to the free list. */
-	*mm = m->next;
+	/* Take it out of the hash table and the active list. */
+	del_hash( m );
+	if ( m->prev != (Map*) 0 )
+		m->prev->next = m->next;
+	else
+		maps = m->next;
+	if ( m->next != (Map*) 0 )
+		m->next->prev = m->prev;
 	--map_count;
+	/* And move the Map to the free list. */
 	m->next = free_maps;
 	free_maps = m;
 	++free_count;
-	/* This will sometimes break hash chains, but that's harmless; the
-	** unmapping code that searches the hash table knows to keep searching.
-	*/
-	hash_table[m->hash_idx] = (Map*) 0;
+	}
+
+
+static void
+lru_append( LruList* l, Map* m )
+	{
+	m->lru_next = (Map*) 0;
+	m->lru_prev = l->tail;
+	if ( l->tail != (Map*) 0 )
+		l->tail->lru_next = m;
+	else
+		l->head = m;
+	l->tail = m;
+	l->bytes += m->size;
+	}
+
+
+static void
+lru_remove( LruList* l, Map* m )
+	{
+	if ( m->lru_prev != (Map*) 0 )
+		m->lru_prev->lru_next = m->lru_next;
+	else
+		l->head = m->lru_next;
+	if ( m->lru_next != (Map*) 0 )
+		m->lru_next->lru_prev = m->lru_prev;
+	else
+		l->tail = m->lru_prev;
+	l->bytes -= m->size;
 	}
 
 
@@ -409,7 +518,7 @@ mmc_destroy( void )
 	Map* m;
 
 	while ( maps != (Map*) 0 )
-		really_unmap( &maps );
+		really_unmap( maps );
 	while ( free_maps != (Map*) 0 )
 		{
 		m = free_maps;
@@ -487,6 +596,26 @@ add_hash( Map* m )
 	}
 
 
+/* Removes a map from the hash table, re-adding the ones after it in the
+** same cluster so that no probe sequence gets broken.
+*/
+static void
+del_hash( Map* m )
+	{
+	unsigned int i;
+	Map* m2;
+
+	i = m->hash_idx;
+	hash_table[i] = (Map*) 0;
+	for ( i = ( i + 1 ) & hash_mask; hash_table[i] != (Map*) 0; i = ( i + 1 ) & hash_mask )
+		{
+		m2 = hash_table[i];
+		hash_table[i] = (Map*) 0;
+		(void) add_hash( m2 );
+		}
+	}
+
+
 static Map*
 find_hash( ino_t ino, dev_t dev, off_t size, time_t ctime )
 	{
@@ -527,14 +656,36 @@ hash( ino_t ino, dev_t dev, off_t size, time_t ctime )
 	}
 
 
+void
+mmc_get_stats( mmc_stats_t* stP )
+	{
+	*stP = stats;
+	stP->maps = map_count;
+	stP->bytes = mapped_bytes;
+	stP->idle_bytes = lru_probation.bytes + lru_protected.bytes;
+	}
+
+
 /* Generate debugging statistics syslog message. */
 void
 mmc_logstats( long secs )
 	{
+	long hits, misses, evictions;
+
 	syslog(
 		LOG_INFO, "  map cache - %d allocated, %d active (%lld bytes), %d free; hash size: %d; expire age: %ld",
 		alloc_count, map_count, (int64_t) mapped_bytes, free_count, hash_size,
 		expire_age );
+	hits = stats.hits - last_stats.hits;
+	misses = stats.misses - last_stats.misses;
+	evictions = stats.evictions - last_stats.evictions;
+	if ( secs > 0 )
+		syslog(
+			LOG_INFO, "  map cache - %ld hits (%g%%), %ld misses (%g/sec), %ld evictions (%g/sec); unused: %lld bytes protected, %lld bytes in probation",
+			hits, hits + misses > 0 ? 100.0 * hits / ( hits + misses ) : 0.0,
+			misses, (float) misses / secs, evictions, (float) evictions / secs,
+			(long long) lru_protected.bytes, (long long) lru_probation.bytes );
+	last_stats = stats;
 	if ( map_count + free_count != alloc_count )
 		syslog( LOG_ERR, "map counts don't add up!" );
 	}
@@ -49,6 +49,19 @@ void mmc_cleanup( struct timeval* nowP );
 /* Free all storage, usually in preparation for exitting. */
 void mmc_destroy( void );
 
+/* Statistics of the cache.  The counters run from the start. */
+typedef struct {
+	long hits;			/* mmc_map() calls which found the file already mapped */
+	long misses;
+	long evictions;		/* unused maps dropped to make room for new ones */
+	int maps;
+	off_t bytes;		/* mapped, in use or not */
+	off_t idle_bytes;	/* mapped and not in use */
+	} mmc_stats_t;
+
+/* Fill in the current statistics. */
+void mmc_get_stats( mmc_stats_t* stP );
+
 /* Generate debugging statistics syslog message. */
 void mmc_logstats( long secs );
 
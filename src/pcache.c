@@ -0,0 +1,505 @@
+/* pcache.c - path cache: realpath() and stat() results, invalidated by inotify
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* Each entry depends on the directory containing its path (and, for a
+* realpath(), the one containing the result): that directory is watched with
+* inotify, and any event on it drops the entry.  The watch goes with the
+* last entry depending on it.  Changes inotify can't report
+* (a directory renamed higher up the path, a file changed through a hard link
+* outside the web tree) are only caught when the entry expires, after
+* PATH_CACHE_TTL seconds.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <errno.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif /* HAVE_SYS_INOTIFY_H */
+
+#include "pcache.h"
+
+
+/* Defines. */
+#ifndef PATH_CACHE_TTL
+#define PATH_CACHE_TTL 60
+#endif
+#ifndef PATH_CACHE_MAX
+#define PATH_CACHE_MAX 10000
+#endif
+#define HASH_SIZE (1 << 12)
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Anything which may change what stat() or realpath() says about a path. */
+#define WATCH_MASK ( IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | \
+	IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF )
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/* Kinds of entries. */
+#define PC_STAT 0
+#define PC_REALPATH 1
+
+
+/* The Path struct. */
+typedef struct PathStruct {
+	char* path;
+	int kind;
+	int err;				/* errno of the call, 0 if it succeeded */
+	struct stat sb;			/* result of a PC_STAT */
+	char* resolved;			/* result of a PC_REALPATH */
+	int wd[2];				/* inotify watches it depends on, or -1 */
+	unsigned int wd_gen[2];	/* wd_gens[wd] when it was added */
+	unsigned int flush_gen;
+	time_t expires;
+	unsigned int hash;
+	struct PathStruct* next;
+	} Path;
+
+
+/* Globals. */
+static Path* hash_table[HASH_SIZE];
+static int path_count = 0;
+static long hits = 0, misses = 0;
+static int ifd = -1;
+/* Bumped on each event of a watch: entries depending on it are then stale. */
+static unsigned int* wd_gens = (unsigned int*) 0;
+/* How many entries depend on each watch. */
+static int* wd_refs = (int*) 0;
+static int max_wd = 0;
+static int watch_count = 0;
+/* Bumped when all entries are stale (inotify queue overflow). */
+static unsigned int flush_gen = 0;
+
+
+/* Forwards. */
+static unsigned int hash( const char* path, int kind );
+static Path* find_path( const char* path, int kind, unsigned int h, time_t now );
+static void add_path( const char* path, int kind, unsigned int h, time_t now, int err, struct stat* sbP, const char* resolved );
+static int is_valid( Path* p, time_t now );
+static void free_path( Path** pp );
+static int watch_dir( const char* path );
+static void unwatch( int wd );
+
+
+int
+pcache_init( void )
+	{
+	/* If we were forked, the entries and the inotify instance are our
+	** parent's ones.
+	*/
+	pcache_destroy();
+#ifdef HAVE_SYS_INOTIFY_H
+	ifd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	if ( ifd < 0 )
+		syslog( LOG_WARNING, "inotify_init1 - %m - paths will be cached for %d seconds whatever happens to them", PATH_CACHE_TTL );
+#endif /* HAVE_SYS_INOTIFY_H */
+	return ifd;
+	}
+
+
+int
+pcache_stat( const char* path, struct stat* sbP )
+	{
+	time_t now = time( (time_t*) 0 );
+	unsigned int h = hash( path, PC_STAT );
+	Path* p;
+	int err;
+
+	p = find_path( path, PC_STAT, h, now );
+	if ( p != (Path*) 0 )
+		{
+		++hits;
+		if ( p->err != 0 )
+			{
+			errno = p->err;
+			return -1;
+			}
+		*sbP = p->sb;
+		return 0;
+		}
+
+	++misses;
+	if ( stat( path, sbP ) < 0 )
+		{
+		err = errno;
+		/* Only remember that it doesn't exist, other errors may not last. */
+		if ( err == ENOENT || err == ENOTDIR )
+			add_path( path, PC_STAT, h, now, err, (struct stat*) 0, (char*) 0 );
+		errno = err;
+		return -1;
+		}
+	add_path( path, PC_STAT, h, now, 0, sbP, (char*) 0 );
+	return 0;
+	}
+
+
+char*
+pcache_realpath( const char* path )
+	{
+	time_t now = time( (time_t*) 0 );
+	unsigned int h = hash( path, PC_REALPATH );
+	Path* p;
+	char* resolved;
+	int err;
+
+	p = find_path( path, PC_REALPATH, h, now );
+	if ( p != (Path*) 0 )
+		{
+		++hits;
+		if ( p->err != 0 )
+			{
+			errno = p->err;
+			return (char*) 0;
+			}
+		resolved = strdup( p->resolved );
+		if ( resolved == (char*) 0 )
+			errno = ENOMEM;
+		return resolved;
+		}
+
+	++misses;
+	resolved = realpath( path, (char*) 0 );
+	if ( resolved == (char*) 0 )
+		{
+		err = errno;
+		if ( err == ENOENT || err == ENOTDIR )
+			add_path( path, PC_REALPATH, h, now, err, (struct stat*) 0, (char*) 0 );
+		errno = err;
+		return (char*) 0;
+		}
+	add_path( path, PC_REALPATH, h, now, 0, (struct stat*) 0, resolved );
+	return resolved;
+	}
+
+
+void
+pcache_events( void )
+	{
+#ifdef HAVE_SYS_INOTIFY_H
+	union {
+		struct inotify_event ev;	/* for the alignment */
+		char buf[8192];
+		} u;
+	struct inotify_event* ev;
+	ssize_t r;
+	char* cp;
+
+	if ( ifd < 0 )
+		return;
+	for (;;)
+		{
+		r = read( ifd, u.buf, sizeof(u.buf) );
+		if ( r < 0 )
+			{
+			if ( errno == EINTR )
+				continue;
+			if ( errno != EAGAIN && errno != EWOULDBLOCK )
+				{
+				syslog( LOG_ERR, "inotify read - %m" );
+				++flush_gen;
+				}
+			return;
+			}
+		if ( r == 0 )
+			return;
+		for ( cp = u.buf; cp < u.buf + r; cp += sizeof(struct inotify_event) + ev->len )
+			{
+			ev = (struct inotify_event*) cp;
+			if ( ev->mask & IN_Q_OVERFLOW )
+				++flush_gen;
+			else if ( ev->wd >= 0 && ev->wd < max_wd )
+				++wd_gens[ev->wd];
+			}
+		}
+#endif /* HAVE_SYS_INOTIFY_H */
+	}
+
+
+void
+pcache_cleanup( struct timeval* nowP )
+	{
+	time_t now;
+	Path** pp;
+	int i;
+
+	/* Get the current time, if necessary. */
+	if ( nowP != (struct timeval*) 0 )
+		now = nowP->tv_sec;
+	else
+		now = time( (time_t*) 0 );
+
+	for ( i = 0; i < HASH_SIZE; ++i )
+		for ( pp = &hash_table[i]; *pp != (Path*) 0; )
+			{
+			if ( ! is_valid( *pp, now ) )
+				free_path( pp );
+			else
+				pp = &(*pp)->next;
+			}
+	}
+
+
+void
+pcache_destroy( void )
+	{
+	int i;
+
+	/* Closed first: a forked process mustn't remove its parent's watches
+	** (the inotify instance is the same) while freeing the entries.
+	*/
+	if ( ifd >= 0 )
+		{
+		(void) close( ifd );
+		ifd = -1;
+		}
+	for ( i = 0; i < HASH_SIZE; ++i )
+		while ( hash_table[i] != (Path*) 0 )
+			free_path( &hash_table[i] );
+	free( (void*) wd_gens );
+	wd_gens = (unsigned int*) 0;
+	free( (void*) wd_refs );
+	wd_refs = (int*) 0;
+	max_wd = 0;
+	watch_count = 0;
+	}
+
+
+void
+pcache_logstats( long secs )
+	{
+	if ( secs > 0 )
+		syslog(
+			LOG_INFO, "  path cache - %d entries, %d watches, %ld hits, %ld misses (%g/sec)",
+			path_count, watch_count, hits, misses, (float) misses / secs );
+	hits = misses = 0;
+	}
+
+
+static unsigned int
+hash( const char* path, int kind )
+	{
+	unsigned int h = 5381;
+
+	while ( *path != '\0' )
+		h = ( h << 5 ) + h + (unsigned char) *path++;
+	return h ^ kind;
+	}
+
+
+/* Returns the entry for path if it is still valid.  A stale one is freed. */
+static Path*
+find_path( const char* path, int kind, unsigned int h, time_t now )
+	{
+	Path** pp;
+	Path* p;
+
+	for ( pp = &hash_table[h & ( HASH_SIZE - 1 )]; *pp != (Path*) 0; pp = &(*pp)->next )
+		{
+		p = *pp;
+		if ( p->hash == h && p->kind == kind && strcmp( p->path, path ) == 0 )
+			{
+			if ( is_valid( p, now ) )
+				return p;
+			free_path( pp );
+			return (Path*) 0;
+			}
+		}
+	return (Path*) 0;
+	}
+
+
+/* Remembers the result of a call, if it can be invalidated when needed. */
+static void
+add_path( const char* path, int kind, unsigned int h, time_t now, int err, struct stat* sbP, const char* resolved )
+	{
+	Path* p;
+	int wd0 = -1, wd1 = -1;
+
+	if ( PATH_CACHE_TTL <= 0 )
+		return;
+	if ( path_count >= PATH_CACHE_MAX )
+		{
+		pcache_cleanup( (struct timeval*) 0 );
+		if ( path_count >= PATH_CACHE_MAX )
+			return;
+		}
+	if ( ifd >= 0 )
+		{
+		wd0 = watch_dir( path );
+		if ( wd0 < 0 )
+			return;
+		if ( resolved != (char*) 0 )
+			{
+			wd1 = watch_dir( resolved );
+			if ( wd1 < 0 )
+				{
+				unwatch( wd0 );
+				return;
+				}
+			}
+		}
+
+	p = (Path*) malloc( sizeof(Path) );
+	if ( p == (Path*) 0 )
+		{
+		unwatch( wd0 );
+		unwatch( wd1 );
+		return;
+		}
+	p->path = strdup( path );
+	p->resolved = ( resolved != (char*) 0 ? strdup( resolved ) : (char*) 0 );
+	if ( p->path == (char*) 0 || ( resolved != (char*) 0 && p->resolved == (char*) 0 ) )
+		{
+		free( (void*) p->path );
+		free( (void*) p->resolved );
+		free( (void*) p );
+		unwatch( wd0 );
+		unwatch( wd1 );
+		return;
+		}
+	p->kind = kind;
+	p->err = err;
+	if ( sbP != (struct stat*) 0 )
+		p->sb = *sbP;
+	p->wd[0] = wd0;
+	p->wd[1] = wd1;
+	p->wd_gen[0] = ( wd0 >= 0 ? wd_gens[wd0] : 0 );
+	p->wd_gen[1] = ( wd1 >= 0 ? wd_gens[wd1] : 0 );
+	p->flush_gen = flush_gen;
+	p->expires = now + PATH_CACHE_TTL;
+	p->hash = h;
+	p->next = hash_table[h & ( HASH_SIZE - 1 )];
+	hash_table[h & ( HASH_SIZE - 1 )] = p;
+	++path_count;
+	}
+
+
+static int
+is_valid( Path* p, time_t now )
+	{
+	int i;
+
+	if ( now >= p->expires || p->flush_gen != flush_gen )
+		return 0;
+	for ( i = 0; i < 2; ++i )
+		if ( p->wd[i] >= 0 && p->wd_gen[i] != wd_gens[p->wd[i]] )
+			return 0;
+	return 1;
+	}
+
+
+static void
+free_path( Path** pp )
+	{
+	Path* p = *pp;
+
+	*pp = p->next;
+	unwatch( p->wd[0] );
+	unwatch( p->wd[1] );
+	free( (void*) p->path );
+	free( (void*) p->resolved );
+	free( (void*) p );
+	--path_count;
+	}
+
+
+/* Watches the directory containing path, or path itself if it ends with a
+** '/', for one more entry.  Returns the watch descriptor, -1 on errors.
+*/
+static int
+watch_dir( const char* path )
+	{
+#ifdef HAVE_SYS_INOTIFY_H
+	static int full_logged = 0;
+	char dir[MAXPATHLEN];
+	const char* slash;
+	size_t len;
+	int wd;
+
+	slash = strrchr( path, '/' );
+	if ( slash == (char*) 0 )
+		(void) strcpy( dir, "." );
+	else
+		{
+		len = ( slash == path ? 1 : slash - path );
+		if ( len >= sizeof(dir) )
+			return -1;
+		(void) memcpy( dir, path, len );
+		dir[len] = '\0';
+		}
+
+	wd = inotify_add_watch( ifd, dir, WATCH_MASK );
+	if ( wd < 0 )
+		{
+		/* (Once: then every path missing from the cache would say so.) */
+		if ( errno == ENOSPC && ! full_logged )
+			{
+			syslog( LOG_WARNING, "inotify_add_watch %.80s - %m - raise fs.inotify.max_user_watches", dir );
+			full_logged = 1;
+			}
+		return -1;
+		}
+	if ( wd >= max_wd )
+		{
+		int new_max = ( max_wd == 0 ? 64 : max_wd );
+		unsigned int* new_gens;
+		int* new_refs;
+
+		while ( new_max <= wd )
+			new_max *= 2;
+		new_gens = (unsigned int*) realloc( (void*) wd_gens, new_max * sizeof(unsigned int) );
+		if ( new_gens != (unsigned int*) 0 )
+			wd_gens = new_gens;
+		new_refs = (int*) realloc( (void*) wd_refs, new_max * sizeof(int) );
+		if ( new_refs != (int*) 0 )
+			wd_refs = new_refs;
+		if ( new_gens == (unsigned int*) 0 || new_refs == (int*) 0 )
+			{
+			/* (A new watch, no entry depends on it yet.) */
+			(void) inotify_rm_watch( ifd, wd );
+			return -1;
+			}
+		(void) memset( &wd_gens[max_wd], 0, ( new_max - max_wd ) * sizeof(unsigned int) );
+		(void) memset( &wd_refs[max_wd], 0, ( new_max - max_wd ) * sizeof(int) );
+		max_wd = new_max;
+		}
+	if ( wd_refs[wd]++ == 0 )
+		++watch_count;
+	return wd;
+#else /* HAVE_SYS_INOTIFY_H */
+	return -1;
+#endif /* HAVE_SYS_INOTIFY_H */
+	}
+
+
+/* Drops an entry's dependency on a watch, and the watch with the last one. */
+static void
+unwatch( int wd )
+	{
+	if ( wd < 0 || wd >= max_wd || wd_refs[wd] <= 0 )
+		return;
+	if ( --wd_refs[wd] == 0 )
+		{
+		--watch_count;
+#ifdef HAVE_SYS_INOTIFY_H
+		if ( ifd >= 0 )
+			(void) inotify_rm_watch( ifd, wd );
+#endif /* HAVE_SYS_INOTIFY_H */
+		}
+	}
@@ -0,0 +1,47 @@
+/* pcache.h - header file for the path cache
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The path cache keeps the results of the realpath() and stat() calls made to
+* resolve requests, so that a URL asked again costs no filesystem syscall.
+* Entries are dropped when inotify reports a change in their directory, and
+* anyway after PATH_CACHE_TTL seconds.
+*/
+
+#ifndef _PCACHE_H_
+#define _PCACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/*! Initialize the path cache of this process (call it again after a fork).
+ * \return the inotify fd to watch for reading (then call pcache_events()),
+ * or -1 if entries will only expire with time.
+ */
+int pcache_init( void );
+
+/*! Same as stat( path, sbP ), through the cache. */
+int pcache_stat( const char* path, struct stat* sbP );
+
+/*! Same as realpath( path, NULL ), through the cache: the returned string
+ * must be free()d.  Returns (char*) 0 with errno set on errors.
+ */
+char* pcache_realpath( const char* path );
+
+/*! Read the pending inotify events and invalidate the entries they concern. */
+void pcache_events( void );
+
+/*! Free the expired entries.  Should be called periodically.
+ * If you have the current time, pass it in, otherwise pass 0.
+ */
+void pcache_cleanup( struct timeval* nowP );
+
+/*! Free all storage, usually in preparation for exitting. */
+void pcache_destroy( void );
+
+/*! Generate debugging statistics syslog message. */
+void pcache_logstats( long secs );
+
+#endif /* _PCACHE_H_ */
@@ -0,0 +1,660 @@
+/* pgpsign.c - in-process OpenPGP signer: detached signatures with libgcrypt
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* At startup the key is exported from gpg, unarmored, and the secret key
+* packet of the subkey gpg would sign with is parsed: its fingerprint has to
+* be the one gpgme listed, and its secret part must not be protected.  The
+* signatures are then the v4 signature packets gpg makes by default for a
+* detached signature: class 0x00 (binary document), hashed issuer
+* fingerprint and creation time subpackets, unhashed issuer key ID, SHA-512
+* for RSA and SHA-256 for Ed25519.  They are armored as gpg does it, without
+* any Version header, so that for a given second both give the same bytes.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <errno.h>
+
+#include "libhttpd.h"
+#include "pgpsign.h"
+
+#ifdef USE_NATIVE_SIGN
+
+#include <gcrypt.h>
+
+
+/* Defines. */
+#define PUBKEY_ALGO_RSA 1
+#define PUBKEY_ALGO_RSA_S 3
+#define PUBKEY_ALGO_EDDSA 22
+#define DIGEST_ALGO_SHA256 8
+#define DIGEST_ALGO_SHA512 10
+#define FPR_LEN 20
+/* Version, class, algorithms and hashed area length, then the hashed
+** area: issuer fingerprint and creation time subpackets.
+*/
+#define HASHED_LEN ( 6 + 23 + 6 )
+/* Unhashed area length, then the issuer key ID subpacket. */
+#define UNHASHED_LEN ( 2 + 10 )
+/* Up to 8192 bits RSA. */
+#define MAX_MPI_BYTES 1024
+#define ARMOR_HEAD "-----BEGIN PGP SIGNATURE-----\n\n"
+#define ARMOR_TAIL "-----END PGP SIGNATURE-----\n"
+
+
+struct PgpSignStruct {
+	gcry_md_hd_t md;
+	};
+
+
+/* Globals. */
+static gcry_sexp_t skey = (gcry_sexp_t) 0;
+static int pubkey_algo;
+static int digest_algo;			/* the OpenPGP number */
+static int md_algo;				/* the libgcrypt one */
+static unsigned char fpr[FPR_LEN];
+/* 1.3.6.1.4.1.11591.15.1 */
+static const unsigned char ed25519_oid[] = { 0x2b, 0x06, 0x01, 0x04, 0x01, 0xda, 0x47, 0x0f, 0x01 };
+static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+/* Forwards. */
+static gpgme_subkey_t signing_subkey( gpgme_key_t key );
+static int load_key( const unsigned char* buf, size_t len, const char* wanted );
+static int parse_key( const unsigned char* body, size_t len, const char* wanted );
+static int next_packet( const unsigned char** pP, const unsigned char* end, int* tagP, const unsigned char** bodyP, size_t* lenP );
+static int parse_mpi( const unsigned char** pP, const unsigned char* end, gcry_mpi_t* mpiP );
+static int fpr_equal( const char* hex, const unsigned char* bin );
+static size_t put_mpi( unsigned char* p, const unsigned char* data, size_t len );
+static size_t put_armor( char* out, const unsigned char* in, size_t len );
+static void wipe( void* p, size_t len );
+
+
+int
+pgpsign_init( gpgme_ctx_t ctx, gpgme_key_t key )
+	{
+#ifdef GPGME_EXPORT_MODE_SECRET
+	gpgme_subkey_t sk;
+	gpgme_data_t data;
+	gpgme_error_t gpgerr;
+	char* buf;
+	size_t len;
+	int armor, r;
+
+	if ( gcry_check_version( (char*) 0 ) == (char*) 0 )
+		return -1;
+	if ( ! gcry_control( GCRYCTL_INITIALIZATION_FINISHED_P ) )
+		{
+		(void) gcry_control( GCRYCTL_DISABLE_SECMEM, 0 );
+		(void) gcry_control( GCRYCTL_INITIALIZATION_FINISHED, 0 );
+		}
+
+	sk = signing_subkey( key );
+	if ( sk == (gpgme_subkey_t) 0 )
+		{
+		syslog( LOG_WARNING, "no valid subkey of %s can sign", key->subkeys->fpr );
+		return -1;
+		}
+
+	gpgerr = gpgme_data_new( &data );
+	if ( gpgerr != GPG_ERR_NO_ERROR )
+		{
+		syslog( LOG_ERR, "gpgme_data_new - %s", gpgme_strerror( gpgerr ) );
+		return -1;
+		}
+	armor = gpgme_get_armor( ctx );
+	gpgme_set_armor( ctx, 0 );
+	gpgerr = gpgme_op_export( ctx, sk->fpr, GPGME_EXPORT_MODE_SECRET, data );
+	gpgme_set_armor( ctx, armor );
+	buf = gpgme_data_release_and_get_mem( data, &len );
+	if ( gpgerr != GPG_ERR_NO_ERROR || buf == (char*) 0 || len == 0 )
+		{
+		syslog( LOG_WARNING, "gpgme_op_export(%s) - %s", sk->fpr,
+			gpgerr != GPG_ERR_NO_ERROR ? gpgme_strerror( gpgerr ) : "nothing exported" );
+		if ( buf != (char*) 0 )
+			gpgme_free( buf );
+		return -1;
+		}
+
+	r = load_key( (unsigned char*) buf, len, sk->fpr );
+	wipe( buf, len );
+	gpgme_free( buf );
+	return r;
+#else /* GPGME_EXPORT_MODE_SECRET */
+	syslog( LOG_WARNING, "this gpgme can't export secret keys" );
+	return -1;
+#endif /* GPGME_EXPORT_MODE_SECRET */
+	}
+
+
+int
+pgpsign_ready( void )
+	{
+	return skey != (gcry_sexp_t) 0;
+	}
+
+
+gpgme_error_t
+pgpsign_begin( PgpSign** psP )
+	{
+	PgpSign* ps;
+	gcry_error_t err;
+
+	if ( skey == (gcry_sexp_t) 0 )
+		return gpg_error( GPG_ERR_NO_SECKEY );
+	ps = (PgpSign*) malloc( sizeof(PgpSign) );
+	if ( ps == (PgpSign*) 0 )
+		return gpgme_error_from_errno( ENOMEM );
+	err = gcry_md_open( &ps->md, md_algo, 0 );
+	if ( err != GPG_ERR_NO_ERROR )
+		{
+		free( (void*) ps );
+		return err;
+		}
+	*psP = ps;
+	return GPG_ERR_NO_ERROR;
+	}
+
+
+void
+pgpsign_write( PgpSign* ps, const void* buf, size_t len )
+	{
+	gcry_md_write( ps->md, buf, len );
+	}
+
+
+gpgme_error_t
+pgpsign_end( PgpSign* ps, char** sigP, size_t* siglenP )
+	{
+	unsigned char body[HASHED_LEN + UNHASHED_LEN + 2 + 2 * ( 2 + MAX_MPI_BYTES )];
+	unsigned char pkt[5 + sizeof(body)];
+	unsigned char* p;
+	unsigned char* digest;
+	const char* names;
+	const char* data;
+	size_t len, bodylen, pktlen;
+	gcry_sexp_t s_data, s_sig, tok;
+	gcry_error_t err;
+	time_t now;
+	char* sig;
+
+	/* The signature packet up to the end of the hashed area... */
+	now = time( (time_t*) 0 );
+	p = body;
+	*p++ = 4;						/* version */
+	*p++ = 0x00;					/* class: signature of a binary document */
+	*p++ = pubkey_algo;
+	*p++ = digest_algo;
+	*p++ = 0;
+	*p++ = HASHED_LEN - 6;
+	*p++ = 1 + 1 + FPR_LEN;		/* issuer fingerprint */
+	*p++ = 33;
+	*p++ = 4;
+	(void) memcpy( p, fpr, FPR_LEN );
+	p += FPR_LEN;
+	*p++ = 1 + 4;					/* signature creation time */
+	*p++ = 2;
+	*p++ = ( now >> 24 ) & 0xff;
+	*p++ = ( now >> 16 ) & 0xff;
+	*p++ = ( now >> 8 ) & 0xff;
+	*p++ = now & 0xff;
+
+	/* ... is hashed after the data, then the v4 trailer. */
+	gcry_md_write( ps->md, body, HASHED_LEN );
+	gcry_md_putc( ps->md, 4 );
+	gcry_md_putc( ps->md, 0xff );
+	gcry_md_putc( ps->md, 0 );
+	gcry_md_putc( ps->md, 0 );
+	gcry_md_putc( ps->md, 0 );
+	gcry_md_putc( ps->md, HASHED_LEN );
+	digest = gcry_md_read( ps->md, md_algo );
+
+	if ( pubkey_algo == PUBKEY_ALGO_EDDSA )
+		{
+		err = gcry_sexp_build( &s_data, (size_t*) 0, "(data(flags eddsa)(hash-algo sha512)(value %b))",
+			(int) gcry_md_get_algo_dlen( md_algo ), digest );
+		names = "r\0s\0";
+		}
+	else
+		{
+		err = gcry_sexp_build( &s_data, (size_t*) 0, "(data(flags pkcs1)(hash %s %b))",
+			gcry_md_algo_name( md_algo ), (int) gcry_md_get_algo_dlen( md_algo ), digest );
+		names = "s\0";
+		}
+	if ( err == GPG_ERR_NO_ERROR )
+		{
+		err = gcry_pk_sign( &s_sig, s_data, skey );
+		gcry_sexp_release( s_data );
+		}
+	if ( err != GPG_ERR_NO_ERROR )
+		{
+		pgpsign_cancel( ps );
+		return err;
+		}
+
+	/* The unhashed area: issuer key ID. */
+	*p++ = 0;
+	*p++ = UNHASHED_LEN - 2;
+	*p++ = 1 + 8;
+	*p++ = 16;
+	(void) memcpy( p, &fpr[FPR_LEN - 8], 8 );
+	p += 8;
+	*p++ = digest[0];
+	*p++ = digest[1];
+	pgpsign_cancel( ps );
+
+	/* The signature MPIs. */
+	for ( ; *names != '\0'; names += strlen( names ) + 1 )
+		{
+		tok = gcry_sexp_find_token( s_sig, names, 0 );
+		data = ( tok != (gcry_sexp_t) 0 ? gcry_sexp_nth_data( tok, 1, &len ) : (char*) 0 );
+		if ( data == (char*) 0 || len > MAX_MPI_BYTES )
+			{
+			gcry_sexp_release( tok );
+			gcry_sexp_release( s_sig );
+			return gpg_error( GPG_ERR_BAD_SIGNATURE );
+			}
+		p += put_mpi( p, (const unsigned char*) data, len );
+		gcry_sexp_release( tok );
+		}
+	gcry_sexp_release( s_sig );
+	bodylen = p - body;
+
+	/* An old format packet header, as gpg writes it. */
+	p = pkt;
+	if ( bodylen < 256 )
+		{
+		*p++ = 0x88;
+		*p++ = bodylen;
+		}
+	else
+		{
+		*p++ = 0x89;
+		*p++ = ( bodylen >> 8 ) & 0xff;
+		*p++ = bodylen & 0xff;
+		}
+	(void) memcpy( p, body, bodylen );
+	pktlen = p - pkt + bodylen;
+
+	sig = (char*) malloc( sizeof(ARMOR_HEAD) + ( pktlen + 2 ) / 3 * 4 + pktlen / 48 + 1 + 7 + sizeof(ARMOR_TAIL) );
+	if ( sig == (char*) 0 )
+		return gpgme_error_from_errno( ENOMEM );
+	*sigP = sig;
+	*siglenP = put_armor( sig, pkt, pktlen );
+	return GPG_ERR_NO_ERROR;
+	}
+
+
+void
+pgpsign_cancel( PgpSign* ps )
+	{
+	gcry_md_close( ps->md );
+	free( (void*) ps );
+	}
+
+
+gpgme_error_t
+pgpsign_sign( const void* data, size_t len, char** sigP, size_t* siglenP )
+	{
+	PgpSign* ps;
+	gpgme_error_t err;
+
+	err = pgpsign_begin( &ps );
+	if ( err != GPG_ERR_NO_ERROR )
+		return err;
+	pgpsign_write( ps, data, len );
+	return pgpsign_end( ps, sigP, siglenP );
+	}
+
+
+void
+pgpsign_destroy( void )
+	{
+	if ( skey != (gcry_sexp_t) 0 )
+		{
+		gcry_sexp_release( skey );
+		skey = (gcry_sexp_t) 0;
+		}
+	}
+
+
+/* The subkey gpg signs with: the newest valid one which can sign, else the
+** primary key.
+*/
+static gpgme_subkey_t
+signing_subkey( gpgme_key_t key )
+	{
+	gpgme_subkey_t sk;
+	gpgme_subkey_t best = (gpgme_subkey_t) 0;
+
+	for ( sk = key->subkeys; sk != (gpgme_subkey_t) 0; sk = sk->next )
+		{
+		if ( ! sk->can_sign || sk->revoked || sk->expired || sk->disabled || sk->invalid )
+			continue;
+		if ( best == (gpgme_subkey_t) 0 || best == key->subkeys || sk->timestamp > best->timestamp )
+			best = sk;
+		}
+	return best;
+	}
+
+
+static int
+load_key( const unsigned char* buf, size_t len, const char* wanted )
+	{
+	const unsigned char* p = buf;
+	const unsigned char* body;
+	size_t bodylen;
+	int tag, r;
+
+	while ( next_packet( &p, buf + len, &tag, &body, &bodylen ) == 0 )
+		{
+		/* Secret key and secret subkey packets. */
+		if ( tag != 5 && tag != 7 )
+			continue;
+		r = parse_key( body, bodylen, wanted );
+		if ( r <= 0 )
+			return r;
+		}
+	syslog( LOG_WARNING, "no RSA or Ed25519 secret key %s exported", wanted );
+	return -1;
+	}
+
+
+/* Loads the key if it is the wanted one.  Returns 0 if so, 1 if it is
+** another one, and -1 if it is but can't be loaded.
+*/
+static int
+parse_key( const unsigned char* body, size_t len, const char* wanted )
+	{
+	const unsigned char* p = body + 6;
+	const unsigned char* end = body + len;
+	const unsigned char* secret;
+	gcry_mpi_t m[6] = { 0, 0, 0, 0, 0, 0 };
+	gcry_buffer_t iov[2];
+	unsigned char head[3];
+	unsigned char keyfpr[FPR_LEN];
+	unsigned int sum;
+	gcry_error_t err;
+	int algo, npub, nsec, i, r;
+
+	if ( len < 6 || body[0] != 4 )
+		return 1;
+	algo = body[5];
+	r = 1;
+	if ( algo == PUBKEY_ALGO_RSA || algo == PUBKEY_ALGO_RSA_S )
+		{
+		npub = 2;					/* n, e */
+		nsec = 4;					/* d, p, q, u */
+		}
+	else if ( algo == PUBKEY_ALGO_EDDSA )
+		{
+		if ( p >= end || *p != sizeof(ed25519_oid) || p + 1 + *p > end ||
+			 memcmp( p + 1, ed25519_oid, sizeof(ed25519_oid) ) != 0 )
+			return 1;
+		p += 1 + sizeof(ed25519_oid);
+		npub = 1;					/* q */
+		nsec = 1;					/* d */
+		}
+	else
+		return 1;
+	for ( i = 0; i < npub; ++i )
+		if ( parse_mpi( &p, end, &m[i] ) != 0 )
+			goto done;
+
+	/* The v4 fingerprint is the SHA-1 of the public key packet. */
+	head[0] = 0x99;
+	head[1] = ( ( p - body ) >> 8 ) & 0xff;
+	head[2] = ( p - body ) & 0xff;
+	(void) memset( iov, 0, sizeof(iov) );
+	iov[0].data = head;
+	iov[0].len = sizeof(head);
+	iov[1].data = (void*) body;
+	iov[1].len = p - body;
+	if ( gcry_md_hash_buffers( GCRY_MD_SHA1, 0, keyfpr, iov, 2 ) != GPG_ERR_NO_ERROR ||
+		 ! fpr_equal( wanted, keyfpr ) )
+		goto done;
+
+	r = -1;
+	if ( p >= end || *p != 0 )
+		{
+		syslog( LOG_WARNING, "the secret key %s is protected, or kept elsewhere", wanted );
+		goto done;
+		}
+	secret = ++p;
+	for ( i = 0; i < nsec; ++i )
+		if ( parse_mpi( &p, end, &m[npub + i] ) != 0 )
+			{
+			syslog( LOG_WARNING, "bad secret key packet for %s", wanted );
+			goto done;
+			}
+	for ( sum = 0; secret < p; ++secret )
+		sum += *secret;
+	if ( p + 2 > end || (unsigned int) ( ( p[0] << 8 ) | p[1] ) != ( sum & 0xffff ) )
+		{
+		syslog( LOG_WARNING, "bad checksum of the secret key %s", wanted );
+		goto done;
+		}
+
+	if ( algo == PUBKEY_ALGO_EDDSA )
+		err = gcry_sexp_build( &skey, (size_t*) 0, "(private-key(ecc(curve Ed25519)(flags eddsa)(q%m)(d%m)))",
+			m[0], m[1] );
+	else
+		err = gcry_sexp_build( &skey, (size_t*) 0, "(private-key(rsa(n%m)(e%m)(d%m)(p%m)(q%m)(u%m)))",
+			m[0], m[1], m[2], m[3], m[4], m[5] );
+	if ( err == GPG_ERR_NO_ERROR && ( err = gcry_pk_testkey( skey ) ) != GPG_ERR_NO_ERROR )
+		{
+		gcry_sexp_release( skey );
+		skey = (gcry_sexp_t) 0;
+		}
+	if ( err != GPG_ERR_NO_ERROR )
+		{
+		syslog( LOG_WARNING, "secret key %s - %s", wanted, gcry_strerror( err ) );
+		goto done;
+		}
+
+	pubkey_algo = algo;
+	if ( algo == PUBKEY_ALGO_EDDSA )
+		{
+		/* gpg matches the digest to the size of the curve. */
+		digest_algo = DIGEST_ALGO_SHA256;
+		md_algo = GCRY_MD_SHA256;
+		}
+	else
+		{
+		/* The first of gpg's default digest preferences. */
+		digest_algo = DIGEST_ALGO_SHA512;
+		md_algo = GCRY_MD_SHA512;
+		}
+	(void) memcpy( fpr, keyfpr, FPR_LEN );
+	r = 0;
+
+	done:
+	for ( i = 0; i < 6; ++i )
+		gcry_mpi_release( m[i] );
+	return r;
+	}
+
+
+/* Steps over a packet, old or new format, but without partial lengths. */
+static int
+next_packet( const unsigned char** pP, const unsigned char* end, int* tagP, const unsigned char** bodyP, size_t* lenP )
+	{
+	const unsigned char* p = *pP;
+	size_t len;
+	int ctb, n;
+
+	if ( p >= end || ! ( *p & 0x80 ) )
+		return -1;
+	ctb = *p++;
+	if ( ctb & 0x40 )
+		{
+		*tagP = ctb & 0x3f;
+		if ( p >= end )
+			return -1;
+		if ( *p < 192 )
+			len = *p++;
+		else if ( *p < 224 )
+			{
+			if ( p + 2 > end )
+				return -1;
+			len = ( ( p[0] - 192 ) << 8 ) + p[1] + 192;
+			p += 2;
+			}
+		else if ( *p == 255 )
+			{
+			if ( p + 5 > end )
+				return -1;
+			len = ( (size_t) p[1] << 24 ) | ( p[2] << 16 ) | ( p[3] << 8 ) | p[4];
+			p += 5;
+			}
+		else
+			return -1;
+		}
+	else
+		{
+		*tagP = ( ctb >> 2 ) & 0xf;
+		if ( ( ctb & 3 ) == 3 )
+			len = end - p;
+		else
+			{
+			n = 1 << ( ctb & 3 );
+			if ( p + n > end )
+				return -1;
+			for ( len = 0; n > 0; --n )
+				len = ( len << 8 ) | *p++;
+			}
+		}
+	if ( len > (size_t) ( end - p ) )
+		return -1;
+	*bodyP = p;
+	*lenP = len;
+	*pP = p + len;
+	return 0;
+	}
+
+
+static int
+parse_mpi( const unsigned char** pP, const unsigned char* end, gcry_mpi_t* mpiP )
+	{
+	size_t n;
+
+	if ( gcry_mpi_scan( mpiP, GCRYMPI_FMT_PGP, *pP, end - *pP, &n ) != GPG_ERR_NO_ERROR )
+		return -1;
+	*pP += n;
+	return 0;
+	}
+
+
+static int
+fpr_equal( const char* hex, const unsigned char* bin )
+	{
+	char buf[2 * FPR_LEN + 1];
+	int i;
+
+	for ( i = 0; i < FPR_LEN; ++i )
+		(void) sprintf( &buf[2 * i], "%02X", bin[i] );
+	return strcasecmp( hex, buf ) == 0;
+	}
+
+
+/* Writes an OpenPGP MPI, without the leading zeros of data. */
+static size_t
+put_mpi( unsigned char* p, const unsigned char* data, size_t len )
+	{
+	unsigned int bits;
+	unsigned char c;
+
+	while ( len > 0 && *data == 0 )
+		{
+		++data;
+		--len;
+		}
+	bits = len * 8;
+	if ( len > 0 )
+		for ( c = *data; ! ( c & 0x80 ); c <<= 1 )
+			--bits;
+	p[0] = ( bits >> 8 ) & 0xff;
+	p[1] = bits & 0xff;
+	(void) memcpy( &p[2], data, len );
+	return 2 + len;
+	}
+
+
+/* Armors a signature packet as gpg does: 64 columns, then the CRC-24. */
+static size_t
+put_armor( char* out, const unsigned char* in, size_t len )
+	{
+	char* o = out;
+	unsigned long crc = 0xb704ce;
+	unsigned long v;
+	size_t i;
+	int j, col;
+
+	for ( i = 0; i < len; ++i )
+		{
+		crc ^= (unsigned long) in[i] << 16;
+		for ( j = 0; j < 8; ++j )
+			{
+			crc <<= 1;
+			if ( crc & 0x1000000 )
+				crc ^= 0x1864cfb;
+			}
+		}
+
+	(void) strcpy( o, ARMOR_HEAD );
+	o += sizeof(ARMOR_HEAD) - 1;
+	for ( i = 0, col = 0; i < len; i += 3 )
+		{
+		v = (unsigned long) in[i] << 16;
+		if ( i + 1 < len )
+			v |= in[i + 1] << 8;
+		if ( i + 2 < len )
+			v |= in[i + 2];
+		*o++ = b64[( v >> 18 ) & 0x3f];
+		*o++ = b64[( v >> 12 ) & 0x3f];
+		*o++ = ( i + 1 < len ? b64[( v >> 6 ) & 0x3f] : '=' );
+		*o++ = ( i + 2 < len ? b64[v & 0x3f] : '=' );
+		col += 4;
+		if ( col == 64 )
+			{
+			*o++ = '\n';
+			col = 0;
+			}
+		}
+	if ( col > 0 )
+		*o++ = '\n';
+	*o++ = '=';
+	*o++ = b64[( crc >> 18 ) & 0x3f];
+	*o++ = b64[( crc >> 12 ) & 0x3f];
+	*o++ = b64[( crc >> 6 ) & 0x3f];
+	*o++ = b64[crc & 0x3f];
+	*o++ = '\n';
+	(void) strcpy( o, ARMOR_TAIL );
+	o += sizeof(ARMOR_TAIL) - 1;
+	return o - out;
+	}
+
+
+/* Clears the exported secret key, without the compiler optimizing it out. */
+static void
+wipe( void* p, size_t len )
+	{
+	volatile unsigned char* vp = (volatile unsigned char*) p;
+
+	while ( len-- > 0 )
+		*vp++ = 0;
+	}
+
+#endif /* USE_NATIVE_SIGN */
@@ -0,0 +1,50 @@
+/* pgpsign.h - header file for the in-process OpenPGP signer
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The in-process signer makes the same armored detached signatures as
+* gpgme_op_sign() with GPGME_SIG_MODE_DETACH, but with libgcrypt and a copy
+* of the secret key loaded once at startup, so that signing a response no
+* longer costs a round trip to gpg and gpg-agent.
+*/
+
+#ifndef _PGPSIGN_H_
+#define _PGPSIGN_H_
+
+#include <sys/types.h>
+#include <gpgme.h>
+
+/* A signature being computed, fed with pgpsign_write(). */
+typedef struct PgpSignStruct PgpSign;
+
+/*! Load the secret part of the subkey gpg would sign with for key, exported
+ * through ctx.  Only RSA and Ed25519 keys without passphrase can be loaded.
+ * \return 0, or -1 if the key can't be used: then keep signing with gpgme.
+ */
+int pgpsign_init( gpgme_ctx_t ctx, gpgme_key_t key );
+
+/*! Whether pgpsign_init() succeeded. */
+int pgpsign_ready( void );
+
+/*! Start a signature.  The functions below may be called from any thread. */
+gpgme_error_t pgpsign_begin( PgpSign** psP );
+
+/*! Add data to the signed content. */
+void pgpsign_write( PgpSign* ps, const void* buf, size_t len );
+
+/*! Finish the signature and free ps.  On success, *sigP is the armored
+ * signature, to be free()d, and *siglenP its length.
+ */
+gpgme_error_t pgpsign_end( PgpSign* ps, char** sigP, size_t* siglenP );
+
+/*! Free ps without signing. */
+void pgpsign_cancel( PgpSign* ps );
+
+/*! Sign len bytes at once, as pgpsign_begin(), _write() and _end(). */
+gpgme_error_t pgpsign_sign( const void* data, size_t len, char** sigP, size_t* siglenP );
+
+/*! Forget the key, usually in preparation for exitting. */
+void pgpsign_destroy( void );
+
+#endif /* _PGPSIGN_H_ */
@@ -0,0 +1,500 @@
+/* presign.c - background pre-signer: signatures made before they are asked
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The web directory is read breadth first, one entry at a time as room is made
+* in the signing pool, and WALK_BATCH entries at most per turn of the main
+* loop (a timer goes on with the walk), so that neither the startup walk nor
+* one after lost inotify events holds the main loop, even when every file is
+* signed already.  Each directory read is watched by inotify, and the files
+* then written, moved in or touched in it are queued, ahead of the walk; a new
+* directory is queued for reading.  A file is handed to the pool (through
+* httpd_presign(), as a low priority job) when a request for it would be
+* signed and its cached signature isn't newer than it, PRESIGN_JOBS at most at
+* a time.  The directories which have a cached manifest get it made again
+* (through httpd_presign_dir()) when they are read, and after any change
+* inotify reports in them, before the walk goes on.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+
+#ifdef HAVE_DIRENT_H
+# include <dirent.h>
+#else
+# define dirent direct
+# ifdef HAVE_SYS_NDIR_H
+#  include <sys/ndir.h>
+# endif
+# ifdef HAVE_SYS_DIR_H
+#  include <sys/dir.h>
+# endif
+# ifdef HAVE_NDIR_H
+#  include <ndir.h>
+# endif
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif /* HAVE_SYS_INOTIFY_H */
+
+#include "libhttpd.h"
+#include "match.h"
+#include "timers.h"
+#include "presign.h"
+#include "sigcache.h"
+#include "dirsig.h"
+
+#ifdef USE_PRESIGN
+
+
+/* Defines. */
+#ifndef MAXPATHLEN
+#define MAXPATHLEN 2048
+#endif
+#define WALK_BATCH 256
+#define WALK_MSECS 1L
+#ifdef HAVE_SYS_INOTIFY_H
+#define WATCH_MASK ( IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR )
+#endif /* HAVE_SYS_INOTIFY_H */
+
+
+/* A queued path, followed by its name. */
+typedef struct NameStruct {
+	struct NameStruct* next;
+	} Name;
+
+typedef struct {
+	Name* head;
+	Name* tail;
+	} NameList;
+
+
+/* Globals. */
+static httpd_server* server = (httpd_server*) 0;
+static int ifd = -1;
+static char** wd_dirs = (char**) 0;	/* directory of each watch, or (char*) 0 */
+static int max_wd = 0;
+static int watch_count = 0;
+static NameList dirs = { (Name*) 0, (Name*) 0 };	/* still to read */
+static NameList files = { (Name*) 0, (Name*) 0 };	/* changed */
+#ifdef USE_DIRSIG
+static NameList manifests = { (Name*) 0, (Name*) 0 };	/* to make again */
+#endif /* USE_DIRSIG */
+static DIR* dirp = (DIR*) 0;		/* being read */
+static char dirpath[MAXPATHLEN];
+static int running = 0;
+static int examined;			/* entries, in this turn */
+static Timer* walk_timer = (Timer*) 0;
+static long submitted = 0;
+
+
+/* Forwards. */
+static void fill( void );
+static void walk_on( ClientData client_data, struct timeval* nowP );
+static int next_file( char* path, struct stat* sbP );
+static int wants_sign( const char* path, const struct stat* sbP );
+static int join( char* path, const char* dir, const char* name );
+static void push_name( NameList* l, const char* name );
+static int pop_name( NameList* l, char* name );
+static void watch_dir( const char* dir );
+#ifdef USE_DIRSIG
+static void remake_manifest( const char* dir );
+#endif /* USE_DIRSIG */
+
+
+int
+presign_init( httpd_server* hs )
+	{
+	/* If we were forked, the state is our parent's one. */
+	presign_destroy();
+	if ( hs->sig_pattern == (char*) 0 )
+		return -1;
+	server = hs;
+#ifdef HAVE_SYS_INOTIFY_H
+	ifd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	if ( ifd < 0 )
+		syslog( LOG_WARNING, "inotify_init1 - %m - only the files there at startup will be signed ahead" );
+#endif /* HAVE_SYS_INOTIFY_H */
+	push_name( &dirs, "." );
+	fill();
+	return ifd;
+	}
+
+
+void
+presign_events( void )
+	{
+#ifdef HAVE_SYS_INOTIFY_H
+	union {
+		struct inotify_event ev;	/* for the alignment */
+		char buf[8192];
+		} u;
+	struct inotify_event* ev;
+	char path[MAXPATHLEN];
+	ssize_t r;
+	char* cp;
+
+	if ( ifd < 0 )
+		return;
+	for (;;)
+		{
+		r = read( ifd, u.buf, sizeof(u.buf) );
+		if ( r < 0 )
+			{
+			if ( errno == EINTR )
+				continue;
+			if ( errno != EAGAIN && errno != EWOULDBLOCK )
+				syslog( LOG_ERR, "inotify read - %m" );
+			break;
+			}
+		if ( r == 0 )
+			break;
+		for ( cp = u.buf; cp < u.buf + r; cp += sizeof(struct inotify_event) + ev->len )
+			{
+			ev = (struct inotify_event*) cp;
+			if ( ev->mask & IN_Q_OVERFLOW )
+				{
+				/* Events were lost: walk it all again. */
+				push_name( &dirs, "." );
+				continue;
+				}
+			if ( ev->wd < 0 || ev->wd >= max_wd || wd_dirs[ev->wd] == (char*) 0 )
+				continue;
+			if ( ev->mask & IN_IGNORED )
+				{
+				free( (void*) wd_dirs[ev->wd] );
+				wd_dirs[ev->wd] = (char*) 0;
+				--watch_count;
+				continue;
+				}
+			if ( ev->len == 0 || join( path, wd_dirs[ev->wd], ev->name ) < 0 )
+				continue;
+#ifdef USE_DIRSIG
+			remake_manifest( wd_dirs[ev->wd] );
+#endif /* USE_DIRSIG */
+			if ( ev->mask & IN_ISDIR )
+				{
+				if ( ev->mask & ( IN_CREATE | IN_MOVED_TO ) )
+					push_name( &dirs, path );
+				}
+			else if ( ev->mask & ( IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB ) )
+				push_name( &files, path );
+			}
+		}
+	fill();
+#endif /* HAVE_SYS_INOTIFY_H */
+	}
+
+
+void
+presign_done( void )
+	{
+	if ( running > 0 )
+		--running;
+	fill();
+	}
+
+
+void
+presign_destroy( void )
+	{
+	char name[MAXPATHLEN];
+	int wd;
+
+	if ( dirp != (DIR*) 0 )
+		{
+		(void) closedir( dirp );
+		dirp = (DIR*) 0;
+		}
+	while ( pop_name( &dirs, name ) == 0 )
+		continue;
+	while ( pop_name( &files, name ) == 0 )
+		continue;
+#ifdef USE_DIRSIG
+	while ( pop_name( &manifests, name ) == 0 )
+		continue;
+#endif /* USE_DIRSIG */
+	for ( wd = 0; wd < max_wd; ++wd )
+		free( (void*) wd_dirs[wd] );
+	free( (void*) wd_dirs );
+	wd_dirs = (char**) 0;
+	max_wd = watch_count = 0;
+	if ( ifd >= 0 )
+		{
+		(void) close( ifd );
+		ifd = -1;
+		}
+	if ( walk_timer != (Timer*) 0 )
+		{
+		tmr_cancel( walk_timer );
+		walk_timer = (Timer*) 0;
+		}
+	running = 0;
+	server = (httpd_server*) 0;
+	}
+
+
+void
+presign_logstats( long secs )
+	{
+	if ( secs > 0 && server != (httpd_server*) 0 )
+		syslog(
+			LOG_INFO, "  pre-signer - %ld files submitted, %d running, %d directories watched%s",
+			submitted, running, watch_count,
+			( dirp != (DIR*) 0 || dirs.head != (Name*) 0 ) ? ", walking" : "" );
+	submitted = 0;
+	}
+
+
+/* Hands files to the signing pool while there is room. */
+static void
+fill( void )
+	{
+	char path[MAXPATHLEN];
+	struct stat sb;
+
+	if ( server == (httpd_server*) 0 )
+		return;
+	examined = 0;
+	while ( running < PRESIGN_JOBS && examined < WALK_BATCH )
+		{
+#ifdef USE_DIRSIG
+		/* (Manifests after the changed files, before the walk.) */
+		if ( files.head == (Name*) 0 && pop_name( &manifests, path ) == 0 )
+			{
+			++examined;
+			if ( stat( path, &sb ) == 0 && S_ISDIR( sb.st_mode ) &&
+				 httpd_presign_dir( path, &sb ) == 0 )
+				{
+				++running;
+				++submitted;
+				}
+			continue;
+			}
+#endif /* USE_DIRSIG */
+		if ( next_file( path, &sb ) < 0 )
+			break;
+		if ( wants_sign( path, &sb ) && httpd_presign( path, &sb ) == 0 )
+			{
+			++running;
+			++submitted;
+			}
+		}
+	/* The rest of the walk in a next turn of the main loop.  (Not in 0 ms:
+	** it would run again in this one, from tmr_run().)
+	*/
+	if ( examined >= WALK_BATCH && walk_timer == (Timer*) 0 )
+		walk_timer = tmr_create( (struct timeval*) 0, walk_on, JunkClientData, WALK_MSECS, 0 );
+	}
+
+
+static void
+walk_on( ClientData client_data, struct timeval* nowP )
+	{
+	walk_timer = (Timer*) 0;
+	fill();
+	}
+
+
+/* Puts in path the next regular file, a changed one first, else the next
+** one of the walk.  Returns -1 when there is none left, or when WALK_BATCH
+** entries were looked at in this turn.
+*/
+static int
+next_file( char* path, struct stat* sbP )
+	{
+	struct dirent* de;
+
+	for (;;)
+		{
+		if ( examined++ >= WALK_BATCH )
+			return -1;
+		if ( pop_name( &files, path ) == 0 )
+			{
+			if ( lstat( path, sbP ) == 0 && S_ISREG( sbP->st_mode ) )
+				return 0;
+			continue;
+			}
+		if ( dirp == (DIR*) 0 )
+			{
+			if ( pop_name( &dirs, dirpath ) < 0 )
+				return -1;
+			/* (Watched before it is read, so nothing is missed.) */
+			watch_dir( dirpath );
+#ifdef USE_DIRSIG
+			remake_manifest( dirpath );
+#endif /* USE_DIRSIG */
+			dirp = opendir( dirpath );
+			continue;
+			}
+		de = readdir( dirp );
+		if ( de == (struct dirent*) 0 )
+			{
+			(void) closedir( dirp );
+			dirp = (DIR*) 0;
+			continue;
+			}
+		if ( strcmp( de->d_name, "." ) == 0 || strcmp( de->d_name, ".." ) == 0 ||
+			 join( path, dirpath, de->d_name ) < 0 || lstat( path, sbP ) < 0 )
+			continue;
+		/* (Symbolic links aren't followed: their target is signed by name.) */
+		if ( S_ISDIR( sbP->st_mode ) )
+			push_name( &dirs, path );
+		else if ( S_ISREG( sbP->st_mode ) )
+			return 0;
+		}
+	}
+
+
+/* Whether a request for path would be signed, and its signature isn't
+** cached.
+*/
+static int
+wants_sign( const char* path, const struct stat* sbP )
+	{
+	/* (Executable files aren't served but as CGI.) */
+	if ( ! ( sbP->st_mode & S_IROTH ) || ( sbP->st_mode & S_IXOTH ) )
+		return 0;
+	if ( match_exec( server->sig_match, path, (int*) 0, 0 ) != 0 )
+		return 0;
+	return ! sigcache_has( path, sbP );
+	}
+
+
+/* Puts in path the name in dir, without a "./" in front.  Returns -1 if too
+** long.
+*/
+static int
+join( char* path, const char* dir, const char* name )
+	{
+	int len;
+
+	if ( strcmp( dir, "." ) == 0 )
+		len = snprintf( path, MAXPATHLEN, "%s", name );
+	else
+		len = snprintf( path, MAXPATHLEN, "%s/%s", dir, name );
+	return ( len < 0 || len >= MAXPATHLEN ) ? -1 : 0;
+	}
+
+
+static void
+push_name( NameList* l, const char* name )
+	{
+	size_t len = strlen( name ) + 1;
+	Name* n;
+
+	n = (Name*) malloc( sizeof(Name) + len );
+	if ( n == (Name*) 0 )
+		{
+		syslog( LOG_ERR, "out of memory queueing %.80s for signature", name );
+		return;
+		}
+	(void) memcpy( (char*) ( n + 1 ), name, len );
+	n->next = (Name*) 0;
+	if ( l->tail != (Name*) 0 )
+		l->tail->next = n;
+	else
+		l->head = n;
+	l->tail = n;
+	}
+
+
+/* Takes the first name of l into name (MAXPATHLEN bytes long).  Returns -1
+** if l is empty.
+*/
+static int
+pop_name( NameList* l, char* name )
+	{
+	Name* n = l->head;
+
+	if ( n == (Name*) 0 )
+		return -1;
+	l->head = n->next;
+	if ( l->head == (Name*) 0 )
+		l->tail = (Name*) 0;
+	(void) strcpy( name, (char*) ( n + 1 ) );
+	free( (void*) n );
+	return 0;
+	}
+
+
+static void
+watch_dir( const char* dir )
+	{
+#ifdef HAVE_SYS_INOTIFY_H
+	int wd;
+	char* copy;
+
+	if ( ifd < 0 )
+		return;
+	wd = inotify_add_watch( ifd, dir, WATCH_MASK );
+	if ( wd < 0 )
+		{
+		if ( errno == ENOSPC )
+			syslog( LOG_WARNING, "inotify_add_watch %.80s - %m - raise fs.inotify.max_user_watches", dir );
+		return;
+		}
+	if ( wd >= max_wd )
+		{
+		int new_max = ( max_wd == 0 ? 64 : max_wd );
+		char** new_dirs;
+
+		while ( new_max <= wd )
+			new_max *= 2;
+		new_dirs = (char**) realloc( (void*) wd_dirs, new_max * sizeof(char*) );
+		if ( new_dirs == (char**) 0 )
+			{
+			(void) inotify_rm_watch( ifd, wd );
+			return;
+			}
+		(void) memset( &new_dirs[max_wd], 0, ( new_max - max_wd ) * sizeof(char*) );
+		wd_dirs = new_dirs;
+		max_wd = new_max;
+		}
+	/* (Watching it again, under a new name maybe, gives the same wd.) */
+	copy = strdup( dir );
+	if ( copy == (char*) 0 )
+		return;
+	if ( wd_dirs[wd] == (char*) 0 )
+		++watch_count;
+	free( (void*) wd_dirs[wd] );
+	wd_dirs[wd] = copy;
+#endif /* HAVE_SYS_INOTIFY_H */
+	}
+
+#ifdef USE_DIRSIG
+/* Queues dir for its manifest to be made again, if one was asked for
+** already (it is then cached) and it isn't queued yet.
+*/
+static void
+remake_manifest( const char* dir )
+	{
+	char cachefile[MAXPATHLEN];
+	struct stat sb;
+	Name* n;
+
+	for ( n = manifests.head; n != (Name*) 0; n = n->next )
+		if ( strcmp( (char*) ( n + 1 ), dir ) == 0 )
+			return;
+	if ( dirsig_ready() && dirsig_path( cachefile, sizeof(cachefile), dir ) == 0 &&
+		 stat( cachefile, &sb ) == 0 )
+		push_name( &manifests, dir );
+	}
+#endif /* USE_DIRSIG */
+
+#endif /* USE_PRESIGN */
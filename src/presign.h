@@ -0,0 +1,38 @@
+/* presign.h - header file for the background pre-signer
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The pre-signer hands to the signing pool, as low priority jobs, the files
+* of the web directory which would be signed and whose cached signature is
+* missing or stale: all of them at startup, then the ones inotify reports
+* changed.  A signed response then rarely has to wait for its signature.
+*/
+
+#ifndef _PRESIGN_H_
+#define _PRESIGN_H_
+
+#include "libhttpd.h"
+
+/*! Start walking the current directory, for the files hs would sign.  Call
+ * it once the signing pool runs, in one process only.
+ * \return the inotify fd to watch for reading (then call presign_events()),
+ * or -1 if changes after the startup walk won't be seen.
+ */
+int presign_init( httpd_server* hs );
+
+/*! Read the pending inotify events and queue the files they concern. */
+void presign_events( void );
+
+/*! A job from httpd_presign() came back from the signing pool: hand the
+ * next file.
+ */
+void presign_done( void );
+
+/*! Free all storage, usually in preparation for exitting. */
+void presign_destroy( void );
+
+/*! Generate debugging statistics syslog message. */
+void presign_logstats( long secs );
+
+#endif /* _PRESIGN_H_ */
@@ -0,0 +1,359 @@
+/* rcache.c - response cache: whole small-file responses, ready to be written
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* An entry is keyed by the (dev, ino, mtime, size) of the file (the mtime to
+* the nanosecond where stat() has it) and by the variant of the response
+* (protocol and Connection header), and also remembers the type and encodings
+* it was served with.  Its buffer holds the headers followed by the body; the
+* only header which changes from a request to another, the Date, is patched in
+* place from a string formatted once per second.  A buffer still being sent is
+* never patched: a copy of the entry replaces it instead.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "libhttpd.h"
+#include "rcache.h"
+
+
+/* Defines. */
+#ifndef RESPONSE_CACHE_MAX_FILE
+#define RESPONSE_CACHE_MAX_FILE 16384
+#endif
+#ifndef RESPONSE_CACHE_MAX_BYTES
+#define RESPONSE_CACHE_MAX_BYTES 16000000
+#endif
+#ifndef RESPONSE_CACHE_EXPIRE_AGE
+#define RESPONSE_CACHE_EXPIRE_AGE 600
+#endif
+#define HASH_SIZE (1 << 10)
+#define DATE_LEN 29		/* strlen( "Sun, 06 Nov 1994 08:49:37 GMT" ) */
+
+
+/* The Entry struct, followed by its buffer in the same allocation. */
+typedef struct EntryStruct {
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	long mtime_nsec;
+	off_t size;
+	int variant;
+	char* type;
+	char* encodings;
+	char* buf;
+	size_t len;
+	size_t date_idx;		/* where the Date header value is in buf */
+	time_t date;			/* the second it says */
+	int refcount;
+	int cached;				/* still in the hash, else freed when released */
+	time_t used_at;
+	unsigned int hash;
+	struct EntryStruct* next;
+	struct EntryStruct* lru_next;	/* cached entries, most recently used first */
+	struct EntryStruct* lru_prev;
+	} Entry;
+
+
+/* Globals. */
+static Entry* hash_table[HASH_SIZE];
+static Entry* lru_head = (Entry*) 0;
+static Entry* lru_tail = (Entry*) 0;
+static int entry_count = 0;
+static size_t cached_bytes = 0;
+static long hits = 0, misses = 0;
+static time_t date_now = (time_t) -1;
+static char date_str[DATE_LEN + 1];
+
+
+/* Forwards. */
+static unsigned int hash( const struct stat* sbP, int variant );
+static Entry* find_entry( const struct stat* sbP, int variant, unsigned int h );
+static Entry* new_entry( const struct stat* sbP, int variant, const char* type, const char* encodings, size_t len );
+static void drop_entry( Entry* e );
+static const char* date_string( time_t now );
+
+
+char*
+rcache_get( const struct stat* sbP, int variant, const char* type, const char* encodings, time_t now, size_t* lenP )
+	{
+	Entry* e;
+	Entry* e2;
+
+	e = find_entry( sbP, variant, hash( sbP, variant ) );
+	if ( e == (Entry*) 0 || strcmp( e->type, type ) != 0 ||
+		 strcmp( e->encodings, encodings ) != 0 )
+		{
+		++misses;
+		return (char*) 0;
+		}
+
+	if ( e->date != now )
+		{
+		if ( e->refcount > 0 )
+			{
+			/* Some connection is still sending it: patch a copy. */
+			e2 = new_entry( sbP, variant, type, encodings, e->len );
+			if ( e2 == (Entry*) 0 )
+				{
+				++misses;
+				return (char*) 0;
+				}
+			(void) memcpy( e2->buf, e->buf, e->len );
+			e2->date_idx = e->date_idx;
+			drop_entry( e );
+			e = e2;
+			}
+		(void) memcpy( &e->buf[e->date_idx], date_string( now ), DATE_LEN );
+		e->date = now;
+		}
+
+	/* Move it to the front of the LRU list. */
+	if ( e != lru_head )
+		{
+		e->lru_prev->lru_next = e->lru_next;
+		if ( e->lru_next != (Entry*) 0 )
+			e->lru_next->lru_prev = e->lru_prev;
+		else
+			lru_tail = e->lru_prev;
+		e->lru_prev = (Entry*) 0;
+		e->lru_next = lru_head;
+		lru_head->lru_prev = e;
+		lru_head = e;
+		}
+	++e->refcount;
+	e->used_at = now;
+	++hits;
+	*lenP = e->len;
+	return e->buf;
+	}
+
+
+void
+rcache_put( const struct stat* sbP, int variant, const char* type, const char* encodings, const char* header, size_t headerlen, const char* body )
+	{
+	Entry* e;
+	const char* cp;
+	size_t len;
+
+	if ( RESPONSE_CACHE_MAX_FILE <= 0 || sbP->st_size > RESPONSE_CACHE_MAX_FILE )
+		return;
+	/* Find the Date header, and check it has the usual length. */
+	for ( cp = header; cp + 8 + DATE_LEN + 2 <= header + headerlen; ++cp )
+		if ( memcmp( cp, "\015\012Date: ", 8 ) == 0 )
+			break;
+	if ( cp + 8 + DATE_LEN + 2 > header + headerlen || cp[8 + DATE_LEN] != '\015' )
+		return;
+
+	e = find_entry( sbP, variant, hash( sbP, variant ) );
+	if ( e != (Entry*) 0 )
+		{
+		if ( strcmp( e->type, type ) == 0 && strcmp( e->encodings, encodings ) == 0 )
+			return;
+		/* Same file, under another name: keep the latest. */
+		drop_entry( e );
+		}
+
+	len = headerlen + sbP->st_size;
+	/* Make room, least recently used first. */
+	for ( e = lru_tail; e != (Entry*) 0 && cached_bytes + len > RESPONSE_CACHE_MAX_BYTES; )
+		{
+		Entry* prev = e->lru_prev;
+		if ( e->refcount == 0 )
+			drop_entry( e );
+		e = prev;
+		}
+	if ( cached_bytes + len > RESPONSE_CACHE_MAX_BYTES )
+		return;
+
+	e = new_entry( sbP, variant, type, encodings, len );
+	if ( e == (Entry*) 0 )
+		return;
+	(void) memcpy( e->buf, header, headerlen );
+	(void) memcpy( &e->buf[headerlen], body, sbP->st_size );
+	e->date_idx = cp + 8 - header;
+	e->date = (time_t) -1;
+	}
+
+
+void
+rcache_release( char* buf )
+	{
+	Entry* e = ( (Entry*) buf ) - 1;
+
+	if ( --e->refcount == 0 && ! e->cached )
+		free( (void*) e );
+	}
+
+
+void
+rcache_cleanup( struct timeval* nowP )
+	{
+	time_t now;
+	Entry* e;
+	Entry* prev;
+
+	if ( nowP != (struct timeval*) 0 )
+		now = nowP->tv_sec;
+	else
+		now = time( (time_t*) 0 );
+
+	for ( e = lru_tail; e != (Entry*) 0; e = prev )
+		{
+		prev = e->lru_prev;
+		if ( now - e->used_at < RESPONSE_CACHE_EXPIRE_AGE )
+			break;
+		if ( e->refcount == 0 )
+			drop_entry( e );
+		}
+	}
+
+
+void
+rcache_destroy( void )
+	{
+	/* The entries still referenced are freed when released. */
+	while ( lru_head != (Entry*) 0 )
+		drop_entry( lru_head );
+	}
+
+
+void
+rcache_logstats( long secs )
+	{
+	if ( secs > 0 )
+		syslog(
+			LOG_INFO, "  response cache - %d entries, %lld bytes, %ld hits, %ld misses (%g/sec)",
+			entry_count, (long long) cached_bytes, hits, misses, (float) misses / secs );
+	hits = misses = 0;
+	}
+
+
+static unsigned int
+hash( const struct stat* sbP, int variant )
+	{
+	unsigned int h = 177573;
+
+	h ^= sbP->st_dev;
+	h += h << 5;
+	h ^= sbP->st_ino;
+	h += h << 5;
+	h ^= sbP->st_mtime;
+	h += h << 5;
+	h ^= ST_MTIME_NSEC( *sbP );
+	h += h << 5;
+	h ^= sbP->st_size;
+	h += h << 5;
+	h ^= variant;
+	h += h << 5;
+	return h;
+	}
+
+
+static Entry*
+find_entry( const struct stat* sbP, int variant, unsigned int h )
+	{
+	Entry* e;
+
+	for ( e = hash_table[h & ( HASH_SIZE - 1 )]; e != (Entry*) 0; e = e->next )
+		if ( e->hash == h && e->ino == sbP->st_ino && e->dev == sbP->st_dev &&
+			 e->mtime == sbP->st_mtime && e->mtime_nsec == ST_MTIME_NSEC( *sbP ) &&
+			 e->size == sbP->st_size &&
+			 e->variant == variant )
+			return e;
+	return (Entry*) 0;
+	}
+
+
+/* Allocates an entry with a buffer of len bytes, and caches it. */
+static Entry*
+new_entry( const struct stat* sbP, int variant, const char* type, const char* encodings, size_t len )
+	{
+	Entry* e;
+	size_t typelen = strlen( type ) + 1;
+	size_t encodingslen = strlen( encodings ) + 1;
+
+	e = (Entry*) malloc( sizeof(Entry) + len + typelen + encodingslen );
+	if ( e == (Entry*) 0 )
+		return (Entry*) 0;
+	e->buf = (char*) ( e + 1 );
+	e->type = &e->buf[len];
+	e->encodings = &e->type[typelen];
+	(void) memcpy( e->type, type, typelen );
+	(void) memcpy( e->encodings, encodings, encodingslen );
+	e->dev = sbP->st_dev;
+	e->ino = sbP->st_ino;
+	e->mtime = sbP->st_mtime;
+	e->mtime_nsec = ST_MTIME_NSEC( *sbP );
+	e->size = sbP->st_size;
+	e->variant = variant;
+	e->len = len;
+	e->refcount = 0;
+	e->cached = 1;
+	e->used_at = time( (time_t*) 0 );
+	e->hash = hash( sbP, variant );
+	e->next = hash_table[e->hash & ( HASH_SIZE - 1 )];
+	hash_table[e->hash & ( HASH_SIZE - 1 )] = e;
+	e->lru_prev = (Entry*) 0;
+	e->lru_next = lru_head;
+	if ( lru_head != (Entry*) 0 )
+		lru_head->lru_prev = e;
+	else
+		lru_tail = e;
+	lru_head = e;
+	++entry_count;
+	cached_bytes += len;
+	return e;
+	}
+
+
+/* Takes an entry out of the cache; it is freed now, or when released. */
+static void
+drop_entry( Entry* e )
+	{
+	Entry** ep;
+
+	for ( ep = &hash_table[e->hash & ( HASH_SIZE - 1 )]; *ep != e; ep = &(*ep)->next )
+		continue;
+	*ep = e->next;
+	if ( e->lru_prev != (Entry*) 0 )
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		lru_head = e->lru_next;
+	if ( e->lru_next != (Entry*) 0 )
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		lru_tail = e->lru_prev;
+	--entry_count;
+	cached_bytes -= e->len;
+	e->cached = 0;
+	if ( e->refcount == 0 )
+		free( (void*) e );
+	}
+
+
+/* The HTTP date of now, formatted once per second. */
+static const char*
+date_string( time_t now )
+	{
+	if ( now != date_now )
+		{
+		(void) strftime( date_str, sizeof(date_str), "%a, %d %b %Y %T GMT", gmtime( &now ) );
+		date_now = now;
+		}
+	return date_str;
+	}
@@ -0,0 +1,45 @@
+/* rcache.h - header file for the response cache
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The response cache keeps the whole 200 response (headers and body) to a
+* GET of a small file in one buffer, so that serving it again is a single
+* write(), with no header to format nor file to map.
+*/
+
+#ifndef _RCACHE_H_
+#define _RCACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/*! Returns the cached response to the file described by sbP, served in
+ * the given variant (protocol and connection headers) with the given type
+ * and encodings, its Date header set to now; and its length in *lenP.
+ * Returns (char*) 0 if there is none.  The buffer must be given back with
+ * rcache_release().
+ */
+char* rcache_get( const struct stat* sbP, int variant, const char* type, const char* encodings, time_t now, size_t* lenP );
+
+/*! Caches the response made of header (which has a Date header) and of the
+ * sbP->st_size bytes of body.
+ */
+void rcache_put( const struct stat* sbP, int variant, const char* type, const char* encodings, const char* header, size_t headerlen, const char* body );
+
+/*! Gives back a buffer returned by rcache_get(). */
+void rcache_release( char* buf );
+
+/*! Free the entries unused for a while.  Should be called periodically.
+ * If you have the current time, pass it in, otherwise pass 0.
+ */
+void rcache_cleanup( struct timeval* nowP );
+
+/*! Free all storage, usually in preparation for exitting. */
+void rcache_destroy( void );
+
+/*! Generate debugging statistics syslog message. */
+void rcache_logstats( long secs );
+
+#endif /* _RCACHE_H_ */
@@ -0,0 +1,745 @@
+/* sigcache.c - sharded, size-bounded signature cache
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* A pack is only appended to, in one write() of a whole record under a
+* shared flock(), or replaced as a whole: rewritten under an exclusive one
+* into a temporary file renamed over it.  A process indexes the records of
+* a pack by their key, remembering the inode and the length it read: a
+* longer pack has its new records read, another inode (rewritten by another
+* process) is read again.  A lookup is then a probe of the index and one
+* pread(), whose first line must match the file signed (keys are hashes,
+* and may collide).  Once a pack is over its share of the budget, the
+* writer rewrites it with the records it read lately first, then the most
+* recently written, until it is 7/8 full: so the stale signatures go.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <sys/file.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "libhttpd.h"
+#include "sigcache.h"
+
+#ifdef SIG_CACHEDIR
+
+
+/* Defines. */
+#ifndef MAXPATHLEN
+#define MAXPATHLEN 2048
+#endif
+#define MAX_HEADER_LEN ( MAXPATHLEN + 64 )
+#define MAX_RECORD_LEN ( MAX_HEADER_LEN + SIGCACHE_MAX_SIG_LEN )
+#define PACK_NAME "%s/%02x.pack"
+/* "SIGC <key> <length>\n" */
+#define PREFIX "SIGC "
+#define PREFIX_LEN 31
+#define SCAN_SIZE 65536
+
+
+/* A record of a pack, as indexed. */
+typedef struct {
+	unsigned long long key;
+	off_t offset;			/* of its first line */
+	size_t len;				/* after its first line; 0 for a free slot */
+	time_t used;			/* when this process last read it, or 0 */
+	} Slot;
+
+/* The index of a pack. */
+typedef struct {
+	Slot* slots;			/* open addressing, on the key */
+	int nslots, maxslots;
+	dev_t dev;				/* of the pack indexed */
+	ino_t ino;
+	off_t scanned;			/* its bytes indexed */
+	time_t checked;			/* when its pack was last stat()ed */
+	int broken;				/* a bad record stopped the indexing */
+	} Shard;
+
+
+/* Globals. */
+static const char* cache_dir = (char*) 0;
+static off_t max_bytes = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static Shard shards[SIGCACHE_SHARDS];
+static char scan_buf[SCAN_SIZE];
+static long hits = 0, misses = 0, written = 0, evicted = 0;
+
+
+/* Forwards. */
+static unsigned long long key( const char* filename, const struct stat* sbP );
+static unsigned long long fnv( unsigned long long h, const char* buf, size_t len );
+static int pack_path( char* path, size_t size, int shard );
+static int make_header( char* header, size_t size, const char* filename, const struct stat* sbP );
+static int write_fully( int fd, const char* buf, size_t len );
+static int read_record( int fd, const Slot* s, char* buf );
+static void refresh( int shard );
+static void index_pack( int shard, int fd );
+static void scan( int shard, int fd );
+static Slot* find_slot( Shard* sh, unsigned long long k );
+static int add_slot( Shard* sh, unsigned long long k, off_t offset, size_t len );
+static void reset( Shard* sh );
+static int open_pack( int shard, int flags, int how );
+static long rewrite( int shard, int fd, int (*keep)( const char* buf, size_t len ), off_t budget, int dry_run, off_t* bytesP, long* evictedP );
+static int slot_compare( const void* a, const void* b );
+
+
+int
+sigcache_init( const char* dir, off_t maxbytes )
+	{
+	struct stat sb;
+	int i;
+
+	if ( stat( dir, &sb ) < 0 || ! S_ISDIR( sb.st_mode ) )
+		{
+		syslog( LOG_ERR, "invalid cache dir %.80s - %m", dir );
+		return -1;
+		}
+	for ( i = 0; i < SIGCACHE_SHARDS; ++i )
+		reset( &shards[i] );
+	max_bytes = maxbytes;
+	cache_dir = dir;
+	return 0;
+	}
+
+
+int
+sigcache_has( const char* filename, const struct stat* sbP )
+	{
+	unsigned long long k;
+	int shard, r;
+
+	if ( cache_dir == (char*) 0 )
+		return 0;
+	k = key( filename, sbP );
+	shard = (int) ( k >> 56 );
+	(void) pthread_mutex_lock( &lock );
+	/* (Asked from the main loop: the pack is looked at once a second.) */
+	if ( shards[shard].checked != time( (time_t*) 0 ) )
+		refresh( shard );
+	r = ( find_slot( &shards[shard], k )->len > 0 );
+	(void) pthread_mutex_unlock( &lock );
+	return r;
+	}
+
+
+char*
+sigcache_get( const char* filename, const struct stat* sbP, size_t* lenP )
+	{
+	char header[MAX_HEADER_LEN];
+	char* buf = (char*) 0;
+	unsigned long long k;
+	Slot* s;
+	int hlen, fd, shard;
+
+	if ( cache_dir == (char*) 0 ||
+		 ( hlen = make_header( header, sizeof(header), filename, sbP ) ) < 0 )
+		return (char*) 0;
+	k = key( filename, sbP );
+	shard = (int) ( k >> 56 );
+	(void) pthread_mutex_lock( &lock );
+	refresh( shard );
+	s = find_slot( &shards[shard], k );
+	if ( s->len > (size_t) hlen && ( fd = open_pack( shard, O_RDONLY, 0 ) ) >= 0 )
+		{
+		/* (open_pack() indexed it again if it was rewritten meanwhile.) */
+		s = find_slot( &shards[shard], k );
+		if ( s->len > (size_t) hlen && ( buf = (char*) malloc( s->len ) ) != (char*) 0 &&
+			 ( read_record( fd, s, buf ) < 0 || memcmp( buf, header, hlen ) != 0 ) )
+			{
+			free( (void*) buf );
+			buf = (char*) 0;
+			}
+		(void) close( fd );
+		}
+	if ( buf == (char*) 0 )
+		++misses;
+	else
+		{
+		++hits;
+		s->used = time( (time_t*) 0 );
+		*lenP = s->len - hlen;
+		(void) memmove( buf, &buf[hlen], *lenP );
+		}
+	(void) pthread_mutex_unlock( &lock );
+	return buf;
+	}
+
+
+int
+sigcache_put( const char* filename, const struct stat* sbP, const char* sig, size_t len )
+	{
+	char header[MAX_HEADER_LEN];
+	char* rec;
+	unsigned long long k;
+	Shard* sh;
+	off_t share = max_bytes / SIGCACHE_SHARDS;
+	int hlen, fd, shard, r;
+
+	if ( cache_dir == (char*) 0 || len == 0 || len > SIGCACHE_MAX_SIG_LEN ||
+		 strchr( filename, '\n' ) != (char*) 0 )
+		return -1;
+	hlen = make_header( header, sizeof(header), filename, sbP );
+	if ( hlen < 0 )
+		return -1;
+	/* (One more byte, for the '\0' of the first line.) */
+	rec = (char*) malloc( PREFIX_LEN + hlen + len + 1 );
+	if ( rec == (char*) 0 )
+		return -1;
+	k = key( filename, sbP );
+	shard = (int) ( k >> 56 );
+	sh = &shards[shard];
+	(void) snprintf( rec, PREFIX_LEN + 1, PREFIX "%016llx %08x\n", k, (unsigned int) ( hlen + len ) );
+	(void) memcpy( &rec[PREFIX_LEN], header, hlen );
+	(void) memcpy( &rec[PREFIX_LEN + hlen], sig, len );
+
+	(void) pthread_mutex_lock( &lock );
+	fd = open_pack( shard, O_RDWR | O_APPEND | O_CREAT, LOCK_SH );
+	if ( fd < 0 )
+		{
+		(void) pthread_mutex_unlock( &lock );
+		free( (void*) rec );
+		syslog( LOG_WARNING, "caching in shard %02x - %m", shard );
+		return -1;
+		}
+	r = write_fully( fd, rec, PREFIX_LEN + hlen + len );
+	free( (void*) rec );
+	if ( r == 0 )
+		{
+		/* Index it, with whatever the others appended meanwhile. */
+		++written;
+		index_pack( shard, fd );
+		find_slot( sh, k )->used = time( (time_t*) 0 );
+		if ( max_bytes > 0 && ( sh->scanned > share || sh->broken ) &&
+			 flock( fd, LOCK_EX | LOCK_NB ) == 0 )
+			(void) rewrite( shard, fd, (int (*)( const char*, size_t )) 0, share - share / 8, 0, (off_t*) 0, (long*) 0 );
+		}
+	(void) close( fd );
+	(void) pthread_mutex_unlock( &lock );
+	return r;
+	}
+
+
+void
+sigcache_walk( int (*func)( const char* buf, size_t len ) )
+	{
+	char buf[MAX_RECORD_LEN];
+	Shard* sh;
+	int shard, i, fd, stop = 0;
+
+	if ( cache_dir == (char*) 0 )
+		return;
+	for ( shard = 0; shard < SIGCACHE_SHARDS && ! stop; ++shard )
+		{
+		(void) pthread_mutex_lock( &lock );
+		fd = open_pack( shard, O_RDONLY, 0 );
+		if ( fd >= 0 )
+			{
+			sh = &shards[shard];
+			for ( i = 0; i < sh->maxslots && ! stop; ++i )
+				if ( sh->slots[i].len > 0 && read_record( fd, &sh->slots[i], buf ) == 0 )
+					stop = func( buf, sh->slots[i].len );
+			(void) close( fd );
+			}
+		(void) pthread_mutex_unlock( &lock );
+		}
+	}
+
+
+long
+sigcache_compact( int shard, int (*keep)( const char* buf, size_t len ), off_t budget, int dry_run, off_t* bytesP, long* evictedP )
+	{
+	long n;
+	int fd;
+
+	*bytesP = 0;
+	*evictedP = 0;
+	if ( cache_dir == (char*) 0 )
+		return -1;
+	(void) pthread_mutex_lock( &lock );
+	fd = open_pack( shard, O_RDWR, dry_run ? LOCK_SH : LOCK_EX );
+	if ( fd < 0 )
+		{
+		(void) pthread_mutex_unlock( &lock );
+		return errno == ENOENT ? 0 : -1;
+		}
+	index_pack( shard, fd );
+	n = rewrite( shard, fd, keep, budget, dry_run, bytesP, evictedP );
+	(void) close( fd );
+	(void) pthread_mutex_unlock( &lock );
+	return n;
+	}
+
+
+int
+sigcache_parse( const char* buf, size_t len, char* name, size_t namesize, off_t* sizeP, time_t* mtimeP, long* nsecP, const char** sigP, size_t* siglenP )
+	{
+	const char* eol;
+	const char* cp;
+	char* end;
+	size_t namelen;
+
+	/* (Each number starts with a digit, so ends before the newline.) */
+	eol = (const char*) memchr( buf, '\n', len );
+	if ( eol == (char*) 0 || eol + 1 == buf + len || ! isdigit( (unsigned char) buf[0] ) )
+		return -1;
+	*sizeP = (off_t) strtoll( buf, &end, 10 );
+	if ( *end != ' ' || ! isdigit( (unsigned char) end[1] ) )
+		return -1;
+	cp = end + 1;
+	*mtimeP = (time_t) strtol( cp, &end, 10 );
+	if ( *end != '.' || ! isdigit( (unsigned char) end[1] ) )
+		return -1;
+	cp = end + 1;
+	*nsecP = strtol( cp, &end, 10 );
+	if ( *end != ' ' || end + 1 >= eol )
+		return -1;
+	cp = end + 1;
+	namelen = eol - cp;
+	if ( namelen >= namesize )
+		return -1;
+	(void) memcpy( name, cp, namelen );
+	name[namelen] = '\0';
+	*sigP = eol + 1;
+	*siglenP = buf + len - *sigP;
+	return 0;
+	}
+
+
+void
+sigcache_logstats( long secs )
+	{
+	(void) pthread_mutex_lock( &lock );
+	if ( secs > 0 )
+		syslog(
+			LOG_INFO, "  signature cache - %ld hits, %ld misses, %ld written, %ld evicted",
+			hits, misses, written, evicted );
+	hits = misses = written = evicted = 0;
+	(void) pthread_mutex_unlock( &lock );
+	}
+
+
+/* The key of a file, its shard in the top 8 bits. */
+static unsigned long long
+key( const char* filename, const struct stat* sbP )
+	{
+	char buf[100];
+	int len;
+
+	len = snprintf(
+		buf, sizeof(buf), " %lld %ld.%09ld",
+		(long long) sbP->st_size, (long) sbP->st_mtime, (long) ST_MTIME_NSEC( *sbP ) );
+	return fnv( fnv( 14695981039346656037ULL, filename, strlen( filename ) ), buf, len );
+	}
+
+
+/* FNV-1a, 64 bits. */
+static unsigned long long
+fnv( unsigned long long h, const char* buf, size_t len )
+	{
+	const unsigned char* cp;
+
+	for ( cp = (const unsigned char*) buf; cp < (const unsigned char*) buf + len; ++cp )
+		h = ( h ^ *cp ) * 1099511628211ULL;
+	return h;
+	}
+
+
+static int
+pack_path( char* path, size_t size, int shard )
+	{
+	int len;
+
+	len = snprintf( path, size, PACK_NAME, cache_dir, shard );
+	return ( len < 0 || len >= size ) ? -1 : 0;
+	}
+
+
+static int
+make_header( char* header, size_t size, const char* filename, const struct stat* sbP )
+	{
+	int len;
+
+	len = snprintf(
+		header, size, "%lld %ld.%09ld %s\n",
+		(long long) sbP->st_size, (long) sbP->st_mtime, (long) ST_MTIME_NSEC( *sbP ), filename );
+	return ( len < 0 || len >= size ) ? -1 : len;
+	}
+
+
+static int
+write_fully( int fd, const char* buf, size_t len )
+	{
+	ssize_t r;
+
+	while ( len > 0 )
+		{
+		r = write( fd, buf, len );
+		if ( r < 0 && errno == EINTR )
+			continue;
+		if ( r <= 0 )
+			return -1;
+		buf += r;
+		len -= r;
+		}
+	return 0;
+	}
+
+
+/* Reads the record of s, after its first line, into buf. */
+static int
+read_record( int fd, const Slot* s, char* buf )
+	{
+	return pread( fd, buf, s->len, s->offset + PREFIX_LEN ) == s->len ? 0 : -1;
+	}
+
+
+/* Brings the index of shard up to date with its pack. */
+static void
+refresh( int shard )
+	{
+	char path[MAXPATHLEN];
+	struct stat sb;
+	Shard* sh = &shards[shard];
+	int fd;
+
+	if ( pack_path( path, sizeof(path), shard ) < 0 )
+		return;
+	sh->checked = time( (time_t*) 0 );
+	if ( stat( path, &sb ) < 0 )
+		{
+		if ( errno == ENOENT )
+			reset( sh );
+		return;
+		}
+	if ( sb.st_ino == sh->ino && sb.st_dev == sh->dev &&
+		 ( sb.st_size == sh->scanned || sh->broken ) )
+		return;
+	fd = open( path, O_RDONLY );
+	if ( fd >= 0 )
+		{
+		index_pack( shard, fd );
+		(void) close( fd );
+		}
+	}
+
+
+/* Indexes the pack open on fd: its new records, or all of them if it
+** isn't the one indexed.
+*/
+static void
+index_pack( int shard, int fd )
+	{
+	struct stat sb;
+	Shard* sh = &shards[shard];
+
+	if ( fstat( fd, &sb ) < 0 )
+		return;
+	if ( sb.st_ino != sh->ino || sb.st_dev != sh->dev || sb.st_size < sh->scanned )
+		{
+		reset( sh );
+		sh->dev = sb.st_dev;
+		sh->ino = sb.st_ino;
+		}
+	if ( sb.st_size > sh->scanned && ! sh->broken )
+		scan( shard, fd );
+	}
+
+
+/* Reads the records of the pack on fd from where its index stops.  A
+** record being appended stops it until next time; a bad one for good.
+*/
+static void
+scan( int shard, int fd )
+	{
+	Shard* sh = &shards[shard];
+	unsigned long long k;
+	unsigned long len;
+	ssize_t r;
+	size_t p;
+	char* end;
+
+	for (;;)
+		{
+		r = pread( fd, scan_buf, sizeof(scan_buf), sh->scanned );
+		if ( r < PREFIX_LEN )
+			return;
+		for ( p = 0; r - p >= PREFIX_LEN; p += PREFIX_LEN + len )
+			{
+			if ( memcmp( &scan_buf[p], PREFIX, sizeof(PREFIX) - 1 ) != 0 ||
+				 scan_buf[p + PREFIX_LEN - 10] != ' ' || scan_buf[p + PREFIX_LEN - 1] != '\n' )
+				break;
+			k = strtoull( &scan_buf[p + sizeof(PREFIX) - 1], &end, 16 );
+			if ( end != &scan_buf[p + PREFIX_LEN - 10] || (int) ( k >> 56 ) != shard )
+				break;
+			len = strtoul( end + 1, &end, 16 );
+			if ( end != &scan_buf[p + PREFIX_LEN - 1] || len == 0 || len > MAX_RECORD_LEN )
+				break;
+			if ( PREFIX_LEN + len > r - p )
+				{
+				/* (The rest is read next turn, if it is there yet.) */
+				len = 0;
+				r = p;
+				break;
+				}
+			if ( add_slot( sh, k, sh->scanned + p, len ) < 0 )
+				{
+				r = p;
+				break;
+				}
+			}
+		if ( r - p >= PREFIX_LEN )
+			{
+			syslog( LOG_WARNING, "bad record in signature cache shard %02x", shard );
+			sh->broken = 1;
+			}
+		sh->scanned += p;
+		if ( p == 0 || sh->broken )
+			return;
+		}
+	}
+
+
+/* The slot of k, or the free one where it would go. */
+static Slot*
+find_slot( Shard* sh, unsigned long long k )
+	{
+	static Slot none;
+	int i;
+
+	if ( sh->maxslots == 0 )
+		{
+		none.len = 0;
+		return &none;
+		}
+	for ( i = (int) ( k & ( sh->maxslots - 1 ) ); ; i = ( i + 1 ) & ( sh->maxslots - 1 ) )
+		if ( sh->slots[i].len == 0 || sh->slots[i].key == k )
+			return &sh->slots[i];
+	}
+
+
+/* Indexes the record of k at offset, in place of an older one of k. */
+static int
+add_slot( Shard* sh, unsigned long long k, off_t offset, size_t len )
+	{
+	Slot* old = sh->slots;
+	Slot* s;
+	int oldmax = sh->maxslots, i;
+
+	if ( ( sh->nslots + 1 ) * 2 > sh->maxslots )
+		{
+		sh->maxslots = ( oldmax == 0 ? 64 : oldmax * 2 );
+		sh->slots = (Slot*) calloc( sh->maxslots, sizeof(Slot) );
+		if ( sh->slots == (Slot*) 0 )
+			{
+			sh->slots = old;
+			sh->maxslots = oldmax;
+			return -1;
+			}
+		for ( i = 0; i < oldmax; ++i )
+			if ( old[i].len > 0 )
+				*find_slot( sh, old[i].key ) = old[i];
+		free( (void*) old );
+		}
+	s = find_slot( sh, k );
+	if ( s->len == 0 )
+		{
+		++sh->nslots;
+		s->key = k;
+		s->used = 0;
+		}
+	s->offset = offset;
+	s->len = len;
+	return 0;
+	}
+
+
+static void
+reset( Shard* sh )
+	{
+	free( (void*) sh->slots );
+	sh->slots = (Slot*) 0;
+	sh->nslots = sh->maxslots = 0;
+	sh->dev = 0;
+	sh->ino = 0;
+	sh->scanned = 0;
+	sh->broken = 0;
+	}
+
+
+/* Opens the pack of shard, flock()ed as how says (0 for not at all), and
+** indexes it again if it isn't the one indexed.  \return the fd, or -1.
+*/
+static int
+open_pack( int shard, int flags, int how )
+	{
+	char path[MAXPATHLEN];
+	struct stat sb, fsb;
+	int fd, tries;
+
+	if ( pack_path( path, sizeof(path), shard ) < 0 )
+		{
+		errno = ENAMETOOLONG;
+		return -1;
+		}
+	for ( tries = 0; tries < 3; ++tries )
+		{
+		fd = open( path, flags, 0644 );
+		if ( fd < 0 )
+			return -1;
+		if ( how != 0 && flock( fd, how ) < 0 )
+			{
+			(void) close( fd );
+			return -1;
+			}
+		/* (Locked, it stays the pack, unless it was just replaced.) */
+		if ( fstat( fd, &fsb ) == 0 && stat( path, &sb ) == 0 &&
+			 sb.st_ino == fsb.st_ino && sb.st_dev == fsb.st_dev )
+			{
+			if ( fsb.st_ino != shards[shard].ino || fsb.st_dev != shards[shard].dev )
+				index_pack( shard, fd );
+			return fd;
+			}
+		(void) close( fd );
+		}
+	errno = EAGAIN;
+	return -1;
+	}
+
+
+/* Rewrites the pack of shard, open and locked on fd, and indexed to its
+** end, with the records to keep (see sigcache_compact()).
+*/
+static long
+rewrite( int shard, int fd, int (*keep)( const char* buf, size_t len ), off_t budget, int dry_run, off_t* bytesP, long* evictedP )
+	{
+	char path[MAXPATHLEN];
+	char tmpfile[MAXPATHLEN];
+	char buf[PREFIX_LEN + MAX_RECORD_LEN];
+	Shard* sh = &shards[shard];
+	Shard fresh;
+	Slot* order;
+	struct stat sb;
+	off_t bytes = 0, offset = 0;
+	long n = 0, gone = 0;
+	int i, count, first, tfd;
+
+	if ( pack_path( path, sizeof(path), shard ) < 0 ||
+		 snprintf( tmpfile, sizeof(tmpfile), "%s.XXXXXX", path ) >= sizeof(tmpfile) )
+		return -1;
+	order = (Slot*) malloc( ( sh->nslots > 0 ? sh->nslots : 1 ) * sizeof(Slot) );
+	if ( order == (Slot*) 0 )
+		return -1;
+	for ( i = 0; i < sh->maxslots; ++i )
+		if ( sh->slots[i].len > 0 )
+			order[n++] = sh->slots[i];
+	count = n;
+	/* Least recently used first: kept from the other end. */
+	qsort( order, count, sizeof(Slot), slot_compare );
+	for ( first = count; first > 0; --first )
+		{
+		Slot* s = &order[first - 1];
+
+		if ( keep != (int (*)( const char*, size_t )) 0 &&
+			 ( read_record( fd, s, buf ) < 0 || ! keep( buf, s->len ) ) )
+			{
+			s->len = 0;
+			continue;
+			}
+		if ( budget > 0 && bytes + PREFIX_LEN + s->len > budget )
+			break;
+		bytes += PREFIX_LEN + s->len;
+		}
+	for ( i = 0; i < first; ++i )
+		if ( order[i].len > 0 )
+			++gone;
+	n = 0;
+	for ( i = first; i < count; ++i )
+		if ( order[i].len > 0 )
+			++n;
+	if ( bytesP != (off_t*) 0 )
+		*bytesP = bytes;
+	if ( evictedP != (long*) 0 )
+		*evictedP = gone;
+	if ( dry_run )
+		{
+		free( (void*) order );
+		return n;
+		}
+
+	/* The records kept, least recently used first, in a new pack. */
+	(void) memset( (void*) &fresh, 0, sizeof(fresh) );
+	tfd = mkstemp( tmpfile );
+	if ( tfd < 0 )
+		{
+		free( (void*) order );
+		return -1;
+		}
+	for ( i = first; i < count; ++i )
+		{
+		Slot* s = &order[i];
+
+		if ( s->len == 0 )
+			continue;
+		if ( pread( fd, buf, PREFIX_LEN + s->len, s->offset ) != PREFIX_LEN + s->len ||
+			 write_fully( tfd, buf, PREFIX_LEN + s->len ) < 0 ||
+			 add_slot( &fresh, s->key, offset, s->len ) < 0 )
+			break;
+		find_slot( &fresh, s->key )->used = s->used;
+		offset += PREFIX_LEN + s->len;
+		}
+	free( (void*) order );
+	if ( i < count || fchmod( tfd, 0644 ) < 0 || fstat( tfd, &sb ) < 0 ||
+		 rename( tmpfile, path ) < 0 )
+		{
+		syslog( LOG_WARNING, "rewriting signature cache shard %02x - %m", shard );
+		(void) close( tfd );
+		(void) unlink( tmpfile );
+		reset( &fresh );
+		return -1;
+		}
+	(void) close( tfd );
+	reset( sh );
+	*sh = fresh;
+	sh->dev = sb.st_dev;
+	sh->ino = sb.st_ino;
+	sh->scanned = offset;
+	evicted += gone;
+	return n;
+	}
+
+
+/* Least recently used first: by when this process read them, then by
+** when they were written.
+*/
+static int
+slot_compare( const void* a, const void* b )
+	{
+	const Slot* sa = (const Slot*) a;
+	const Slot* sb = (const Slot*) b;
+
+	if ( sa->used != sb->used )
+		return sa->used < sb->used ? -1 : 1;
+	return sa->offset < sb->offset ? -1 : ( sa->offset > sb->offset ? 1 : 0 );
+	}
+
+#endif /* SIG_CACHEDIR */
@@ -0,0 +1,79 @@
+/* sigcache.h - header file for the sharded signature cache
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The signatures are cached under SIG_CACHEDIR in 256 pack files, one per
+* shard, each a sequence of records only ever appended to:
+*
+*	SIGC <key: 16 hex digits> <length of the rest: 8 hex digits>\n
+*	<size> <mtime>.<nanoseconds> <name>\n
+*	<the armored signature>
+*
+* where the key is a 64-bit hash of the name, size and mtime of the file,
+* its top 8 bits the shard: <shard: 2 hex digits>.pack.  A changed file
+* gets a new key: its old signature is never read again, and goes with the
+* least recently used ones when the pack is rewritten, once it is over its
+* share of SIG_CACHE_MAX_BYTES.  Each process indexes the records of a
+* pack in memory the first time it needs it, then as the pack grows.  All
+* this may be used from any thread.
+*/
+
+#ifndef _SIGCACHE_H_
+#define _SIGCACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define SIGCACHE_SHARDS 256
+#define SIGCACHE_MAX_SIG_LEN 16384	/* bigger signatures aren't cached */
+
+/*! Cache the signatures in dir (which must stay), in at most maxbytes (0
+ * for no limit).
+ * \return 0, or -1 if dir isn't a directory: nothing will be cached.
+ */
+int sigcache_init( const char* dir, off_t maxbytes );
+
+/*! Whether the signature of filename, described by sbP, seems cached (the
+ * index has its key, but the record isn't read).  Meant for the main loop:
+ * it is a lookup in memory, the pack being stat()ed at most once a second,
+ * so it may miss what the other processes cached in the last second.
+ */
+int sigcache_has( const char* filename, const struct stat* sbP );
+
+/*! Read the signature of filename, described by sbP.
+ * \return it, malloc()ed, and its length in *lenP; or (char*) 0.
+ */
+char* sigcache_get( const char* filename, const struct stat* sbP, size_t* lenP );
+
+/*! Cache sig, len bytes, as the signature of filename described by sbP,
+ * making room in its shard if need be.
+ * \return 0, or -1.
+ */
+int sigcache_put( const char* filename, const struct stat* sbP, const char* sig, size_t len );
+
+/*! Call func with each signature cached (its record after the first
+ * line, as sigcache_parse() reads it), until it returns non-zero.
+ */
+void sigcache_walk( int (*func)( const char* buf, size_t len ) );
+
+/*! Rewrite the pack of shard with only the records that keep (if not
+ * null, given them as sigcache_walk() does) says to keep, most recently
+ * used first, while they fit in budget bytes (0 for no limit).  With
+ * dry_run set, only count.
+ * \return how many records are kept, with their bytes in *bytesP and how
+ * many went for the budget in *evictedP; or -1.
+ */
+long sigcache_compact( int shard, int (*keep)( const char* buf, size_t len ), off_t budget, int dry_run, off_t* bytesP, long* evictedP );
+
+/*! Split the len bytes of a record, after its first line, into the name
+ * (copied in name, of namesize bytes), size, mtime and mtime nanoseconds
+ * of the file, and its signature.
+ * \return 0, or -1 if it isn't a record.
+ */
+int sigcache_parse( const char* buf, size_t len, char* name, size_t namesize, off_t* sizeP, time_t* mtimeP, long* nsecP, const char** sigP, size_t* siglenP );
+
+/*! Generate debugging statistics syslog message. */
+void sigcache_logstats( long secs );
+
+#endif /* _SIGCACHE_H_ */
@@ -0,0 +1,559 @@
+/* sigcompact.c - offline cleanup of the signature cache
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* Run in the running directory of the server (or given it), while the
+* server runs or not.  It moves the signatures cached the old ways (one
+* file per file signed, where it is in the web directory or in a shard
+* directory) into the packs, removes the left over temporary files, then
+* rewrites each pack without the signatures of files which were deleted or
+* changed, nor the least recently used ones beyond its share of the budget.
+* Last, it removes the Merkle trees of files deleted or changed, and the
+* manifests of directories deleted, an hour old at least (a younger one may
+* be the temporary file of a writer).
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syslog.h>
+#include <errno.h>
+
+#ifdef HAVE_DIRENT_H
+# include <dirent.h>
+#else
+# define dirent direct
+# ifdef HAVE_SYS_NDIR_H
+#  include <sys/ndir.h>
+# endif
+# ifdef HAVE_SYS_DIR_H
+#  include <sys/dir.h>
+# endif
+# ifdef HAVE_NDIR_H
+#  include <ndir.h>
+# endif
+#endif
+
+#include "libhttpd.h"
+#include "sigcache.h"
+
+#ifdef SIG_CACHEDIR
+
+
+/* Defines. */
+#ifndef MAXPATHLEN
+#define MAXPATHLEN 2048
+#endif
+#define MAX_FILE_LEN ( SIGCACHE_MAX_SIG_LEN + MAXPATHLEN + 64 )
+#define KEY_DIGITS 16
+#define PACK_SUFFIX ".pack"
+#define COUNTED_NAME ".counted"
+#define TMP_MAX_AGE 3600
+
+
+/* Globals. */
+static char* argv0;
+static int dry_run = 0;
+static time_t now;
+static long nkept = 0;
+static off_t kept_bytes = 0;
+static long migrated = 0, stale = 0, broken = 0, temporary = 0, evicted = 0;
+#if defined(USE_MERKLE) || defined(USE_DIRSIG)
+static long pruned = 0;
+#endif /* USE_MERKLE || USE_DIRSIG */
+
+
+/* Forwards. */
+static void usage( void );
+static void read_shard_dir( char* path );
+static void migrate( char* path, size_t prefixlen );
+static void migrate_key( const char* path, const struct stat* sbP );
+static void moved_in( const struct stat* sbP );
+static int keep_fresh( const char* buf, size_t len );
+static void drop( const char* path, long* countP );
+static int is_shard( const char* name );
+static int is_key( const char* name, size_t len );
+static int is_temporary( const char* name, size_t len );
+#if defined(USE_MERKLE) || defined(USE_DIRSIG)
+static void prune( char* path, size_t prefixlen, int (*fresh)( const char* path, const char* webpath ) );
+#endif /* USE_MERKLE || USE_DIRSIG */
+#ifdef USE_MERKLE
+static int tree_fresh( const char* path, const char* webpath );
+#endif /* USE_MERKLE */
+#ifdef USE_DIRSIG
+static int manifest_fresh( const char* path, const char* webpath );
+#endif /* USE_DIRSIG */
+
+#endif /* SIG_CACHEDIR */
+
+
+int
+main( int argc, char** argv )
+	{
+#ifdef SIG_CACHEDIR
+	off_t budget = SIG_CACHE_MAX_BYTES;
+	char path[MAXPATHLEN];
+	DIR* dirp;
+	struct dirent* de;
+	struct stat sb;
+	off_t share, bytes;
+	size_t len, namelen;
+	long n, ev;
+	int argn, i;
+
+	argv0 = argv[0];
+	for ( argn = 1; argn < argc && argv[argn][0] == '-'; ++argn )
+		{
+		if ( strcmp( argv[argn], "-n" ) == 0 )
+			dry_run = 1;
+		else if ( strcmp( argv[argn], "-b" ) == 0 && argn + 1 < argc )
+			budget = (off_t) strtoll( argv[++argn], (char**) 0, 10 );
+		else
+			usage();
+		}
+	if ( argn + 1 < argc )
+		usage();
+	if ( argn < argc && chdir( argv[argn] ) < 0 )
+		{
+		perror( argv[argn] );
+		exit( 1 );
+		}
+	/* (Signatures are cached from the web directory, as the server runs.) */
+	if ( chdir( WEB_DIR ) < 0 )
+		{
+		perror( WEB_DIR );
+		exit( 1 );
+		}
+	openlog( argv0, LOG_PERROR, LOG_USER );
+	now = time( (time_t*) 0 );
+	/* (No room is made while moving signatures in: it is made below.) */
+	if ( sigcache_init( SIG_CACHE_DIR, 0 ) < 0 )
+		exit( 1 );
+
+	len = strlen( SIG_CACHE_DIR );
+	(void) strcpy( path, SIG_CACHE_DIR );
+	dirp = opendir( path );
+	if ( dirp == (DIR*) 0 )
+		{
+		perror( path );
+		exit( 1 );
+		}
+	while ( ( de = readdir( dirp ) ) != (struct dirent*) 0 )
+		{
+		if ( strcmp( de->d_name, "." ) == 0 || strcmp( de->d_name, ".." ) == 0 ||
+			 len + 1 + strlen( de->d_name ) + 1 > sizeof(path) )
+			continue;
+		path[len] = '/';
+		(void) strcpy( &path[len + 1], de->d_name );
+		if ( lstat( path, &sb ) < 0 )
+			continue;
+		namelen = strlen( de->d_name );
+		if ( S_ISDIR( sb.st_mode ) && namelen == 2 && is_shard( de->d_name ) )
+			read_shard_dir( path );
+		else if ( S_ISREG( sb.st_mode ) && namelen > 2 && is_shard( de->d_name ) &&
+				  strncmp( &de->d_name[2], PACK_SUFFIX, sizeof(PACK_SUFFIX) - 1 ) == 0 )
+			{
+			/* A pack, or what is left of one being rewritten. */
+			if ( namelen != 2 + sizeof(PACK_SUFFIX) - 1 && sb.st_mtime < now - TMP_MAX_AGE )
+				drop( path, &temporary );
+			}
+		else
+			migrate( path, len + 1 );
+		}
+	(void) closedir( dirp );
+
+	/* (Packs are rewritten after the move, with what went there.) */
+	share = budget / SIGCACHE_SHARDS;
+	if ( budget > 0 && share == 0 )
+		share = 1;
+	for ( i = 0; i < SIGCACHE_SHARDS; ++i )
+		{
+		n = sigcache_compact( i, keep_fresh, share, dry_run, &bytes, &ev );
+		if ( n < 0 )
+			{
+			(void) fprintf( stderr, "%s: shard %02x: %s\n", argv0, i, strerror( errno ) );
+			continue;
+			}
+		nkept += n;
+		kept_bytes += bytes;
+		evicted += ev;
+		}
+
+	(void) printf(
+		"%s%ld signatures kept (%lld bytes), %ld moved in, %ld stale, %ld broken, %ld temporary files, %ld least recently used removed\n",
+		dry_run ? "(dry run) " : "", nkept, (long long) kept_bytes,
+		migrated, stale, broken, temporary, evicted );
+
+#ifdef USE_MERKLE
+	(void) strcpy( path, MERKLE_CACHE_DIR );
+	prune( path, strlen( path ) + 1, tree_fresh );
+#endif /* USE_MERKLE */
+#ifdef USE_DIRSIG
+	(void) strcpy( path, DIRSIG_CACHE_DIR );
+	prune( path, strlen( path ) + 1, manifest_fresh );
+#endif /* USE_DIRSIG */
+#if defined(USE_MERKLE) || defined(USE_DIRSIG)
+	(void) printf(
+		"%s%ld trees and manifests removed\n", dry_run ? "(dry run) " : "", pruned );
+#endif /* USE_MERKLE || USE_DIRSIG */
+	exit( 0 );
+#else /* SIG_CACHEDIR */
+	(void) fprintf( stderr, "%s: built without SIG_CACHEDIR\n", argv[0] );
+	exit( 1 );
+#endif /* SIG_CACHEDIR */
+	}
+
+#ifdef SIG_CACHEDIR
+
+
+static void
+usage( void )
+	{
+	(void) fprintf( stderr,
+		"Usage: %s [-n] [-b BYTES] [DIR]\n"
+		"	-n          only tell what would be done\n"
+		"	-b BYTES    how big the cache may be (0 for no limit)\n"
+		"	DIR         running directory of the server - default: the current one\n",
+		argv0 );
+	exit( 1 );
+	}
+
+
+/* Moves the files of a shard directory, as the cache was before the
+** packs, into the pack, and what isn't its files (a web subdirectory with
+** the shard's name, cached the old way) too.
+*/
+static void
+read_shard_dir( char* path )
+	{
+	DIR* dirp;
+	struct dirent* de;
+	struct stat sb;
+	size_t len = strlen( path ), namelen;
+
+	dirp = opendir( path );
+	if ( dirp == (DIR*) 0 )
+		return;
+	while ( ( de = readdir( dirp ) ) != (struct dirent*) 0 )
+		{
+		namelen = strlen( de->d_name );
+		if ( strcmp( de->d_name, "." ) == 0 || strcmp( de->d_name, ".." ) == 0 ||
+			 len + 1 + namelen + 1 > MAXPATHLEN )
+			continue;
+		path[len] = '/';
+		(void) strcpy( &path[len + 1], de->d_name );
+		if ( lstat( path, &sb ) < 0 )
+			continue;
+		if ( is_key( de->d_name, namelen ) && S_ISREG( sb.st_mode ) )
+			migrate_key( path, &sb );
+		else if ( ( is_temporary( de->d_name, namelen ) || strcmp( de->d_name, COUNTED_NAME ) == 0 ) &&
+				  S_ISREG( sb.st_mode ) )
+			/* (Its writer is gone, and so is the count it stamped.) */
+			drop( path, &temporary );
+		else
+			migrate( path, strlen( SIG_CACHE_DIR ) + 1 );
+		}
+	path[len] = '\0';
+	(void) closedir( dirp );
+	if ( ! dry_run )
+		(void) rmdir( path );
+	}
+
+
+/* Moves a file of a shard directory into its pack, if its file is the
+** same.
+*/
+static void
+migrate_key( const char* path, const struct stat* sbP )
+	{
+	char buf[MAX_FILE_LEN];
+	char filename[MAXPATHLEN];
+	struct stat filesb;
+	const char* sig;
+	size_t siglen;
+	off_t size;
+	time_t mtime;
+	long nsec;
+	ssize_t r;
+	int fd;
+
+	r = -1;
+	if ( sbP->st_size <= sizeof(buf) && ( fd = open( path, O_RDONLY ) ) >= 0 )
+		{
+		r = read( fd, buf, sizeof(buf) );
+		(void) close( fd );
+		}
+	if ( r != sbP->st_size ||
+		 sigcache_parse( buf, r, filename, sizeof(filename), &size, &mtime, &nsec, &sig, &siglen ) < 0 ||
+		 siglen == 0 )
+		drop( path, &broken );
+	else if ( stat( filename, &filesb ) < 0 || ! S_ISREG( filesb.st_mode ) ||
+			  filesb.st_size != size || filesb.st_mtime != mtime ||
+			  ST_MTIME_NSEC( filesb ) != nsec )
+		drop( path, &stale );
+	else if ( ! dry_run && sigcache_put( filename, &filesb, sig, siglen ) < 0 )
+		drop( path, &broken );
+	else
+		{
+		moved_in( sbP );
+		if ( ! dry_run )
+			(void) unlink( path );
+		}
+	}
+
+
+/* Moves the signatures cached the old way under path into the packs:
+** their file names are what follows the first prefixlen bytes.
+*/
+static void
+migrate( char* path, size_t prefixlen )
+	{
+	char buf[SIGCACHE_MAX_SIG_LEN];
+	DIR* dirp;
+	struct dirent* de;
+	struct stat sb, filesb;
+	size_t len = strlen( path );
+	ssize_t r;
+	int fd;
+
+	if ( lstat( path, &sb ) < 0 )
+		return;
+	if ( S_ISDIR( sb.st_mode ) )
+		{
+		dirp = opendir( path );
+		if ( dirp == (DIR*) 0 )
+			return;
+		while ( ( de = readdir( dirp ) ) != (struct dirent*) 0 )
+			{
+			if ( strcmp( de->d_name, "." ) == 0 || strcmp( de->d_name, ".." ) == 0 ||
+				 len + 1 + strlen( de->d_name ) + 1 > MAXPATHLEN )
+				continue;
+			path[len] = '/';
+			(void) strcpy( &path[len + 1], de->d_name );
+			migrate( path, prefixlen );
+			}
+		path[len] = '\0';
+		(void) closedir( dirp );
+		if ( ! dry_run )
+			(void) rmdir( path );
+		return;
+		}
+	if ( ! S_ISREG( sb.st_mode ) )
+		return;
+
+	/* (As they were: a signature older than its file is stale.) */
+	if ( stat( &path[prefixlen], &filesb ) < 0 || ! S_ISREG( filesb.st_mode ) ||
+		 sb.st_mtime <= filesb.st_mtime )
+		{
+		drop( path, &stale );
+		return;
+		}
+	r = -1;
+	if ( sb.st_size <= sizeof(buf) && ( fd = open( path, O_RDONLY ) ) >= 0 )
+		{
+		r = read( fd, buf, sizeof(buf) );
+		(void) close( fd );
+		}
+	if ( r <= 0 || r != sb.st_size || ( ! dry_run && sigcache_put( &path[prefixlen], &filesb, buf, r ) < 0 ) )
+		{
+		drop( path, &broken );
+		return;
+		}
+	moved_in( &sb );
+	if ( ! dry_run )
+		(void) unlink( path );
+	}
+
+
+static void
+moved_in( const struct stat* sbP )
+	{
+	++migrated;
+	if ( dry_run )
+		{
+		/* (About its size in a pack, where it isn't.) */
+		++nkept;
+		kept_bytes += sbP->st_size;
+		}
+	}
+
+
+/* Whether to keep a record of a pack: if its file didn't change since. */
+static int
+keep_fresh( const char* buf, size_t len )
+	{
+	char filename[MAXPATHLEN];
+	struct stat sb;
+	const char* sig;
+	size_t siglen;
+	off_t size;
+	time_t mtime;
+	long nsec;
+
+	if ( sigcache_parse( buf, len, filename, sizeof(filename), &size, &mtime, &nsec, &sig, &siglen ) < 0 )
+		{
+		++broken;
+		return 0;
+		}
+	if ( stat( filename, &sb ) < 0 || ! S_ISREG( sb.st_mode ) ||
+		 sb.st_size != size || sb.st_mtime != mtime || ST_MTIME_NSEC( sb ) != nsec )
+		{
+		++stale;
+		return 0;
+		}
+	return 1;
+	}
+
+
+static void
+drop( const char* path, long* countP )
+	{
+	if ( ! dry_run && unlink( path ) < 0 )
+		{
+		perror( path );
+		return;
+		}
+	++*countP;
+	}
+
+
+/* Whether name starts with a shard, in 2 lower case hex digits. */
+static int
+is_shard( const char* name )
+	{
+	return isxdigit( (unsigned char) name[0] ) && ! isupper( (unsigned char) name[0] ) &&
+		isxdigit( (unsigned char) name[1] ) && ! isupper( (unsigned char) name[1] );
+	}
+
+
+/* Whether name (len bytes) is a key, as the shard directories named their
+** files.
+*/
+static int
+is_key( const char* name, size_t len )
+	{
+	size_t i;
+
+	if ( len != KEY_DIGITS )
+		return 0;
+	for ( i = 0; i < len; ++i )
+		if ( ! isxdigit( (unsigned char) name[i] ) || isupper( (unsigned char) name[i] ) )
+			return 0;
+	return 1;
+	}
+
+
+/* Whether name (len bytes) is a temporary file of a shard directory. */
+static int
+is_temporary( const char* name, size_t len )
+	{
+	return len == KEY_DIGITS + 7 && name[KEY_DIGITS] == '.' &&
+		is_key( name, KEY_DIGITS );
+	}
+
+
+#if defined(USE_MERKLE) || defined(USE_DIRSIG)
+/* Removes the files under path, a cache of files about the web directory
+** (their web paths follow the first prefixlen bytes), which aren't fresh
+** and are old enough, then the directories left empty.
+*/
+static void
+prune( char* path, size_t prefixlen, int (*fresh)( const char* path, const char* webpath ) )
+	{
+	DIR* dirp;
+	struct dirent* de;
+	struct stat sb;
+	size_t len = strlen( path );
+
+	dirp = opendir( path );
+	if ( dirp == (DIR*) 0 )
+		return;
+	while ( ( de = readdir( dirp ) ) != (struct dirent*) 0 )
+		{
+		if ( strcmp( de->d_name, "." ) == 0 || strcmp( de->d_name, ".." ) == 0 ||
+			 len + 1 + strlen( de->d_name ) + 1 > MAXPATHLEN )
+			continue;
+		path[len] = '/';
+		(void) strcpy( &path[len + 1], de->d_name );
+		if ( lstat( path, &sb ) < 0 )
+			continue;
+		if ( S_ISDIR( sb.st_mode ) )
+			{
+			prune( path, prefixlen, fresh );
+			if ( ! dry_run )
+				(void) rmdir( path );
+			}
+		else if ( sb.st_mtime < now - TMP_MAX_AGE && ! fresh( path, &path[prefixlen] ) )
+			drop( path, &pruned );
+		}
+	path[len] = '\0';
+	(void) closedir( dirp );
+	}
+#endif /* USE_MERKLE || USE_DIRSIG */
+
+
+#ifdef USE_MERKLE
+/* Whether the tree file path was made of webpath as it is (see merkle.h). */
+static int
+tree_fresh( const char* path, const char* webpath )
+	{
+	char ident[100];
+	char buf[100];
+	struct stat sb;
+	int len, fd;
+	ssize_t r;
+
+	if ( stat( webpath, &sb ) < 0 || ! S_ISREG( sb.st_mode ) )
+		return 0;
+	len = snprintf(
+		ident, sizeof(ident), "%lld %ld.%09ld %llu\n",
+		(long long) sb.st_size, (long) sb.st_mtime, (long) ST_MTIME_NSEC( sb ),
+		(unsigned long long) sb.st_ino );
+	fd = open( path, O_RDONLY );
+	if ( fd < 0 )
+		return 0;
+	r = read( fd, buf, len );
+	(void) close( fd );
+	return r == len && memcmp( buf, ident, len ) == 0;
+	}
+#endif /* USE_MERKLE */
+
+
+#ifdef USE_DIRSIG
+/* Whether path is the manifest of a directory, webpath its DIR_MANIFEST_NAME,
+** which is still there.  (A changed one gets its manifest made again.)
+*/
+static int
+manifest_fresh( const char* path, const char* webpath )
+	{
+	char dir[MAXPATHLEN];
+	const char* name;
+	struct stat sb;
+
+	name = strrchr( webpath, '/' );
+	name = ( name == (char*) 0 ? webpath : name + 1 );
+	if ( strcmp( name, DIR_MANIFEST_NAME ) != 0 )
+		return 0;
+	if ( name == webpath )
+		return 1;
+	(void) memcpy( dir, webpath, name - 1 - webpath );
+	dir[name - 1 - webpath] = '\0';
+	return stat( dir, &sb ) == 0 && S_ISDIR( sb.st_mode );
+	}
+#endif /* USE_DIRSIG */
+
+#endif /* SIG_CACHEDIR */
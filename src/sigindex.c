@@ -0,0 +1,266 @@
+/* sigindex.c - in-memory index of the signature cache
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* An entry is keyed by the file name, and remembers the (dev, ino, mtime,
+* size) of the file it signs (the mtime to the nanosecond where stat() has
+* it): when the file has changed, the entry is stale and dropped as soon as
+* it is looked up.  The name and the signature follow the entry in the same
+* allocation.  At startup the packs of the cache are read in, keeping
+* only the signatures of files which haven't changed since, as far as there
+* is room; later entries come from the signatures made.  The least
+* recently used entries make room when SIG_INDEX_MAX_BYTES is reached.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "libhttpd.h"
+#include "sigindex.h"
+#include "sigcache.h"
+
+#ifdef SIG_CACHEDIR
+
+
+/* Defines. */
+#ifndef SIG_INDEX_MAX_BYTES
+#define SIG_INDEX_MAX_BYTES 8000000
+#endif
+#ifndef MAXPATHLEN
+#define MAXPATHLEN 2048
+#endif
+#define HASH_SIZE (1 << 12)
+
+
+/* The Entry struct, followed by its name and its signature. */
+typedef struct EntryStruct {
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	long mtime_nsec;
+	off_t size;
+	char* name;
+	char* sig;
+	size_t siglen;
+	size_t bytes;			/* of the whole allocation */
+	unsigned int hash;
+	struct EntryStruct* next;
+	struct EntryStruct* lru_next;	/* most recently used first */
+	struct EntryStruct* lru_prev;
+	} Entry;
+
+
+/* Globals. */
+static Entry* hash_table[HASH_SIZE];
+static Entry* lru_head = (Entry*) 0;
+static Entry* lru_tail = (Entry*) 0;
+static int entry_count = 0;
+static size_t indexed_bytes = 0;
+static long hits = 0, misses = 0;
+
+
+/* Forwards. */
+static int index_sig( const char* buf, size_t len );
+static unsigned int hash( const char* filename );
+static Entry* find_entry( const char* filename, unsigned int h );
+static void drop_entry( Entry* e );
+
+
+void
+sigindex_init( const char* dir )
+	{
+	sigcache_walk( index_sig );
+	syslog( LOG_INFO, "%d signatures indexed from %.80s", entry_count, dir );
+	}
+
+
+char*
+sigindex_get( const char* filename, const struct stat* sbP, size_t* lenP )
+	{
+	Entry* e;
+
+	e = find_entry( filename, hash( filename ) );
+	if ( e == (Entry*) 0 )
+		{
+		++misses;
+		return (char*) 0;
+		}
+	if ( e->ino != sbP->st_ino || e->dev != sbP->st_dev ||
+		 e->mtime != sbP->st_mtime || e->mtime_nsec != ST_MTIME_NSEC( *sbP ) ||
+		 e->size != sbP->st_size )
+		{
+		/* The file changed since. */
+		drop_entry( e );
+		++misses;
+		return (char*) 0;
+		}
+
+	/* Move it to the front of the LRU list. */
+	if ( e != lru_head )
+		{
+		e->lru_prev->lru_next = e->lru_next;
+		if ( e->lru_next != (Entry*) 0 )
+			e->lru_next->lru_prev = e->lru_prev;
+		else
+			lru_tail = e->lru_prev;
+		e->lru_prev = (Entry*) 0;
+		e->lru_next = lru_head;
+		lru_head->lru_prev = e;
+		lru_head = e;
+		}
+	++hits;
+	*lenP = e->siglen;
+	return e->sig;
+	}
+
+
+void
+sigindex_put( const char* filename, const struct stat* sbP, const char* sig, size_t len )
+	{
+	Entry* e;
+	size_t namelen = strlen( filename ) + 1;
+	size_t bytes = sizeof(Entry) + namelen + len;
+	unsigned int h = hash( filename );
+
+	if ( len > SIGCACHE_MAX_SIG_LEN )
+		return;
+	e = find_entry( filename, h );
+	if ( e != (Entry*) 0 )
+		drop_entry( e );
+	/* Make room, least recently used first. */
+	while ( lru_tail != (Entry*) 0 && indexed_bytes + bytes > SIG_INDEX_MAX_BYTES )
+		drop_entry( lru_tail );
+	if ( indexed_bytes + bytes > SIG_INDEX_MAX_BYTES )
+		return;
+
+	e = (Entry*) malloc( bytes );
+	if ( e == (Entry*) 0 )
+		return;
+	e->name = (char*) ( e + 1 );
+	e->sig = &e->name[namelen];
+	(void) memcpy( e->name, filename, namelen );
+	(void) memcpy( e->sig, sig, len );
+	e->siglen = len;
+	e->bytes = bytes;
+	e->dev = sbP->st_dev;
+	e->ino = sbP->st_ino;
+	e->mtime = sbP->st_mtime;
+	e->mtime_nsec = ST_MTIME_NSEC( *sbP );
+	e->size = sbP->st_size;
+	e->hash = h;
+	e->next = hash_table[h & ( HASH_SIZE - 1 )];
+	hash_table[h & ( HASH_SIZE - 1 )] = e;
+	e->lru_prev = (Entry*) 0;
+	e->lru_next = lru_head;
+	if ( lru_head != (Entry*) 0 )
+		lru_head->lru_prev = e;
+	else
+		lru_tail = e;
+	lru_head = e;
+	++entry_count;
+	indexed_bytes += bytes;
+	}
+
+
+void
+sigindex_destroy( void )
+	{
+	while ( lru_head != (Entry*) 0 )
+		drop_entry( lru_head );
+	}
+
+
+void
+sigindex_logstats( long secs )
+	{
+	if ( secs > 0 )
+		syslog(
+			LOG_INFO, "  signature index - %d entries, %lld bytes, %ld hits, %ld misses",
+			entry_count, (long long) indexed_bytes, hits, misses );
+	hits = misses = 0;
+	}
+
+
+/* Indexes a signature of the cache, unless its file changed since.
+** \return non-zero once the index is full.
+*/
+static int
+index_sig( const char* buf, size_t len )
+	{
+	struct stat sb;
+	char filename[MAXPATHLEN];
+	const char* sig;
+	size_t siglen;
+	off_t size;
+	time_t mtime;
+	long nsec;
+
+	if ( sigcache_parse( buf, len, filename, sizeof(filename), &size, &mtime, &nsec, &sig, &siglen ) == 0 &&
+		 stat( filename, &sb ) == 0 && S_ISREG( sb.st_mode ) &&
+		 sb.st_size == size && sb.st_mtime == mtime && ST_MTIME_NSEC( sb ) == nsec )
+		sigindex_put( filename, &sb, sig, siglen );
+	return indexed_bytes >= SIG_INDEX_MAX_BYTES;
+	}
+
+
+static unsigned int
+hash( const char* filename )
+	{
+	unsigned int h = 177573;
+	const unsigned char* cp;
+
+	for ( cp = (const unsigned char*) filename; *cp != '\0'; ++cp )
+		{
+		h ^= *cp;
+		h += h << 5;
+		}
+	return h;
+	}
+
+
+static Entry*
+find_entry( const char* filename, unsigned int h )
+	{
+	Entry* e;
+
+	for ( e = hash_table[h & ( HASH_SIZE - 1 )]; e != (Entry*) 0; e = e->next )
+		if ( e->hash == h && strcmp( e->name, filename ) == 0 )
+			return e;
+	return (Entry*) 0;
+	}
+
+
+static void
+drop_entry( Entry* e )
+	{
+	Entry** ep;
+
+	for ( ep = &hash_table[e->hash & ( HASH_SIZE - 1 )]; *ep != e; ep = &(*ep)->next )
+		continue;
+	*ep = e->next;
+	if ( e->lru_prev != (Entry*) 0 )
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		lru_head = e->lru_next;
+	if ( e->lru_next != (Entry*) 0 )
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		lru_tail = e->lru_prev;
+	--entry_count;
+	indexed_bytes -= e->bytes;
+	free( (void*) e );
+	}
+
+#endif /* SIG_CACHEDIR */
@@ -0,0 +1,38 @@
+/* sigindex.h - header file for the in-memory index of the signature cache
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The signature index keeps in memory the detached signatures cached in
+* SIG_CACHEDIR, so that a signed file whose signature is known is answered
+* by the main loop at once, without a signing job nor an interposer.
+*/
+
+#ifndef _SIGINDEX_H_
+#define _SIGINDEX_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*! Index the signatures cached under dir (given to sigcache_init()), of
+ * the files whose names are relative to the current directory, as far as
+ * there is room.
+ */
+void sigindex_init( const char* dir );
+
+/*! Returns the signature of filename, if the index has one of the file
+ * described by sbP, and its length in *lenP; else (char*) 0.  The
+ * signature stays valid until the next call to this package.
+ */
+char* sigindex_get( const char* filename, const struct stat* sbP, size_t* lenP );
+
+/*! Remembers sig as the signature of the file described by sbP. */
+void sigindex_put( const char* filename, const struct stat* sbP, const char* sig, size_t len );
+
+/*! Free all storage, usually in preparation for exitting. */
+void sigindex_destroy( void );
+
+/*! Generate debugging statistics syslog message. */
+void sigindex_logstats( long secs );
+
+#endif /* _SIGINDEX_H_ */
@@ -0,0 +1,990 @@
+/* signpool.c - signing worker pool: detached signatures made by processes
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* Jobs wait in a FIFO until a thread takes them, the low priority ones in a
+* second FIFO, taken from only when the first one is empty (or moved to the
+* first one, when a response comes to wait for them).  Each thread hands its
+* jobs to its own signer process, forked before any thread starts, over a
+* socket pair, and waits for the answer: the threads never take a lock of
+* gpgme, stdio or syslog, so that the main loop may fork its children at any
+* time.  A signer maps the file (checking it's still the one which was
+* stat()ed), looks its signature up in the signature cache, else signs (in
+* process when pgpsign.c could load the key, else with its own gpgme context)
+* and caches it.  A job with a tree file gets its Merkle tree made and its
+* manifest signed too, unless the tree file was made of the file as it is; a
+* job with a directory name makes and signs the manifest of that directory
+* instead, or only touches the cached one if nothing changed.  Both go through
+* a temporary file renamed in place, so that two signers making the same one
+* don't mix their output.  Finished jobs are linked in a list, and the main
+* loop is woken up through an eventfd (or a pipe where there is none).
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syslog.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif /* HAVE_SYS_EVENTFD_H */
+
+#include "libhttpd.h"
+#include "signpool.h"
+#include "pgpsign.h"
+#include "merkle.h"
+#include "dirsig.h"
+#include "sigcache.h"
+
+#ifdef USE_SIGN_POOL
+
+
+/* What a thread sends its signer: the strings (filename, cachename,
+** cachefile, treefile, dirname) follow, each with its '\0', slen 0 for a
+** null one.
+*/
+#define NSTRINGS 5
+typedef struct {
+	struct stat sb;
+	off_t first;
+	size_t len;
+	size_t slen[NSTRINGS];
+	} Request;
+
+/* What the signer answers: the signature follows.  The counts are the
+** signer's since its last answer.
+*/
+typedef struct {
+	gpgme_error_t err;
+	size_t siglen;
+	long signed_count, cache_hits, errors;
+	} Reply;
+
+typedef struct {
+	pid_t pid;
+	int fd;			/* -1 once the signer is lost */
+	} Signer;
+
+
+/* Globals. */
+static int nthreads = 0;
+static pthread_t* threads;
+static Signer* signers;
+static int nsigners = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static SignJob* queue_head = (SignJob*) 0;
+static SignJob* queue_tail = (SignJob*) 0;
+static SignJob* low_head = (SignJob*) 0;
+static SignJob* low_tail = (SignJob*) 0;
+static SignJob* done_head = (SignJob*) 0;
+static int pending = 0;			/* low priority jobs apart */
+static int low_pending = 0;
+static int stopping = 0;
+static int notify_fds[2] = { -1, -1 };	/* the same eventfd twice, or a pipe */
+static long signed_count = 0, cache_hits = 0, errors = 0, lost = 0;
+static long latency = 0;		/* ms, main loop only */
+
+
+/* Forwards. */
+static void* worker( void* arg );
+static void relay( Signer* sp, SignJob* job );
+static void signer( int fd, gpgme_ctx_t mainctx );
+static void serve( int fd, gpgme_ctx_t ctx );
+static int read_all( int fd, void* buf, size_t len );
+static int write_all( int fd, const void* buf, size_t len );
+static void sign_job( gpgme_ctx_t ctx, SignJob* job );
+static gpgme_error_t sign_data( gpgme_ctx_t ctx, const char* data, size_t len, char** sigP, size_t* siglenP );
+static gpgme_error_t engine_sign( gpgme_ctx_t ctx, const char* data, size_t len, char** sigP, size_t* siglenP );
+#if defined(USE_MERKLE) || defined(USE_DIRSIG)
+static void write_file( const char* path, const char* buf, size_t len );
+#endif /* USE_MERKLE || USE_DIRSIG */
+#ifdef USE_MERKLE
+static void make_tree( gpgme_ctx_t ctx, SignJob* job );
+#endif /* USE_MERKLE */
+#ifdef USE_DIRSIG
+static void make_manifest( gpgme_ctx_t ctx, SignJob* job );
+#endif /* USE_DIRSIG */
+
+
+int
+signpool_init( int nworkers, gpgme_ctx_t ctx )
+	{
+	sigset_t all, omask;
+	int sv[2];
+	pid_t pid;
+	int i, j;
+
+	if ( nworkers <= 0 )
+		return -1;
+#ifdef HAVE_SYS_EVENTFD_H
+	notify_fds[0] = notify_fds[1] = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	if ( notify_fds[0] < 0 )
+		{
+		syslog( LOG_ERR, "eventfd - %m" );
+		return -1;
+		}
+#else /* HAVE_SYS_EVENTFD_H */
+	if ( pipe( notify_fds ) < 0 )
+		{
+		syslog( LOG_ERR, "pipe - %m" );
+		return -1;
+		}
+	for ( i = 0; i < 2; ++i )
+		{
+		(void) fcntl( notify_fds[i], F_SETFL, fcntl( notify_fds[i], F_GETFL, 0 ) | O_NONBLOCK );
+		(void) fcntl( notify_fds[i], F_SETFD, FD_CLOEXEC );
+		}
+#endif /* HAVE_SYS_EVENTFD_H */
+
+	threads = (pthread_t*) malloc( nworkers * sizeof(pthread_t) );
+	signers = (Signer*) malloc( nworkers * sizeof(Signer) );
+	if ( threads == (pthread_t*) 0 || signers == (Signer*) 0 )
+		{
+		syslog( LOG_ERR, "out of memory allocating the signing pool" );
+		signpool_destroy();
+		return -1;
+		}
+
+	/* All the signers first, while this process has only one thread. */
+	for ( i = 0; i < nworkers; ++i )
+		{
+		if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 )
+			{
+			syslog( LOG_ERR, "socketpair - %m" );
+			break;
+			}
+		pid = fork();
+		if ( pid < 0 )
+			{
+			syslog( LOG_ERR, "fork - %m" );
+			(void) close( sv[0] );
+			(void) close( sv[1] );
+			break;
+			}
+		if ( pid == 0 )
+			{
+			/* Child process: only its own end open, so that each signer
+			** sees the end of file when its thread's process is gone.
+			*/
+			for ( j = 0; j < nsigners; ++j )
+				(void) close( signers[j].fd );
+			(void) close( sv[0] );
+			signer( sv[1], ctx );
+			_exit( 0 );
+			}
+		(void) close( sv[1] );
+		(void) fcntl( sv[0], F_SETFD, FD_CLOEXEC );
+		signers[nsigners].pid = pid;
+		signers[nsigners].fd = sv[0];
+		++nsigners;
+		}
+
+	/* The threads inherit the signal mask: with all of them blocked, the
+	** handlers (shut_down() and signpool_destroy() included) only run in
+	** the main thread.
+	*/
+	(void) sigfillset( &all );
+	(void) pthread_sigmask( SIG_SETMASK, &all, &omask );
+	for ( i = 0; i < nsigners; ++i )
+		{
+		if ( pthread_create( &threads[i], (pthread_attr_t*) 0, worker, &signers[i] ) != 0 )
+			{
+			syslog( LOG_ERR, "pthread_create - %m" );
+			break;
+			}
+		++nthreads;
+		}
+	(void) pthread_sigmask( SIG_SETMASK, &omask, (sigset_t*) 0 );
+	if ( nthreads == 0 )
+		{
+		signpool_destroy();
+		return -1;
+		}
+	return notify_fds[0];
+	}
+
+
+int
+signpool_pending( void )
+	{
+	int n;
+
+	if ( nthreads == 0 )
+		return -1;
+	(void) pthread_mutex_lock( &lock );
+	n = pending;
+	(void) pthread_mutex_unlock( &lock );
+	return n;
+	}
+
+
+long
+signpool_latency( void )
+	{
+	return latency;
+	}
+
+
+int
+signpool_submit( SignJob* job )
+	{
+	if ( nthreads == 0 )
+		return -1;
+	job->sig = (char*) 0;
+	job->siglen = 0;
+	job->err = GPG_ERR_NO_ERROR;
+	job->next = (SignJob*) 0;
+	(void) gettimeofday( &job->queued, (struct timezone*) 0 );
+	(void) pthread_mutex_lock( &lock );
+	if ( job->low )
+		{
+		if ( low_tail != (SignJob*) 0 )
+			low_tail->next = job;
+		else
+			low_head = job;
+		low_tail = job;
+		++low_pending;
+		}
+	else
+		{
+		if ( queue_tail != (SignJob*) 0 )
+			queue_tail->next = job;
+		else
+			queue_head = job;
+		queue_tail = job;
+		++pending;
+		}
+	(void) pthread_cond_signal( &wake );
+	(void) pthread_mutex_unlock( &lock );
+	return 0;
+	}
+
+
+int
+signpool_promote( SignJob* job )
+	{
+	SignJob** jP;
+	SignJob* prev = (SignJob*) 0;
+	int r = 0;
+
+	(void) pthread_mutex_lock( &lock );
+	for ( jP = &low_head; *jP != (SignJob*) 0; prev = *jP, jP = &(*jP)->next )
+		if ( *jP == job )
+			{
+			*jP = job->next;
+			if ( low_tail == job )
+				low_tail = prev;
+			--low_pending;
+			job->next = (SignJob*) 0;
+			if ( queue_tail != (SignJob*) 0 )
+				queue_tail->next = job;
+			else
+				queue_head = job;
+			queue_tail = job;
+			++pending;
+			r = 1;
+			break;
+			}
+	(void) pthread_mutex_unlock( &lock );
+	return r;
+	}
+
+
+int
+signpool_cancel( SignJob* job )
+	{
+	SignJob** jP;
+	SignJob* prev = (SignJob*) 0;
+	int r = 0;
+
+	(void) pthread_mutex_lock( &lock );
+	for ( jP = &queue_head; *jP != (SignJob*) 0; prev = *jP, jP = &(*jP)->next )
+		if ( *jP == job )
+			{
+			*jP = job->next;
+			if ( queue_tail == job )
+				queue_tail = prev;
+			--pending;
+			r = 1;
+			break;
+			}
+	(void) pthread_mutex_unlock( &lock );
+	return r;
+	}
+
+
+SignJob*
+signpool_collect( void )
+	{
+	SignJob* jobs;
+	SignJob* job;
+	struct timeval now;
+	long ms;
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t count;
+#else /* HAVE_SYS_EVENTFD_H */
+	char buf[64];
+#endif /* HAVE_SYS_EVENTFD_H */
+
+	/* Reset the notification first: a job finished from now on
+	** notifies again.
+	*/
+#ifdef HAVE_SYS_EVENTFD_H
+	(void) read( notify_fds[0], &count, sizeof(count) );
+#else /* HAVE_SYS_EVENTFD_H */
+	while ( read( notify_fds[0], buf, sizeof(buf) ) > 0 )
+		continue;
+#endif /* HAVE_SYS_EVENTFD_H */
+	(void) pthread_mutex_lock( &lock );
+	jobs = done_head;
+	done_head = (SignJob*) 0;
+	(void) pthread_mutex_unlock( &lock );
+
+	/* (The pre-signer's jobs wait behind the others on purpose.) */
+	(void) gettimeofday( &now, (struct timezone*) 0 );
+	for ( job = jobs; job != (SignJob*) 0; job = job->next )
+		if ( ! job->low )
+			{
+			ms = ( now.tv_sec - job->queued.tv_sec ) * 1000L +
+				( now.tv_usec - job->queued.tv_usec ) / 1000L;
+			latency += ( ms - latency ) / 8;
+			}
+	return jobs;
+	}
+
+
+void
+signpool_destroy( void )
+	{
+	SignJob* job;
+	int i;
+
+	(void) pthread_mutex_lock( &lock );
+	stopping = 1;
+	(void) pthread_cond_broadcast( &wake );
+	(void) pthread_mutex_unlock( &lock );
+	for ( i = 0; i < nthreads; ++i )
+		(void) pthread_join( threads[i], (void**) 0 );
+	/* (The signers exit when they read the end of file.) */
+	for ( i = 0; i < nsigners; ++i )
+		if ( signers[i].fd >= 0 )
+			(void) close( signers[i].fd );
+	nsigners = 0;
+	/* The jobs no thread took come out of signpool_collect(), unsigned. */
+	(void) pthread_mutex_lock( &lock );
+	while ( queue_head != (SignJob*) 0 )
+		{
+		job = queue_head;
+		queue_head = job->next;
+		job->next = done_head;
+		done_head = job;
+		}
+	while ( low_head != (SignJob*) 0 )
+		{
+		job = low_head;
+		low_head = job->next;
+		job->next = done_head;
+		done_head = job;
+		}
+	queue_tail = low_tail = (SignJob*) 0;
+	pending = low_pending = 0;
+	(void) pthread_mutex_unlock( &lock );
+	nthreads = 0;
+	free( (void*) threads );
+	threads = (pthread_t*) 0;
+	free( (void*) signers );
+	signers = (Signer*) 0;
+	if ( notify_fds[0] >= 0 )
+		(void) close( notify_fds[0] );
+	if ( notify_fds[1] >= 0 && notify_fds[1] != notify_fds[0] )
+		(void) close( notify_fds[1] );
+	notify_fds[0] = notify_fds[1] = -1;
+	}
+
+
+void
+signpool_logstats( long secs )
+	{
+	long s, h, e, g;
+	int p, l;
+
+	(void) pthread_mutex_lock( &lock );
+	p = pending;
+	l = low_pending;
+	s = signed_count;
+	h = cache_hits;
+	e = errors;
+	g = lost;
+	signed_count = cache_hits = errors = 0;
+	(void) pthread_mutex_unlock( &lock );
+	if ( secs > 0 && nthreads > 0 )
+		syslog(
+			LOG_INFO, "  signing pool - %d signers (%ld lost), %d pending (%d low), %ld signed (%g/sec), %ld from cache, %ld errors, %ld ms latency",
+			nthreads, g, p, l, s, (float) s / secs, h, e, latency );
+	}
+
+
+/* A thread: no syslog() nor gpgme here (see the top of this file). */
+static void*
+worker( void* arg )
+	{
+	Signer* sp = (Signer*) arg;
+	SignJob* job;
+	uint64_t one = 1;
+	int low;
+
+	(void) pthread_mutex_lock( &lock );
+	for (;;)
+		{
+		while ( queue_head == (SignJob*) 0 && low_head == (SignJob*) 0 && ! stopping )
+			(void) pthread_cond_wait( &wake, &lock );
+		if ( stopping )
+			break;
+		/* (A job's low doesn't tell its queue: it may have been promoted.) */
+		low = ( queue_head == (SignJob*) 0 );
+		if ( ! low )
+			{
+			job = queue_head;
+			queue_head = job->next;
+			if ( queue_head == (SignJob*) 0 )
+				queue_tail = (SignJob*) 0;
+			}
+		else
+			{
+			job = low_head;
+			low_head = job->next;
+			if ( low_head == (SignJob*) 0 )
+				low_tail = (SignJob*) 0;
+			}
+		(void) pthread_mutex_unlock( &lock );
+
+		relay( sp, job );
+
+		(void) pthread_mutex_lock( &lock );
+		if ( low )
+			--low_pending;
+		else
+			--pending;
+		job->next = done_head;
+		done_head = job;
+		/* (A full eventfd counter or pipe has woken the main loop already.) */
+		(void) write( notify_fds[1], &one, sizeof(one) );
+		/* Without its signer, a thread leaves the jobs to the others, if
+		** any is left.
+		*/
+		if ( sp->fd < 0 && lost < nsigners )
+			break;
+		}
+	(void) pthread_mutex_unlock( &lock );
+	return (void*) 0;
+	}
+
+
+/* Has the job done by the thread's signer. */
+static void
+relay( Signer* sp, SignJob* job )
+	{
+	Request req;
+	Reply rep;
+	const char* strs[NSTRINGS];
+	int i;
+
+	if ( sp->fd < 0 )
+		{
+		job->err = gpgme_error_from_errno( EPIPE );
+		(void) pthread_mutex_lock( &lock );
+		++errors;
+		(void) pthread_mutex_unlock( &lock );
+		return;
+		}
+	(void) memset( (void*) &req, 0, sizeof(req) );
+	req.sb = job->sb;
+	req.first = job->first;
+	req.len = job->len;
+	strs[0] = job->filename;
+	strs[1] = job->cachename;
+	strs[2] = job->cachefile;
+	strs[3] = job->treefile;
+	strs[4] = job->dirname;
+	for ( i = 0; i < NSTRINGS; ++i )
+		req.slen[i] = ( strs[i] != (char*) 0 ? strlen( strs[i] ) + 1 : 0 );
+	rep.err = GPG_ERR_NO_ERROR;
+	if ( write_all( sp->fd, &req, sizeof(req) ) == 0 )
+		{
+		for ( i = 0; i < NSTRINGS; ++i )
+			if ( req.slen[i] > 0 && write_all( sp->fd, strs[i], req.slen[i] ) < 0 )
+				break;
+		if ( i == NSTRINGS && read_all( sp->fd, &rep, sizeof(rep) ) == 0 )
+			{
+			if ( rep.siglen > 0 )
+				{
+				job->sig = (char*) malloc( rep.siglen );
+				if ( job->sig == (char*) 0 )
+					rep.err = gpgme_error_from_errno( ENOMEM );
+				/* (Read anyway, to stay in step with the signer.) */
+				if ( read_all( sp->fd, job->sig != (char*) 0 ? job->sig : (char*) 0, rep.siglen ) < 0 )
+					goto lost;
+				job->siglen = rep.siglen;
+				}
+			job->err = rep.err;
+			(void) pthread_mutex_lock( &lock );
+			signed_count += rep.signed_count;
+			cache_hits += rep.cache_hits;
+			errors += rep.errors;
+			(void) pthread_mutex_unlock( &lock );
+			return;
+			}
+		}
+
+	lost:
+	/* The signer died: its jobs fail from now on. */
+	free( (void*) job->sig );
+	job->sig = (char*) 0;
+	job->err = gpgme_error_from_errno( EPIPE );
+	(void) close( sp->fd );
+	sp->fd = -1;
+	(void) pthread_mutex_lock( &lock );
+	++errors;
+	++lost;
+	(void) pthread_mutex_unlock( &lock );
+	}
+
+
+/* A signer process: signs the jobs its thread sends, until the end of
+** file.
+*/
+static void
+signer( int fd, gpgme_ctx_t mainctx )
+	{
+	gpgme_ctx_t ctx;
+	gpgme_key_t key;
+	gpgme_error_t gpgerr;
+	sigset_t none;
+	int sig, j;
+
+	/* None of the handlers of the main process. */
+	for ( sig = 1; sig < NSIG; ++sig )
+		(void) signal( sig, SIG_DFL );
+	(void) signal( SIGPIPE, SIG_IGN );
+	(void) sigemptyset( &none );
+	(void) sigprocmask( SIG_SETMASK, &none, (sigset_t*) 0 );
+	if ( notify_fds[0] >= 0 )
+		(void) close( notify_fds[0] );
+	if ( notify_fds[1] >= 0 && notify_fds[1] != notify_fds[0] )
+		(void) close( notify_fds[1] );
+
+	gpgerr = gpgme_new( &ctx );
+	if ( gpgerr != GPG_ERR_NO_ERROR )
+		{
+		syslog( LOG_ERR, "gpgme_new - %s", gpgme_strerror( gpgerr ) );
+		_exit( 1 );
+		}
+	(void) gpgme_set_protocol( ctx, gpgme_get_protocol( mainctx ) );
+	gpgme_set_armor( ctx, gpgme_get_armor( mainctx ) );
+	for ( j = 0; ( key = gpgme_signers_enum( mainctx, j ) ) != (gpgme_key_t) 0; ++j )
+		{
+		(void) gpgme_signers_add( ctx, key );
+		gpgme_key_unref( key );
+		}
+	serve( fd, ctx );
+	gpgme_release( ctx );
+	}
+
+
+/* Reads the jobs from fd and answers them, until the end of file. */
+static void
+serve( int fd, gpgme_ctx_t ctx )
+	{
+	Request req;
+	Reply rep;
+	SignJob job;
+	struct stat sb;
+	char* strs[NSTRINGS];
+	char* map;
+	size_t maplen;
+	int i, ffd;
+
+	for (;;)
+		{
+		if ( read_all( fd, &req, sizeof(req) ) < 0 )
+			return;
+		for ( i = 0; i < NSTRINGS; ++i )
+			{
+			strs[i] = (char*) 0;
+			if ( req.slen[i] == 0 )
+				continue;
+			strs[i] = (char*) malloc( req.slen[i] );
+			if ( strs[i] == (char*) 0 || read_all( fd, strs[i], req.slen[i] ) < 0 )
+				return;
+			strs[i][req.slen[i] - 1] = '\0';
+			}
+		(void) memset( (void*) &job, 0, sizeof(job) );
+		job.sb = req.sb;
+		job.mtime = req.sb.st_mtime;
+		job.first = req.first;
+		job.len = req.len;
+		job.filename = strs[0];
+		job.cachename = strs[1];
+		job.cachefile = strs[2];
+		job.treefile = strs[3];
+		job.dirname = strs[4];
+		job.err = GPG_ERR_NO_ERROR;
+
+		/* The bytes to sign, of the file the main loop stat()ed. */
+		map = (char*) 0;
+		maplen = 0;
+		if ( job.filename != (char*) 0 )
+			{
+			ffd = open( job.filename, O_RDONLY );
+			if ( ffd < 0 || fstat( ffd, &sb ) < 0 )
+				job.err = gpgme_error_from_errno( errno );
+			else if ( sb.st_ino != req.sb.st_ino || sb.st_dev != req.sb.st_dev ||
+					  sb.st_size != req.sb.st_size || sb.st_mtime != req.sb.st_mtime ||
+					  ST_MTIME_NSEC( sb ) != ST_MTIME_NSEC( req.sb ) ||
+					  req.first + (off_t) req.len > sb.st_size )
+				job.err = gpgme_error_from_errno( ESTALE );
+			else if ( sb.st_size > 0 )
+				{
+				maplen = sb.st_size;
+				map = (char*) mmap( 0, maplen, PROT_READ, MAP_PRIVATE, ffd, 0 );
+				if ( map == (char*) -1 )
+					{
+					job.err = gpgme_error_from_errno( errno );
+					map = (char*) 0;
+					}
+				}
+			if ( ffd >= 0 )
+				(void) close( ffd );
+			job.data = ( map != (char*) 0 ? &map[req.first] : "" );
+			}
+
+		if ( job.err == GPG_ERR_NO_ERROR )
+			sign_job( ctx, &job );
+		else
+			++errors;
+		if ( map != (char*) 0 )
+			(void) munmap( (void*) map, maplen );
+		for ( i = 0; i < NSTRINGS; ++i )
+			free( (void*) strs[i] );
+
+		rep.err = job.err;
+		rep.siglen = ( job.err == GPG_ERR_NO_ERROR ? job.siglen : 0 );
+		rep.signed_count = signed_count;
+		rep.cache_hits = cache_hits;
+		rep.errors = errors;
+		signed_count = cache_hits = errors = 0;
+		if ( write_all( fd, &rep, sizeof(rep) ) < 0 ||
+			 write_all( fd, job.sig, rep.siglen ) < 0 )
+			return;
+		free( (void*) job.sig );
+		}
+	}
+
+
+/* Reads len bytes, or into the void if buf is null.
+** \return 0, or -1 on an error or the end of file.
+*/
+static int
+read_all( int fd, void* buf, size_t len )
+	{
+	char scratch[1024];
+	ssize_t r;
+
+	while ( len > 0 )
+		{
+		if ( buf != (void*) 0 )
+			r = read( fd, buf, len );
+		else
+			r = read( fd, scratch, MIN( len, sizeof(scratch) ) );
+		if ( r < 0 && errno == EINTR )
+			continue;
+		if ( r <= 0 )
+			return -1;
+		if ( buf != (void*) 0 )
+			buf = (char*) buf + r;
+		len -= r;
+		}
+	return 0;
+	}
+
+
+/* \return 0, or -1 on an error. */
+static int
+write_all( int fd, const void* buf, size_t len )
+	{
+	ssize_t r;
+
+	while ( len > 0 )
+		{
+		r = write( fd, buf, len );
+		if ( r < 0 && errno == EINTR )
+			continue;
+		if ( r <= 0 )
+			return -1;
+		buf = (const char*) buf + r;
+		len -= r;
+		}
+	return 0;
+	}
+
+
+static void
+sign_job( gpgme_ctx_t ctx, SignJob* job )
+	{
+#ifdef USE_DIRSIG
+	if ( job->dirname != (char*) 0 )
+		{
+		make_manifest( ctx, job );
+		return;
+		}
+#endif /* USE_DIRSIG */
+#ifdef USE_MERKLE
+	if ( job->treefile != (char*) 0 )
+		make_tree( ctx, job );
+#endif /* USE_MERKLE */
+
+#ifdef SIG_CACHEDIR
+	if ( job->cachename != (char*) 0 &&
+		 ( job->sig = sigcache_get( job->cachename, &(job->sb), &job->siglen ) ) != (char*) 0 )
+		{
+		(void) pthread_mutex_lock( &lock );
+		++cache_hits;
+		(void) pthread_mutex_unlock( &lock );
+		return;
+		}
+#endif /* SIG_CACHEDIR */
+
+	job->err = sign_data( ctx, job->data, job->len, &job->sig, &job->siglen );
+
+	(void) pthread_mutex_lock( &lock );
+	if ( job->err == GPG_ERR_NO_ERROR )
+		++signed_count;
+	else
+		++errors;
+	(void) pthread_mutex_unlock( &lock );
+#ifdef SIG_CACHEDIR
+	if ( job->err == GPG_ERR_NO_ERROR && job->cachename != (char*) 0 )
+		(void) sigcache_put( job->cachename, &(job->sb), job->sig, job->siglen );
+#endif /* SIG_CACHEDIR */
+	}
+
+
+#ifdef USE_MERKLE
+/* Makes the tree file of the job, unless it was made of the file as it is. */
+static void
+make_tree( gpgme_ctx_t ctx, SignJob* job )
+	{
+	char* tree;
+	char* sig;
+	char* buf;
+	size_t len, manifest, siglen;
+
+	if ( merkle_fresh( job->treefile, &(job->sb) ) )
+		return;
+	tree = merkle_tree( job->data, &(job->sb), MERKLE_CHUNK_SIZE, &len, &manifest );
+	if ( tree == (char*) 0 )
+		return;
+	if ( sign_data( ctx, &tree[manifest], len - manifest, &sig, &siglen ) == GPG_ERR_NO_ERROR )
+		{
+		/* The tree and its manifest, an empty line, the signature. */
+		buf = (char*) realloc( (void*) tree, len + 1 + siglen );
+		if ( buf != (char*) 0 )
+			{
+			tree = buf;
+			tree[len] = '\n';
+			(void) memcpy( &tree[len + 1], sig, siglen );
+			write_file( job->treefile, tree, len + 1 + siglen );
+			}
+		free( (void*) sig );
+		}
+	free( (void*) tree );
+	}
+#endif /* USE_MERKLE */
+
+
+#ifdef USE_DIRSIG
+/* Makes the manifest of the job's directory, from the cached one, and
+** caches it with its signature.
+*/
+static void
+make_manifest( gpgme_ctx_t ctx, SignJob* job )
+	{
+	struct stat sb;
+	char* old = (char*) 0;
+	char* manifest;
+	char* sig;
+	char* buf;
+	const char* oldsig;
+	size_t oldlen = 0, oldsiglen, len, siglen;
+	time_t oldtime = 0;
+	int fd;
+
+	/* The last one, for the hashes of the files which didn't change. */
+	if ( stat( job->cachefile, &sb ) == 0 && S_ISREG( sb.st_mode ) &&
+		 ( old = (char*) malloc( sb.st_size + 1 ) ) != (char*) 0 )
+		{
+		fd = open( job->cachefile, O_RDONLY );
+		if ( fd >= 0 )
+			{
+			if ( read( fd, old, sb.st_size ) == sb.st_size &&
+				 dirsig_split( old, sb.st_size, &oldlen, &oldsig, &oldsiglen ) == 0 )
+				{
+				old[sb.st_size] = '\0';
+				oldtime = sb.st_mtime;
+				}
+			else
+				oldlen = 0;
+			(void) close( fd );
+			}
+		}
+	manifest = dirsig_make( job->dirname, old, oldlen, oldtime, &len );
+	if ( manifest == (char*) 0 )
+		{
+		job->err = gpgme_error_from_errno( errno );
+		free( (void*) old );
+		(void) pthread_mutex_lock( &lock );
+		++errors;
+		(void) pthread_mutex_unlock( &lock );
+		return;
+		}
+	if ( len == oldlen && memcmp( manifest, old, len ) == 0 )
+		{
+		/* Nothing changed: the signature still holds. */
+		(void) utimes( job->cachefile, (struct timeval*) 0 );
+		job->err = GPG_ERR_NO_ERROR;
+		(void) pthread_mutex_lock( &lock );
+		++cache_hits;
+		(void) pthread_mutex_unlock( &lock );
+		}
+	else
+		{
+		job->err = sign_data( ctx, manifest, len, &sig, &siglen );
+		if ( job->err == GPG_ERR_NO_ERROR )
+			{
+			/* The manifest, an empty line, the signature. */
+			buf = (char*) realloc( (void*) manifest, len + 1 + siglen );
+			if ( buf != (char*) 0 )
+				{
+				manifest = buf;
+				manifest[len] = '\n';
+				(void) memcpy( &manifest[len + 1], sig, siglen );
+				write_file( job->cachefile, manifest, len + 1 + siglen );
+				}
+			free( (void*) sig );
+			}
+		(void) pthread_mutex_lock( &lock );
+		if ( job->err == GPG_ERR_NO_ERROR )
+			++signed_count;
+		else
+			++errors;
+		(void) pthread_mutex_unlock( &lock );
+		}
+	free( (void*) manifest );
+	free( (void*) old );
+	}
+#endif /* USE_DIRSIG */
+
+
+/* Signs len bytes at data, in process if the key could be loaded; the
+** signature is malloc()ed.
+*/
+static gpgme_error_t
+sign_data( gpgme_ctx_t ctx, const char* data, size_t len, char** sigP, size_t* siglenP )
+	{
+#ifdef USE_NATIVE_SIGN
+	if ( pgpsign_ready() )
+		return pgpsign_sign( data, len, sigP, siglenP );
+#endif /* USE_NATIVE_SIGN */
+	return engine_sign( ctx, data, len, sigP, siglenP );
+	}
+
+
+/* Signs through gpgme, and so the gpg engine. */
+static gpgme_error_t
+engine_sign( gpgme_ctx_t ctx, const char* data, size_t len, char** sigP, size_t* siglenP )
+	{
+	gpgme_data_t gpgdata, gpgsig;
+	gpgme_error_t err;
+	char* sig;
+	size_t siglen;
+
+	err = gpgme_data_new_from_mem( &gpgdata, data, len, 0 );
+	if ( err == GPG_ERR_NO_ERROR )
+		{
+		err = gpgme_data_new( &gpgsig );
+		if ( err == GPG_ERR_NO_ERROR )
+			{
+			err = gpgme_op_sign( ctx, gpgdata, gpgsig, GPGME_SIG_MODE_DETACH );
+			if ( err == GPG_ERR_NO_ERROR )
+				{
+				sig = gpgme_data_release_and_get_mem( gpgsig, &siglen );
+				*sigP = (char*) malloc( siglen > 0 ? siglen : 1 );
+				if ( *sigP != (char*) 0 )
+					{
+					(void) memcpy( *sigP, sig, siglen );
+					*siglenP = siglen;
+					}
+				else
+					err = gpgme_error_from_errno( ENOMEM );
+				gpgme_free( sig );
+				}
+			else
+				gpgme_data_release( gpgsig );
+			}
+		gpgme_data_release( gpgdata );
+		}
+	return err;
+	}
+
+
+#if defined(USE_MERKLE) || defined(USE_DIRSIG)
+/* Writes a cache file, through a temporary file renamed in place. */
+static void
+write_file( const char* path, const char* buf, size_t len )
+	{
+	char tmpfile[MAXPATHLEN];
+	int fd;
+
+	if ( snprintf( tmpfile, sizeof(tmpfile), "%s.XXXXXX", path ) >= sizeof(tmpfile) ||
+		 httpd_mk_path( path ) < 0 )
+		return;
+	fd = mkstemp( tmpfile );
+	if ( fd < 0 )
+		return;
+	if ( httpd_write_fully( fd, buf, len ) != len ||
+		 fchmod( fd, 0644 ) < 0 )
+		{
+		(void) close( fd );
+		(void) unlink( tmpfile );
+		return;
+		}
+	if ( close( fd ) < 0 || rename( tmpfile, path ) < 0 )
+		{
+		syslog( LOG_WARNING, "caching %.80s - %m", path );
+		(void) unlink( tmpfile );
+		}
+	}
+#endif /* USE_MERKLE || USE_DIRSIG */
+
+#endif /* USE_SIGN_POOL */
@@ -0,0 +1,99 @@
+/* signpool.h - header file for the signing worker pool
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The signing pool makes the detached signatures of static files in a few
+* signer processes, each fed by a thread, so that the main loop doesn't
+* have to fork an interposer for each signed response.  Jobs are queued by
+* the main loop; the finished ones are handed back to it through a file
+* descriptor which becomes readable (an eventfd where there is one).
+*/
+
+#ifndef _SIGNPOOL_H_
+#define _SIGNPOOL_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <gpgme.h>
+
+/* The low of a background job queued for the Merkle tree of a file whose
+** signature is cached, not by the pre-signer.
+*/
+#define SIGNJOB_TREE 2
+
+/* A signing job.  Only the main loop touches client_data and the links
+** between the jobs of the same file, which are only signed once: the
+** others wait for it, as its waiters, without going to the pool.  sb is set
+** before the job is queued: the signer doesn't sign a file which changed
+** since.
+*/
+typedef struct SignJobStruct {
+	const char* filename;	/* to sign, or (char*) 0 */
+	off_t first;			/* the bytes to sign, from there */
+	size_t len;
+	const char* data;		/* the bytes to sign (in the signer only) */
+	const char* cachename;	/* the file whose signature is cached, or (char*) 0 */
+	const char* cachefile;	/* where the manifest is cached */
+	const char* treefile;	/* where the Merkle tree of data goes, or (char*) 0 */
+	const char* dirname;	/* of the manifest to make (in cachefile) instead, or (char*) 0 */
+	time_t mtime;			/* of the file: an older cached signature is stale */
+	void* client_data;
+	struct stat sb;
+	char* sig;				/* malloc()ed signature, when err is 0 */
+	size_t siglen;
+	gpgme_error_t err;
+	int low;				/* taken only when no other job waits (or SIGNJOB_TREE) */
+	struct timeval queued;	/* when submitted */
+	struct SignJobStruct* next;
+	struct SignJobStruct* leader;	/* the job signing for this one, or (SignJob*) 0 */
+	struct SignJobStruct* waiters;	/* of a leader, then of each waiter */
+	struct SignJobStruct* flight_next;	/* in the list of the jobs being signed */
+	} SignJob;
+
+/*! Fork nworkers signer processes, signing with the same keys and armor
+ * as ctx, then start a thread for each, with all signals blocked.  The
+ * threads only relay the jobs, so that the process may fork() afterwards.
+ * \return the fd to watch for reading (then call signpool_collect()), or
+ * -1 if the pool couldn't start.
+ */
+int signpool_init( int nworkers, gpgme_ctx_t ctx );
+
+/*! How many jobs are queued or being signed, low priority ones apart; -1
+ * if the pool isn't running.
+ */
+int signpool_pending( void );
+
+/*! How many milliseconds the responses waited for their signature lately
+ * (a moving average, low priority jobs apart).
+ */
+long signpool_latency( void );
+
+/*! Queue a job.  \return 0, or -1 if the pool isn't running. */
+int signpool_submit( SignJob* job );
+
+/*! Make a low priority job an ordinary one, if no thread has started it
+ * yet.  \return 1 if so, else 0.
+ */
+int signpool_promote( SignJob* job );
+
+/*! Take a job (not a low priority one) back out of the queue, if no thread
+ * has started it yet.
+ * \return 1 if so, else 0: it will then come out of signpool_collect().
+ */
+int signpool_cancel( SignJob* job );
+
+/*! Return the list (through next) of the jobs finished since last time. */
+SignJob* signpool_collect( void );
+
+/*! Stop the threads once they are done with their current job, and so the
+ * signers, usually in preparation for exitting.  The jobs still queued
+ * then come out of signpool_collect(), unsigned.
+ */
+void signpool_destroy( void );
+
+/*! Generate debugging statistics syslog message. */
+void signpool_logstats( long secs );
+
+#endif /* _SIGNPOOL_H_ */
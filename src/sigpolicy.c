@@ -0,0 +1,131 @@
+/* sigpolicy.c - load-adaptive signing policy
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The latency is only looked at while responses wait for the signing pool:
+* it is only updated as jobs come back, and would else keep signing busy
+* once nothing is signed any more.  The load average is read once a second
+* at most.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "libhttpd.h"
+#include "sigpolicy.h"
+#ifdef USE_SIGN_POOL
+#include "signpool.h"
+#endif /* USE_SIGN_POOL */
+
+
+/* Globals. */
+static int busy_queue = SIGN_BUSY_QUEUE;
+static long busy_latency = SIGN_BUSY_LATENCY;
+static double busy_load = SIGN_BUSY_LOAD;
+static int busy_action = SIGPOLICY_CACHE;
+static double last_load = 0.0;
+#ifdef HAVE_GETLOADAVG
+static time_t load_time = 0;
+#endif /* HAVE_GETLOADAVG */
+static long counts[SIGPOLICY_COUNT];
+static const char* action_names[] = { "sign", "delay", "cache", "refuse" };
+
+
+/* Forwards. */
+static double load_average( void );
+
+
+void
+sigpolicy_init( int queue, long latency, double load, int action )
+	{
+	busy_queue = queue;
+	busy_latency = latency;
+	busy_load = load;
+	busy_action = action;
+	}
+
+
+int
+sigpolicy_action( const char* name )
+	{
+	int i;
+
+	for ( i = SIGPOLICY_DELAY; i <= SIGPOLICY_REFUSE; ++i )
+		if ( strcasecmp( name, action_names[i] ) == 0 )
+			return i;
+	return -1;
+	}
+
+
+int
+sigpolicy_decide( httpd_server* hs )
+	{
+	int full, busy = 0;
+#ifdef USE_SIGN_POOL
+	int pending = signpool_pending();
+
+	if ( pending >= 0 )
+		{
+		full = pending >= SIGN_QUEUE_MAX;
+		busy =
+			( busy_queue > 0 && pending >= busy_queue ) ||
+			( busy_latency > 0 && pending > 0 && signpool_latency() >= busy_latency );
+		}
+	else
+#endif /* USE_SIGN_POOL */
+	/* (No more interposers than CGIs.) */
+	full = hs->cgi_limit > 0 && hs->cgi_count >= hs->cgi_limit;
+	if ( ! ( full || busy || ( busy_load > 0 && load_average() >= busy_load ) ) )
+		return SIGPOLICY_SIGN;
+	if ( busy_action == SIGPOLICY_DELAY && full )
+		return SIGPOLICY_CACHE;
+	return busy_action;
+	}
+
+
+void
+sigpolicy_count( int what )
+	{
+	if ( what >= 0 && what < SIGPOLICY_COUNT )
+		++counts[what];
+	}
+
+
+void
+sigpolicy_logstats( long secs )
+	{
+	if ( secs > 0 )
+		syslog(
+			LOG_INFO, "  signing policy - %ld signed, %ld delayed, %ld from cache only, %ld unsigned, %ld refused, load %g",
+			counts[SIGPOLICY_SIGN], counts[SIGPOLICY_DELAY], counts[SIGPOLICY_CACHE],
+			counts[SIGPOLICY_UNSIGNED], counts[SIGPOLICY_REFUSE], last_load );
+	(void) memset( counts, 0, sizeof(counts) );
+	}
+
+
+static double
+load_average( void )
+	{
+#ifdef HAVE_GETLOADAVG
+	time_t now = time( (time_t*) 0 );
+
+	if ( now != load_time )
+		{
+		load_time = now;
+		if ( getloadavg( &last_load, 1 ) < 1 )
+			last_load = 0.0;
+		}
+#endif /* HAVE_GETLOADAVG */
+	return last_load;
+	}
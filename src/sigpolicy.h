@@ -0,0 +1,49 @@
+/* sigpolicy.h - header file for the load-adaptive signing policy
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The signing policy decides, for each GET of a file to be signed, whether
+* its signature is made as usual or, when signing is busy, what becomes of
+* it if it isn't cached already.  Signing is busy when enough responses
+* wait for the signing pool (or enough interposers run, without it), when
+* the responses waited too long for their signature lately, or when the
+* load average is too high.
+*/
+
+#ifndef _SIGPOLICY_H_
+#define _SIGPOLICY_H_
+
+#include "libhttpd.h"
+
+/* Decisions, and what the responses became. */
+#define SIGPOLICY_SIGN 0		/* signed */
+#define SIGPOLICY_DELAY 1		/* busy, but signed all the same: it will wait */
+#define SIGPOLICY_CACHE 2		/* busy: signed only if the signature is cached */
+#define SIGPOLICY_REFUSE 3		/* busy: a 503 if the signature isn't cached */
+#define SIGPOLICY_UNSIGNED 4	/* (what became of a SIGPOLICY_CACHE one which wasn't) */
+#define SIGPOLICY_COUNT 5
+
+/*! Set the thresholds: responses waiting for the signing pool, milliseconds
+ * they waited lately, load average (0 not to look at one of them), and
+ * what to do when one is reached.
+ */
+void sigpolicy_init( int queue, long latency, double load, int action );
+
+/*! The decision of the action named name ("delay", "cache" or "refuse").
+ * \return it, or -1 if there's none of that name.
+ */
+int sigpolicy_action( const char* name );
+
+/*! Decide for a response to be signed, by the server hs.
+ * \return a decision, SIGPOLICY_SIGN to SIGPOLICY_REFUSE.
+ */
+int sigpolicy_decide( httpd_server* hs );
+
+/*! Count what became of a response. */
+void sigpolicy_count( int what );
+
+/*! Generate debugging statistics syslog message. */
+void sigpolicy_logstats( long secs );
+
+#endif /* _SIGPOLICY_H_ */
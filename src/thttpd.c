@@ -26,6 +26,10 @@
 ** SUCH DAMAGE.
 */
 
+#if defined(HAVE_SCHED_SETAFFINITY) && ! defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* for CPU_SET() */
+#endif
+
 #ifdef HAVE_DEFINES_H
 #include "defines.h"
 #endif
@@ -39,6 +43,9 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/uio.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
@@ -58,6 +65,9 @@
 #include <time.h>
 #endif
 #include <unistd.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 
 #include <fcntl.h>
 
@@ -68,6 +78,17 @@
 #include "fdwatch.h"
 #include "libhttpd.h"
 #include "mmc.h"
+#include "pcache.h"
+#include "rcache.h"
+#include "zcache.h"
+#include "signpool.h"
+#include "sigindex.h"
+#include "sigcache.h"
+#include "presign.h"
+#include "merkle.h"
+#include "dirsig.h"
+#include "sigpolicy.h"
+#include "pgpsign.h"
 #include "timers.h"
 #include "match.h"
 #include "peers.h"
@@ -79,6 +100,10 @@
 #define SHUT_WR 1
 #endif
 
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
 #ifndef HAVE_INT64T
 typedef long long int64_t;
 #endif
@@ -105,6 +130,14 @@ static char * sig_pattern = (char*) 0;
 #endif /* SIG_EXCLUDE_PATTERN */
 static unsigned short port = DEFAULT_PORT;
 static int connlimit = DEFAULT_CONNLIMIT;
+static int keepalive_timelimit = IDLE_KEEPALIVE_TIMELIMIT;
+static int keepalive_max = KEEPALIVE_MAX_REQUESTS;
+static int sign_busy_queue = SIGN_BUSY_QUEUE;
+static long sign_busy_latency = SIGN_BUSY_LATENCY;
+static double sign_busy_load = SIGN_BUSY_LOAD;
+static char* sign_busy_action = SIGN_BUSY_ACTION;
+static int workers = DEFAULT_WORKERS;
+static int cpuaffinity = 0;
 static char* logfile = (char*) 0;
 static char* throttlefile = (char*) 0;
 static char* hostname = (char*) 0;
@@ -121,19 +154,30 @@ typedef struct {
 	} throttletab;
 static throttletab* throttles;
 static int numthrottles, maxthrottles;
+static MatchSet* throttle_match;	/* all the throttle patterns, compiled */
 
 #define THROTTLE_NOLIMIT -1
 
+typedef struct {
+	pid_t pid;			/* 0 once exited */
+	int status;
+	time_t started_at;
+	} workertab;
+static workertab* workertabs = (workertab*) 0;	/* only in the supervisor */
+static volatile int num_workers;
+
 typedef struct {
 	int conn_state;
 	int next_free_connect;
 	httpd_conn* hc;
 	int tnums[MAXTHROTTLENUMS];		 /* throttle indexes */
 	int numtnums;
+	int nrequests;		/* requests read on this connection so far */
 	long max_limit, min_limit;
 	time_t started_at, active_at;
 	Timer* wakeup_timer;
 	Timer* linger_timer;
+	Timer* idle_timer;
 	long wouldblock_delay;
 	off_t bytes;
 	off_t end_byte_index;
@@ -142,6 +186,12 @@ typedef struct {
 static connecttab* connects;
 static int num_connects, max_connects, first_free_connect;
 static int httpd_conn_count;
+static int pcache_fd = -1;		/* inotify fd of the path cache */
+static int signpool_fd = -1;	/* readable when the signing pool has finished jobs */
+#ifdef USE_PRESIGN
+static int presign_fd = -1;		/* inotify fd of the pre-signer */
+static int presigner = 1;		/* whether this process signs ahead (the first worker does) */
+#endif /* USE_PRESIGN */
 
 /* The connection states. */
 #define CNST_FREE 0
@@ -149,6 +199,8 @@ static int httpd_conn_count;
 #define CNST_SENDING 2
 #define CNST_PAUSING 3
 #define CNST_LINGERING 4
+#define CNST_KEEPALIVE 5
+#define CNST_SIGNING 6		/* waiting for the signing pool */
 
 static httpd_server* hs = (httpd_server*) 0;
 int terminate = 0;
@@ -188,17 +240,38 @@ static void no_value_required( char* name, char* value );
 static char* e_strdup( char* oldstr );
 static void read_throttlefile( char* throttlefile );
 static void shut_down( void );
+#ifdef HAVE_SIGSET
+static void set_handler( int sig, void (*handler)( int ) );
+#endif /* HAVE_SIGSET */
+static void spawn_workers( void );
+static void init_worker( int wnum );
+static void signal_workers( int sig );
 static int handle_newconnect( struct timeval* tvP, int listen_fd );
 static void handle_read( connecttab* c, struct timeval* tvP );
+static void serve_requests( connecttab* c, struct timeval* tvP );
+static int pipelined_request( connecttab* c, struct timeval* tvP );
+static void handle_request( connecttab* c, struct timeval* tvP );
+static void start_sending( connecttab* c, struct timeval* tvP );
+#ifdef USE_SIGN_POOL
+static void handle_signed( struct timeval* tvP );
+#endif /* USE_SIGN_POOL */
 static void handle_send( connecttab* c, struct timeval* tvP );
+#ifdef USE_SENDFILE
+static ssize_t sendfile_response( httpd_conn* hc, off_t offset, size_t len );
+#endif /* USE_SENDFILE */
+static ssize_t ranges_response( httpd_conn* hc, off_t pos, size_t* lenP );
 static void handle_linger( connecttab* c, struct timeval* tvP );
 static int check_throttles( connecttab* c );
 static void clear_throttles( connecttab* c, struct timeval* tvP );
 static void update_throttles( ClientData client_data, struct timeval* nowP );
+static int flush_response( connecttab* c, struct timeval* tvP );
 static void finish_connection( connecttab* c, struct timeval* tvP );
+static void keepalive_connection( connecttab* c, struct timeval* tvP );
 static void clear_connection( connecttab* c, struct timeval* tvP );
 static void really_clear_connection( connecttab* c, struct timeval* tvP );
-static void idle( ClientData client_data, struct timeval* nowP );
+static long idle_timelimit( connecttab* c );
+static void set_idle_timer( connecttab* c, struct timeval* tvP );
+static void idle_connection( ClientData client_data, struct timeval* nowP );
 static void wakeup_connection( ClientData client_data, struct timeval* nowP );
 static void linger_clear_connection( ClientData client_data, struct timeval* nowP );
 static void occasional( ClientData client_data, struct timeval* nowP );
@@ -216,6 +289,23 @@ static void thttpd_logstats( long secs );
 	errx((code),__VA_ARGS__); \
 	} while (0)
 
+#ifdef HAVE_SIGSET
+/* Sets up handler for sig for good, as sigset() does: without it, which
+** glibc deprecates under _GNU_SOURCE (see the top of this file).
+*/
+static void
+set_handler( int sig, void (*handler)( int ) )
+	{
+	struct sigaction sa;
+
+	(void) memset( (void*) &sa, 0, sizeof(sa) );
+	sa.sa_handler = handler;
+	(void) sigemptyset( &sa.sa_mask );
+	sa.sa_flags = 0;
+	(void) sigaction( sig, &sa, (struct sigaction*) 0 );
+	}
+#endif /* HAVE_SIGSET */
+
 /* SIGTERM and SIGINT say to exit immediately. */
 static void handle_term( int sig ) {
 	/* Don't need to set up the handler again, since it's a one-shot. */
@@ -232,7 +322,7 @@ handle_chld( int sig )
 	{
 	const int oerrno = errno;
 	pid_t pid;
-	int status;
+	int status, i;
 
 #ifndef HAVE_SIGSET
 	/* Set up handler again. */
@@ -256,6 +346,16 @@ handle_chld( int sig )
 			break;
 			}
 
+		/* Is it one of our workers ? (then we are the supervisor) */
+		if ( workertabs != (workertab*) 0 )
+			for ( i = 0; i < workers; ++i )
+				if ( workertabs[i].pid == pid )
+					{
+					workertabs[i].pid = 0;
+					workertabs[i].status = status;
+					--num_workers;
+					}
+
 		/* Note 1: here may happen a minor race bug :
 		 * child may be killed earlier and following code which unset hctab.hcs[pid-hctab.pidmin]
 		 * may happen BEFORE we set it. 
@@ -307,6 +407,14 @@ handle_usr1( int sig )
 	{
 	/* Don't need to set up the handler again, since it's a one-shot. */
 
+	if ( workertabs != (workertab*) 0 )
+		{
+		/* Supervisor: the workers have the connections, pass the word on. */
+		signal_workers( SIGUSR1 );
+		got_usr1 = 1;
+		return;
+		}
+
 	if ( num_connects == 0 )
 		{
 		/* If there are no active connections we want to exit immediately
@@ -337,7 +445,10 @@ handle_usr2( int sig )
 	(void) signal( SIGUSR2, handle_usr2 );
 #endif /* ! HAVE_SIGSET */
 
-	logstats( (struct timeval*) 0 );
+	if ( workertabs != (workertab*) 0 )
+		signal_workers( SIGUSR2 );
+	else
+		logstats( (struct timeval*) 0 );
 
 	/* Restore previous errno. */
 	errno = oerrno;
@@ -439,7 +550,7 @@ main( int argc, char** argv )
 	struct passwd *pwd;
 	char cwd[MAXPATHLEN+1];
 	FILE *logfp;
-	int num_ready, cnum, i, cont;
+	int num_ready, cnum, i;
 	connecttab *c;
 	httpd_conn *hc;
 	struct timeval tv;
@@ -620,14 +731,6 @@ main( int argc, char** argv )
 		(void) fclose( pidfp );
 		}
 
-	/* Initialize the fdwatch package.  Have to do this before chroot,
-	** if /dev/poll is used.
-	*/
-	max_connects = fdwatch_get_nfiles();
-	if ( max_connects < 0 )
-		DIE(1,"fdwatch initialization failure");
-	max_connects -= SPARE_FDS;
-
 	/* if we have to limit the number of connexion per client (and if root), set the iptables rule */
 	if ( connlimit > 0 ) {
 		if ( getuid() != 0 ) {
@@ -673,15 +776,15 @@ main( int argc, char** argv )
 
 	/* Set up to catch signals. */
 #ifdef HAVE_SIGSET
-	(void) sigset( SIGTERM, handle_term );
-	(void) sigset( SIGINT, handle_term );
-	(void) sigset( SIGCHLD, handle_chld );
-	(void) sigset( SIGPIPE, SIG_IGN );		  /* get EPIPE instead */
-	(void) sigset( SIGHUP, handle_hup );
-	(void) sigset( SIGUSR1, handle_usr1 );
-	(void) sigset( SIGUSR2, handle_usr2 );
-	(void) sigset( SIGALRM, handle_alrm );
-	(void) sigset( SIGBUS, handle_bus );
+	set_handler( SIGTERM, handle_term );
+	set_handler( SIGINT, handle_term );
+	set_handler( SIGCHLD, handle_chld );
+	set_handler( SIGPIPE, SIG_IGN );		  /* get EPIPE instead */
+	set_handler( SIGHUP, handle_hup );
+	set_handler( SIGUSR1, handle_usr1 );
+	set_handler( SIGUSR2, handle_usr2 );
+	set_handler( SIGALRM, handle_alrm );
+	set_handler( SIGBUS, handle_bus );
 #else /* HAVE_SIGSET */
 	(void) signal( SIGTERM, handle_term );
 	(void) signal( SIGINT, handle_term );
@@ -705,19 +808,47 @@ main( int argc, char** argv )
 	/* Initialize the HTTP layer.  Got to do this before giving up root,
 	** so that we can bind to a privileged port.
 	*/
+	if ( workers > 1 )
+		hsbfield |= HS_REUSEPORT;
 	hs = httpd_initialize(hostname, port, cgi_pattern, fastcgi_pass,
 			sig_pattern, cgi_limit, cwd, hsbfield, logfp);
 	if ( hs == (httpd_server*) 0 )
 		DIE(1,"Could not perform httpd initialization (%m). Exiting");
 
+#ifdef SIG_CACHEDIR
+	/* Index the cached signatures before forking: the workers share it. */
+	if ( sigcache_init( SIG_CACHE_DIR, SIG_CACHE_MAX_BYTES ) == 0 )
+		sigindex_init( SIG_CACHE_DIR );
+#endif /* SIG_CACHEDIR */
+#ifdef USE_MERKLE
+	(void) merkle_init( MERKLE_CACHE_DIR );
+#endif /* USE_MERKLE */
+#ifdef USE_DIRSIG
+	(void) dirsig_init( DIRSIG_CACHE_DIR );
+#endif /* USE_DIRSIG */
+	sigpolicy_init( sign_busy_queue, sign_busy_latency, sign_busy_load, sigpolicy_action( sign_busy_action ) );
+
+	/* Fork the workers, still as root so they can bind their own listen
+	** sockets.  The parent stays in there to supervise them.
+	*/
+	if ( workers > 1 )
+		spawn_workers();
+
+	/* Initialize the fdwatch package (one per process: the kernel side of
+	** epoll, kqueue or /dev/poll would be shared by forked processes).
+	*/
+	max_connects = fdwatch_get_nfiles();
+	if ( max_connects < 0 )
+		DIE(1,"fdwatch initialization failure");
+	max_connects -= SPARE_FDS;
+
+	/* The path cache is per process too. */
+	pcache_fd = pcache_init();
+
 	/* Set up the occasional timer. */
 	if ( tmr_create( (struct timeval*) 0, occasional, JunkClientData, OCCASIONAL_TIME * 1000L, 1 ) == (Timer*) 0 )
 		DIE(1,"tmr_create(occasional) failed");
 
-	/* Set up the idle timer. */
-	if ( tmr_create( (struct timeval*) 0, idle, JunkClientData, 5 * 1000L, 1 ) == (Timer*) 0 )
-		DIE(1,"tmr_create(idle) failed");
-
 	if ( numthrottles > 0 )
 		/* Set up the throttles timer. */
 		if ( tmr_create( (struct timeval*) 0, update_throttles, JunkClientData, THROTTLE_TIME * 1000L, 1 ) == (Timer*) 0 )
@@ -895,8 +1026,27 @@ main( int argc, char** argv )
 		}
 	}
 
+#ifdef USE_NATIVE_SIGN
+	/* Load the signing key, to sign without the gpg engine. */
+	if ( pgpsign_init( main_gpgctx, mygpgkey ) == 0 )
+		syslog( LOG_INFO, "signing in process with libgcrypt" );
+	else
+		syslog( LOG_WARNING, "signing through the gpg engine" );
+#endif /* USE_NATIVE_SIGN */
+
 	gpgme_key_unref(mygpgkey);
 
+#ifdef USE_SIGN_POOL
+	/* The signers (after the workers fork, with the key set). */
+	signpool_fd = signpool_init( SIGN_WORKERS, main_gpgctx );
+	if ( signpool_fd < 0 )
+		syslog( LOG_WARNING, "no signing pool, signed files will fork an interposer each" );
+#endif /* USE_SIGN_POOL */
+#ifdef USE_PRESIGN
+	if ( signpool_fd >= 0 && presigner )
+		presign_fd = presign_init( hs );
+#endif /* USE_PRESIGN */
+
 	/* Initialize our connections table. */
 	connects = NEW( connecttab, max_connects );
 	if ( connects == (connecttab*) 0 )
@@ -915,6 +1065,14 @@ main( int argc, char** argv )
 	if ( hs != (httpd_server*) 0 )
 		for ( i=0 ; hs->listen_fds[i]>=0 ; i++ )
 				fdwatch_add_fd( hs->listen_fds[i], (void*) 0, FDW_READ );
+	if ( pcache_fd >= 0 )
+		fdwatch_add_fd( pcache_fd, (void*) 0, FDW_READ );
+	if ( signpool_fd >= 0 )
+		fdwatch_add_fd( signpool_fd, (void*) 0, FDW_READ );
+#ifdef USE_PRESIGN
+	if ( presign_fd >= 0 )
+		fdwatch_add_fd( presign_fd, (void*) 0, FDW_READ );
+#endif /* USE_PRESIGN */
 
 	/* We will now only use syslog if some errors happen, so close stderr */
 	if ( debug )
@@ -963,22 +1121,30 @@ main( int argc, char** argv )
 			}
 		//if (tv.tv_sec%86400 < 600)... /* (just an idea if need to launch daily jobs) */
 
-		/* Is it a new connection? */
-		if ( hs != (httpd_server*) 0 ) {
-			cont=0;
-			for ( i=0 ; hs->listen_fds[i]>=0 ; i++ ) {
-				if ( fdwatch_check_fd( hs->listen_fds[i] ) && handle_newconnect( &tv, hs->listen_fds[i] ) ) {
-					cont=1;
-					break;
-				/* Go around the loop and do another fdwatch, rather than
-				** dropping through and processing existing connections.
-				** New connections always get priority.
-				*/
-				}
-			}
-			if (cont)
-				continue;
-		}
+		/* Is it a new connection?  New connections get serviced first,
+		** but we then drop through to the existing ones: their events
+		** are edge-triggered and would be lost if we went around the
+		** loop for another fdwatch.
+		*/
+		if ( hs != (httpd_server*) 0 )
+			for ( i=0 ; hs->listen_fds[i]>=0 ; i++ )
+				if ( fdwatch_check_fd( hs->listen_fds[i] ) )
+					(void) handle_newconnect( &tv, hs->listen_fds[i] );
+
+		/* Something changed in the web tree? */
+		if ( pcache_fd >= 0 && fdwatch_check_fd( pcache_fd ) )
+			pcache_events();
+
+#ifdef USE_SIGN_POOL
+		/* Signatures ready? */
+		if ( signpool_fd >= 0 && fdwatch_check_fd( signpool_fd ) )
+			handle_signed( &tv );
+#endif /* USE_SIGN_POOL */
+#ifdef USE_PRESIGN
+		/* Files to sign ahead? */
+		if ( presign_fd >= 0 && fdwatch_check_fd( presign_fd ) )
+			presign_events();
+#endif /* USE_PRESIGN */
 
 		/* Find the connections that need servicing. */
 		while ( ( c = (connecttab*) fdwatch_get_next_client_data() ) != (connecttab*) -1 )
@@ -992,7 +1158,8 @@ main( int argc, char** argv )
 			else
 				switch ( c->conn_state )
 					{
-					case CNST_READING: handle_read( c, &tv ); break;
+					case CNST_READING:
+					case CNST_KEEPALIVE: handle_read( c, &tv ); break;
 					case CNST_SENDING: handle_send( c, &tv ); break;
 					case CNST_LINGERING: handle_linger( c, &tv ); break;
 					}
@@ -1008,6 +1175,10 @@ main( int argc, char** argv )
 						fdwatch_del_fd( hs->listen_fds[i] );
 				httpd_unlisten( hs );
 				}
+			/* Don't wait for idle persistent connections. */
+			for ( cnum = 0; cnum < max_connects; ++cnum )
+				if ( connects[cnum].conn_state == CNST_KEEPALIVE )
+					really_clear_connection( &connects[cnum], &tv );
 			}
 
 		/* From handle_send()/writev; see handle_sigbus(). */
@@ -1059,6 +1230,11 @@ parse_args( int argc, char** argv )
 			++argn;
 			connlimit = (unsigned short) atoi( argv[argn] );
 			}
+		else if ( strcmp( argv[argn], "-w" ) == 0 && argn + 1 < argc )
+			{
+			++argn;
+			workers = atoi( argv[argn] );
+			}
 		else if ( strcmp( argv[argn], "-nk" ) == 0 )
 			{
 			hsbfield &= ~HS_PKS_ADD_MERGE_ONLY;
@@ -1148,6 +1324,7 @@ usage( void )
 				"	-C FILE     config file to use - default: "DEFAULT_CFILE" in running directory\n"
 				"	-p PORT     listenning port - default: %d\n"
 				"	-H HOST     host name or address to bind to - default: all available\n"
+				"	-w N        number of worker processes - default: %d\n"
 #ifdef VHOSTING
 				"	-vh         enable virtual hosting\n"
 #endif /* VHOSTING */
@@ -1172,7 +1349,7 @@ usage( void )
 				"	-fpr KeyID  fingerprint of the "SOFTWARE_NAME"'s OpenPGP key - no default, MANDATORY\n"
 				"	-V          show version and exit\n"
 				"	-D          stay in foreground (usefull to debug or monitor)\n"
-			, argv0, user, DEFAULT_PORT
+			, argv0, user, DEFAULT_PORT, DEFAULT_WORKERS
 #if DEFAULT_CONNLIMIT > 0
 			, DEFAULT_CONNLIMIT
 #endif /* DEFAULT_CONNLIMIT > 0 */
@@ -1272,6 +1449,52 @@ static int read_config( char* filename )
 				value_required( name, value );
 				cgi_limit = atoi( value );
 				}
+			else if ( strcasecmp( name, "keepalivetime" ) == 0 )
+				{
+				value_required( name, value );
+				keepalive_timelimit = atoi( value );
+				}
+			else if ( strcasecmp( name, "keepalivemax" ) == 0 )
+				{
+				value_required( name, value );
+				keepalive_max = atoi( value );
+				}
+			else if ( strcasecmp( name, "signqueue" ) == 0 )
+				{
+				value_required( name, value );
+				sign_busy_queue = atoi( value );
+				}
+			else if ( strcasecmp( name, "signlatency" ) == 0 )
+				{
+				value_required( name, value );
+				sign_busy_latency = atol( value );
+				}
+			else if ( strcasecmp( name, "signload" ) == 0 )
+				{
+				value_required( name, value );
+				sign_busy_load = atof( value );
+				}
+			else if ( strcasecmp( name, "signbusy" ) == 0 )
+				{
+				value_required( name, value );
+				if ( sigpolicy_action( value ) < 0 )
+					{
+					(void) fprintf(
+						stderr, "%s: signbusy must be delay, cache or refuse\n", argv0 );
+					exit( 1 );
+					}
+				sign_busy_action = e_strdup( value );
+				}
+			else if ( strcasecmp( name, "workers" ) == 0 )
+				{
+				value_required( name, value );
+				workers = atoi( value );
+				}
+			else if ( strcasecmp( name, "cpuaffinity" ) == 0 )
+				{
+				no_value_required( name, value );
+				cpuaffinity = 1;
+				}
 			else if ( strcasecmp( name, "throttles" ) == 0 )
 				{
 				value_required( name, value );
@@ -1454,6 +1677,22 @@ read_throttlefile( char* throttlefile )
 		++numthrottles;
 		}
 	(void) fclose( fp );
+
+	/* Compile all the patterns, so a request is checked in a single pass. */
+	if ( numthrottles > 0 )
+		{
+		char** patterns = NEW( char*, numthrottles );
+		int tnum;
+
+		if ( patterns == (char**) 0 )
+			DIE( 1, "out of memory allocating %s", "throttle patterns" );
+		for ( tnum = 0; tnum < numthrottles; ++tnum )
+			patterns[tnum] = throttles[tnum].pattern;
+		throttle_match = match_compile( patterns, numthrottles );
+		free( (void*) patterns );
+		if ( throttle_match == (MatchSet*) 0 )
+			DIE( 1, "out of memory compiling %s", "throttle patterns" );
+		}
 	}
 
 
@@ -1463,6 +1702,10 @@ shut_down( void )
 	int cnum, i;
 	struct timeval tv;
 
+	/* Supervisor: the workers shut down on their own. */
+	if ( workertabs != (workertab*) 0 )
+		signal_workers( SIGTERM );
+
 	/* childs's gentle kill */
 	for ( cnum = hctab.pidmin; cnum < hctab.pidmax; ++cnum )
 		if (hctab.hcs[cnum-hctab.pidmin]) {
@@ -1471,7 +1714,8 @@ shut_down( void )
 		}
 
 	(void) gettimeofday( &tv, (struct timezone*) 0 );
-	logstats( &tv );
+	if ( workertabs == (workertab*) 0 )
+		logstats( &tv );
 
 	for ( cnum = 0; cnum < max_connects; ++cnum )
 		{
@@ -1489,15 +1733,59 @@ shut_down( void )
 		{
 		httpd_server* ths = hs;
 		hs = (httpd_server*) 0;
-		for ( i=0 ; ths->listen_fds[i]>=0 ; i++ )
+		if ( workertabs == (workertab*) 0 )
+			for ( i=0 ; ths->listen_fds[i]>=0 ; i++ )
 				fdwatch_del_fd( ths->listen_fds[i] );
 		httpd_terminate( ths );
 		}
+#ifdef USE_SIGN_POOL
+	/* (After the connections: their jobs still queued are cancelled.) */
+	if ( signpool_fd >= 0 )
+		{
+		SignJob* job;
+		SignJob* next;
+
+		fdwatch_del_fd( signpool_fd );
+		signpool_fd = -1;
+		signpool_destroy();
+		for ( job = signpool_collect(); job != (SignJob*) 0; job = next )
+			{
+			next = job->next;
+			httpd_sign_release( job );
+			}
+		}
+#endif /* USE_SIGN_POOL */
+#ifdef USE_PRESIGN
+	if ( presign_fd >= 0 )
+		{
+		fdwatch_del_fd( presign_fd );
+		presign_fd = -1;
+		}
+	presign_destroy();
+#endif /* USE_PRESIGN */
+#ifdef USE_NATIVE_SIGN
+	pgpsign_destroy();
+#endif /* USE_NATIVE_SIGN */
 	mmc_destroy();
+	if ( pcache_fd >= 0 )
+		{
+		fdwatch_del_fd( pcache_fd );
+		pcache_fd = -1;
+		}
+	pcache_destroy();
+	rcache_destroy();
+#ifdef USE_COMPRESSION
+	zcache_destroy();
+#endif /* USE_COMPRESSION */
+#ifdef SIG_CACHEDIR
+	sigindex_destroy();
+#endif /* SIG_CACHEDIR */
 	tmr_destroy();
 	free( (void*) connects );
 	if ( throttles != (throttletab*) 0 )
 		free( (void*) throttles );
+	match_free( throttle_match );
+	throttle_match = (MatchSet*) 0;
 
 	/* childs's hard kill */
 	for ( cnum = hctab.pidmin; cnum < hctab.pidmax; ++cnum )
@@ -1513,6 +1801,164 @@ shut_down( void )
 
 	}
 
+/* Fork the worker processes.  Only returns in a worker: the parent stays in
+** there to supervise them, starting again those which crash, and exits once
+** they are all gone.
+*/
+static void
+spawn_workers( void )
+	{
+	int wnum;
+	pid_t pid;
+	time_t now;
+	sigset_t mask, omask;
+
+	workertabs = NEW( workertab, workers );
+	if ( workertabs == (workertab*) 0 )
+		DIE( 1, "out of memory allocating %s", "a workertab" );
+	for ( wnum = 0; wnum < workers; ++wnum )
+		{
+		workertabs[wnum].pid = 0;
+		workertabs[wnum].status = 0;
+		workertabs[wnum].started_at = 0;
+		}
+	num_workers = 0;
+#ifndef SO_REUSEPORT
+	syslog( LOG_WARNING, "no SO_REUSEPORT, %d workers will share the same listen socket(s)", workers );
+#endif /* ! SO_REUSEPORT */
+
+	/* The watchdog is for the event loops. */
+	(void) alarm( 0 );
+
+	/* Keep the signals we care about for sigsuspend(), so none get lost. */
+	(void) sigemptyset( &mask );
+	(void) sigaddset( &mask, SIGCHLD );
+	(void) sigaddset( &mask, SIGHUP );
+	(void) sigaddset( &mask, SIGUSR1 );
+	(void) sigaddset( &mask, SIGUSR2 );
+	(void) sigprocmask( SIG_BLOCK, &mask, &omask );
+
+	for (;;)
+		{
+		if ( got_hup )
+			{
+			signal_workers( SIGHUP );
+			got_hup = 0;
+			}
+
+		now = time( (time_t*) 0 );
+		for ( wnum = 0; wnum < workers && ! got_usr1; ++wnum )
+			{
+			if ( workertabs[wnum].pid != 0 )
+				continue;
+			if ( workertabs[wnum].started_at != 0 )
+				{
+				/* This one exited, see if it deserves a new start. */
+				if ( WIFEXITED( workertabs[wnum].status ) && WEXITSTATUS( workertabs[wnum].status ) == 0 )
+					{
+					syslog( LOG_NOTICE, "worker %d exited", wnum );
+					workertabs[wnum].pid = -1;
+					continue;
+					}
+				if ( now - workertabs[wnum].started_at < WORKER_RESPAWN_TIME )
+					{
+					syslog( LOG_ERR, "worker %d died too soon (status 0x%x), giving up on it", wnum, workertabs[wnum].status );
+					workertabs[wnum].pid = -1;
+					continue;
+					}
+				syslog( LOG_ERR, "worker %d died (status 0x%x), starting it again", wnum, workertabs[wnum].status );
+				}
+			pid = fork();
+			if ( pid == 0 )
+				{
+				(void) sigprocmask( SIG_SETMASK, &omask, (sigset_t*) 0 );
+				init_worker( wnum );
+				return;
+				}
+			if ( pid < 0 )
+				{
+				syslog( LOG_ERR, "fork worker %d - %m", wnum );
+				workertabs[wnum].pid = -1;
+				continue;
+				}
+			workertabs[wnum].pid = pid;
+			workertabs[wnum].started_at = now;
+			++num_workers;
+			}
+#ifdef SO_REUSEPORT
+		/* The kernel would hand the initial socket(s) their share of the
+		** connections, and the supervisor doesn't accept: the workers
+		** started (and respawned ones) listen on sockets of their own.
+		*/
+		httpd_unlisten( hs );
+#endif /* SO_REUSEPORT */
+
+		if ( num_workers <= 0 )
+			break;
+		(void) sigsuspend( &omask );
+		}
+
+	shut_down();
+	syslog( LOG_NOTICE, "exiting" );
+	closelog();
+	exit( got_usr1 ? 0 : 1 );
+	}
+
+/* First things a worker does after the fork. */
+static void
+init_worker( int wnum )
+	{
+	free( (void*) workertabs );
+	workertabs = (workertab*) 0;
+	num_workers = 0;
+#ifdef USE_PRESIGN
+	presigner = ( wnum == 0 );
+#endif /* USE_PRESIGN */
+
+	/* Leave the netfilter rule to the supervisor. */
+	iptables_cmd[0] = '\0';
+
+	/* Pending alarms are not inherited. */
+	(void) alarm( OCCASIONAL_TIME * 3 );
+
+#ifdef SO_REUSEPORT
+	/* Each worker, the first one too, gets listen socket(s) of its own:
+	** the initial ones go with the supervisor's copies, which nobody
+	** accepts on (see spawn_workers()).
+	*/
+	if ( httpd_relisten( hs ) < 1 )
+		DIE(1,"worker %d: could not get listen socket(s) of its own", wnum);
+#endif /* SO_REUSEPORT */
+
+	if ( cpuaffinity )
+		{
+#ifdef HAVE_SCHED_SETAFFINITY
+		cpu_set_t cpus;
+		long ncpus = sysconf( _SC_NPROCESSORS_ONLN );
+
+		if ( ncpus < 1 )
+			ncpus = 1;
+		CPU_ZERO( &cpus );
+		CPU_SET( wnum % ncpus, &cpus );
+		if ( sched_setaffinity( 0, sizeof(cpus), &cpus ) < 0 )
+			syslog( LOG_WARNING, "worker %d: sched_setaffinity - %m", wnum );
+#else /* HAVE_SCHED_SETAFFINITY */
+		syslog( LOG_WARNING, "compiled without sched_setaffinity(), cpuaffinity option is ignored." );
+#endif /* HAVE_SCHED_SETAFFINITY */
+		}
+	}
+
+/* Send a signal to all the running workers (supervisor only). */
+static void
+signal_workers( int sig )
+	{
+	int wnum;
+
+	for ( wnum = 0; wnum < workers; ++wnum )
+		if ( workertabs[wnum].pid > 0 )
+			(void) kill( workertabs[wnum].pid, sig );
+	}
+
 /*
  * \return 1 if there is no more connection to accept for now, else 0
  * \note may exit() !
@@ -1583,13 +2029,16 @@ handle_newconnect( struct timeval* tvP, int listen_fd )
 		c->active_at = tvP->tv_sec;
 		c->wakeup_timer = (Timer*) 0;
 		c->linger_timer = (Timer*) 0;
+		c->idle_timer = (Timer*) 0;
+		set_idle_timer( c, tvP );
 		c->next_byte_index = 0;
 		c->numtnums = 0;
+		c->nrequests = 0;
 
 		/* Set the connection file descriptor to no-delay mode. */
 		httpd_set_ndelay( c->hc->conn_fd );
 
-		fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ );
+		fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ | FDW_EDGE );
 
 		++stats_connections;
 		if ( num_connects > stats_simultaneous )
@@ -1602,61 +2051,145 @@ static void
 handle_read( connecttab* c, struct timeval* tvP )
 	{
 	int sz;
-	//ClientData client_data;
+	size_t avail;
 	httpd_conn* hc = c->hc;
 
-	/* Is there room in our buffer to read more bytes? */
-	if ( hc->read_idx >= hc->read_size )
+	/* The connection is watched edge-triggered, so we won't be told again
+	** about bytes already waiting: keep reading until we get a short
+	** count or a complete request.
+	*/
+	for (;;)
 		{
-		if ( hc->read_size > 5000 )
+		/* Is there room in our buffer to read more bytes? */
+		if ( hc->read_idx >= hc->read_size )
+			{
+			if ( hc->read_size > 5000 )
+				{
+				httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
+				finish_connection( c, tvP );
+				return;
+				}
+			httpd_realloc_str(
+				&hc->read_buf, &hc->read_size, hc->read_size + 1000 );
+			}
+
+		/* Read some more bytes. */
+		avail = hc->read_size - hc->read_idx;
+		sz = read( hc->conn_fd, &(hc->read_buf[hc->read_idx]), avail );
+		if ( c->conn_state == CNST_KEEPALIVE )
+			{
+			/* Between requests, the client just closing is fine. */
+			if ( sz < 0 && ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ) )
+				return;
+			if ( sz <= 0 )
+				{
+				really_clear_connection( c, tvP );
+				return;
+				}
+			c->conn_state = CNST_READING;
+			}
+		if ( sz == 0 )
 			{
 			httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
 			finish_connection( c, tvP );
 			return;
 			}
-		httpd_realloc_str(
-			&hc->read_buf, &hc->read_size, hc->read_size + 1000 );
-		}
+		if ( sz < 0 )
+			{
+			/* Ignore EINTR and EAGAIN.  Also ignore EWOULDBLOCK.  At first glance
+			** you would think that connections returned by fdwatch as readable
+			** should never give an EWOULDBLOCK; however, this apparently can
+			** happen if a packet gets garbled.
+			*/
+			if ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK )
+				return;
+			httpd_send_err(
+				hc, 400, httpd_err400title, "", httpd_err400form, "" );
+			finish_connection( c, tvP );
+			return;
+			}
+		hc->read_idx += sz;
+		c->active_at = tvP->tv_sec;
 
-	/* Read some more bytes. */
-	sz = read(
-		hc->conn_fd, &(hc->read_buf[hc->read_idx]),
-		hc->read_size - hc->read_idx );
-	if ( sz == 0 )
-		{
-		httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
-		finish_connection( c, tvP );
-		return;
-		}
-	if ( sz < 0 )
-		{
-		/* Ignore EINTR and EAGAIN.  Also ignore EWOULDBLOCK.  At first glance
-		** you would think that connections returned by fdwatch as readable
-		** should never give an EWOULDBLOCK; however, this apparently can
-		** happen if a packet gets garbled.
-		*/
-		if ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK )
+		/* Do we have a complete request yet? */
+		switch ( httpd_got_request( hc ) )
+			{
+			case GR_NO_REQUEST:
+			if ( (size_t) sz < avail )
+				return;		/* socket drained, wait for more */
+			continue;
+			case GR_BAD_REQUEST:
+			httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
+			finish_connection( c, tvP );
 			return;
-		httpd_send_err(
-			hc, 400, httpd_err400title, "", httpd_err400form, "" );
-		finish_connection( c, tvP );
-		return;
+			}
+		break;
 		}
-	hc->read_idx += sz;
-	c->active_at = tvP->tv_sec;
 
-	/* Do we have a complete request yet? */
+	/* Yes. */
+	serve_requests( c, tvP );
+	}
+
+
+/* Serve the complete request at the front of the read buffer, then those
+** the client pipelined behind it, as long as the connection is kept alive
+** and they don't have to wait for the socket to become writable.
+*/
+static void
+serve_requests( connecttab* c, struct timeval* tvP )
+	{
+	do
+		handle_request( c, tvP );
+	while ( pipelined_request( c, tvP ) );
+	}
+
+
+/* Once a response is done on a kept-alive connection, check whether the
+** next request is already complete in the read buffer.
+*/
+static int
+pipelined_request( connecttab* c, struct timeval* tvP )
+	{
+	httpd_conn* hc = c->hc;
+
+	if ( c->conn_state != CNST_KEEPALIVE || hc->read_idx == 0 )
+		return 0;
 	switch ( httpd_got_request( hc ) )
 		{
 		case GR_NO_REQUEST:
-		return;
+		/* Only the beginning of it is here; send the responses held back
+		** so far while waiting for the rest.
+		*/
+		if ( flush_response( c, tvP ) )
+			{
+			/* (Checked again from its start once they are out.) */
+			hc->checked_idx = 0;
+			hc->checked_state = CHST_FIRSTWORD;
+			}
+		else
+			c->conn_state = CNST_READING;
+		return 0;
 		case GR_BAD_REQUEST:
 		httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
 		finish_connection( c, tvP );
-		return;
+		return 0;
 		}
+	return 1;
+	}
 
-	/* Yes.  Try parsing and resolving it. */
+
+static void
+handle_request( connecttab* c, struct timeval* tvP )
+	{
+	int sign, r;
+	httpd_conn* hc = c->hc;
+
+	/* Allow it a persistent connection unless it's the last one we'll
+	** take, then try parsing and resolving it.
+	*/
+	++c->nrequests;
+	if ( keepalive_timelimit > 0 && c->nrequests < keepalive_max && ! terminate )
+		hc->bfield |= HC_KEEP_ALIVE;
 	if ( httpd_parse_request( hc ) < 0 )
 		{
 		finish_connection( c, tvP );
@@ -1672,14 +2205,57 @@ handle_read( connecttab* c, struct timeval* tvP )
 		return;
 		}
 
-	/* Start the connection going. */
-	if ( httpd_start_request( hc, tvP ) < 0 )
+	/* Start the connection going.  The signing interposer dup2()s a pipe
+	** over conn_fd, while epoll would keep watching the socket it was
+	** registered with; so in that case take the fd out of the watch list
+	** meanwhile, and put whatever it has become back afterwards.  (The
+	** signing pool leaves conn_fd alone.)
+	*/
+	sign = ( hc->bfield & HC_DETACH_SIGN ) && signpool_fd < 0;
+	if ( sign )
+		fdwatch_del_fd( hc->conn_fd );
+	r = httpd_start_request( hc, tvP );
+	if ( sign )
+		fdwatch_add_fd( hc->conn_fd, c, FDW_WRITE | FDW_EDGE );
+	if ( r < 0 )
 		{
 		/* Something went wrong.  Close down the connection. */
 		finish_connection( c, tvP );
 		return;
 		}
 
+#ifdef USE_SIGN_POOL
+	/* The signature comes back through handle_signed().  Meanwhile conn_fd
+	** isn't watched, as when pausing: the next pipelined request, or poll()
+	** and select() seeing it readable, would only spin the loop.
+	*/
+	if ( hc->bfield & HC_SIGN_PENDING )
+		{
+		if ( httpd_sign_submit( hc, c ) < 0 )
+			{
+			hc->responselen = hc->heldlen;
+			httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
+			finish_connection( c, tvP );
+			return;
+			}
+		c->conn_state = CNST_SIGNING;
+		fdwatch_del_fd( hc->conn_fd );
+		return;
+		}
+#endif /* USE_SIGN_POOL */
+
+	start_sending( c, tvP );
+	}
+
+
+/* Send the response httpd_start_request() has prepared: its buffered
+** headers, then the file, if any.
+*/
+static void
+start_sending( connecttab* c, struct timeval* tvP )
+	{
+	httpd_conn* hc = c->hc;
+
 	/* Fill in end_byte_index. */
 	if ( hc->bfield & HC_GOT_RANGE )
 		{
@@ -1692,9 +2268,9 @@ handle_read( connecttab* c, struct timeval* tvP )
 		c->end_byte_index = hc->bytes_to_send;
 
 	/* Check if it's already handled. */
-	if ( hc->file_address == (char*) 0 )
+	if ( hc->file_address == (char*) 0 && hc->file_fd < 0 )
 		{
-		/* No file address means someone else (a child process) is handling it. */
+		/* No file means someone else (a child process) is handling it. */
 		int tind;
 		for ( tind = 0; tind < c->numtnums; ++tind )
 			throttles[c->tnums[tind]].bytes_since_avg += hc->bytes_sent;
@@ -1702,9 +2278,25 @@ handle_read( connecttab* c, struct timeval* tvP )
 		finish_connection( c, tvP );
 		return;
 		}
+	/* If more pipelined requests wait behind this one and the file is
+	** small, just copy it behind its headers: the responses will then go
+	** out together.
+	*/
+	if ( ( hc->bfield & HC_KEEP_ALIVE ) && hc->checked_idx < hc->read_idx &&
+		 hc->file_address != (char*) 0 && hc->nranges == 0 &&
+		 hc->responselen + ( c->end_byte_index - c->next_byte_index ) <= PIPELINE_COALESCE_SIZE )
+		{
+		int tind;
+		off_t len = c->end_byte_index - c->next_byte_index;
+		httpd_add_response( hc, &(hc->file_address[c->next_byte_index]), len );
+		for ( tind = 0; tind < c->numtnums; ++tind )
+			throttles[c->tnums[tind]].bytes_since_avg += len;
+		hc->bytes_sent += len;
+		c->next_byte_index = c->end_byte_index;
+		}
 	if ( c->next_byte_index >= c->end_byte_index )
 		{
-		/* There's nothing to send. */
+		/* There's nothing (more) to send. */
 		finish_connection( c, tvP );
 		return;
 		}
@@ -1713,18 +2305,62 @@ handle_read( connecttab* c, struct timeval* tvP )
 	c->conn_state = CNST_SENDING;
 	c->started_at = tvP->tv_sec;
 	c->wouldblock_delay = 0;
-	//client_data.p = c;
 
-	fdwatch_del_fd( hc->conn_fd );
-	fdwatch_add_fd( hc->conn_fd, c, FDW_WRITE );
+	fdwatch_mod_fd( hc->conn_fd, c, FDW_WRITE | FDW_EDGE );
+	}
+
+
+#ifdef USE_SIGN_POOL
+/* Send the responses whose signature is ready. */
+static void
+handle_signed( struct timeval* tvP )
+	{
+	SignJob* job;
+	SignJob* next;
+	SignJob* w;
+	connecttab* c;
+#ifdef USE_PRESIGN
+	int low;
+#endif /* USE_PRESIGN */
+
+	for ( job = signpool_collect(); job != (SignJob*) 0; job = next )
+		{
+		next = job->next;
+		/* The job's own connection, then the ones waiting for the same
+		** signature.  (No client data for the connections cleared
+		** meanwhile, nor for the pre-signer's jobs.)
+		*/
+		for ( w = job; w != (SignJob*) 0; w = w->waiters )
+			{
+			c = (connecttab*) w->client_data;
+			if ( c != (connecttab*) 0 )
+				{
+				httpd_signed( c->hc, job );
+				c->active_at = tvP->tv_sec;
+				c->conn_state = CNST_READING;
+				fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ | FDW_EDGE );
+				start_sending( c, tvP );
+				}
+			}
+#ifdef USE_PRESIGN
+		low = job->low;
+		httpd_sign_release( job );
+		if ( low && low != SIGNJOB_TREE )
+			presign_done();
+#else /* USE_PRESIGN */
+		httpd_sign_release( job );
+#endif /* USE_PRESIGN */
+		}
 	}
+#endif /* USE_SIGN_POOL */
 
 
 static void
 handle_send( connecttab* c, struct timeval* tvP )
 	{
-	size_t max_bytes;
-	int sz, coast;
+	size_t max_bytes, len;
+	int sz, wrote, coast;
+	int nwrites;
 	ClientData client_data;
 	time_t elapsed;
 	httpd_conn* hc = c->hc;
@@ -1735,146 +2371,327 @@ handle_send( connecttab* c, struct timeval* tvP )
 	else
 		max_bytes = c->max_limit / 4;		/* send at most 1/4 seconds worth */
 
-	/* Do we need to write the headers first? */
-	if ( hc->responselen == 0 )
-		{
-		/* No, just write the file. */
-		sz = write(
-			hc->conn_fd, &(hc->file_address[c->next_byte_index]),
-			MIN( c->end_byte_index - c->next_byte_index, max_bytes ) );
-		}
-	else
+	/* Edge-triggered again: go on writing until the socket buffer is full
+	** (a short count), we are done, or the throttle pauses us.
+	*/
+	for ( nwrites = 0; ; ++nwrites )
 		{
-		/* Yes.  We'll combine headers and file into a single writev(),
-		** hoping that this generates a single packet.
-		*/
-		struct iovec iv[2];
-
-		iv[0].iov_base = hc->response;
-		iv[0].iov_len = hc->responselen;
-		iv[1].iov_base = &(hc->file_address[c->next_byte_index]);
-		iv[1].iov_len = MIN( c->end_byte_index - c->next_byte_index, max_bytes );
-		sz = writev( hc->conn_fd, iv, 2 );
-		}
-
-	if ( sz < 0 && errno == EINTR )
-		return;
+		len = MIN( c->end_byte_index - c->next_byte_index, max_bytes );
 
-	if ( sz == 0 ||
-		 ( sz < 0 && ( errno == EWOULDBLOCK || errno == EAGAIN ) ) )
-		{
-		/* This shouldn't happen, but some kernels, e.g.
-		** SunOS 4.1.x, are broken and select() says that
-		** O_NDELAY sockets are always writable even when
-		** they're actually not.
-		**
-		** Current workaround is to block sending on this
-		** socket for a brief adaptively-tuned period.
-		** Fortunately we already have all the necessary
-		** blocking code, for use with throttling.
-		*/
-		c->wouldblock_delay += MIN_WOULDBLOCK_DELAY;
-		c->conn_state = CNST_PAUSING;
-		fdwatch_del_fd( hc->conn_fd );
-		client_data.p = c;
-		if ( c->wakeup_timer != (Timer*) 0 )
-			syslog( LOG_ERR, "replacing non-null wakeup_timer!" );
-		c->wakeup_timer = tmr_create(
-			tvP, wakeup_connection, client_data, c->wouldblock_delay, 0 );
-		if ( c->wakeup_timer == (Timer*) 0 )
+		if ( c->end_byte_index == 0 )
 			{
-			syslog( LOG_CRIT, "tmr_create(wakeup_connection) failed" );
-			exit( 1 );
+			/* Only a buffered response to flush, see flush_response(). */
+			len = hc->responselen;
+			sz = write( hc->conn_fd, hc->response, len );
 			}
-		return;
-		}
-
-	if ( sz < 0 )
-		{
-		/* Something went wrong, close this connection.
-		**
-		** If it's just an EPIPE, don't bother logging, that
-		** just means the client hung up on us.
-		**
-		** On some systems, write() occasionally gives an EINVAL.
-		** Dunno why, something to do with the socket going
-		** bad.  Anyway, we don't log those either.
-		**
-		** And ECONNRESET isn't interesting either.
-		*/
-		if ( errno != EPIPE && errno != EINVAL && errno != ECONNRESET )
-			syslog( LOG_ERR, "write - %m sending %.80s", hc->encodedurl );
-		clear_connection( c, tvP );
-		return;
-		}
-
-	/* Ok, we wrote something. */
-	c->active_at = tvP->tv_sec;
-	/* Was this a headers + file writev()? */
-	if ( hc->responselen > 0 )
-		{
-		/* Yes; did we write only part of the headers? */
-		if ( sz < hc->responselen )
+		else if ( hc->nranges > 0 )
+			sz = ranges_response( hc, c->next_byte_index, &len );
+		else
+#ifdef USE_SENDFILE
+		if ( hc->file_fd >= 0 )
 			{
-			/* Yes; move the unwritten part to the front of the buffer. */
-			int newlen = hc->responselen - sz;
-			(void) memmove( hc->response, &(hc->response[sz]), newlen );
-			hc->responselen = newlen;
-			sz = 0;
+			sz = sendfile_response( hc, c->next_byte_index, len );
+			len += hc->responselen;
 			}
 		else
+#endif /* USE_SENDFILE */
+		/* Do we need to write the headers first? */
+		if ( hc->responselen == 0 )
 			{
-			/* Nope, we wrote the full headers, so adjust accordingly. */
-			sz -= hc->responselen;
-			hc->responselen = 0;
+			/* No, just write the file. */
+			sz = write(
+				hc->conn_fd, &(hc->file_address[c->next_byte_index]), len );
+			}
+		else
+			{
+			/* Yes.  We'll combine headers and file into a single writev(),
+			** hoping that this generates a single packet.
+			*/
+			struct iovec iv[2];
+
+			iv[0].iov_base = hc->response;
+			iv[0].iov_len = hc->responselen;
+			iv[1].iov_base = &(hc->file_address[c->next_byte_index]);
+			iv[1].iov_len = len;
+			sz = writev( hc->conn_fd, iv, 2 );
+			len += hc->responselen;
 			}
-		}
-	/* And update how much of the file we wrote. */
-	c->next_byte_index += sz;
-	c->hc->bytes_sent += sz;
-	for ( tind = 0; tind < c->numtnums; ++tind )
-		throttles[c->tnums[tind]].bytes_since_avg += sz;
-
-	/* Are we done? */
-	if ( c->next_byte_index >= c->end_byte_index )
-		{
-		/* This connection is finished! */
-		finish_connection( c, tvP );
-		return;
-		}
 
-	/* Tune the (blockheaded) wouldblock delay. */
-	if ( c->wouldblock_delay > MIN_WOULDBLOCK_DELAY )
-		c->wouldblock_delay -= MIN_WOULDBLOCK_DELAY;
+		if ( sz < 0 && errno == EINTR )
+			return;
 
-	/* If we're throttling, check if we're sending too fast. */
-	if ( c->max_limit != THROTTLE_NOLIMIT )
-		{
-		elapsed = tvP->tv_sec - c->started_at;
-		if ( elapsed == 0 )
-			elapsed = 1;		/* count at least one second */
-		if ( c->hc->bytes_sent / elapsed > c->max_limit )
+		if ( sz == 0 ||
+			 ( sz < 0 && ( errno == EWOULDBLOCK || errno == EAGAIN ) ) )
 			{
+			/* If we already wrote something this time, the buffer just
+			** filled up: the next writable edge will bring us back.
+			*/
+			if ( nwrites > 0 )
+				return;
+
+			/* This shouldn't happen, but some kernels, e.g.
+			** SunOS 4.1.x, are broken and select() says that
+			** O_NDELAY sockets are always writable even when
+			** they're actually not.
+			**
+			** Current workaround is to block sending on this
+			** socket for a brief adaptively-tuned period.
+			** Fortunately we already have all the necessary
+			** blocking code, for use with throttling.
+			*/
+			c->wouldblock_delay += MIN_WOULDBLOCK_DELAY;
 			c->conn_state = CNST_PAUSING;
 			fdwatch_del_fd( hc->conn_fd );
-			/* How long should we wait to get back on schedule?  If less
-			** than a second (integer math rounding), use 1/2 second.
-			*/
-			coast = c->hc->bytes_sent / c->max_limit - elapsed;
 			client_data.p = c;
 			if ( c->wakeup_timer != (Timer*) 0 )
 				syslog( LOG_ERR, "replacing non-null wakeup_timer!" );
 			c->wakeup_timer = tmr_create(
-				tvP, wakeup_connection, client_data,
-				coast > 0 ? ( coast * 1000L ) : 500L, 0 );
+				tvP, wakeup_connection, client_data, c->wouldblock_delay, 0 );
 			if ( c->wakeup_timer == (Timer*) 0 )
 				{
 				syslog( LOG_CRIT, "tmr_create(wakeup_connection) failed" );
 				exit( 1 );
 				}
+			return;
+			}
+
+		if ( sz < 0 )
+			{
+			/* Something went wrong, close this connection.
+			**
+			** If it's just an EPIPE, don't bother logging, that
+			** just means the client hung up on us.
+			**
+			** On some systems, write() occasionally gives an EINVAL.
+			** Dunno why, something to do with the socket going
+			** bad.  Anyway, we don't log those either.
+			**
+			** And ECONNRESET isn't interesting either.
+			*/
+			if ( errno != EPIPE && errno != EINVAL && errno != ECONNRESET )
+				syslog( LOG_ERR, "write - %m sending %.80s", hc->encodedurl );
+			clear_connection( c, tvP );
+			return;
+			}
+
+		/* Ok, we wrote something. */
+		wrote = sz;
+		c->active_at = tvP->tv_sec;
+		/* Was this a headers + file writev()? */
+		if ( hc->responselen > 0 )
+			{
+			/* Yes; did we write only part of the headers? */
+			if ( sz < hc->responselen )
+				{
+				/* Yes; move the unwritten part to the front of the buffer. */
+				int newlen = hc->responselen - sz;
+				(void) memmove( hc->response, &(hc->response[sz]), newlen );
+				hc->responselen = newlen;
+				sz = 0;
+				}
+			else
+				{
+				/* Nope, we wrote the full headers, so adjust accordingly. */
+				sz -= hc->responselen;
+				hc->responselen = 0;
+				}
+			}
+		/* And update how much of the file we wrote. */
+		c->next_byte_index += sz;
+		c->hc->bytes_sent += sz;
+		for ( tind = 0; tind < c->numtnums; ++tind )
+			throttles[c->tnums[tind]].bytes_since_avg += sz;
+
+		/* Are we done? */
+		if ( c->next_byte_index >= c->end_byte_index && hc->responselen == 0 )
+			{
+			/* This response is finished!  Go on with pipelined requests,
+			** if any.
+			*/
+			finish_connection( c, tvP );
+			if ( pipelined_request( c, tvP ) )
+				serve_requests( c, tvP );
+			return;
+			}
+
+		/* Tune the (blockheaded) wouldblock delay. */
+		if ( c->wouldblock_delay > MIN_WOULDBLOCK_DELAY )
+			c->wouldblock_delay -= MIN_WOULDBLOCK_DELAY;
+
+		/* If we're throttling, check if we're sending too fast. */
+		if ( c->max_limit != THROTTLE_NOLIMIT )
+			{
+			elapsed = tvP->tv_sec - c->started_at;
+			if ( elapsed == 0 )
+				elapsed = 1;		/* count at least one second */
+			if ( c->hc->bytes_sent / elapsed > c->max_limit )
+				{
+				c->conn_state = CNST_PAUSING;
+				fdwatch_del_fd( hc->conn_fd );
+				/* How long should we wait to get back on schedule?  If less
+				** than a second (integer math rounding), use 1/2 second.
+				*/
+				coast = c->hc->bytes_sent / c->max_limit - elapsed;
+				client_data.p = c;
+				if ( c->wakeup_timer != (Timer*) 0 )
+					syslog( LOG_ERR, "replacing non-null wakeup_timer!" );
+				c->wakeup_timer = tmr_create(
+					tvP, wakeup_connection, client_data,
+					coast > 0 ? ( coast * 1000L ) : 500L, 0 );
+				if ( c->wakeup_timer == (Timer*) 0 )
+					{
+					syslog( LOG_CRIT, "tmr_create(wakeup_connection) failed" );
+					exit( 1 );
+					}
+				return;
+				}
 			}
+		/* (No check on min_limit here, that only controls connection startups.) */
+
+		/* A short write means the socket buffer is full for now. */
+		if ( (size_t) wrote < len )
+			return;
+		}
+	}
+
+
+#ifdef USE_SENDFILE
+/* Same as the headers + file writev() of handle_send(), with the file data
+** going straight from the page cache to the socket.  MSG_MORE keeps the
+** headers for the first packet of data.
+** \return the number of bytes written (headers included), or -1.
+*/
+static ssize_t
+sendfile_response( httpd_conn* hc, off_t offset, size_t len )
+	{
+	ssize_t hsz = 0, fsz;
+
+	if ( hc->responselen > 0 )
+		{
+		hsz = send( hc->conn_fd, hc->response, hc->responselen, len > 0 ? MSG_MORE : 0 );
+		if ( hsz < hc->responselen )
+			return hsz;
+		}
+	fsz = sendfile( hc->conn_fd, hc->file_fd, &offset, len );
+	if ( fsz == 0 && len > 0 )
+		{
+		/* The file got shorter since we stat()ed it. */
+		fsz = -1;
+		errno = EIO;
 		}
-	/* (No check on min_limit here, that only controls connection startups.) */
+	if ( fsz < 0 )
+		/* The headers are gone whatever the error: report them, so that
+		** they aren't sent again (a real error comes back next time).
+		*/
+		return hsz > 0 ? hsz : -1;
+	return hsz + fsz;
+	}
+#endif /* USE_SENDFILE */
+
+
+/* Sends up to *lenP bytes of a multipart/byteranges response, from pos:
+** the parts headers and closing delimiter come from partsbuf, the data
+** from the map of the file, all in a single writev(), or with sendfile()
+** (only as far as the next part headers, then).  *lenP is set to the
+** number of bytes it tried to write, headers included.
+** \return the number of bytes written (headers included), or -1.
+*/
+static ssize_t
+ranges_response( httpd_conn* hc, off_t pos, size_t* lenP )
+	{
+	struct iovec iv[32];
+	int n = 0, i;
+	size_t budget = *lenP, total = 0, len;
+	off_t segpos = 0, seglen;
+	size_t sf_len = 0;
+	ssize_t sz = 0;
+#ifdef USE_SENDFILE
+	off_t sf_offset = 0;
+	ssize_t fsz;
+#endif /* USE_SENDFILE */
+
+	if ( hc->responselen > 0 )
+		{
+		iv[n].iov_base = hc->response;
+		iv[n].iov_len = hc->responselen;
+		++n;
+		total += hc->responselen;
+		}
+	for ( i = 0; i <= hc->nranges && budget > 0 && n < SIZEOFARRAY(iv); ++i )
+		{
+		httpd_range* r = &hc->ranges[i];
+
+		/* The headers of the part... */
+		if ( pos < segpos + (off_t) r->headlen )
+			{
+			len = MIN( r->headlen - ( pos - segpos ), budget );
+			iv[n].iov_base = &hc->partsbuf[r->headidx + ( pos - segpos )];
+			iv[n].iov_len = len;
+			++n;
+			budget -= len;
+			total += len;
+			pos += len;
+			}
+		segpos += r->headlen;
+		/* ... then its data. */
+		seglen = r->last - r->first + 1;
+		if ( budget > 0 && pos < segpos + seglen && n < SIZEOFARRAY(iv) )
+			{
+			len = MIN( segpos + seglen - pos, budget );
+#ifdef USE_SENDFILE
+			if ( hc->file_fd >= 0 )
+				{
+				sf_offset = r->first + ( pos - segpos );
+				sf_len = len;
+				break;
+				}
+#endif /* USE_SENDFILE */
+			iv[n].iov_base = &hc->file_address[r->first + ( pos - segpos )];
+			iv[n].iov_len = len;
+			++n;
+			budget -= len;
+			total += len;
+			pos += len;
+			}
+		segpos += seglen;
+		}
+	*lenP = total + sf_len;
+
+	if ( n > 0 )
+		{
+#ifdef USE_SENDFILE
+		if ( sf_len > 0 )
+			{
+			struct msghdr msg;
+
+			(void) memset( &msg, 0, sizeof(msg) );
+			msg.msg_iov = iv;
+			msg.msg_iovlen = n;
+			sz = sendmsg( hc->conn_fd, &msg, MSG_MORE );
+			}
+		else
+#endif /* USE_SENDFILE */
+		sz = writev( hc->conn_fd, iv, n );
+		if ( sz < 0 || (size_t) sz < total )
+			return sz;
+		}
+#ifdef USE_SENDFILE
+	if ( sf_len > 0 )
+		{
+		fsz = sendfile( hc->conn_fd, hc->file_fd, &sf_offset, sf_len );
+		if ( fsz == 0 )
+			{
+			/* The file got shorter since we stat()ed it. */
+			fsz = -1;
+			errno = EIO;
+			}
+		if ( fsz < 0 )
+			/* (As in sendfile_response(): what was sent is gone.) */
+			return sz > 0 ? sz : -1;
+		sz += fsz;
+		}
+#endif /* USE_SENDFILE */
+	return sz;
 	}
 
 
@@ -1887,7 +2704,9 @@ handle_linger( connecttab* c, struct timeval* tvP )
 	/* In lingering-close mode we just read and ignore bytes.  An error
 	** or EOF ends things, otherwise we go until a timeout.
 	*/
-	r = read( c->hc->conn_fd, buf, sizeof(buf) );
+	do
+		r = read( c->hc->conn_fd, buf, sizeof(buf) );
+	while ( r == sizeof(buf) );
 	if ( r < 0 && ( errno == EINTR || errno == EAGAIN ) )
 		return;
 	if ( r <= 0 )
@@ -1898,39 +2717,40 @@ handle_linger( connecttab* c, struct timeval* tvP )
 static int
 check_throttles( connecttab* c )
 	{
-	int tnum;
+	int ids[MAXTHROTTLENUMS];
+	int nids, i, tnum;
 	long l;
 
 	c->numtnums = 0;
 	c->max_limit = c->min_limit = THROTTLE_NOLIMIT;
-	for ( tnum = 0; tnum < numthrottles && c->numtnums < MAXTHROTTLENUMS;
-		  ++tnum )
-		if ( match( throttles[tnum].pattern, c->hc->realfilename ) )
+	nids = match_exec( throttle_match, c->hc->realfilename, ids, MAXTHROTTLENUMS );
+	for ( i = 0; i < nids && i < MAXTHROTTLENUMS; ++i )
+		{
+		tnum = ids[i];
+		/* If we're way over the limit, don't even start. */
+		if ( throttles[tnum].rate > throttles[tnum].max_limit * 2 )
+			return 0;
+		/* Also don't start if we're under the minimum. */
+		if ( throttles[tnum].rate < throttles[tnum].min_limit )
+			return 0;
+		if ( throttles[tnum].num_sending < 0 )
 			{
-			/* If we're way over the limit, don't even start. */
-			if ( throttles[tnum].rate > throttles[tnum].max_limit * 2 )
-				return 0;
-			/* Also don't start if we're under the minimum. */
-			if ( throttles[tnum].rate < throttles[tnum].min_limit )
-				return 0;
-			if ( throttles[tnum].num_sending < 0 )
-				{
-				syslog( LOG_ERR, "throttle sending count was negative - shouldn't happen!" );
-				throttles[tnum].num_sending = 0;
-				}
-			c->tnums[c->numtnums++] = tnum;
-			++throttles[tnum].num_sending;
-			l = throttles[tnum].max_limit / throttles[tnum].num_sending;
-			if ( c->max_limit == THROTTLE_NOLIMIT )
-				c->max_limit = l;
-			else
-				c->max_limit = MIN( c->max_limit, l );
-			l = throttles[tnum].min_limit;
-			if ( c->min_limit == THROTTLE_NOLIMIT )
-				c->min_limit = l;
-			else
-				c->min_limit = MAX( c->min_limit, l );
+			syslog( LOG_ERR, "throttle sending count was negative - shouldn't happen!" );
+			throttles[tnum].num_sending = 0;
 			}
+		c->tnums[c->numtnums++] = tnum;
+		++throttles[tnum].num_sending;
+		l = throttles[tnum].max_limit / throttles[tnum].num_sending;
+		if ( c->max_limit == THROTTLE_NOLIMIT )
+			c->max_limit = l;
+		else
+			c->max_limit = MIN( c->max_limit, l );
+		l = throttles[tnum].min_limit;
+		if ( c->min_limit == THROTTLE_NOLIMIT )
+			c->min_limit = l;
+		else
+			c->min_limit = MAX( c->min_limit, l );
+		}
 	return 1;
 	}
 
@@ -1997,14 +2817,89 @@ update_throttles( ClientData client_data, struct timeval* nowP )
 	}
 
 
+/* Send the buffered response, as much as the socket takes right now.  The
+** rest is left to handle_send(), which finishes the connection again once
+** it is out.
+** \return 1 if some is left.
+*/
+static int
+flush_response( connecttab* c, struct timeval* tvP )
+	{
+	httpd_conn* hc = c->hc;
+	ssize_t sz;
+
+	if ( hc->responselen == 0 )
+		return 0;
+	sz = write( hc->conn_fd, hc->response, hc->responselen );
+	if ( sz < 0 && errno != EINTR && errno != EWOULDBLOCK && errno != EAGAIN )
+		{
+		/* The client is gone; reading will tell. */
+		hc->responselen = 0;
+		return 0;
+		}
+	if ( sz > 0 )
+		{
+		hc->responselen -= sz;
+		(void) memmove( hc->response, &(hc->response[sz]), hc->responselen );
+		c->active_at = tvP->tv_sec;
+		}
+	if ( hc->responselen == 0 )
+		return 0;
+
+	c->next_byte_index = c->end_byte_index = 0;
+	c->conn_state = CNST_SENDING;
+	c->started_at = tvP->tv_sec;
+	c->wouldblock_delay = 0;
+	fdwatch_mod_fd( hc->conn_fd, c, FDW_WRITE | FDW_EDGE );
+	return 1;
+	}
+
+
 static void
 finish_connection( connecttab* c, struct timeval* tvP )
 	{
-	/* If we haven't actually sent the buffered response yet, do so now. */
-	httpd_write_response( c->hc );
+	/* If we haven't actually sent the buffered response yet, do so now;
+	** unless more pipelined requests are waiting, so that their responses
+	** may go out together.
+	*/
+	if ( ( ! ( c->hc->bfield & HC_KEEP_ALIVE ) ||
+		   c->hc->checked_idx >= c->hc->read_idx ||
+		   c->hc->responselen >= PIPELINE_COALESCE_SIZE ) &&
+		 flush_response( c, tvP ) )
+		return;
 
-	/* And clear. */
-	clear_connection( c, tvP );
+	/* And clear, unless the connection is to be kept alive. */
+	if ( c->hc->bfield & HC_KEEP_ALIVE )
+		keepalive_connection( c, tvP );
+	else
+		clear_connection( c, tvP );
+	}
+
+
+/* Get a persistent connection whose response is complete ready for the
+** next request.
+*/
+static void
+keepalive_connection( connecttab* c, struct timeval* tvP )
+	{
+	if ( c->wakeup_timer != (Timer*) 0 )
+		{
+		tmr_cancel( c->wakeup_timer );
+		c->wakeup_timer = 0;
+		}
+	stats_bytes += c->hc->bytes_sent;
+	clear_throttles( c, tvP );
+	c->numtnums = 0;
+	httpd_reset_conn( c->hc, tvP );
+	c->next_byte_index = 0;
+	c->active_at = tvP->tv_sec;
+	if ( c->conn_state == CNST_PAUSING )
+		fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ | FDW_EDGE );
+	else
+		fdwatch_mod_fd( c->hc->conn_fd, c, FDW_READ | FDW_EDGE );
+	c->conn_state = CNST_KEEPALIVE;
+	/* The keep-alive time limit is shorter than the others. */
+	set_idle_timer( c, tvP );
 	}
 
 
@@ -2018,6 +2913,10 @@ clear_connection( connecttab* c, struct timeval* tvP )
 		tmr_cancel( c->wakeup_timer );
 		c->wakeup_timer = 0;
 		}
+#ifdef USE_SIGN_POOL
+	if ( c->conn_state == CNST_SIGNING )
+		httpd_sign_cancel( c->hc );
+#endif /* USE_SIGN_POOL */
 
 	/* This is our version of Apache's lingering_close() routine, which is
 	** their version of the often-broken SO_LINGER socket option.  For why
@@ -2039,11 +2938,12 @@ clear_connection( connecttab* c, struct timeval* tvP )
 		}
 	if ( c->hc->bfield & HC_SHOULD_LINGER )
 		{
-		if ( c->conn_state != CNST_PAUSING )
-			fdwatch_del_fd( c->hc->conn_fd );
-		c->conn_state = CNST_LINGERING;
 		shutdown( c->hc->conn_fd, SHUT_WR );
-		fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ );
+		if ( c->conn_state != CNST_PAUSING && c->conn_state != CNST_SIGNING )
+			fdwatch_mod_fd( c->hc->conn_fd, c, FDW_READ | FDW_EDGE );
+		else
+			fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ | FDW_EDGE );
+		c->conn_state = CNST_LINGERING;
 		client_data.p = c;
 		if ( c->linger_timer != (Timer*) 0 )
 			syslog( LOG_ERR, "replacing non-null linger_timer!" );
@@ -2064,7 +2964,7 @@ static void
 really_clear_connection( connecttab* c, struct timeval* tvP )
 	{
 	stats_bytes += c->hc->bytes_sent;
-	if ( c->conn_state != CNST_PAUSING )
+	if ( c->conn_state != CNST_PAUSING && c->conn_state != CNST_SIGNING )
 		fdwatch_del_fd( c->hc->conn_fd );
 	httpd_close_conn( c->hc, tvP );
 	clear_throttles( c, tvP );
@@ -2073,6 +2973,11 @@ really_clear_connection( connecttab* c, struct timeval* tvP )
 		tmr_cancel( c->linger_timer );
 		c->linger_timer = 0;
 		}
+	if ( c->idle_timer != (Timer*) 0 )
+		{
+		tmr_cancel( c->idle_timer );
+		c->idle_timer = 0;
+		}
 	c->conn_state = CNST_FREE;
 	c->next_free_connect = first_free_connect;
 	first_free_connect = c - connects;		/* division by sizeof is implied */
@@ -2080,39 +2985,92 @@ really_clear_connection( connecttab* c, struct timeval* tvP )
 	}
 
 
+/* How long a connection may stay inactive in its current state. */
+static long
+idle_timelimit( connecttab* c )
+	{
+	switch ( c->conn_state )
+		{
+		case CNST_READING: return IDLE_READ_TIMELIMIT;
+		case CNST_SENDING:
+		case CNST_PAUSING:
+		case CNST_SIGNING: return IDLE_SEND_TIMELIMIT;
+		case CNST_KEEPALIVE: return keepalive_timelimit;
+		}
+	return 0;
+	}
+
+
+/* (Re)arm the idle timer of a connection for the time limit of its state.
+** Activity only updates active_at: when the timer fires too early because
+** of it, idle_connection() just arms it again for the remaining time.
+*/
 static void
-idle( ClientData client_data, struct timeval* nowP )
+set_idle_timer( connecttab* c, struct timeval* tvP )
+	{
+	ClientData client_data;
+	long secs;
+
+	if ( c->idle_timer != (Timer*) 0 )
+		{
+		tmr_cancel( c->idle_timer );
+		c->idle_timer = (Timer*) 0;
+		}
+	if ( idle_timelimit( c ) <= 0 )
+		return;
+	secs = c->active_at + idle_timelimit( c ) - tvP->tv_sec;
+	if ( secs < 0 )
+		secs = 0;
+	client_data.p = c;
+	c->idle_timer = tmr_create(
+		tvP, idle_connection, client_data, secs * 1000L, 0 );
+	if ( c->idle_timer == (Timer*) 0 )
+		{
+		syslog( LOG_CRIT, "tmr_create(idle_connection) failed" );
+		exit( 1 );
+		}
+	}
+
+
+static void
+idle_connection( ClientData client_data, struct timeval* nowP )
 	{
-	int cnum;
 	connecttab* c;
 
-	for ( cnum = 0; cnum < max_connects; ++cnum )
+	c = (connecttab*) client_data.p;
+	c->idle_timer = (Timer*) 0;
+	if ( nowP->tv_sec - c->active_at < idle_timelimit( c ) )
 		{
-		c = &connects[cnum];
-		switch ( c->conn_state )
-			{
-			case CNST_READING:
-			if ( nowP->tv_sec - c->active_at >= IDLE_READ_TIMELIMIT )
-				{
-				syslog( LOG_INFO,
-					"%.80s connection timed out reading",
-					c->hc->client_addr );
-				httpd_send_err(
-					c->hc, 408, httpd_err408title, "", httpd_err408form, "" );
-				finish_connection( c, nowP );
-				}
-			break;
-			case CNST_SENDING:
-			case CNST_PAUSING:
-			if ( nowP->tv_sec - c->active_at >= IDLE_SEND_TIMELIMIT )
-				{
-				syslog( LOG_INFO,
-					"%.80s connection timed out sending",
-					c->hc->client_addr );
-				clear_connection( c, nowP );
-				}
-			break;
-			}
+		/* There was some activity meanwhile. */
+		set_idle_timer( c, nowP );
+		return;
+		}
+	switch ( c->conn_state )
+		{
+		case CNST_READING:
+		syslog( LOG_INFO,
+			"%.80s connection timed out reading",
+			c->hc->client_addr );
+		httpd_send_err(
+			c->hc, 408, httpd_err408title, "", httpd_err408form, "" );
+		finish_connection( c, nowP );
+		break;
+		case CNST_SENDING:
+		case CNST_PAUSING:
+		syslog( LOG_INFO,
+			"%.80s connection timed out sending",
+			c->hc->client_addr );
+		clear_connection( c, nowP );
+		break;
+		case CNST_SIGNING:
+		syslog( LOG_INFO,
+			"%.80s connection timed out signing",
+			c->hc->client_addr );
+		clear_connection( c, nowP );
+		break;
+		case CNST_KEEPALIVE:
+		really_clear_connection( c, nowP );
+		break;
 		}
 	}
 
@@ -2127,7 +3085,7 @@ wakeup_connection( ClientData client_data, struct timeval* nowP )
 	if ( c->conn_state == CNST_PAUSING )
 		{
 		c->conn_state = CNST_SENDING;
-		fdwatch_add_fd( c->hc->conn_fd, c, FDW_WRITE );
+		fdwatch_add_fd( c->hc->conn_fd, c, FDW_WRITE | FDW_EDGE );
 		}
 	}
 
@@ -2146,6 +3104,11 @@ static void
 occasional( ClientData client_data, struct timeval* nowP )
 	{
 	mmc_cleanup( nowP );
+	pcache_cleanup( nowP );
+	rcache_cleanup( nowP );
+#ifdef USE_COMPRESSION
+	zcache_cleanup( nowP );
+#endif /* USE_COMPRESSION */
 	tmr_cleanup();
 	watchdog_flag = 1;				/* let the watchdog know that we are alive */
 	}
@@ -2185,6 +3148,22 @@ logstats( struct timeval* nowP )
 	thttpd_logstats( stats_secs );
 	httpd_logstats( stats_secs );
 	mmc_logstats( stats_secs );
+	pcache_logstats( stats_secs );
+	rcache_logstats( stats_secs );
+#ifdef USE_COMPRESSION
+	zcache_logstats( stats_secs );
+#endif /* USE_COMPRESSION */
+#ifdef USE_SIGN_POOL
+	signpool_logstats( stats_secs );
+#endif /* USE_SIGN_POOL */
+#ifdef USE_PRESIGN
+	presign_logstats( stats_secs );
+#endif /* USE_PRESIGN */
+#ifdef SIG_CACHEDIR
+	sigindex_logstats( stats_secs );
+	sigcache_logstats( stats_secs );
+#endif /* SIG_CACHEDIR */
+	sigpolicy_logstats( stats_secs );
 	fdwatch_logstats( stats_secs );
 	tmr_logstats( stats_secs );
 	}
@@ -34,8 +34,26 @@
 #include "timers.h"
 
 
-#define HASH_SIZE 67
-static Timer* timers[HASH_SIZE];
+/* The active timers are kept in a hierarchical timing wheel: WHEEL_LEVELS
+** wheels of WHEEL_SIZE slots, the first one moving by one slot every
+** millisecond and each of the others WHEEL_SIZE times slower than the
+** previous one.  A timer goes in the slowest wheel it needs, and cascades
+** down to the faster ones as its time comes closer.  So adding, resetting
+** or canceling a timer doesn't depend on how many there are.
+*/
+#define WHEEL_BITS 6
+#define WHEEL_SIZE ( 1 << WHEEL_BITS )
+#define WHEEL_MASK ( WHEEL_SIZE - 1 )
+#define WHEEL_LEVELS 5
+#define WHEEL_SPAN(level) ( 1UL << ( WHEEL_BITS * (level) ) )	/* ticks per slot */
+
+/* Slot of the timers tmr_run() has taken out of the wheel to run them. */
+#define SLOT_EXPIRED -1
+
+static Timer* wheel[WHEEL_LEVELS * WHEEL_SIZE];
+static int level_count[WHEEL_LEVELS];
+static unsigned long wheel_ticks;		/* next tick to process */
+static Timer* expired;
 static Timer* free_timers;
 static int alloc_count, active_count, free_count;
 
@@ -43,106 +61,100 @@ ClientData JunkClientData;
 
 
 
-static unsigned int
-hash( Timer* t )
+/* Convert a time to milliseconds ticks.  Unsigned arithmetic: it wraps,
+** so only differences make sense.  Trigger times get rounded up so that
+** a timer never runs early.
+*/
+static unsigned long
+ticks( struct timeval* tvP, int round_up )
 	{
-	/* We can hash on the trigger time, even though it can change over
-	** the life of a timer via either the periodic bit or the tmr_reset()
-	** call.  This is because both of those guys call l_resort(), which
-	** recomputes the hash and moves the timer to the appropriate list.
-	*/
-	return (
-		(unsigned int) t->time.tv_sec ^
-		(unsigned int) t->time.tv_usec ) % HASH_SIZE;
+	return (unsigned long) tvP->tv_sec * 1000UL +
+		( (unsigned long) tvP->tv_usec + ( round_up ? 999UL : 0UL ) ) / 1000UL;
 	}
 
 
 static void
 l_add( Timer* t )
 	{
-	int h = t->hash;
-	register Timer* t2;
-	register Timer* t2prev;
+	unsigned long when = ticks( &t->time, 1 );
+	long delta = (long) ( when - wheel_ticks );
+	int level;
 
-	t2 = timers[h];
-	if ( t2 == (Timer*) 0 )
-		{
-		/* The list is empty. */
-		timers[h] = t;
-		t->prev = t->next = (Timer*) 0;
-		}
-	else
+	if ( delta < 0 )
 		{
-		if ( t->time.tv_sec < t2->time.tv_sec ||
-			 ( t->time.tv_sec == t2->time.tv_sec &&
-			   t->time.tv_usec <= t2->time.tv_usec ) )
-			{
-			/* The new timer goes at the head of the list. */
-			timers[h] = t;
-			t->prev = (Timer*) 0;
-			t->next = t2;
-			t2->prev = t;
-			}
-		else
-			{
-			/* Walk the list to find the insertion point. */
-			for ( t2prev = t2, t2 = t2->next; t2 != (Timer*) 0;
-				  t2prev = t2, t2 = t2->next )
-				{
-				if ( t->time.tv_sec < t2->time.tv_sec ||
-					 ( t->time.tv_sec == t2->time.tv_sec &&
-					   t->time.tv_usec <= t2->time.tv_usec ) )
-					{
-					/* Found it. */
-					t2prev->next = t;
-					t->prev = t2prev;
-					t->next = t2;
-					t2->prev = t;
-					return;
-					}
-				}
-			/* Oops, got to the end of the list.  Add to tail. */
-			t2prev->next = t;
-			t->prev = t2prev;
-			t->next = (Timer*) 0;
-			}
+		/* Already late, it will run on the next tick. */
+		when = wheel_ticks;
+		delta = 0;
 		}
+	for ( level = 0; level < WHEEL_LEVELS - 1; ++level )
+		if ( (unsigned long) delta < WHEEL_SPAN( level + 1 ) )
+			break;
+	if ( (unsigned long) delta >= WHEEL_SPAN( WHEEL_LEVELS ) )
+		/* Beyond the slowest wheel: park it in its last slot, it will be
+		** put back in when this slot cascades.
+		*/
+		when = wheel_ticks + WHEEL_SPAN( WHEEL_LEVELS ) - 1;
+
+	t->slot = level * WHEEL_SIZE + ( ( when >> ( WHEEL_BITS * level ) ) & WHEEL_MASK );
+	t->prev = (Timer*) 0;
+	t->next = wheel[t->slot];
+	if ( t->next != (Timer*) 0 )
+		t->next->prev = t;
+	wheel[t->slot] = t;
+	++level_count[level];
 	}
 
 
 static void
 l_remove( Timer* t )
 	{
-	int h = t->hash;
-
-	if ( t->prev == (Timer*) 0 )
-		timers[h] = t->next;
-	else
+	if ( t->prev != (Timer*) 0 )
 		t->prev->next = t->next;
+	else if ( t->slot == SLOT_EXPIRED )
+		expired = t->next;
+	else
+		wheel[t->slot] = t->next;
 	if ( t->next != (Timer*) 0 )
 		t->next->prev = t->prev;
+	if ( t->slot != SLOT_EXPIRED )
+		--level_count[t->slot / WHEEL_SIZE];
 	}
 
 
 static void
 l_resort( Timer* t )
 	{
-	/* Remove the timer from its old list. */
+	/* Remove the timer from its old slot. */
 	l_remove( t );
-	/* Recompute the hash. */
-	t->hash = hash( t );
-	/* And add it back in to its new list, sorted correctly. */
+	/* And add it back in to the slot of its new time. */
 	l_add( t );
 	}
 
 
+/* Spread the timers of an upper wheel slot down to the faster wheels. */
+static void
+cascade( int level )
+	{
+	int h = level * WHEEL_SIZE + ( ( wheel_ticks >> ( WHEEL_BITS * level ) ) & WHEEL_MASK );
+
+	while ( wheel[h] != (Timer*) 0 )
+		l_resort( wheel[h] );
+	}
+
+
 void
 tmr_init( void )
 	{
 	int h;
-
-	for ( h = 0; h < HASH_SIZE; ++h )
-		timers[h] = (Timer*) 0;
+	struct timeval now;
+
+	for ( h = 0; h < WHEEL_LEVELS * WHEEL_SIZE; ++h )
+		wheel[h] = (Timer*) 0;
+	for ( h = 0; h < WHEEL_LEVELS; ++h )
+		level_count[h] = 0;
+	(void) gettimeofday( &now, (struct timezone*) 0 );
+	wheel_ticks = ticks( &now, 0 );
+	expired = (Timer*) 0;
 	free_timers = (Timer*) 0;
 	alloc_count = active_count = free_count = 0;
 	}
@@ -184,8 +196,7 @@ tmr_create(
 		t->time.tv_sec += t->time.tv_usec / 1000000L;
 		t->time.tv_usec %= 1000000L;
 		}
-	t->hash = hash( t );
-	/* Add the new timer to the proper active list. */
+	/* Add the new timer to the proper slot. */
 	l_add( t );
 	++active_count;
 
@@ -211,34 +222,35 @@ tmr_timeout( struct timeval* nowP )
 long
 tmr_mstimeout( struct timeval* nowP )
 	{
-	int h;
+	int level, i;
 	int gotone;
-	long msecs, m;
-	register Timer* t;
+	unsigned long when, next;
+	long msecs;
 
 	gotone = 0;
-	msecs = 0;		  /* make lint happy */
-	/* Since the lists are sorted, we only need to look at the
-	** first timer on each one.
+	next = 0;		  /* make lint happy */
+	/* For each wheel, find the first slot which will need some work: the
+	** timers of the first wheel run then, those of the others just move
+	** down, which is early enough to wake up.
 	*/
-	for ( h = 0; h < HASH_SIZE; ++h )
+	for ( level = 0; level < WHEEL_LEVELS; ++level )
 		{
-		t = timers[h];
-		if ( t != (Timer*) 0 )
-			{
-			m = ( t->time.tv_sec - nowP->tv_sec ) * 1000L +
-				( t->time.tv_usec - nowP->tv_usec ) / 1000L;
-			if ( ! gotone )
+		if ( level_count[level] == 0 )
+			continue;
+		/* Start from the next turn of this wheel (or the current tick). */
+		when = ( wheel_ticks + WHEEL_SPAN( level ) - 1 ) & ~( WHEEL_SPAN( level ) - 1 );
+		for ( i = 0; i < WHEEL_SIZE; ++i, when += WHEEL_SPAN( level ) )
+			if ( wheel[level * WHEEL_SIZE + ( ( when >> ( WHEEL_BITS * level ) ) & WHEEL_MASK )] != (Timer*) 0 )
 				{
-				msecs = m;
+				if ( ! gotone || (long) ( when - next ) < 0 )
+					next = when;
 				gotone = 1;
+				break;
 				}
-			else if ( m < msecs )
-				msecs = m;
-			}
 		}
 	if ( ! gotone )
 		return INFTIM;
+	msecs = (long) ( next - ticks( nowP, 0 ) );
 	if ( msecs <= 0 )
 		msecs = 0;
 	return msecs;
@@ -248,21 +260,55 @@ tmr_mstimeout( struct timeval* nowP )
 void
 tmr_run( struct timeval* nowP )
 	{
-	int h;
+	int level;
+	unsigned long now = ticks( nowP, 0 );
+	unsigned long next;
 	Timer* t;
-	Timer* next;
 
-	for ( h = 0; h < HASH_SIZE; ++h )
-		for ( t = timers[h]; t != (Timer*) 0; t = next )
+	while ( (long) ( now - wheel_ticks ) >= 0 )
+		{
+		/* Jump over the ticks where nothing can happen: up to the next
+		** turn of the first non-empty wheel.
+		*/
+		for ( level = 0; level < WHEEL_LEVELS && level_count[level] == 0; ++level )
+			continue;
+		if ( level == WHEEL_LEVELS )
 			{
-			next = t->next;
-			/* Since the lists are sorted, as soon as we find a timer
-			** that isn't ready yet, we can go on to the next list.
-			*/
-			if ( t->time.tv_sec > nowP->tv_sec ||
-				 ( t->time.tv_sec == nowP->tv_sec &&
-				   t->time.tv_usec > nowP->tv_usec ) )
+			wheel_ticks = now + 1;
+			break;
+			}
+		if ( level > 0 && ( wheel_ticks & ( WHEEL_SPAN( level ) - 1 ) ) != 0 )
+			{
+			next = ( wheel_ticks | ( WHEEL_SPAN( level ) - 1 ) ) + 1;
+			if ( (long) ( now - next ) < 0 )
+				{
+				wheel_ticks = now + 1;
 				break;
+				}
+			wheel_ticks = next;
+			}
+
+		/* When a wheel starts a new turn, the next slot of the slower one
+		** cascades down.
+		*/
+		for ( level = 1; level < WHEEL_LEVELS; ++level )
+			{
+			if ( ( wheel_ticks & ( WHEEL_SPAN( level ) - 1 ) ) != 0 )
+				break;
+			cascade( level );
+			}
+
+		/* Take the timers of this tick aside, and run them. */
+		expired = wheel[wheel_ticks & WHEEL_MASK];
+		wheel[wheel_ticks & WHEEL_MASK] = (Timer*) 0;
+		for ( t = expired; t != (Timer*) 0; t = t->next )
+			{
+			t->slot = SLOT_EXPIRED;
+			--level_count[0];
+			}
+		++wheel_ticks;
+		while ( ( t = expired ) != (Timer*) 0 )
+			{
 			(t->timer_proc)( t->client_data, nowP );
 			if ( t->periodic )
 				{
@@ -279,6 +325,7 @@ tmr_run( struct timeval* nowP )
 			else
 				tmr_cancel( t );
 			}
+		}
 	}
 
 
@@ -300,7 +347,7 @@ tmr_reset( struct timeval* nowP, Timer* t )
 void
 tmr_cancel( Timer* t )
 	{
-	/* Remove it from its active list. */
+	/* Remove it from its slot. */
 	l_remove( t );
 	--active_count;
 	/* And put it on the free list. */
@@ -332,9 +379,11 @@ tmr_destroy( void )
 	{
 	int h;
 
-	for ( h = 0; h < HASH_SIZE; ++h )
-		while ( timers[h] != (Timer*) 0 )
-			tmr_cancel( timers[h] );
+	for ( h = 0; h < WHEEL_LEVELS * WHEEL_SIZE; ++h )
+		while ( wheel[h] != (Timer*) 0 )
+			tmr_cancel( wheel[h] );
+	while ( expired != (Timer*) 0 )
+		tmr_cancel( expired );
 	tmr_cleanup();
 	}
 
@@ -65,7 +65,7 @@ typedef struct TimerStruct {
 	struct timeval time;
 	struct TimerStruct* prev;
 	struct TimerStruct* next;
-	int hash;
+	int slot;			/* in the timing wheel */
 	} Timer;
 
 /* Initialize the timer package. */
@@ -0,0 +1,356 @@
+/* zcache.c - compressed output cache: the gzip encoding of static files
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* An entry is keyed by the (dev, ino, mtime, size) of the file (the mtime
+* to the nanosecond where stat() has it), so a changed file is compressed
+* again.  A file which doesn't shrink enough gets an
+* entry without data, so that it isn't compressed again for nothing.  When
+* the cache is full of buffers still being sent, a new one is served
+* without being cached.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "libhttpd.h"
+
+#ifdef USE_COMPRESSION
+
+#include <zlib.h>
+
+#include "mmc.h"
+#include "zcache.h"
+
+
+/* Defines. */
+#ifndef COMPRESS_MIN_FILE
+#define COMPRESS_MIN_FILE 256
+#endif
+#ifndef COMPRESS_LEVEL
+#define COMPRESS_LEVEL 6
+#endif
+#ifndef COMPRESS_CACHE_MAX_BYTES
+#define COMPRESS_CACHE_MAX_BYTES 32000000
+#endif
+#ifndef COMPRESS_CACHE_EXPIRE_AGE
+#define COMPRESS_CACHE_EXPIRE_AGE 600
+#endif
+/* Compressed data has to save at least 1/MIN_GAIN of the file. */
+#define MIN_GAIN 10
+#define HASH_SIZE (1 << 10)
+
+
+/* The Entry struct, followed by its buffer in the same allocation. */
+typedef struct EntryStruct {
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	long mtime_nsec;
+	off_t size;
+	char* buf;				/* (char*) 0 if compressing isn't worth it */
+	size_t len;
+	int refcount;
+	int cached;				/* still in the hash, else freed when released */
+	time_t used_at;
+	unsigned int hash;
+	struct EntryStruct* next;
+	struct EntryStruct* lru_next;	/* cached entries, most recently used first */
+	struct EntryStruct* lru_prev;
+	} Entry;
+
+
+/* Globals. */
+static Entry* hash_table[HASH_SIZE];
+static Entry* lru_head = (Entry*) 0;
+static Entry* lru_tail = (Entry*) 0;
+static int entry_count = 0;
+static size_t cached_bytes = 0;
+static long hits = 0, misses = 0;
+static off_t bytes_in = 0, bytes_out = 0;
+
+
+/* Forwards. */
+static unsigned int hash( const struct stat* sbP );
+static Entry* find_entry( const struct stat* sbP, unsigned int h );
+static Entry* compress_file( char* filename, struct stat* sbP, struct timeval* nowP );
+static void link_entry( Entry* e );
+static void drop_entry( Entry* e );
+
+
+char*
+zcache_get( char* filename, struct stat* sbP, struct timeval* nowP, size_t* lenP )
+	{
+	Entry* e;
+
+	if ( sbP->st_size < COMPRESS_MIN_FILE || sbP->st_size > COMPRESS_MAX_FILE )
+		return (char*) 0;
+
+	e = find_entry( sbP, hash( sbP ) );
+	if ( e != (Entry*) 0 )
+		{
+		++hits;
+		/* Move it to the front of the LRU list. */
+		if ( e != lru_head )
+			{
+			e->lru_prev->lru_next = e->lru_next;
+			if ( e->lru_next != (Entry*) 0 )
+				e->lru_next->lru_prev = e->lru_prev;
+			else
+				lru_tail = e->lru_prev;
+			e->lru_prev = (Entry*) 0;
+			e->lru_next = lru_head;
+			lru_head->lru_prev = e;
+			lru_head = e;
+			}
+		}
+	else
+		{
+		++misses;
+		e = compress_file( filename, sbP, nowP );
+		if ( e == (Entry*) 0 )
+			return (char*) 0;
+		}
+
+	e->used_at = ( nowP != (struct timeval*) 0 ? nowP->tv_sec : time( (time_t*) 0 ) );
+	if ( e->buf == (char*) 0 )
+		return (char*) 0;
+	++e->refcount;
+	*lenP = e->len;
+	return e->buf;
+	}
+
+
+void
+zcache_release( char* buf )
+	{
+	Entry* e = ( (Entry*) buf ) - 1;
+
+	if ( --e->refcount == 0 && ! e->cached )
+		free( (void*) e );
+	}
+
+
+void
+zcache_cleanup( struct timeval* nowP )
+	{
+	time_t now;
+	Entry* e;
+	Entry* prev;
+
+	if ( nowP != (struct timeval*) 0 )
+		now = nowP->tv_sec;
+	else
+		now = time( (time_t*) 0 );
+
+	for ( e = lru_tail; e != (Entry*) 0; e = prev )
+		{
+		prev = e->lru_prev;
+		if ( now - e->used_at < COMPRESS_CACHE_EXPIRE_AGE )
+			break;
+		if ( e->refcount == 0 )
+			drop_entry( e );
+		}
+	}
+
+
+void
+zcache_destroy( void )
+	{
+	/* The entries still referenced are freed when released. */
+	while ( lru_head != (Entry*) 0 )
+		drop_entry( lru_head );
+	}
+
+
+void
+zcache_logstats( long secs )
+	{
+	if ( secs > 0 )
+		syslog(
+			LOG_INFO, "  compression cache - %d entries, %lld bytes, %ld hits, %ld misses (%g/sec), %lld bytes compressed to %lld",
+			entry_count, (long long) cached_bytes, hits, misses,
+			(float) misses / secs, (long long) bytes_in, (long long) bytes_out );
+	hits = misses = 0;
+	bytes_in = bytes_out = 0;
+	}
+
+
+static unsigned int
+hash( const struct stat* sbP )
+	{
+	unsigned int h = 177573;
+
+	h ^= sbP->st_dev;
+	h += h << 5;
+	h ^= sbP->st_ino;
+	h += h << 5;
+	h ^= sbP->st_mtime;
+	h += h << 5;
+	h ^= ST_MTIME_NSEC( *sbP );
+	h += h << 5;
+	h ^= sbP->st_size;
+	h += h << 5;
+	return h;
+	}
+
+
+static Entry*
+find_entry( const struct stat* sbP, unsigned int h )
+	{
+	Entry* e;
+
+	for ( e = hash_table[h & ( HASH_SIZE - 1 )]; e != (Entry*) 0; e = e->next )
+		if ( e->hash == h && e->ino == sbP->st_ino && e->dev == sbP->st_dev &&
+			 e->mtime == sbP->st_mtime && e->mtime_nsec == ST_MTIME_NSEC( *sbP ) &&
+			 e->size == sbP->st_size )
+			return e;
+	return (Entry*) 0;
+	}
+
+
+/* Compresses a file into a new entry, cached if there is room. */
+static Entry*
+compress_file( char* filename, struct stat* sbP, struct timeval* nowP )
+	{
+	z_stream zs;
+	char* addr;
+	Entry* e;
+	Entry* e2;
+	Entry* prev;
+	int r;
+
+	addr = mmc_map( filename, sbP, nowP );
+	if ( addr == (char*) 0 )
+		return (Entry*) 0;
+	(void) memset( &zs, 0, sizeof(zs) );
+	/* 15 + 16: a gzip wrapper, not a zlib one. */
+	if ( deflateInit2( &zs, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+		{
+		syslog( LOG_ERR, "deflateInit2 failed" );
+		mmc_unmap( addr, sbP, nowP );
+		return (Entry*) 0;
+		}
+	e = (Entry*) malloc( sizeof(Entry) + deflateBound( &zs, sbP->st_size ) );
+	if ( e == (Entry*) 0 )
+		{
+		(void) deflateEnd( &zs );
+		mmc_unmap( addr, sbP, nowP );
+		return (Entry*) 0;
+		}
+	zs.next_in = (Bytef*) addr;
+	zs.avail_in = sbP->st_size;
+	zs.next_out = (Bytef*) ( e + 1 );
+	zs.avail_out = deflateBound( &zs, sbP->st_size );
+	r = deflate( &zs, Z_FINISH );
+	(void) deflateEnd( &zs );
+	mmc_unmap( addr, sbP, nowP );
+	if ( r != Z_STREAM_END )
+		{
+		syslog( LOG_ERR, "deflate %.80s failed (%d)", filename, r );
+		free( (void*) e );
+		return (Entry*) 0;
+		}
+
+	e->dev = sbP->st_dev;
+	e->ino = sbP->st_ino;
+	e->mtime = sbP->st_mtime;
+	e->mtime_nsec = ST_MTIME_NSEC( *sbP );
+	e->size = sbP->st_size;
+	e->refcount = 0;
+	e->hash = hash( sbP );
+	if ( (off_t) zs.total_out > sbP->st_size - sbP->st_size / MIN_GAIN )
+		{
+		/* Not worth it, just remember that. */
+		e->len = 0;
+		e2 = (Entry*) realloc( (void*) e, sizeof(Entry) );
+		}
+	else
+		{
+		e->len = zs.total_out;
+		bytes_in += sbP->st_size;
+		bytes_out += e->len;
+		e2 = (Entry*) realloc( (void*) e, sizeof(Entry) + e->len );
+		}
+	if ( e2 != (Entry*) 0 )
+		e = e2;
+	e->buf = ( e->len > 0 ? (char*) ( e + 1 ) : (char*) 0 );
+
+	/* Make room, least recently used first. */
+	for ( e2 = lru_tail; e2 != (Entry*) 0 && cached_bytes + e->len > COMPRESS_CACHE_MAX_BYTES; e2 = prev )
+		{
+		prev = e2->lru_prev;
+		if ( e2->refcount == 0 )
+			drop_entry( e2 );
+		}
+	if ( cached_bytes + e->len > COMPRESS_CACHE_MAX_BYTES )
+		{
+		if ( e->buf == (char*) 0 )
+			{
+			free( (void*) e );
+			return (Entry*) 0;
+			}
+		e->cached = 0;
+		return e;
+		}
+	link_entry( e );
+	return e;
+	}
+
+
+static void
+link_entry( Entry* e )
+	{
+	e->cached = 1;
+	e->next = hash_table[e->hash & ( HASH_SIZE - 1 )];
+	hash_table[e->hash & ( HASH_SIZE - 1 )] = e;
+	e->lru_prev = (Entry*) 0;
+	e->lru_next = lru_head;
+	if ( lru_head != (Entry*) 0 )
+		lru_head->lru_prev = e;
+	else
+		lru_tail = e;
+	lru_head = e;
+	++entry_count;
+	cached_bytes += e->len;
+	}
+
+
+/* Takes an entry out of the cache; it is freed now, or when released. */
+static void
+drop_entry( Entry* e )
+	{
+	Entry** ep;
+
+	for ( ep = &hash_table[e->hash & ( HASH_SIZE - 1 )]; *ep != e; ep = &(*ep)->next )
+		continue;
+	*ep = e->next;
+	if ( e->lru_prev != (Entry*) 0 )
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		lru_head = e->lru_next;
+	if ( e->lru_next != (Entry*) 0 )
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		lru_tail = e->lru_prev;
+	--entry_count;
+	cached_bytes -= e->len;
+	e->cached = 0;
+	if ( e->refcount == 0 )
+		free( (void*) e );
+	}
+
+#endif /* USE_COMPRESSION */
@@ -0,0 +1,38 @@
+/* zcache.h - header file for the compressed output cache
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The compressed output cache keeps the gzip encoding of the static files
+* served to clients accepting it, so that each file is compressed only once.
+*/
+
+#ifndef _ZCACHE_H_
+#define _ZCACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/*! Returns the gzip encoding of the file described by sbP, compressing it
+ * first if needed, and its length in *lenP.  Returns (char*) 0 if it can't,
+ * or if compressing it isn't worth it.  The buffer must be given back with
+ * zcache_release().
+ */
+char* zcache_get( char* filename, struct stat* sbP, struct timeval* nowP, size_t* lenP );
+
+/*! Gives back a buffer returned by zcache_get(). */
+void zcache_release( char* buf );
+
+/*! Free the entries unused for a while.  Should be called periodically.
+ * If you have the current time, pass it in, otherwise pass 0.
+ */
+void zcache_cleanup( struct timeval* nowP );
+
+/*! Free all storage, usually in preparation for exitting. */
+void zcache_destroy( void );
+
+/*! Generate debugging statistics syslog message. */
+void zcache_logstats( long secs );
+
+#endif /* _ZCACHE_H_ */